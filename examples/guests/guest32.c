@@ -716,6 +716,7 @@ unsigned char splash[SPLASH_WIDTH * SPLASH_HEIGHT] = {
 #define STACK_SIZE 16384
 
 #define COM1 0x3F8
+#define COM1_FIFO_SIZE 16
 
 static char stack[STACK_SIZE];
 
@@ -768,11 +769,32 @@ void serial_write_char(char c)
     outb(COM1, c);
 }
 
+void serial_init(void)
+{
+    // Enable and clear the FIFOs
+    outb(COM1 + 2, 0x07);
+}
+
 void serial_write_str(char *str)
 {
-    for (int i = 0; str[i] != '\0'; ++i)
+    int i = 0;
+
+    while (str[i] != '\0')
     {
-        serial_write_char(str[i]);
+        unsigned char status = inb(COM1 + 5);
+
+        // Wait for the transmitter to be empty
+        while (((status >> 5) & 1) == 0)
+        {
+            asm volatile("pause");
+            status = inb(COM1 + 5);
+        }
+
+        // An empty transmitter FIFO can take a full burst without polling
+        for (int n = 0; n < COM1_FIFO_SIZE && str[i] != '\0'; ++n, ++i)
+        {
+            outb(COM1, str[i]);
+        }
     }
 }
 
@@ -797,6 +819,7 @@ __attribute__((naked, section(".boot"))) void _start(void)
                  :
                  : "r"(stack + STACK_SIZE));
 
+    serial_init();
     serial_write_str("Echo program running in KVM\n");
 
     char *ptr = (char *)0xC000000A;
@@ -2,6 +2,8 @@
 
 #include <blackhv/memory.h>
 #include <blackhv/mmio.h>
+#include <blackhv/ps2.h>
+#include <blackhv/screen.h>
 #include <blackhv/serial.h>
 #include <blackhv/vm.h>
 #include <err.h>
@@ -62,7 +64,7 @@ void *worker1(void *params)
     {
         char c;
 
-        if (serial_read(serial, (u8 *)&c, 1) == 1)
+        if (serial_read_timeout(serial, (u8 *)&c, 1, -1) == 1)
         {
             putchar(c);
         }
@@ -188,6 +190,16 @@ int main(int argc, const char *argv[])
     dump_e820_table(vm);
 
     screen_init(vm, 0xC2000000);
+
+    ps2_t *ps2 = ps2_new(vm);
+
+    if (ps2 == NULL)
+    {
+        errx(1, "Failed to create the PS/2 controller");
+    }
+
+    screen_set_ps2(vm, ps2);
+
     pthread_t th2;
     pthread_create(&th2, NULL, screen_run, (void *)vm);
 
@@ -205,6 +217,7 @@ int main(int argc, const char *argv[])
     pthread_join(th2, NULL);
 
     screen_uninit(vm);
+    ps2_destroy(ps2);
     vm_destroy(vm);
 
     return 0;
@@ -1,8 +1,11 @@
 #include <blackhv/atapi.h>
 #include <blackhv/memory.h>
+#include <blackhv/pci.h>
+#include <blackhv/ps2.h>
 #include <blackhv/screen.h>
 #include <blackhv/serial.h>
 #include <blackhv/vm.h>
+#include <blackhv/zimage.h>
 #include <elf.h>
 #include <err.h>
 #include <fcntl.h>
@@ -171,7 +174,8 @@ static void *serial_thread(void *param)
 
     for (;;)
     {
-        int r = (int)serial_read(serial, buffer, 1024);
+        // Sleep until the guest writes something
+        int r = (int)serial_read_timeout(serial, buffer, 1024, -1);
 
         printf("%.*s", r, buffer);
     }
@@ -205,14 +209,53 @@ int main(int argc, char **argv)
         errx(1, "Failed to create serial");
     }
 
+    if (serial_set_irq(serial, vm, COM1_IRQ) != 1)
+    {
+        errx(1, "Failed to wire serial interrupt");
+    }
+
     pthread_t pthread;
 
     pthread_create(&pthread, NULL, serial_thread, serial);
 
-    int disk_fd = open(argv[2], O_RDONLY);
-    atapi_init(vm, disk_fd);
+    pci_init();
+
+    size_t disk_len = strlen(argv[2]);
+    int disk_fd = -1;
+
+    // Images compressed by examples/zimage
+    if (disk_len > 4 && strcmp(argv[2] + disk_len - 4, ".bhz") == 0)
+    {
+        zimage_t *zimage = zimage_open(argv[2]);
+
+        if (zimage == NULL)
+        {
+            errx(1, "Failed to open the compressed image");
+        }
+
+        atapi_init_disk(vm, zimage_disk(zimage));
+    }
+    else
+    {
+        disk_fd = open(argv[2], O_RDONLY);
+
+        if (atapi_init_mmap(vm, disk_fd) != 1)
+        {
+            atapi_init(vm, disk_fd);
+        }
+    }
 
     screen_init(vm, FRAMEBUFFER_GUEST);
+
+    ps2_t *ps2 = ps2_new(vm);
+
+    if (ps2 == NULL)
+    {
+        errx(1, "Failed to create the PS/2 controller");
+    }
+
+    screen_set_ps2(vm, ps2);
+
     pthread_t screen_th;
     pthread_create(&screen_th, NULL, screen_run, (void *)vm);
 
@@ -227,8 +270,12 @@ int main(int argc, char **argv)
         errx(1, "Failed to run VM");
     }
 
-    close(disk_fd);
+    if (disk_fd >= 0)
+    {
+        close(disk_fd);
+    }
     screen_uninit(vm);
+    ps2_destroy(ps2);
     vm_destroy(vm);
 
     return 0;
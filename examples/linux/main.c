@@ -1,10 +1,10 @@
 #include <asm/bootparam.h>
 #include <blackhv/memory.h>
 #include <blackhv/serial.h>
+#include <blackhv/serial_io.h>
 #include <blackhv/vm.h>
 #include <err.h>
 #include <fcntl.h>
-#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -179,22 +179,6 @@ static void *load_file(const char *path, size_t *size)
     return map;
 }
 
-static void *serial_thread(void *param)
-{
-    printf("Thread started\n");
-    serial_t *serial = (serial_t *)param;
-    unsigned char buffer[1024];
-
-    for (;;)
-    {
-        int r = (int)serial_read(serial, buffer, 1024);
-
-        printf("%.*s", r, buffer);
-    }
-
-    return NULL;
-}
-
 int main(int argc, char *argv[])
 {
     if (argc != 2)
@@ -221,11 +205,20 @@ int main(int argc, char *argv[])
         errx(1, "Failed to create serial");
     }
 
-    pthread_t pthread;
+    if (serial_set_irq(serial, vm, COM1_IRQ) != 1)
+    {
+        errx(1, "Failed to wire serial interrupt");
+    }
 
-    pthread_create(&pthread, NULL, serial_thread, serial);
+    serial_io_t *io = serial_io_new();
 
-    sleep(1);
+    if (io == NULL
+        || serial_io_add_fd(
+               io, serial_chardev(serial), STDIN_FILENO, STDOUT_FILENO)
+            != 1)
+    {
+        errx(1, "Failed to connect the serial to the terminal");
+    }
 
     printf("Running the VM\n");
 
@@ -234,6 +227,8 @@ int main(int argc, char *argv[])
         errx(1, "Failed to run VM");
     }
 
+    serial_io_destroy(io);
+    serial_destroy(serial);
     vm_destroy(vm);
 
     return 0;
@@ -0,0 +1,127 @@
+#include <blackhv/recorder.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(void)
+{
+    errx(1, "Usage: ./replay [-r fps] input.bhr output.y4m");
+}
+
+static u8 clamp(s32 value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+/**
+ * Write a frame in BT.601 limited range YUV 4:4:4
+ */
+static void write_frame(FILE *out, const u32 *pixels, u32 nb_pixels, u8 *yuv)
+{
+    for (u32 i = 0; i < nb_pixels; ++i)
+    {
+        s32 r = (pixels[i] >> 16) & 0xFF;
+        s32 g = (pixels[i] >> 8) & 0xFF;
+        s32 b = pixels[i] & 0xFF;
+
+        yuv[i] = clamp(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+        yuv[nb_pixels + i] =
+            clamp(128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8));
+        yuv[2 * nb_pixels + i] =
+            clamp(128 + ((112 * r - 94 * g - 18 * b + 128) >> 8));
+    }
+
+    fprintf(out, "FRAME\n");
+    fwrite(yuv, 1, 3 * nb_pixels, out);
+}
+
+int main(int argc, char **argv)
+{
+    u32 fps = 30;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            fps = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2 || fps == 0)
+    {
+        usage();
+    }
+
+    recording_t *recording = recording_open(argv[optind]);
+
+    if (recording == NULL)
+    {
+        errx(1, "Failed to open %s", argv[optind]);
+    }
+
+    FILE *out = fopen(argv[optind + 1], "w");
+
+    if (out == NULL)
+    {
+        err(1, "%s", argv[optind + 1]);
+    }
+
+    struct recorder_frame frame;
+    const u32 *pixels = recording_next(recording, &frame);
+
+    if (pixels == NULL)
+    {
+        errx(1, "Empty recording");
+    }
+
+    // The video keeps the size of the first frame
+    u32 width = frame.width;
+    u32 height = frame.height;
+    u32 nb_pixels = width * height;
+    u32 *shown = malloc(nb_pixels * sizeof(u32));
+    u8 *yuv = malloc(3 * nb_pixels);
+    u64 nb_frames = 0;
+
+    if (shown == NULL || yuv == NULL)
+    {
+        errx(1, "Out of memory");
+    }
+
+    memcpy(shown, pixels, nb_pixels * sizeof(u32));
+    fprintf(out, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", width, height, fps);
+
+    // Each recorded frame is repeated until the next one is due
+    while ((pixels = recording_next(recording, &frame)) != NULL)
+    {
+        while (nb_frames * 1000000 / fps < frame.timestamp_us)
+        {
+            write_frame(out, shown, nb_pixels, yuv);
+            nb_frames += 1;
+        }
+
+        if (frame.width != width || frame.height != height)
+        {
+            warnx("Frame of %ux%u skipped", frame.width, frame.height);
+            continue;
+        }
+
+        memcpy(shown, pixels, nb_pixels * sizeof(u32));
+    }
+
+    write_frame(out, shown, nb_pixels, yuv);
+    printf("%lu frames\n", (unsigned long)nb_frames + 1);
+
+    free(yuv);
+    free(shown);
+    fclose(out);
+    recording_close(recording);
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <blackhv/zimage.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void usage(void)
+{
+    errx(1, "Usage: ./zimage [-c chunk_kb] [-l level] input output.bhz");
+}
+
+int main(int argc, char **argv)
+{
+    u32 chunk_size = ZIMAGE_CHUNK_SIZE;
+    s32 level = 6;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            chunk_size = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'l':
+            level = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 2)
+    {
+        usage();
+    }
+
+    int in_fd = open(argv[optind], O_RDONLY);
+
+    if (in_fd < 0)
+    {
+        err(1, "%s", argv[optind]);
+    }
+
+    int out_fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (out_fd < 0)
+    {
+        err(1, "%s", argv[optind + 1]);
+    }
+
+    if (zimage_convert(in_fd, out_fd, chunk_size, level) != 1)
+    {
+        unlink(argv[optind + 1]);
+        errx(1, "Conversion failed");
+    }
+
+    struct stat in_stat;
+    struct stat out_stat;
+
+    if (fstat(in_fd, &in_stat) == 0 && fstat(out_fd, &out_stat) == 0
+        && in_stat.st_size > 0)
+    {
+        printf("%ld -> %ld bytes (%.1f%%)\n",
+               (long)in_stat.st_size,
+               (long)out_stat.st_size,
+               100.0 * out_stat.st_size / in_stat.st_size);
+    }
+
+    close(out_fd);
+    close(in_fd);
+
+    return 0;
+}
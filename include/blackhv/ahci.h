@@ -0,0 +1,27 @@
+#ifndef AHCI_HEADER
+#define AHCI_HEADER
+
+#include <blackhv/disk.h>
+#include <blackhv/types.h>
+#include <blackhv/vm.h>
+
+#define AHCI_IRQ 11
+#define AHCI_ABAR_BASE 0xFEBF0000 // HBA registers, PCI BAR5
+
+typedef struct ahci ahci_t;
+
+/**
+ * AHCI 1.3 host bus adapter with a SATA disk on port 0. The HBA is a PCI
+ * function (pci_init must have been called before) whose registers are at
+ * AHCI_ABAR_BASE. Commands, including NCQ ones, are executed by a pool of
+ * worker threads straight from and to the guest memory, the completion is
+ * signalled on `irq`. The vm must have been initialized with CREATE_IRQCHIP.
+ * The workers hold the guest memory (memory_hold) during a transfer, so
+ * memory_unmap waits for the commands using the range. The disk is not closed
+ * by ahci_destroy.
+ */
+ahci_t *ahci_new(vm_t *vm, u32 irq, struct disk disk);
+
+void ahci_destroy(ahci_t *ahci);
+
+#endif
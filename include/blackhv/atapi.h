@@ -1,8 +1,39 @@
 #ifndef ATAPI_H
 #define ATAPI_H
 
+#include <blackhv/disk.h>
 #include <blackhv/vm.h>
 
+#define ATAPI_IRQ 14
+#define ATAPI_BMIDE_BASE 0xC000 // Bus master registers, PCI BAR4
+
+/**
+ * ATAPI drive on the primary channel. The controller is also a PCI IDE
+ * function (pci_init) whose bus master registers allow DMA transfers, the
+ * completion is signalled on ATAPI_IRQ.
+ */
 void atapi_init(vm_t *vm, int disk_fd);
 
+/**
+ * Same as atapi_init with the blocks read from `disk`, for instance a
+ * compressed image (zimage_disk). Calling it again changes the media: the
+ * cached blocks are dropped and the readahead thread no longer reads the
+ * previous disk when it returns.
+ */
+void atapi_init_disk(vm_t *vm, struct disk disk);
+
+/**
+ * Same as atapi_init but the disk is mapped read-only and blocks are sent to
+ * the guest straight from the page cache, which is shared by every process
+ * using the same image. The file descriptor can be closed afterwards.
+ *
+ * @return 1 on success, 0 if the disk cannot be mapped
+ */
+s32 atapi_init_mmap(vm_t *vm, int disk_fd);
+
+/**
+ * Number of READ(12) blocks served from the block cache and from the disk
+ */
+void atapi_cache_stats(u64 *hits, u64 *misses);
+
 #endif
@@ -0,0 +1,80 @@
+#ifndef BLOCK_CACHE_HEADER
+#define BLOCK_CACHE_HEADER
+
+#include <blackhv/types.h>
+#include <pthread.h>
+#include <stddef.h>
+
+struct block_cache_entry
+{
+    u64 index;
+    struct block_cache_entry *prev; // LRU list, most recently used first
+    struct block_cache_entry *next;
+    struct block_cache_entry *hash_next;
+    u8 *data;
+};
+
+/**
+ * Fixed size LRU cache of blocks identified by their index. The functions
+ * can be called from several threads.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t block_size;
+    size_t nb_blocks;
+    size_t used;
+    struct block_cache_entry *entries;
+    struct block_cache_entry **buckets;
+    size_t buckets_mask;
+    struct block_cache_entry *head;
+    struct block_cache_entry *tail;
+    u8 *data;
+    u64 hits;
+    u64 misses;
+} block_cache_t;
+
+block_cache_t *block_cache_new(size_t block_size, size_t nb_blocks);
+
+void block_cache_destroy(block_cache_t *cache);
+
+/**
+ * Copy the block `index` in buffer (block_size bytes) and mark it as the most
+ * recently used.
+ *
+ * @return 1 on a hit, 0 on a miss
+ */
+s32 block_cache_read(block_cache_t *cache, u64 index, u8 *buffer);
+
+/**
+ * Same as block_cache_read but only `len` bytes are copied, starting at
+ * `offset` in the block
+ *
+ * @return 1 on a hit, 0 on a miss or a range outside of the block
+ */
+s32 block_cache_read_at(block_cache_t *cache,
+                        u64 index,
+                        size_t offset,
+                        size_t len,
+                        u8 *buffer);
+
+/**
+ * Insert or update the block `index`, evicting the least recently used block
+ * when the cache is full.
+ */
+void block_cache_write(block_cache_t *cache, u64 index, const u8 *buffer);
+
+/**
+ * Check if a block is cached without updating the LRU order or the counters
+ */
+s32 block_cache_contains(block_cache_t *cache, u64 index);
+
+/**
+ * Drop every block, for instance when the data behind the indexes changed.
+ * The counters are kept.
+ */
+void block_cache_clear(block_cache_t *cache);
+
+void block_cache_stats(block_cache_t *cache, u64 *hits, u64 *misses);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef DISK_HEADER
+#define DISK_HEADER
+
+#include <blackhv/types.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Disk image behind a block device. readv and writev return the number of
+ * bytes transferred like preadv and pwritev, -1 on error. They can be called
+ * from several threads at once.
+ */
+struct disk
+{
+    void *image;
+    u64 size; // Bytes
+    ssize_t (*readv)(void *image,
+                     const struct iovec *iov,
+                     u32 nb_iov,
+                     u64 offset);
+    ssize_t (*writev)(void *image,
+                      const struct iovec *iov,
+                      u32 nb_iov,
+                      u64 offset);
+    s32 (*flush)(void *image); // 1 on success, 0 otherwise
+};
+
+/**
+ * Raw image in a regular file or a block device, the file descriptor is
+ * used as is.
+ */
+struct disk raw_disk(int fd);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef FRAMEBUFFER_HEADER
 #define FRAMEBUFFER_HEADER
 
+// Mode of the screen until the guest sets one with the VBE registers (vbe.h)
 #define FB_WIDTH 320
 #define FB_HEIGHT 200
 #define FB_BPP 4
@@ -0,0 +1,81 @@
+#ifndef HEADLESS_HEADER
+#define HEADLESS_HEADER
+
+#include <blackhv/recorder.h>
+#include <blackhv/types.h>
+#include <blackhv/vbe.h>
+#include <blackhv/vm.h>
+
+#define HEADLESS_MAGIC 0x42464842 // "BHFB"
+#define HEADLESS_VERSION 3
+#define HEADLESS_MAX_RECTS 64
+#define HEADLESS_FPS 60
+
+// The video memory starts the memfd, the header follows it on its own page
+#define HEADLESS_HEADER_OFFSET VBE_VRAM_SIZE
+#define HEADLESS_SIZE (HEADLESS_HEADER_OFFSET + 4096)
+
+struct headless_rect
+{
+    u32 x;
+    u32 y;
+    u32 width;
+    u32 height;
+};
+
+/**
+ * Header of the shared memory, at HEADLESS_HEADER_OFFSET. `sequence` is odd
+ * while the mode and the rectangles are being written: readers copy them and
+ * check that `sequence` was even and did not change. It is also a futex woken
+ * at each frame. The rectangles are the pixels changed by the frame
+ * `sequence`, a mode change damages the whole frame.
+ * Every field is a u32, the layout has no padding.
+ */
+struct headless_header
+{
+    u32 magic;
+    u32 version;
+    u32 width;
+    u32 height;
+    u32 pitch; // Bytes per row
+    u32 bpp; // 15 and 16 are RGB555 and RGB565, 24 and 32 are (X)RGB
+    u32 offset; // Of the visible frame in the memfd
+    u32 sequence;
+    u32 nb_rects;
+    struct headless_rect rects[HEADLESS_MAX_RECTS];
+    u32 palette[256]; // XRGB colors of the 8 bits pixels
+};
+
+typedef struct headless headless_t;
+
+/**
+ * Screen without a window: the guest video memory at `framebuffer_phys` is a
+ * memfd, which external processes can mmap to read the pixels with no copy.
+ * The guest picks the mode with the VBE registers (vbe.h). Damage is found
+ * with dirty logging `fps` times per second by a thread, or on
+ * headless_update calls when `fps` is 0.
+ */
+headless_t *headless_new(vm_t *vm, u64 framebuffer_phys, u32 fps);
+
+void headless_destroy(headless_t *headless);
+
+/**
+ * Get the memfd, to be passed to the consumers (fork, SCM_RIGHTS or
+ * /proc/<pid>/fd/<fd>). It is sealed against resizing.
+ */
+s32 headless_get_fd(headless_t *headless);
+
+/**
+ * Publish the pixels changed since the last frame
+ *
+ * @return 1 if a frame was published, 0 if nothing changed
+ */
+s32 headless_update(headless_t *headless);
+
+/**
+ * Record the published frames to `recorder`, or stop recording with NULL.
+ * The recorder can be destroyed once this returns.
+ */
+void headless_set_recorder(headless_t *headless, recorder_t *recorder);
+
+#endif
@@ -10,6 +10,8 @@ struct handler
     void (*outw_handler)(u16, u16, void *);
     u8 (*inb_handler)(u16, void *);
     u16 (*inw_handler)(u16, void *);
+    void (*outl_handler)(u16, u32, void *);
+    u32 (*inl_handler)(u16, void *);
 };
 
 void io_register_handler(u16 port, struct handler hdl);
@@ -24,4 +26,8 @@ s32 io_handle_outw(u16 port, u16 data);
 
 s32 io_handle_inw(u16 port, u16 *output);
 
+s32 io_handle_outl(u16 port, u32 data);
+
+s32 io_handle_inl(u16 port, u32 *output);
+
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <blackhv/linked_list.h>
 #include <blackhv/types.h>
 #include <blackhv/vm.h>
+#include <pthread.h>
 
 #define KB_1 (1 << 10)
 #define MB_1 (1 << 20)
@@ -12,6 +13,11 @@
 #define MEMORY_USABLE 0x1
 #define MEMORY_MMIO 0x2
 #define MEMORY_FRAMEBUFFER 0x3
+#define MEMORY_FILE 0x4
+
+/* memory_map_file flags */
+#define MEMORY_READ_ONLY 0x1
+#define MEMORY_LOG_DIRTY 0x2
 
 typedef struct vm vm_t;
 
@@ -22,12 +28,15 @@ struct memory_entry
     u64 size;
     u32 slot;
     u32 type;
+    u32 flags; // KVM_MEM_* flags of the slot
 };
 
 struct memory
 {
     linked_list_t *memory_entries;
     u32 next_slot;
+    // Held for writing to add or remove entries, for reading to use them
+    pthread_rwlock_t lock;
 };
 
 typedef struct memory memory_t;
@@ -57,6 +66,36 @@ void memory_destroy(memory_t *mem);
 
 s32 memory_alloc(vm_t *vm, u64 phys_addr, u64 size, u32 type);
 
+/**
+ * Map `size` bytes of a file at `phys_addr` with MAP_SHARED, guest stores
+ * land in the host page cache of the file. With MEMORY_READ_ONLY guest stores
+ * exit to the mmio handlers instead, with MEMORY_LOG_DIRTY they are logged
+ * like for MEMORY_FRAMEBUFFER. The file descriptor is not closed.
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 memory_map_file(vm_t *vm, u64 phys_addr, u64 size, int fd, u32 flags);
+
+/**
+ * Remove the memory added at `phys_addr` by memory_alloc or memory_map_file,
+ * the address is available again. It waits for the memory_read and
+ * memory_write running on other threads and for the memory_hold not released
+ * yet, but pointers from memory_get_ptr into the range must no longer be used.
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 memory_unmap(vm_t *vm, u64 phys_addr);
+
+/**
+ * Keep the memory ranges in place until memory_release, for devices using
+ * pointers from memory_get_ptr on their own threads. memory_unmap waits for
+ * the release. The other memory functions can be called in between, but not
+ * memory_alloc, memory_map_file and memory_unmap.
+ */
+void memory_hold(vm_t *vm);
+
+void memory_release(vm_t *vm);
+
 /**
  * Write into guest memory area
  *
@@ -69,6 +108,15 @@ s64 memory_write(vm_t *vm, u64 dest, u8 *buffer, u64 size);
 
 void *memory_get_ptr(vm_t *vm, u64 addr);
 
+/**
+ * Get the pages of the MEMORY_FRAMEBUFFER or MEMORY_LOG_DIRTY range
+ * containing `phys_addr` written by the guest since the last call, one bit per
+ * page. `bitmap` holds at least one u64 per 64 pages of the range.
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 memory_get_dirty_log(vm_t *vm, u64 phys_addr, u64 *bitmap);
+
 /**
  * Read from guest memory area
  *
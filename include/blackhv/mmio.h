@@ -30,4 +30,6 @@ void mmio_unregister(s32 id);
 
 void mmio_handle_write(u64 address, u8 data[8], u32 len);
 
+void mmio_handle_read(u64 address, u8 data[8], u32 len);
+
 #endif
\ No newline at end of file
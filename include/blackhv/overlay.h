@@ -0,0 +1,77 @@
+#ifndef OVERLAY_HEADER
+#define OVERLAY_HEADER
+
+#include <blackhv/disk.h>
+#include <blackhv/types.h>
+
+#define OVERLAY_MAGIC 0x4F564842 // "BHVO"
+#define OVERLAY_VERSION 1
+#define OVERLAY_CLUSTER_BITS 16 // 64 KB clusters by default
+#define OVERLAY_BASE_PATH_MAX 1024
+
+/**
+ * Copy-on-write overlay file format, little endian:
+ *
+ * - cluster 0: this header
+ * - cluster 1 and following: the L1 table, one u64 per L2 table
+ * - L2 tables and data clusters, appended when allocated
+ *
+ * An L2 table is one cluster of u64, the offset in the overlay of each data
+ * cluster. A zero entry means the cluster was never written and is read from
+ * the base image (zeros past its end).
+ */
+struct overlay_header
+{
+    u32 magic;
+    u32 version;
+    u32 cluster_bits;
+    u32 l1_size; // Entries
+    u64 size; // Virtual disk size in bytes, the size of the base image
+    u64 l1_offset;
+    char base_path[OVERLAY_BASE_PATH_MAX];
+} __attribute__((packed));
+
+typedef struct overlay overlay_t;
+
+/**
+ * Create an empty overlay over the image at `base_path`. The path is stored
+ * as is, an absolute path keeps the overlay usable from any directory.
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 overlay_create(const char *path, const char *base_path, u32 cluster_bits);
+
+/**
+ * Open an overlay and its base image, which is never written
+ */
+overlay_t *overlay_open(const char *path);
+
+void overlay_close(overlay_t *overlay);
+
+/**
+ * @return number of bytes read, short at the end of the disk, -1 on error
+ */
+ssize_t overlay_readv(overlay_t *overlay,
+                      const struct iovec *iov,
+                      u32 nb_iov,
+                      u64 offset);
+
+/**
+ * Write to the overlay, the first write to a cluster copies the rest of the
+ * cluster from the base image.
+ *
+ * @return number of bytes written, -1 on error
+ */
+ssize_t overlay_writev(overlay_t *overlay,
+                       const struct iovec *iov,
+                       u32 nb_iov,
+                       u64 offset);
+
+/**
+ * @return 1 on success, 0 otherwise
+ */
+s32 overlay_flush(overlay_t *overlay);
+
+struct disk overlay_disk(overlay_t *overlay);
+
+#endif
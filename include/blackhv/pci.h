@@ -0,0 +1,98 @@
+#ifndef PCI_HEADER
+#define PCI_HEADER
+
+#include <blackhv/types.h>
+
+/** PCI configuration mechanism #1 on bus 0, function 0 only **/
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+#define PCI_MAX_DEVICES 32
+#define PCI_CONFIG_SIZE 256
+
+/* Configuration space header */
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_REVISION_ID 0x08
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0A
+#define PCI_CLASS 0x0B
+#define PCI_CACHE_LINE_SIZE 0x0C
+#define PCI_LATENCY_TIMER 0x0D
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR(N) (0x10 + (N) * 4)
+#define PCI_INTERRUPT_LINE 0x3C
+#define PCI_INTERRUPT_PIN 0x3D
+
+#define PCI_NB_BARS 6
+
+/* Command register */
+#define PCI_COMMAND_IO 0x1
+#define PCI_COMMAND_MEMORY 0x2
+#define PCI_COMMAND_MASTER 0x4
+
+/* BAR type bit */
+#define PCI_BAR_IO 0x1
+
+struct pci_device
+{
+    s32 slot; // Set by pci_register
+    u8 config[PCI_CONFIG_SIZE];
+    u32 bar_size[PCI_NB_BARS]; // Power of two, 0 when the BAR is unused
+
+    // Called after the guest wrote the command register or a BAR, can be NULL
+    void (*config_changed)(struct pci_device *dev);
+    void *data;
+};
+
+static inline u16 pci_config_read16(struct pci_device *dev, u32 offset)
+{
+    return dev->config[offset] | (dev->config[offset + 1] << 8);
+}
+
+static inline u32 pci_config_read32(struct pci_device *dev, u32 offset)
+{
+    return pci_config_read16(dev, offset)
+        | ((u32)pci_config_read16(dev, offset + 2) << 16);
+}
+
+static inline void pci_config_write16(struct pci_device *dev,
+                                      u32 offset,
+                                      u16 value)
+{
+    dev->config[offset] = value & 0xFF;
+    dev->config[offset + 1] = value >> 8;
+}
+
+static inline void pci_config_write32(struct pci_device *dev,
+                                      u32 offset,
+                                      u32 value)
+{
+    pci_config_write16(dev, offset, value & 0xFFFF);
+    pci_config_write16(dev, offset + 2, value >> 16);
+}
+
+/**
+ * Address programmed in a BAR, without the type bits
+ */
+u32 pci_bar_address(struct pci_device *dev, u32 bar);
+
+/**
+ * Register the configuration ports and a host bridge in slot 0
+ */
+void pci_init(void);
+
+/**
+ * Add a device on bus 0. The structure is used in place and must stay valid
+ * until pci_unregister.
+ *
+ * @return the slot of the device, -1 if the bus is full
+ */
+s32 pci_register(struct pci_device *dev);
+
+void pci_unregister(s32 slot);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef PIXEL_HEADER
+#define PIXEL_HEADER
+
+#include <blackhv/types.h>
+
+/** Conversion of guest framebuffer pixels to ARGB8888 **/
+
+#define PIXEL_ISA_SCALAR 0
+#define PIXEL_ISA_SSE2 1
+#define PIXEL_ISA_AVX2 2
+
+/**
+ * Convert `nb_pixels` pixels of `bpp` bits (8, 15, 16, 24 or 32) to ARGB8888
+ * with an opaque alpha. 15 and 16 bits pixels are RGB555 and RGB565, 24 bits
+ * pixels are BGR bytes. 8 bits pixels index `palette`, 256 XRGB colors,
+ * which is unused by the other depths.
+ */
+void pixel_convert(u32 *dst,
+                   const u8 *src,
+                   u64 nb_pixels,
+                   u32 bpp,
+                   const u32 *palette);
+
+/**
+ * Get the instruction set used by pixel_convert, by default the best one the
+ * CPU supports
+ */
+u32 pixel_get_isa(void);
+
+/**
+ * Force the instruction set used by pixel_convert, for tests and benchmarks
+ *
+ * @return 1 on success, 0 if the CPU does not support it
+ */
+s32 pixel_set_isa(u32 isa);
+
+#endif
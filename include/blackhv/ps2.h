@@ -0,0 +1,58 @@
+#ifndef PS2_HEADER
+#define PS2_HEADER
+
+#include <blackhv/types.h>
+#include <blackhv/vm.h>
+
+/** i8042 PS/2 controller with a keyboard and a mouse **/
+
+#define PS2_DATA 0x60
+#define PS2_STATUS 0x64 // Read
+#define PS2_COMMAND 0x64 // Write
+
+#define PS2_KEYBOARD_IRQ 1
+#define PS2_MOUSE_IRQ 12
+
+#define PS2_QUEUE_EVENTS 1024 // Per device, further input is dropped
+#define PS2_FIFO_SIZE 256 // Bytes waiting for the guest, per device
+
+/* Mouse buttons */
+#define PS2_BUTTON_LEFT 0x1
+#define PS2_BUTTON_RIGHT 0x2
+#define PS2_BUTTON_MIDDLE 0x4
+
+typedef struct ps2 ps2_t;
+
+/**
+ * Register the controller ports and wire the keyboard and mouse interrupts.
+ * The vm must have been initialized with CREATE_IRQCHIP, or be NULL to leave
+ * them unwired. The keyboard sends scan code set 1, as translated by the
+ * controller on a PC.
+ */
+ps2_t *ps2_new(vm_t *vm);
+
+void ps2_destroy(ps2_t *ps2);
+
+/**
+ * Queue a key press or release. `usage` is a USB HID usage of the keyboard
+ * page, which are also the SDL scan codes.
+ *
+ * The input functions only write to a lock-free queue, they do not take the
+ * device lock nor interrupt the guest until ps2_flush is called. They are
+ * called from a single thread, once ps2_new returned.
+ */
+void ps2_key(ps2_t *ps2, u32 usage, u32 pressed);
+
+/**
+ * Queue a mouse movement, `dy` grows downwards, `dz` is the wheel and grows
+ * upwards. `buttons` are the PS2_BUTTON_* held.
+ */
+void ps2_mouse(ps2_t *ps2, s32 dx, s32 dy, s32 dz, u32 buttons);
+
+/**
+ * Hand the queued input to the device, after a batch of input events. The
+ * guest is interrupted once if it was not already busy reading the input.
+ */
+void ps2_flush(ps2_t *ps2);
+
+#endif
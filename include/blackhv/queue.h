@@ -2,26 +2,69 @@
 #define QUEUE_HEADER
 
 #include <blackhv/types.h>
-#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
+#define QUEUE_CACHE_LINE 64
+
+/**
+ * Lock-free single-producer/single-consumer ring buffer. One thread can call
+ * queue_write while another thread calls queue_read without any lock.
+ *
+ * `front` and `rear` are free-running indices, they are masked when accessing
+ * the buffer. Each side lives on its own cache line with a cached copy of the
+ * other side index to avoid bouncing cache lines between the two threads.
+ */
 typedef struct
 {
-    pthread_mutex_t mutex;
-    size_t buffer_size;
-    size_t front;
-    size_t rear;
-    u8 is_full;
+    // Consumer side
+    _Alignas(QUEUE_CACHE_LINE) atomic_size_t front;
+    size_t rear_cache;
+
+    // Producer side
+    _Alignas(QUEUE_CACHE_LINE) atomic_size_t rear;
+    size_t front_cache;
+
+    // Read only after creation
+    _Alignas(QUEUE_CACHE_LINE) size_t buffer_size; // Always a power of two
+    size_t mask;
     u8 *buffer;
 } queue_t;
 
+/**
+ * Create a new queue. `buffer_size` is rounded up to the next power of two.
+ */
 queue_t *queue_new(size_t buffer_size);
 
+/**
+ * Write up to `size` bytes, must only be called by the producer thread.
+ *
+ * @return number of bytes written, 0 if the queue is full
+ */
 size_t queue_write(queue_t *queue, u8 *buffer, size_t size);
 
+/**
+ * Read up to `size` bytes, must only be called by the consumer thread.
+ *
+ * @return number of bytes read, 0 if the queue is empty
+ */
 size_t queue_read(queue_t *queue, u8 *buffer, size_t size);
 
+/**
+ * Same as queue_read but sleeps on `event_fd` while the queue is empty, at
+ * most `timeout_ms` milliseconds (forever if negative). The producer must
+ * signal the eventfd after each write. Must only be called by the consumer.
+ *
+ * @return number of bytes read, 0 on timeout
+ */
+size_t queue_read_wait(queue_t *queue,
+                       s32 event_fd,
+                       u8 *buffer,
+                       size_t size,
+                       s32 timeout_ms);
+
 u32 queue_empty(queue_t *queue);
 
 void queue_destroy(queue_t *queue);
 
-#endif
\ No newline at end of file
+#endif
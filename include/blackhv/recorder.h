@@ -0,0 +1,93 @@
+#ifndef RECORDER_HEADER
+#define RECORDER_HEADER
+
+#include <blackhv/types.h>
+#include <blackhv/vbe.h>
+
+#define RECORDER_MAGIC 0x52484842 // "BHHR"
+#define RECORDER_VERSION 1
+#define RECORDER_MAX_PENDING 0x4000000 // Bytes of frames waiting to be written
+
+/* Ops of a frame, in the 2 high bits of a u32 whose low bits are a count */
+#define RECORDER_OP_SKIP 0x0 // Pixels unchanged since the previous frame
+#define RECORDER_OP_FILL 0x1 // Followed by one pixel, repeated count times
+#define RECORDER_OP_COPY 0x2 // Followed by count pixels
+#define RECORDER_OP_SHIFT 30
+#define RECORDER_COUNT_MASK ((1U << RECORDER_OP_SHIFT) - 1)
+
+/**
+ * Recording file format, little endian: this header, then the frames.
+ * Frames are only recorded when the guest drew something.
+ */
+struct recorder_header
+{
+    u32 magic;
+    u32 version;
+} __attribute__((packed));
+
+/**
+ * Each frame is this header followed by `size` bytes of ops, which describe
+ * the ARGB8888 pixels in raster order as a delta from the previous frame.
+ * The pixels following the last op are unchanged. A frame of another size
+ * than the previous one is a delta from a black frame.
+ */
+struct recorder_frame
+{
+    u64 timestamp_us; // Since the start of the recording
+    u32 width;
+    u32 height;
+    u32 size;
+} __attribute__((packed));
+
+struct recorder_stats
+{
+    u64 frames; // Written to the file
+    u64 dropped; // Not recorded because the writer was late
+    u64 bytes; // Written to the file
+};
+
+typedef struct recorder recorder_t;
+typedef struct recording recording_t;
+
+/**
+ * Record frames to a new file at `path`. The frames are encoded and written
+ * by a thread, the screen only copies the rows changed by the guest.
+ */
+recorder_t *recorder_new(const char *path);
+
+/**
+ * Write the remaining frames and close the file
+ */
+void recorder_destroy(recorder_t *recorder);
+
+/**
+ * Start a frame of the mode `mode`, whose first visible pixel is at `frame`.
+ * The rows are copied by recorder_add_rows, they are all copied when the
+ * previous frame was dropped. The frame is queued by recorder_end_frame.
+ * These three functions are called from a single thread.
+ */
+void recorder_begin_frame(recorder_t *recorder,
+                          const struct vbe_mode *mode,
+                          const u8 *frame,
+                          const u32 *palette);
+
+void recorder_add_rows(recorder_t *recorder, u32 first_row, u32 nb_rows);
+
+void recorder_end_frame(recorder_t *recorder);
+
+void recorder_get_stats(recorder_t *recorder, struct recorder_stats *stats);
+
+recording_t *recording_open(const char *path);
+
+void recording_close(recording_t *recording);
+
+/**
+ * Decode the next frame, its header is copied to `frame`
+ *
+ * @return the width * height ARGB8888 pixels, valid until the next call, NULL
+ * at the end of the recording or on error
+ */
+const u32 *recording_next(recording_t *recording,
+                          struct recorder_frame *frame);
+
+#endif
@@ -5,9 +5,46 @@
 
 typedef struct vm vm_t;
 typedef struct screen screen_t;
+typedef struct recorder recorder_t;
+typedef struct ps2 ps2_t;
+
+#define SCREEN_MAX_FPS 60
+
+/**
+ * Counters of the render loop, times in microseconds. A poll checks the
+ * framebuffer for damage, a frame is presented only when a poll found some.
+ */
+struct screen_stats
+{
+    u64 polls;
+    u64 frames;
+    u64 uploaded_bytes;
+    u64 last_frame_us; // Upload and present time of the last frame
+    u64 max_frame_us;
+    u64 total_frame_us;
+};
 
 s64 screen_init(vm_t *vm, u64 framebuffer_phys);
 void *screen_run(void *params);
 void screen_uninit(vm_t *vm);
 
+/**
+ * Limit the refresh rate, SCREEN_MAX_FPS by default
+ */
+void screen_set_max_fps(vm_t *vm, u32 fps);
+
+void screen_get_stats(vm_t *vm, struct screen_stats *stats);
+
+/**
+ * Record the frames to `recorder`, or stop recording with NULL. The recorder
+ * can be destroyed once this returns.
+ */
+void screen_set_recorder(vm_t *vm, recorder_t *recorder);
+
+/**
+ * Forward the keyboard and mouse events of the window to `ps2`, before
+ * screen_run is started. A click grabs the mouse, Ctrl+Alt+G releases it.
+ */
+void screen_set_ps2(vm_t *vm, ps2_t *ps2);
+
 #endif
@@ -6,15 +6,43 @@
 #define COM3 0x3E8
 #define COM4 0x2E8
 
+#define COM1_IRQ 4
+#define COM2_IRQ 3
+#define COM3_IRQ 4
+#define COM4_IRQ 3
+
+#define SERIAL_FIFO_SIZE 16
+
 #include <blackhv/queue.h>
 #include <blackhv/types.h>
+#include <pthread.h>
 #include <stddef.h>
 
+typedef struct vm vm_t;
+
 typedef struct
 {
     u16 port;
     queue_t *guest_queue; // Write from guest to host
     queue_t *host_queue; // Write from host to guest
+    s32 event_fd; // Signaled each time the guest writes data
+
+    // 16550A state, protected by lock
+    pthread_mutex_t lock;
+    vm_t *vm; // NULL when the interrupt line is not wired
+    u32 irq;
+    u8 irq_level;
+    u8 ier;
+    u8 lcr;
+    u8 mcr;
+    u8 fcr;
+    u8 scr;
+    u8 dll;
+    u8 dlh;
+    u8 thr_interrupt; // THR empty interrupt pending
+    u8 rx_fifo[SERIAL_FIFO_SIZE];
+    u8 rx_head;
+    u8 rx_count;
 } serial_t;
 
 /**
@@ -22,6 +50,14 @@ typedef struct
  */
 serial_t *serial_new(u16 port, size_t internal_buffer_size);
 
+/**
+ * Wire the serial interrupt to an IRQ line of the vm. The vm must have been
+ * initialized with CREATE_IRQCHIP.
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 serial_set_irq(serial_t *serial, vm_t *vm, u32 irq);
+
 void serial_destroy(serial_t *serial);
 
 /**
@@ -30,8 +66,23 @@ void serial_destroy(serial_t *serial);
 size_t serial_read(serial_t *serial, u8 *buffer, size_t len);
 
 /**
- * Write data to the guest
+ * Read data sent by the guest, waiting at most `timeout_ms` milliseconds for
+ * data to be available. A negative timeout waits forever.
+ */
+size_t serial_read_timeout(serial_t *serial,
+                           u8 *buffer,
+                           size_t len,
+                           s32 timeout_ms);
+
+/**
+ * Get an eventfd that becomes readable when the guest writes data. It can be
+ * used with poll, select or epoll.
+ */
+s32 serial_get_eventfd(serial_t *serial);
+
+/**
+ * Write data to the guest, it can be called from several threads
  */
 size_t serial_write(serial_t *serial, u8 *buffer, size_t len);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,83 @@
+#ifndef SERIAL_IO_HEADER
+#define SERIAL_IO_HEADER
+
+#include <blackhv/serial.h>
+#include <blackhv/types.h>
+#include <blackhv/virtio_console.h>
+#include <stddef.h>
+
+/**
+ * Host side of a character device. read returns the data written by the
+ * guest, write sends data to the guest and event_fd becomes readable when
+ * the guest has written something.
+ */
+struct chardev
+{
+    void *device;
+    size_t (*read)(void *device, u8 *buffer, size_t len);
+    size_t (*write)(void *device, u8 *buffer, size_t len);
+    s32 event_fd;
+};
+
+struct chardev serial_chardev(serial_t *serial);
+
+struct chardev virtio_console_chardev(virtio_console_t *console);
+
+/**
+ * A single I/O thread shared by every backend. It sleeps in epoll until a
+ * device or a backend file descriptor is ready, gathers all the pending guest
+ * output and forwards it with one writev per backend.
+ *
+ * Once attached, the I/O thread is the only reader and writer of the device,
+ * the *_read and *_write functions of the device must not be called anymore.
+ * A device can be attached to a single backend.
+ */
+typedef struct serial_io serial_io_t;
+
+serial_io_t *serial_io_new(void);
+
+/**
+ * Stop the I/O thread and close every backend
+ */
+void serial_io_destroy(serial_io_t *io);
+
+/**
+ * Forward the guest output to already opened file descriptors. `in_fd` is
+ * the guest input and can be -1, the descriptors are not closed.
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 serial_io_add_fd(serial_io_t *io,
+                     struct chardev dev,
+                     s32 in_fd,
+                     s32 out_fd);
+
+/**
+ * Append the guest output to a log file
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 serial_io_add_file(serial_io_t *io, struct chardev dev, const char *path);
+
+/**
+ * Create a pseudo terminal connected to the device, its path is written in
+ * `name` (`screen /dev/pts/N` to attach to it).
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 serial_io_add_pty(serial_io_t *io,
+                      struct chardev dev,
+                      char *name,
+                      size_t name_len);
+
+/**
+ * Listen on a unix stream socket at `path`, which may only be taken by a
+ * socket left by a previous run. One client is connected at a time, a new
+ * client replaces the previous one. The guest output is
+ * discarded while no client is connected.
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 serial_io_add_unix(serial_io_t *io, struct chardev dev, const char *path);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef URING_HEADER
+#define URING_HEADER
+
+#include <blackhv/types.h>
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/**
+ * Minimal io_uring wrapper over the raw system calls. The submission side
+ * and the completion side can each be used by a single thread.
+ */
+struct uring
+{
+    s32 fd;
+
+    u32 *sq_head;
+    u32 *sq_tail;
+    u32 sq_mask;
+    u32 *sq_array;
+    u32 sq_entries;
+    u32 sq_pending_tail; // Tail including the entries not yet submitted
+    struct io_uring_sqe *sqes;
+
+    u32 *cq_head;
+    u32 *cq_tail;
+    u32 cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/**
+ * @return 1 on success, 0 otherwise
+ */
+s32 uring_init(struct uring *ring, u32 entries);
+
+void uring_destroy(struct uring *ring);
+
+/**
+ * Get a zeroed submission entry
+ *
+ * @return the entry, NULL if the submission queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/**
+ * Submit every entry obtained since the last call with a single system call
+ *
+ * @return number of entries submitted, -1 on error
+ */
+s32 uring_submit(struct uring *ring);
+
+/**
+ * Sleep until at least one completion is available
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 uring_wait(struct uring *ring);
+
+/**
+ * @return the next completion, NULL if there is none
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+/**
+ * Release the completion returned by uring_peek_cqe
+ */
+void uring_cqe_seen(struct uring *ring);
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef VBE_HEADER
+#define VBE_HEADER
+
+#include <blackhv/types.h>
+#include <blackhv/vm.h>
+
+/** Bochs VBE display interface (DISPI), as emulated by Bochs and QEMU **/
+
+#define VBE_DISPI_IOPORT_INDEX 0x1CE
+#define VBE_DISPI_IOPORT_DATA 0x1CF
+
+/* VGA DAC, the palette of the 8 bits modes */
+#define VBE_DAC_READ_INDEX 0x3C7
+#define VBE_DAC_WRITE_INDEX 0x3C8
+#define VBE_DAC_DATA 0x3C9
+
+/* VGA input status, its vertical retrace bit paces the page flips */
+#define VBE_VGA_STATUS 0x3DA
+#define VBE_VGA_STATUS_BLANK 0x01
+#define VBE_VGA_STATUS_RETRACE 0x08
+#define VBE_REFRESH_HZ 60
+
+/* Registers */
+#define VBE_DISPI_INDEX_ID 0x0
+#define VBE_DISPI_INDEX_XRES 0x1
+#define VBE_DISPI_INDEX_YRES 0x2
+#define VBE_DISPI_INDEX_BPP 0x3
+#define VBE_DISPI_INDEX_ENABLE 0x4
+#define VBE_DISPI_INDEX_BANK 0x5
+#define VBE_DISPI_INDEX_VIRT_WIDTH 0x6
+#define VBE_DISPI_INDEX_VIRT_HEIGHT 0x7
+#define VBE_DISPI_INDEX_X_OFFSET 0x8
+#define VBE_DISPI_INDEX_Y_OFFSET 0x9
+#define VBE_DISPI_INDEX_VIDEO_MEMORY_64K 0xA
+#define VBE_DISPI_INDEX_NB 0xB
+
+#define VBE_DISPI_ID0 0xB0C0
+#define VBE_DISPI_ID5 0xB0C5
+
+/* Enable register bits */
+#define VBE_DISPI_ENABLED 0x01
+#define VBE_DISPI_GETCAPS 0x02
+#define VBE_DISPI_8BIT_DAC 0x20
+#define VBE_DISPI_LFB_ENABLED 0x40
+#define VBE_DISPI_NOCLEARMEM 0x80
+
+#define VBE_MAX_XRES 1280
+#define VBE_MAX_YRES 1024
+#define VBE_MAX_BPP 32
+#define VBE_VRAM_SIZE 0x1000000 // 16 MB, two frames of the largest mode
+
+/* Bochs display adapter, Linux binds bochs-drm to it */
+#define VBE_PCI_VENDOR 0x1234
+#define VBE_PCI_DEVICE 0x1111
+
+/**
+ * Visible mode. Until the guest enables the DISPI, it is the FB_WIDTH x
+ * FB_HEIGHT x 32 bits mode of framebuffer.h at the start of the video memory.
+ */
+struct vbe_mode
+{
+    u32 width;
+    u32 height;
+    u32 bpp; // 8, 15, 16, 24 or 32 bits per pixel
+    u32 pitch; // Bytes per row
+    u64 offset; // Of the first visible pixel in the video memory
+};
+
+typedef struct vbe vbe_t;
+
+/**
+ * Register the DISPI ports and a Bochs display PCI function, visible once
+ * pci_init is called, whose BAR0 is the video memory at `vram_phys` (not
+ * relocated). The VBE_VRAM_SIZE bytes at `vram_phys` must be guest memory
+ * writable with memory_write, they are cleared when a mode is set.
+ */
+vbe_t *vbe_new(vm_t *vm, u64 vram_phys);
+
+void vbe_destroy(vbe_t *vbe);
+
+/**
+ * Get the current mode, can be called from any thread
+ *
+ * @return the generation of the mode, incremented at each change, and at each
+ * palette change in 8 bits modes
+ */
+u32 vbe_get_mode(vbe_t *vbe, struct vbe_mode *mode);
+
+/**
+ * Get the 256 XRGB colors of the 8 bits modes, in `palette`
+ */
+void vbe_get_palette(vbe_t *vbe, u32 *palette);
+
+/**
+ * Tell that the frame of the mode `generation` is on screen. From a page
+ * flip until then, the vertical retrace bit reads 0, so that a guest waiting
+ * for the retrace does not draw into the buffer being shown.
+ */
+void vbe_set_presented(vbe_t *vbe, u32 generation);
+
+#endif
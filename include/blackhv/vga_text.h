@@ -0,0 +1,51 @@
+#ifndef VGA_TEXT_HEADER
+#define VGA_TEXT_HEADER
+
+#include <blackhv/types.h>
+
+/** VGA text mode, the 80x25 cells at 0xB8000 **/
+
+#define VGA_TEXT_ADDRESS 0xB8000
+#define VGA_TEXT_COLS 80
+#define VGA_TEXT_ROWS 25
+#define VGA_TEXT_CELLS (VGA_TEXT_COLS * VGA_TEXT_ROWS)
+
+#define VGA_GLYPH_WIDTH 8
+#define VGA_GLYPH_HEIGHT 16
+#define VGA_TEXT_WIDTH (VGA_TEXT_COLS * VGA_GLYPH_WIDTH) // Pixels
+#define VGA_TEXT_HEIGHT (VGA_TEXT_ROWS * VGA_GLYPH_HEIGHT)
+
+// Rendered (character, attribute) pairs kept, direct mapped
+#define VGA_GLYPH_CACHE_SIZE 4096
+
+typedef struct vga_text vga_text_t;
+
+/**
+ * Renderer of the text cells to a VGA_TEXT_WIDTH x VGA_TEXT_HEIGHT ARGB8888
+ * frame. The glyphs of code page 437 are rasterized once, the ones the font
+ * lacks are drawn as a hollow box.
+ */
+vga_text_t *vga_text_new(void);
+
+void vga_text_destroy(vga_text_t *text);
+
+/**
+ * Render the cells which changed since the previous call, all of them the
+ * first time. A cell is a character in its low byte and an attribute in its
+ * high byte: the foreground color in bits 0-3, the background color in bits
+ * 4-6, bit 7 blinks and is ignored.
+ *
+ * @return the number of cells rendered, the pixel rows which changed are
+ * [*first_row, *last_row] when it is not 0
+ */
+u32 vga_text_render(vga_text_t *text,
+                    const u16 *cells,
+                    u32 *first_row,
+                    u32 *last_row);
+
+/**
+ * Get the frame, VGA_TEXT_WIDTH pixels per row
+ */
+const u32 *vga_text_get_frame(vga_text_t *text);
+
+#endif
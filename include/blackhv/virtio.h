@@ -0,0 +1,212 @@
+#ifndef VIRTIO_HEADER
+#define VIRTIO_HEADER
+
+#include <blackhv/types.h>
+#include <blackhv/vm.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/** virtio-mmio transport (virtio 1.1, section 4.2) **/
+
+#define VIRTIO_MMIO_SIZE 0x200
+
+/* Device IDs */
+#define VIRTIO_ID_BLOCK 2
+#define VIRTIO_ID_CONSOLE 3
+#define VIRTIO_ID_PMEM 27
+
+/* Device independent feature bits */
+#define VIRTIO_RING_F_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1 32
+
+#define VIRTIO_FEATURE(BIT) (1ULL << (BIT))
+
+/* Device status */
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_NEEDS_RESET 64
+#define VIRTIO_STATUS_FAILED 128
+
+/* Interrupt status */
+#define VIRTIO_INT_VRING 1
+#define VIRTIO_INT_CONFIG 2
+
+#define VIRTIO_MAX_QUEUES 16
+#define VIRTQ_MAX_SIZE 256
+#define VIRTQ_MAX_CHAIN 64
+
+/** Split virtqueue layout, shared with the guest **/
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+struct virtq_desc
+{
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+};
+
+struct virtq_avail
+{
+    u16 flags;
+    u16 idx;
+    u16 ring[]; // followed by used_event with VIRTIO_RING_F_EVENT_IDX
+};
+
+struct virtq_used_elem
+{
+    u32 id;
+    u32 len;
+};
+
+struct virtq_used
+{
+    u16 flags;
+    u16 idx;
+    struct virtq_used_elem ring[]; // followed by avail_event
+};
+
+struct virtq
+{
+    pthread_mutex_t lock; // Held by devices while processing the queue
+    u16 num;
+    u16 ready;
+    u64 desc_addr;
+    u64 avail_addr;
+    u64 used_addr;
+
+    // Host pointers, valid once the queue is ready
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+
+    u16 last_avail_idx;
+    u16 used_idx;
+    u16 signalled_used; // used_idx at the last interrupt
+};
+
+/**
+ * A descriptor chain popped from a virtqueue. Device readable buffers come
+ * first (out), followed by device writable buffers (in).
+ */
+struct virtq_chain
+{
+    u16 head;
+    u16 out_num;
+    u16 in_num;
+    struct iovec iov[VIRTQ_MAX_CHAIN];
+};
+
+struct virtio_device
+{
+    vm_t *vm;
+    u64 base_address;
+    u32 irq;
+    s32 mmio_id;
+
+    // Filled by the device before calling virtio_device_init
+    u32 device_id;
+    u64 device_features;
+    u16 num_queues;
+    void *config;
+    u32 config_size;
+
+    // Called on the vcpu thread when the guest kicks a queue
+    void (*notify)(struct virtio_device *dev, u16 queue);
+    // Called when the guest writes in the configuration space, can be NULL
+    void (*config_write)(struct virtio_device *dev,
+                         u32 offset,
+                         u8 *data,
+                         u32 len);
+    // Called when the guest resets the device, can be NULL
+    void (*reset)(struct virtio_device *dev);
+    void *data;
+
+    // Transport state
+    u64 driver_features;
+    u32 device_features_sel;
+    u32 driver_features_sel;
+    u32 queue_sel;
+    u32 status;
+    u32 config_generation;
+
+    pthread_mutex_t irq_lock;
+    u32 interrupt_status;
+
+    struct virtq queues[VIRTIO_MAX_QUEUES];
+};
+
+/**
+ * Register a virtio-mmio device of VIRTIO_MMIO_SIZE bytes at `base_address`.
+ * mmio_init must have been called before. Linux guests find the device with
+ * the `virtio_mmio.device=512@<base_address>:<irq>` command line parameter.
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 virtio_device_init(struct virtio_device *dev,
+                       vm_t *vm,
+                       u64 base_address,
+                       u32 irq);
+
+void virtio_device_uninit(struct virtio_device *dev);
+
+/**
+ * Check if a feature has been accepted by the driver
+ */
+static inline u32 virtio_has_feature(struct virtio_device *dev, u32 bit)
+{
+    return (dev->driver_features & VIRTIO_FEATURE(bit)) != 0;
+}
+
+/**
+ * Pop the next available descriptor chain, the queue lock must be held.
+ * Malformed chains are returned to the driver with a zero length and skipped.
+ *
+ * @return 1 if a chain was popped, 0 if the queue is empty
+ */
+s32 virtq_pop(struct virtio_device *dev,
+              struct virtq *vq,
+              struct virtq_chain *chain);
+
+/**
+ * Return a chain to the driver, `len` is the number of bytes written in the
+ * device writable buffers. The queue lock must be held.
+ */
+void virtq_push(struct virtq *vq, u16 head, u32 len);
+
+/**
+ * Interrupt the guest if it wants to be notified about the chains pushed since
+ * the last call. Call it once after a batch of virtq_push, with the queue lock
+ * held.
+ */
+void virtq_notify(struct virtio_device *dev, struct virtq *vq);
+
+/**
+ * Ask the driver not to kick the queue while the device is processing it.
+ * The queue lock must be held.
+ */
+void virtq_disable_notify(struct virtio_device *dev, struct virtq *vq);
+
+/**
+ * Ask the driver to kick the queue again when it makes new chains available.
+ * The queue lock must be held.
+ *
+ * @return 1 if chains were made available while notifications were disabled,
+ * the device must process them since no kick will come for them.
+ */
+u32 virtq_enable_notify(struct virtio_device *dev, struct virtq *vq);
+
+/**
+ * Raise a configuration change interrupt
+ */
+void virtio_config_changed(struct virtio_device *dev);
+
+#endif
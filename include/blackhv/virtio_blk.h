@@ -0,0 +1,138 @@
+#ifndef VIRTIO_BLK_HEADER
+#define VIRTIO_BLK_HEADER
+
+#include <blackhv/types.h>
+#include <blackhv/uring.h>
+#include <blackhv/virtio.h>
+#include <pthread.h>
+
+/* Block feature bits */
+#define VIRTIO_BLK_F_SEG_MAX 2
+#define VIRTIO_BLK_F_RO 5
+#define VIRTIO_BLK_F_BLK_SIZE 6
+#define VIRTIO_BLK_F_FLUSH 9
+#define VIRTIO_BLK_F_MQ 12
+#define VIRTIO_BLK_F_DISCARD 13
+
+/* Request types */
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_GET_ID 8
+#define VIRTIO_BLK_T_DISCARD 11
+
+/* Request status */
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+#define VIRTIO_BLK_ID_BYTES 20
+
+/* virtio_blk_new flags */
+#define VIRTIO_BLK_READ_ONLY 0x1
+
+struct virtio_blk_config
+{
+    u64 capacity; // In 512 bytes sectors
+    u32 size_max;
+    u32 seg_max;
+    u16 cylinders;
+    u8 heads;
+    u8 sectors;
+    u32 blk_size;
+    u8 physical_block_exp;
+    u8 alignment_offset;
+    u16 min_io_size;
+    u32 opt_io_size;
+    u8 writeback;
+    u8 unused0;
+    u16 num_queues;
+    u32 max_discard_sectors;
+    u32 max_discard_seg;
+    u32 discard_sector_alignment;
+    u32 max_write_zeroes_sectors;
+    u32 max_write_zeroes_seg;
+    u8 write_zeroes_may_unmap;
+    u8 unused1[3];
+} __attribute__((packed));
+
+struct virtio_blk_req_header
+{
+    u32 type;
+    u32 reserved;
+    u64 sector;
+} __attribute__((packed));
+
+struct virtio_blk_discard
+{
+    u64 sector;
+    u32 num_sectors;
+    u32 flags;
+} __attribute__((packed));
+
+typedef struct virtio_blk virtio_blk_t;
+
+/**
+ * A request submitted to io_uring, indexed by the head of its chain
+ */
+struct virtio_blk_request
+{
+    u16 head;
+    u8 *status;
+    u32 size; // Expected result of the operation
+    u32 len; // Bytes written in the device writable buffers on success
+    u32 nb_iov;
+    struct iovec iov[VIRTQ_MAX_CHAIN];
+};
+
+struct virtio_blk_queue
+{
+    virtio_blk_t *blk;
+    u16 index;
+    struct uring ring; // Submitted on the vcpu thread, completed on thread
+    pthread_t thread;
+    u32 in_flight;
+    u32 stopping; // The completion thread got the stop request
+    struct virtio_blk_request requests[VIRTQ_MAX_SIZE];
+};
+
+/**
+ * virtio block device (virtio 1.1, section 5.2). Requests are executed
+ * asynchronously with io_uring straight from the guest buffers. Each request
+ * queue has its own ring and completion thread, which returns the requests
+ * and interrupts the guest once per batch.
+ */
+struct virtio_blk
+{
+    struct virtio_device dev;
+    struct virtio_blk_config config;
+    int disk_fd;
+    u32 read_only;
+    u16 nb_queues;
+    struct virtio_blk_queue *queues;
+};
+
+/**
+ * Create a virtio block device backed by `disk_fd` at `base_address`,
+ * raising interrupts on `irq`, with `nb_queues` request queues (at most
+ * VIRTIO_MAX_QUEUES). mmio_init must have been called before. The file
+ * descriptor is not closed by virtio_blk_destroy.
+ */
+virtio_blk_t *virtio_blk_new(vm_t *vm,
+                             u64 base_address,
+                             u32 irq,
+                             int disk_fd,
+                             u32 flags,
+                             u16 nb_queues);
+
+void virtio_blk_destroy(virtio_blk_t *blk);
+
+/**
+ * Pin the completion thread of request queue `queue` on `cpu`
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 virtio_blk_set_affinity(virtio_blk_t *blk, u16 queue, u32 cpu);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef VIRTIO_CONSOLE_HEADER
+#define VIRTIO_CONSOLE_HEADER
+
+#include <blackhv/queue.h>
+#include <blackhv/types.h>
+#include <blackhv/virtio.h>
+#include <stddef.h>
+
+/* Console feature bits */
+#define VIRTIO_CONSOLE_F_SIZE 0
+#define VIRTIO_CONSOLE_F_EMERG_WRITE 2
+
+struct virtio_console_config
+{
+    u16 cols;
+    u16 rows;
+    u32 max_nr_ports;
+    u32 emerg_wr;
+} __attribute__((packed));
+
+/**
+ * virtio console (virtio 1.1, section 5.3) with a single port. The guest
+ * posts whole buffers and kicks the device once per batch, the data ends up
+ * in the same kind of queues as a serial_t.
+ */
+typedef struct
+{
+    struct virtio_device dev;
+    struct virtio_console_config config;
+    queue_t *guest_queue; // Write from guest to host
+    queue_t *host_queue; // Write from host to guest
+    s32 event_fd; // Signaled each time the guest writes data
+
+    // Transmit chain partially copied because guest_queue was full
+    struct virtq_chain tx_chain;
+    u8 tx_pending;
+    size_t tx_offset;
+} virtio_console_t;
+
+/**
+ * Create a virtio console at `base_address` raising interrupts on `irq`.
+ * mmio_init must have been called before. Linux guests need
+ * `virtio_mmio.device=512@<base_address>:<irq> console=hvc0` on their
+ * command line.
+ */
+virtio_console_t *virtio_console_new(vm_t *vm,
+                                     u64 base_address,
+                                     u32 irq,
+                                     size_t internal_buffer_size);
+
+void virtio_console_destroy(virtio_console_t *console);
+
+/**
+ * Read data sent by the guest
+ */
+size_t virtio_console_read(virtio_console_t *console, u8 *buffer, size_t len);
+
+/**
+ * Read data sent by the guest, waiting at most `timeout_ms` milliseconds for
+ * data to be available. A negative timeout waits forever.
+ */
+size_t virtio_console_read_timeout(virtio_console_t *console,
+                                   u8 *buffer,
+                                   size_t len,
+                                   s32 timeout_ms);
+
+/**
+ * Get an eventfd that becomes readable when the guest writes data
+ */
+s32 virtio_console_get_eventfd(virtio_console_t *console);
+
+/**
+ * Write data to the guest
+ */
+size_t virtio_console_write(virtio_console_t *console, u8 *buffer, size_t len);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef VIRTIO_PMEM_HEADER
+#define VIRTIO_PMEM_HEADER
+
+#include <blackhv/types.h>
+#include <blackhv/virtio.h>
+#include <pthread.h>
+
+/* Request types */
+#define VIRTIO_PMEM_REQ_TYPE_FLUSH 0
+
+/* virtio_pmem_new flags */
+#define VIRTIO_PMEM_READ_ONLY 0x1
+
+struct virtio_pmem_config
+{
+    u64 start; // Guest physical address of the region
+    u64 size;
+} __attribute__((packed));
+
+struct virtio_pmem_req
+{
+    u32 type;
+} __attribute__((packed));
+
+struct virtio_pmem_resp
+{
+    u32 ret; // 0 on success
+} __attribute__((packed));
+
+/**
+ * virtio persistent memory device (virtio 1.2, section 5.19). The file is
+ * mapped in the guest physical memory, guests access it with plain loads and
+ * stores (DAX) and only exit to flush it to the storage. Flush requests are
+ * executed by a thread, one fdatasync covers all the requests of a batch.
+ */
+typedef struct
+{
+    struct virtio_device dev;
+    struct virtio_pmem_config config;
+    int fd;
+    u32 read_only;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    u32 pending; // Kicked since the thread last looked at the queue
+    u32 stop;
+} virtio_pmem_t;
+
+/**
+ * Create a virtio pmem device at `base_address` raising interrupts on `irq`,
+ * whose region maps the whole file `fd` at `phys_addr`. mmio_init must have
+ * been called before. The mapping stays until the vm is destroyed and the
+ * file descriptor is not closed by virtio_pmem_destroy.
+ */
+virtio_pmem_t *virtio_pmem_new(vm_t *vm,
+                               u64 base_address,
+                               u32 irq,
+                               u64 phys_addr,
+                               int fd,
+                               u32 flags);
+
+void virtio_pmem_destroy(virtio_pmem_t *pmem);
+
+#endif
@@ -67,4 +67,15 @@ s32 vm_run(vm_t *vm);
 
 s32 vm_dump_regs(vm_t *vm);
 
+/**
+ * Set the level of an interrupt line of the in-kernel interrupt controller.
+ * The vcpu must have been initialized with CREATE_IRQCHIP.
+ *
+ * @param vm the virtual machine
+ * @param irq the interrupt line (GSI)
+ * @param level 1 to raise the line, 0 to lower it
+ * @return 1 on success, 0 otherwise
+ */
+s32 vm_irq_line(vm_t *vm, u32 irq, u32 level);
+
 #endif
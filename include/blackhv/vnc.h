@@ -0,0 +1,65 @@
+#ifndef VNC_HEADER
+#define VNC_HEADER
+
+#include <blackhv/types.h>
+
+/** Remote framebuffer (RFB 3.3 to 3.8) server for VNC viewers **/
+
+#define VNC_MAX_CLIENTS 16
+#define VNC_MAX_LISTENERS 4
+#define VNC_TILE 16 // Pixels, the damage is tracked per tile
+
+/* Encodings */
+#define VNC_ENCODING_RAW 0
+#define VNC_ENCODING_HEXTILE 5
+#define VNC_ENCODING_DESKTOP_SIZE -223
+
+/* Hextile subencoding bits */
+#define VNC_HEXTILE_RAW 0x01
+#define VNC_HEXTILE_BACKGROUND 0x02
+#define VNC_HEXTILE_FOREGROUND 0x04
+#define VNC_HEXTILE_ANY_SUBRECTS 0x08
+#define VNC_HEXTILE_COLOURED 0x10
+
+typedef struct vnc vnc_t;
+typedef struct ps2 ps2_t;
+
+/**
+ * Serve the frames published in the shared memory `fd` of a headless screen
+ * (headless_get_fd), which is mapped again and can be closed. Viewers only
+ * get the tiles changed since their previous update, each tile is encoded
+ * once in hextile per pixel format and the same bytes are sent to every
+ * viewer using that format. Viewers without hextile get raw pixels. The
+ * server has no authentication, it listens on local sockets only to be
+ * tunneled.
+ */
+vnc_t *vnc_new(s32 fd);
+
+/**
+ * Disconnect the viewers and remove the unix sockets
+ */
+void vnc_destroy(vnc_t *vnc);
+
+/**
+ * Listen on a unix stream socket at `path`
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 vnc_add_unix(vnc_t *vnc, const char *path);
+
+/**
+ * Listen on the TCP `port` of 127.0.0.1 (display N is port 5900 + N)
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 vnc_add_tcp(vnc_t *vnc, u16 port);
+
+/**
+ * Forward the keys and the pointer of the viewers to `ps2`, or stop with
+ * NULL. The I/O thread of the server becomes the producer of `ps2`, the keys
+ * are mapped for a US layout and the pointer positions are sent as moves.
+ * `ps2` can be destroyed once this returns with NULL.
+ */
+void vnc_set_ps2(vnc_t *vnc, ps2_t *ps2);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef ZIMAGE_HEADER
+#define ZIMAGE_HEADER
+
+#include <blackhv/disk.h>
+#include <blackhv/types.h>
+
+#define ZIMAGE_MAGIC 0x5A494842 // "BHIZ"
+#define ZIMAGE_VERSION 1
+#define ZIMAGE_CHUNK_SIZE 0x10000 // 64 KB chunks by default
+#define ZIMAGE_CACHE_BYTES 0x400000 // Decompressed chunks kept in memory
+
+/**
+ * Read-only compressed image file format, little endian:
+ *
+ * - the chunks, each one compressed independently with zlib and stored back
+ *   to back. A chunk that does not shrink is stored as is.
+ * - the index, nb_chunks + 1 u64, the offset of each chunk in the file then
+ *   the end of the last one
+ * - this footer, at the very end of the file
+ *
+ * Every chunk but the last one holds chunk_size bytes of the image. A chunk
+ * whose stored length is its decompressed length is not compressed.
+ */
+struct zimage_footer
+{
+    u32 magic;
+    u32 version;
+    u32 chunk_size;
+    u32 nb_chunks;
+    u64 size; // Decompressed image size in bytes
+    u64 index_offset;
+} __attribute__((packed));
+
+typedef struct zimage zimage_t;
+
+/**
+ * Compress the image read from `in_fd` to `out_fd`, `level` is the zlib
+ * compression level (1 to 9).
+ *
+ * @return 1 on success, 0 otherwise
+ */
+s32 zimage_convert(int in_fd, int out_fd, u32 chunk_size, s32 level);
+
+zimage_t *zimage_open(const char *path);
+
+void zimage_close(zimage_t *zimage);
+
+/**
+ * Decompressed chunks are cached, a chunk is read and decompressed once while
+ * it stays in the cache.
+ *
+ * @return number of bytes read, short at the end of the image, -1 on error
+ */
+ssize_t zimage_readv(zimage_t *zimage,
+                     const struct iovec *iov,
+                     u32 nb_iov,
+                     u64 offset);
+
+/**
+ * Chunk cache counters since zimage_open
+ */
+void zimage_stats(zimage_t *zimage, u64 *hits, u64 *misses);
+
+/**
+ * Read-only disk, writes fail
+ */
+struct disk zimage_disk(zimage_t *zimage);
+
+#endif
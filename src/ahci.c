@@ -0,0 +1,1119 @@
+#define _GNU_SOURCE
+
+#include <blackhv/ahci.h>
+#include <blackhv/memory.h>
+#include <blackhv/mmio.h>
+#include <blackhv/pci.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Intel ICH9 AHCI function */
+#define AHCI_VENDOR 0x8086
+#define AHCI_DEVICE 0x2922
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_SATA 0x06
+#define AHCI_PROG_IF 0x01
+#define ABAR 5
+#define ABAR_SIZE 0x1000
+
+#define NB_PORTS 1
+#define NB_SLOTS 32
+#define NB_JOBS (NB_PORTS * NB_SLOTS)
+#define NB_WORKERS 4
+#define PRDT_MAX_ENTRIES 256
+#define SECTOR_SIZE 512
+
+/* Generic host control registers */
+#define HBA_CAP 0x00
+#define HBA_GHC 0x04
+#define HBA_IS 0x08
+#define HBA_PI 0x0C
+#define HBA_VS 0x10
+#define HBA_PORTS 0x100
+#define HBA_PORT_SIZE 0x80
+
+#define CAP_S64A (1U << 31)
+#define CAP_SNCQ (1U << 30)
+#define CAP_SAM (1U << 18) // AHCI only, no legacy IDE registers
+#define CAP_ISS_GEN1 (1U << 20)
+#define CAP_NCS(N) (((N) - 1) << 8)
+#define CAP_NP(N) ((N) - 1)
+
+#define GHC_HR (1U << 0)
+#define GHC_IE (1U << 1)
+#define GHC_AE (1U << 31)
+
+#define AHCI_VERSION 0x00010300
+
+/* Port registers */
+#define PX_CLB 0x00
+#define PX_CLBU 0x04
+#define PX_FB 0x08
+#define PX_FBU 0x0C
+#define PX_IS 0x10
+#define PX_IE 0x14
+#define PX_CMD 0x18
+#define PX_TFD 0x20
+#define PX_SIG 0x24
+#define PX_SSTS 0x28
+#define PX_SCTL 0x2C
+#define PX_SERR 0x30
+#define PX_SACT 0x34
+#define PX_CI 0x38
+
+#define PX_IS_DHRS (1U << 0)
+#define PX_IS_SDBS (1U << 3)
+#define PX_IS_TFES (1U << 30)
+
+#define PX_CMD_ST (1U << 0)
+#define PX_CMD_SUD (1U << 1)
+#define PX_CMD_POD (1U << 2)
+#define PX_CMD_CLO (1U << 3)
+#define PX_CMD_FRE (1U << 4)
+#define PX_CMD_FR (1U << 14)
+#define PX_CMD_CR (1U << 15)
+
+#define SIG_SATA_DISK 0x00000101
+#define SSTS_ACTIVE 0x113 // Device present, Gen1 speed, active state
+
+/* Task file status and error */
+#define ATA_SR_ERR (1 << 0)
+#define ATA_SR_DRQ (1 << 3)
+#define ATA_SR_DSC (1 << 4)
+#define ATA_SR_DRDY (1 << 6)
+#define ATA_SR_BSY (1 << 7)
+#define ATA_ER_ABRT (1 << 2)
+
+/* ATA commands */
+#define ATA_CMD_READ_PIO 0x20
+#define ATA_CMD_READ_PIO_EXT 0x24
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_PIO 0x30
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_FLUSH_CACHE 0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+#define ATA_CMD_SET_FEATURES 0xEF
+
+/* Frame Information Structures */
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_TYPE_REG_D2H 0x34
+#define FIS_TYPE_SET_DEVICE_BITS 0xA1
+#define FIS_H2D_COMMAND (1 << 7)
+#define FIS_INTERRUPT (1 << 6)
+
+/* Received FIS area */
+#define RFIS_OFFSET 0x40
+#define SDBFIS_OFFSET 0x58
+
+/* Command header and table */
+#define HEADER_ATAPI (1 << 5)
+#define HEADER_WRITE (1 << 6)
+#define TABLE_PRDT 0x80
+#define PRD_DBC_MASK 0x3FFFFF
+
+struct command_header
+{
+    u16 flags;
+    u16 prdtl; // Number of PRD entries
+    u32 prdbc; // Bytes transferred, written by the HBA
+    u32 ctba;
+    u32 ctbau;
+    u32 reserved[4];
+} __attribute__((packed));
+
+struct prd
+{
+    u32 dba;
+    u32 dbau;
+    u32 reserved;
+    u32 dbc; // Byte count minus one
+} __attribute__((packed));
+
+struct fis_reg_h2d
+{
+    u8 type;
+    u8 flags;
+    u8 command;
+    u8 features_low;
+    u8 lba_low[3];
+    u8 device;
+    u8 lba_high[3];
+    u8 features_high;
+    u16 count;
+    u8 icc;
+    u8 control;
+    u8 reserved[4];
+} __attribute__((packed));
+
+struct fis_reg_d2h
+{
+    u8 type;
+    u8 flags;
+    u8 status;
+    u8 error;
+    u8 lba_low[3];
+    u8 device;
+    u8 lba_high[3];
+    u8 reserved0;
+    u16 count;
+    u8 reserved1[6];
+} __attribute__((packed));
+
+struct fis_set_device_bits
+{
+    u8 type;
+    u8 flags;
+    u8 status;
+    u8 error;
+    u32 active; // Completed NCQ tags
+} __attribute__((packed));
+
+/**
+ * A command decoded on the vcpu thread and executed by a worker
+ */
+struct ahci_job
+{
+    u32 port;
+    u32 slot;
+    u32 generation;
+    u8 command;
+    u8 write;
+    u8 ncq;
+    u64 lba;
+    u32 count; // Sectors
+    u64 table;
+    u16 nb_prd;
+};
+
+struct ahci_port
+{
+    u32 clb;
+    u32 clbu;
+    u32 fb;
+    u32 fbu;
+    u32 is;
+    u32 ie;
+    u32 cmd;
+    u32 tfd;
+    u32 sctl;
+    u32 serr;
+    u32 sact;
+    u32 ci;
+    u32 busy; // Slots handed to the workers
+    u32 ncq; // Slots running a queued command
+    u32 generation; // Incremented when the port stops, drops late completions
+};
+
+struct ahci
+{
+    vm_t *vm;
+    u32 irq;
+    struct disk disk;
+    u64 nb_sectors;
+    struct pci_device pci;
+    struct mmio_region region;
+
+    pthread_mutex_t lock; // Registers, ports and jobs
+    pthread_cond_t work;
+    pthread_t workers[NB_WORKERS];
+    u32 nb_workers;
+    u32 stop;
+    struct ahci_job jobs[NB_JOBS];
+    u32 job_head;
+    u32 nb_jobs;
+
+    u32 ghc;
+    u32 is;
+    u32 irq_level;
+    struct ahci_port ports[NB_PORTS];
+};
+
+static u64 port_address(u32 low, u32 high)
+{
+    return ((u64)high << 32) | low;
+}
+
+static void update_irq(ahci_t *ahci)
+{
+    for (u32 i = 0; i < NB_PORTS; ++i)
+    {
+        if (ahci->ports[i].is & ahci->ports[i].ie)
+        {
+            ahci->is |= 1U << i;
+        }
+    }
+
+    u32 level = (ahci->ghc & GHC_IE) && ahci->is != 0;
+
+    if (level != ahci->irq_level)
+    {
+        vm_irq_line(ahci->vm, ahci->irq, level);
+        ahci->irq_level = level;
+    }
+}
+
+static void post_fis(ahci_t *ahci,
+                     struct ahci_port *port,
+                     u32 offset,
+                     void *fis,
+                     u32 len)
+{
+    if (port->cmd & PX_CMD_FRE)
+    {
+        u64 address = port_address(port->fb, port->fbu) + offset;
+
+        memory_write(ahci->vm, address, fis, len);
+    }
+}
+
+static void post_d2h(ahci_t *ahci, struct ahci_port *port)
+{
+    struct fis_reg_d2h fis = {
+        .type = FIS_TYPE_REG_D2H,
+        .flags = FIS_INTERRUPT,
+        .status = port->tfd & 0xFF,
+        .error = port->tfd >> 8,
+    };
+
+    post_fis(ahci, port, RFIS_OFFSET, &fis, sizeof(fis));
+}
+
+static void post_sdb(ahci_t *ahci, struct ahci_port *port, u32 active)
+{
+    struct fis_set_device_bits fis = {
+        .type = FIS_TYPE_SET_DEVICE_BITS,
+        .flags = FIS_INTERRUPT,
+        .status = port->tfd & 0xFF,
+        .active = active,
+    };
+
+    post_fis(ahci, port, SDBFIS_OFFSET, &fis, sizeof(fis));
+}
+
+/**
+ * Report the end of a command to the guest, called with the lock held
+ */
+static void complete(ahci_t *ahci, struct ahci_job *job, u32 ok, u32 bytes)
+{
+    struct ahci_port *port = &ahci->ports[job->port];
+    u32 bit = 1U << job->slot;
+
+    // The port was stopped or reset while the command was running
+    if (job->generation != port->generation)
+    {
+        return;
+    }
+
+    u64 header = port_address(port->clb, port->clbu)
+        + job->slot * sizeof(struct command_header)
+        + offsetof(struct command_header, prdbc);
+
+    memory_write(ahci->vm, header, (u8 *)&bytes, sizeof(bytes));
+
+    port->busy &= ~bit;
+    port->tfd = ok ? ATA_SR_DRDY | ATA_SR_DSC
+                   : (ATA_ER_ABRT << 8) | ATA_SR_DRDY | ATA_SR_ERR;
+
+    if (job->ncq)
+    {
+        port->ncq &= ~bit;
+        port->sact &= ~bit;
+    }
+    else
+    {
+        port->ci &= ~bit;
+    }
+
+    if (!ok)
+    {
+        post_d2h(ahci, port);
+        port->is |= PX_IS_TFES;
+    }
+    else if (job->ncq)
+    {
+        post_sdb(ahci, port, bit);
+        port->is |= PX_IS_SDBS;
+    }
+    else
+    {
+        post_d2h(ahci, port);
+        port->is |= PX_IS_DHRS;
+    }
+
+    update_irq(ahci);
+}
+
+static u64 fis_lba48(const struct fis_reg_h2d *fis)
+{
+    return fis->lba_low[0] | ((u64)fis->lba_low[1] << 8)
+        | ((u64)fis->lba_low[2] << 16) | ((u64)fis->lba_high[0] << 24)
+        | ((u64)fis->lba_high[1] << 32) | ((u64)fis->lba_high[2] << 40);
+}
+
+static u64 fis_lba28(const struct fis_reg_h2d *fis)
+{
+    return fis->lba_low[0] | ((u64)fis->lba_low[1] << 8)
+        | ((u64)fis->lba_low[2] << 16) | ((u64)(fis->device & 0xF) << 24);
+}
+
+/**
+ * Read the command header and the command FIS of a slot
+ *
+ * @return 1 if the command can be handed to a worker, 0 otherwise
+ */
+static u32 decode_command(ahci_t *ahci,
+                          struct ahci_port *port,
+                          struct ahci_job *job)
+{
+    struct command_header header;
+    struct fis_reg_h2d fis;
+    u64 address = port_address(port->clb, port->clbu)
+        + job->slot * sizeof(struct command_header);
+
+    if (memory_read(ahci->vm, address, (u8 *)&header, sizeof(header))
+        != sizeof(header))
+    {
+        return 0;
+    }
+
+    job->table = port_address(header.ctba & ~0x7FU, header.ctbau);
+    job->nb_prd = header.prdtl;
+
+    if (memory_read(ahci->vm, job->table, (u8 *)&fis, sizeof(fis))
+            != sizeof(fis)
+        || fis.type != FIS_TYPE_REG_H2D || !(fis.flags & FIS_H2D_COMMAND)
+        || (header.flags & HEADER_ATAPI))
+    {
+        return 0;
+    }
+
+    job->command = fis.command;
+
+    switch (fis.command)
+    {
+    case ATA_CMD_READ_FPDMA_QUEUED:
+    case ATA_CMD_WRITE_FPDMA_QUEUED:
+        // The sector count is in the features register, the tag in count
+        job->ncq = 1;
+        job->write = fis.command == ATA_CMD_WRITE_FPDMA_QUEUED;
+        job->lba = fis_lba48(&fis);
+        job->count = fis.features_low | (fis.features_high << 8);
+        job->count = job->count == 0 ? 0x10000 : job->count;
+        break;
+    case ATA_CMD_READ_DMA_EXT:
+    case ATA_CMD_READ_PIO_EXT:
+    case ATA_CMD_WRITE_DMA_EXT:
+    case ATA_CMD_WRITE_PIO_EXT:
+        job->write = fis.command == ATA_CMD_WRITE_DMA_EXT
+            || fis.command == ATA_CMD_WRITE_PIO_EXT;
+        job->lba = fis_lba48(&fis);
+        job->count = fis.count == 0 ? 0x10000 : fis.count;
+        break;
+    case ATA_CMD_READ_DMA:
+    case ATA_CMD_READ_PIO:
+    case ATA_CMD_WRITE_DMA:
+    case ATA_CMD_WRITE_PIO:
+        job->write = fis.command == ATA_CMD_WRITE_DMA
+            || fis.command == ATA_CMD_WRITE_PIO;
+        job->lba = fis_lba28(&fis);
+        job->count = (fis.count & 0xFF) == 0 ? 0x100 : fis.count & 0xFF;
+        break;
+    default:
+        break;
+    }
+
+    return 1;
+}
+
+/**
+ * Hand the slots newly set in PxCI to the workers
+ */
+static void port_issue(ahci_t *ahci, u32 index)
+{
+    struct ahci_port *port = &ahci->ports[index];
+    u32 pending = port->ci & ~port->busy;
+
+    for (u32 slot = 0; slot < NB_SLOTS; ++slot)
+    {
+        u32 bit = 1U << slot;
+
+        if (!(pending & bit))
+        {
+            continue;
+        }
+
+        struct ahci_job job = {
+            .port = index,
+            .slot = slot,
+            .generation = port->generation,
+        };
+
+        port->busy |= bit;
+
+        if (!decode_command(ahci, port, &job))
+        {
+            complete(ahci, &job, 0, 0);
+            continue;
+        }
+
+        // A queued command is accepted right away, it completes through SActive
+        if (job.ncq)
+        {
+            port->ncq |= bit;
+            port->ci &= ~bit;
+        }
+
+        ahci->jobs[(ahci->job_head + ahci->nb_jobs) % NB_JOBS] = job;
+        ahci->nb_jobs++;
+        pthread_cond_signal(&ahci->work);
+    }
+}
+
+/**
+ * Forget the commands of a port which are not running yet
+ */
+static void drop_jobs(ahci_t *ahci, u32 index)
+{
+    u32 kept = 0;
+
+    for (u32 i = 0; i < ahci->nb_jobs; ++i)
+    {
+        struct ahci_job *job = &ahci->jobs[(ahci->job_head + i) % NB_JOBS];
+
+        if (job->port != index)
+        {
+            ahci->jobs[(ahci->job_head + kept) % NB_JOBS] = *job;
+            kept++;
+        }
+    }
+
+    ahci->nb_jobs = kept;
+}
+
+static void port_stop(ahci_t *ahci, u32 index)
+{
+    struct ahci_port *port = &ahci->ports[index];
+
+    drop_jobs(ahci, index);
+    port->ci = 0;
+    port->sact = 0;
+    port->busy = 0;
+    port->ncq = 0;
+    port->generation++;
+}
+
+static void port_reset(ahci_t *ahci, u32 index)
+{
+    struct ahci_port *port = &ahci->ports[index];
+
+    port_stop(ahci, index);
+
+    u32 generation = port->generation;
+
+    memset(port, 0, sizeof(struct ahci_port));
+    port->generation = generation;
+    port->tfd = ATA_SR_DRDY | ATA_SR_DSC;
+}
+
+static void hba_reset(ahci_t *ahci)
+{
+    for (u32 i = 0; i < NB_PORTS; ++i)
+    {
+        port_reset(ahci, i);
+    }
+
+    ahci->ghc = GHC_AE;
+    ahci->is = 0;
+    update_irq(ahci);
+}
+
+static u32 port_read(struct ahci_port *port, u32 offset)
+{
+    switch (offset)
+    {
+    case PX_CLB:
+        return port->clb;
+    case PX_CLBU:
+        return port->clbu;
+    case PX_FB:
+        return port->fb;
+    case PX_FBU:
+        return port->fbu;
+    case PX_IS:
+        return port->is;
+    case PX_IE:
+        return port->ie;
+    case PX_CMD:
+        // The engines start and stop immediately
+        return port->cmd | ((port->cmd & PX_CMD_ST) ? PX_CMD_CR : 0)
+            | ((port->cmd & PX_CMD_FRE) ? PX_CMD_FR : 0);
+    case PX_TFD:
+        return port->tfd;
+    case PX_SIG:
+        return SIG_SATA_DISK;
+    case PX_SSTS:
+        return SSTS_ACTIVE;
+    case PX_SCTL:
+        return port->sctl;
+    case PX_SERR:
+        return port->serr;
+    case PX_SACT:
+        return port->sact;
+    case PX_CI:
+        return port->ci;
+    default:
+        return 0;
+    }
+}
+
+static void port_write(ahci_t *ahci, u32 index, u32 offset, u32 value)
+{
+    struct ahci_port *port = &ahci->ports[index];
+
+    switch (offset)
+    {
+    case PX_CLB:
+        port->clb = value & ~0x3FFU;
+        break;
+    case PX_CLBU:
+        port->clbu = value;
+        break;
+    case PX_FB:
+        port->fb = value & ~0xFFU;
+        break;
+    case PX_FBU:
+        port->fbu = value;
+        break;
+    case PX_IS:
+        port->is &= ~value;
+        break;
+    case PX_IE:
+        port->ie = value;
+        break;
+    case PX_CMD:
+        if ((port->cmd & PX_CMD_ST) && !(value & PX_CMD_ST))
+        {
+            port_stop(ahci, index);
+        }
+
+        // Command list override, the device looks idle again
+        if (value & PX_CMD_CLO)
+        {
+            port->tfd &= ~(ATA_SR_BSY | ATA_SR_DRQ);
+        }
+
+        port->cmd = value & (PX_CMD_ST | PX_CMD_SUD | PX_CMD_POD | PX_CMD_FRE);
+        break;
+    case PX_SCTL:
+        port->sctl = value;
+        break;
+    case PX_SERR:
+        port->serr &= ~value;
+        break;
+    case PX_SACT:
+        if (port->cmd & PX_CMD_ST)
+        {
+            port->sact |= value;
+        }
+        break;
+    case PX_CI:
+        if (port->cmd & PX_CMD_ST)
+        {
+            port->ci |= value;
+            port_issue(ahci, index);
+        }
+        break;
+    default:
+        break;
+    }
+
+    update_irq(ahci);
+}
+
+static u32 hba_read(ahci_t *ahci, u32 offset)
+{
+    if (offset >= HBA_PORTS && offset < HBA_PORTS + NB_PORTS * HBA_PORT_SIZE)
+    {
+        u32 index = (offset - HBA_PORTS) / HBA_PORT_SIZE;
+
+        return port_read(&ahci->ports[index], offset % HBA_PORT_SIZE);
+    }
+
+    switch (offset)
+    {
+    case HBA_CAP:
+        return CAP_S64A | CAP_SNCQ | CAP_SAM | CAP_ISS_GEN1 | CAP_NCS(NB_SLOTS)
+            | CAP_NP(NB_PORTS);
+    case HBA_GHC:
+        return ahci->ghc;
+    case HBA_IS:
+        return ahci->is;
+    case HBA_PI:
+        return (1U << NB_PORTS) - 1;
+    case HBA_VS:
+        return AHCI_VERSION;
+    default:
+        return 0;
+    }
+}
+
+static void hba_write(ahci_t *ahci, u32 offset, u32 value)
+{
+    if (offset >= HBA_PORTS && offset < HBA_PORTS + NB_PORTS * HBA_PORT_SIZE)
+    {
+        u32 index = (offset - HBA_PORTS) / HBA_PORT_SIZE;
+
+        port_write(ahci, index, offset % HBA_PORT_SIZE, value);
+        return;
+    }
+
+    switch (offset)
+    {
+    case HBA_GHC:
+        if (value & GHC_HR)
+        {
+            hba_reset(ahci);
+            break;
+        }
+
+        ahci->ghc = GHC_AE | (value & GHC_IE);
+        update_irq(ahci);
+        break;
+    case HBA_IS:
+        ahci->is &= ~value;
+
+        // Lower the line first, an edge triggered controller must see the
+        // interrupts still pending
+        if (ahci->irq_level)
+        {
+            vm_irq_line(ahci->vm, ahci->irq, 0);
+            ahci->irq_level = 0;
+        }
+
+        update_irq(ahci);
+        break;
+    default:
+        break;
+    }
+}
+
+static u32 memory_enabled(ahci_t *ahci)
+{
+    return (pci_config_read16(&ahci->pci, PCI_COMMAND) & PCI_COMMAND_MEMORY)
+        != 0;
+}
+
+static void abar_read(struct mmio_region *region,
+                      u64 address,
+                      u8 data[8],
+                      u32 len,
+                      void *arg)
+{
+    ahci_t *ahci = arg;
+    u32 offset = address - region->base_address;
+
+    if (!memory_enabled(ahci) || len > 4)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&ahci->lock);
+    u32 value = hba_read(ahci, offset & ~0x3U) >> ((offset & 0x3) * 8);
+    pthread_mutex_unlock(&ahci->lock);
+
+    memcpy(data, &value, len);
+}
+
+static void abar_write(struct mmio_region *region,
+                       u64 address,
+                       u8 data[8],
+                       u32 len,
+                       void *arg)
+{
+    ahci_t *ahci = arg;
+    u32 offset = address - region->base_address;
+    u32 value;
+
+    // Registers are only written with aligned 32 bits accesses
+    if (!memory_enabled(ahci) || len != 4 || (offset & 0x3) != 0)
+    {
+        return;
+    }
+
+    memcpy(&value, data, sizeof(value));
+
+    pthread_mutex_lock(&ahci->lock);
+    hba_write(ahci, offset, value);
+    pthread_mutex_unlock(&ahci->lock);
+}
+
+static void ata_string(u16 *words, const char *str, u32 nb_words)
+{
+    size_t len = strlen(str);
+
+    // Two characters per word, the first one in the high byte
+    for (u32 i = 0; i < nb_words * 2; ++i)
+    {
+        u8 c = i < len ? str[i] : ' ';
+
+        words[i / 2] |= (i % 2 == 0) ? c << 8 : c;
+    }
+}
+
+static void identify(ahci_t *ahci, u16 id[256])
+{
+    u64 sectors = ahci->nb_sectors;
+    u32 sectors28 = sectors > 0x0FFFFFFF ? 0x0FFFFFFF : sectors;
+
+    memset(id, 0, 256 * sizeof(u16));
+
+    id[0] = 0x0040; // Fixed device
+    id[1] = 16383; // Legacy geometry
+    id[3] = 16;
+    id[6] = 63;
+    ata_string(id + 10, "BHV00000001", 10);
+    ata_string(id + 23, "1.0", 4);
+    ata_string(id + 27, "blackhv AHCI disk", 20);
+    id[49] = 0x0300; // LBA and DMA
+    id[53] = 0x0006; // Words 64-70 and 88 are valid
+    id[60] = sectors28 & 0xFFFF;
+    id[61] = sectors28 >> 16;
+    id[63] = 0x0007; // Multiword DMA 0-2
+    id[75] = NB_SLOTS - 1; // Queue depth
+    id[76] = 0x0102; // NCQ, SATA Gen1
+    id[80] = 0x00F0; // ATA/ATAPI-4 to ATA/ATAPI-7
+    id[83] = 0x7400; // 48-bit LBA, FLUSH CACHE and FLUSH CACHE EXT
+    id[84] = 0x4000;
+    id[86] = 0x3400;
+    id[87] = 0x4000;
+    id[88] = 0x203F; // UDMA 0-5, UDMA 5 selected
+    id[100] = sectors & 0xFFFF;
+    id[101] = (sectors >> 16) & 0xFFFF;
+    id[102] = (sectors >> 32) & 0xFFFF;
+    id[103] = (sectors >> 48) & 0xFFFF;
+    id[106] = 0x4000; // 512 bytes logical sectors
+}
+
+/**
+ * Point an iovec at each buffer of the PRD table, in the guest memory
+ *
+ * @return the number of iovecs, 0 if an entry is not in guest RAM
+ */
+static u32 map_prdt(ahci_t *ahci,
+                    struct ahci_job *job,
+                    struct iovec *iov,
+                    u64 *size)
+{
+    *size = 0;
+
+    if (job->nb_prd > PRDT_MAX_ENTRIES)
+    {
+        return 0;
+    }
+
+    for (u32 i = 0; i < job->nb_prd; ++i)
+    {
+        struct prd entry;
+        u64 address = job->table + TABLE_PRDT + i * sizeof(entry);
+
+        if (memory_read(ahci->vm, address, (u8 *)&entry, sizeof(entry))
+            != sizeof(entry))
+        {
+            return 0;
+        }
+
+        u64 buffer = port_address(entry.dba & ~0x1U, entry.dbau);
+        u32 len = (entry.dbc & PRD_DBC_MASK) + 1;
+        u8 *start = memory_get_ptr(ahci->vm, buffer);
+        u8 *end = memory_get_ptr(ahci->vm, buffer + len - 1);
+
+        // The buffer must be contiguous on the host too
+        if (start == NULL || end != start + len - 1)
+        {
+            return 0;
+        }
+
+        iov[i].iov_base = start;
+        iov[i].iov_len = len;
+        *size += len;
+    }
+
+    return job->nb_prd;
+}
+
+/**
+ * Shorten an iovec array to `len` bytes
+ *
+ * @return the number of iovecs left
+ */
+static u32 iov_trim(struct iovec *iov, u32 nb_iov, u64 len)
+{
+    for (u32 i = 0; i < nb_iov; ++i)
+    {
+        if (iov[i].iov_len >= len)
+        {
+            iov[i].iov_len = len;
+            return i + 1;
+        }
+
+        len -= iov[i].iov_len;
+    }
+
+    return nb_iov;
+}
+
+static u32 buffer_to_iov(struct iovec *iov, u32 nb_iov, void *buffer, u32 len)
+{
+    u32 copied = 0;
+
+    for (u32 i = 0; i < nb_iov && copied < len; ++i)
+    {
+        u32 size = iov[i].iov_len < len - copied ? iov[i].iov_len
+                                                 : len - copied;
+
+        memcpy(iov[i].iov_base, (u8 *)buffer + copied, size);
+        copied += size;
+    }
+
+    return copied;
+}
+
+/**
+ * Run a command on a worker thread
+ *
+ * @return 1 on success, 0 if the command must be aborted
+ */
+static u32 execute(ahci_t *ahci, struct ahci_job *job, u32 *bytes)
+{
+    struct iovec iov[PRDT_MAX_ENTRIES];
+    u64 size = 0;
+    u32 nb_iov = map_prdt(ahci, job, iov, &size);
+
+    if (nb_iov != job->nb_prd)
+    {
+        return 0;
+    }
+
+    switch (job->command)
+    {
+    case ATA_CMD_IDENTIFY: {
+        u16 id[256];
+
+        identify(ahci, id);
+        *bytes = buffer_to_iov(iov, nb_iov, id, sizeof(id));
+        return 1;
+    }
+    case ATA_CMD_SET_FEATURES:
+        return 1;
+    case ATA_CMD_FLUSH_CACHE:
+    case ATA_CMD_FLUSH_CACHE_EXT:
+        return ahci->disk.flush(ahci->disk.image);
+    case ATA_CMD_READ_PIO:
+    case ATA_CMD_READ_PIO_EXT:
+    case ATA_CMD_READ_DMA:
+    case ATA_CMD_READ_DMA_EXT:
+    case ATA_CMD_READ_FPDMA_QUEUED:
+    case ATA_CMD_WRITE_PIO:
+    case ATA_CMD_WRITE_PIO_EXT:
+    case ATA_CMD_WRITE_DMA:
+    case ATA_CMD_WRITE_DMA_EXT:
+    case ATA_CMD_WRITE_FPDMA_QUEUED: {
+        u64 len = (u64)job->count * SECTOR_SIZE;
+        u64 offset = job->lba * SECTOR_SIZE;
+
+        if (job->lba > ahci->nb_sectors
+            || job->count > ahci->nb_sectors - job->lba || len > size)
+        {
+            return 0;
+        }
+
+        nb_iov = iov_trim(iov, nb_iov, len);
+
+        void *image = ahci->disk.image;
+        ssize_t r = job->write ? ahci->disk.writev(image, iov, nb_iov, offset)
+                               : ahci->disk.readv(image, iov, nb_iov, offset);
+
+        if (r != (ssize_t)len)
+        {
+            return 0;
+        }
+
+        *bytes = len;
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+static void *worker_thread(void *params)
+{
+    ahci_t *ahci = params;
+
+    pthread_mutex_lock(&ahci->lock);
+
+    for (;;)
+    {
+        while (ahci->nb_jobs == 0 && !ahci->stop)
+        {
+            pthread_cond_wait(&ahci->work, &ahci->lock);
+        }
+
+        if (ahci->nb_jobs == 0)
+        {
+            break;
+        }
+
+        struct ahci_job job = ahci->jobs[ahci->job_head];
+
+        ahci->job_head = (ahci->job_head + 1) % NB_JOBS;
+        ahci->nb_jobs--;
+
+        // The disk is accessed without the lock, the vcpu keeps issuing
+        pthread_mutex_unlock(&ahci->lock);
+
+        // The PRDT buffers are used through memory_get_ptr, memory_unmap
+        // waits for the end of the transfer. The hold is released before
+        // taking the lock, which the vcpu holds while reading guest memory.
+        u32 bytes = 0;
+
+        memory_hold(ahci->vm);
+        u32 ok = execute(ahci, &job, &bytes);
+        memory_release(ahci->vm);
+
+        pthread_mutex_lock(&ahci->lock);
+        complete(ahci, &job, ok, bytes);
+    }
+
+    pthread_mutex_unlock(&ahci->lock);
+
+    return NULL;
+}
+
+static void stop_workers(ahci_t *ahci)
+{
+    pthread_mutex_lock(&ahci->lock);
+    ahci->stop = 1;
+    pthread_cond_broadcast(&ahci->work);
+    pthread_mutex_unlock(&ahci->lock);
+
+    for (u32 i = 0; i < ahci->nb_workers; ++i)
+    {
+        pthread_join(ahci->workers[i], NULL);
+    }
+
+    ahci->nb_workers = 0;
+}
+
+static void pci_setup(ahci_t *ahci)
+{
+    struct pci_device *dev = &ahci->pci;
+
+    pci_config_write16(dev, PCI_VENDOR_ID, AHCI_VENDOR);
+    pci_config_write16(dev, PCI_DEVICE_ID, AHCI_DEVICE);
+    pci_config_write16(
+        dev, PCI_COMMAND, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+    dev->config[PCI_CLASS] = PCI_CLASS_STORAGE;
+    dev->config[PCI_SUBCLASS] = PCI_SUBCLASS_SATA;
+    dev->config[PCI_PROG_IF] = AHCI_PROG_IF;
+    dev->config[PCI_INTERRUPT_LINE] = ahci->irq;
+    dev->config[PCI_INTERRUPT_PIN] = 1; // INTA#
+    pci_config_write32(dev, PCI_BAR(ABAR), AHCI_ABAR_BASE);
+    dev->bar_size[ABAR] = ABAR_SIZE;
+    dev->data = ahci;
+}
+
+static void ahci_free(ahci_t *ahci)
+{
+    pthread_cond_destroy(&ahci->work);
+    pthread_mutex_destroy(&ahci->lock);
+    free(ahci);
+}
+
+ahci_t *ahci_new(vm_t *vm, u32 irq, struct disk disk)
+{
+    if (vm == NULL)
+    {
+        return NULL;
+    }
+
+    ahci_t *ahci = calloc(1, sizeof(ahci_t));
+
+    if (ahci == NULL)
+    {
+        return NULL;
+    }
+
+    ahci->vm = vm;
+    ahci->irq = irq;
+    ahci->disk = disk;
+    ahci->nb_sectors = disk.size / SECTOR_SIZE;
+    pthread_mutex_init(&ahci->lock, NULL);
+    pthread_cond_init(&ahci->work, NULL);
+    hba_reset(ahci);
+    pci_setup(ahci);
+
+    ahci->region.base_address = AHCI_ABAR_BASE;
+    ahci->region.high_address = AHCI_ABAR_BASE + ABAR_SIZE;
+    ahci->region.read_handler = abar_read;
+    ahci->region.write_handler = abar_write;
+    ahci->region.data = ahci;
+
+    if (mmio_register(vm, &ahci->region) < 0)
+    {
+        fprintf(stderr, "Failed to register the AHCI registers\n");
+        ahci_free(ahci);
+        return NULL;
+    }
+
+    if (pci_register(&ahci->pci) < 0)
+    {
+        fprintf(stderr, "Failed to register the AHCI PCI function\n");
+        mmio_unregister(ahci->region.id);
+        ahci_free(ahci);
+        return NULL;
+    }
+
+    for (u32 i = 0; i < NB_WORKERS; ++i)
+    {
+        if (pthread_create(&ahci->workers[i], NULL, worker_thread, ahci) != 0)
+        {
+            break;
+        }
+
+        ahci->nb_workers++;
+    }
+
+    if (ahci->nb_workers == 0)
+    {
+        pci_unregister(ahci->pci.slot);
+        mmio_unregister(ahci->region.id);
+        ahci_free(ahci);
+        return NULL;
+    }
+
+    return ahci;
+}
+
+void ahci_destroy(ahci_t *ahci)
+{
+    if (ahci == NULL)
+    {
+        return;
+    }
+
+    pci_unregister(ahci->pci.slot);
+    mmio_unregister(ahci->region.id);
+    stop_workers(ahci);
+    vm_irq_line(ahci->vm, ahci->irq, 0);
+    ahci_free(ahci);
+}
@@ -1,6 +1,14 @@
 #include <blackhv/atapi.h>
+#include <blackhv/block_cache.h>
+#include <blackhv/disk.h>
 #include <blackhv/io.h>
+#include <blackhv/memory.h>
+#include <blackhv/pci.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -41,6 +49,9 @@
 
 #define ABRT (1 << 2)
 
+/* Features register */
+#define FEATURES_DMA (1 << 0)
+
 /* ATAPI signature */
 #define ATAPI_SIG_SC 0x01
 #define ATAPI_SIG_LBA_LO 0x01
@@ -57,9 +68,42 @@
 #define DPO (1 << 4)
 
 #define ATAPI_BLK_CACHE_SZ 256
+#define ATAPI_READ_CHUNK_BLKS 16 // Blocks read per syscall
+#define ATAPI_READAHEAD_BLKS 64
+#define ATAPI_MAX_BYTE_COUNT 0xF800 // Largest multiple of CD_BLOCK_SZ
+#define ATAPI_PATTERN_STREAK 4 // Requests before switching the mmap advice
 #define CD_BLOCK_SZ 2048
 #define PACKET_SZ 12
 
+/* Bus master IDE registers, primary channel */
+#define BM_COMMAND 0
+#define BM_STATUS 2
+#define BM_PRD_TABLE 4
+#define BM_NB_PORTS 8
+#define BM_BAR 4
+#define BM_BAR_SIZE 16 // Both channels
+
+#define BM_COMMAND_START (1 << 0)
+#define BM_COMMAND_READ (1 << 3) // Device to memory
+
+#define BM_STATUS_ACTIVE (1 << 0)
+#define BM_STATUS_ERROR (1 << 1)
+#define BM_STATUS_IRQ (1 << 2)
+#define BM_STATUS_DRIVE0_DMA (1 << 5)
+#define BM_STATUS_DRIVE1_DMA (1 << 6)
+
+/* Physical Region Descriptors */
+#define PRD_EOT 0x8000
+#define PRD_MAX_BYTES 0x10000
+#define PRD_MAX_ENTRIES 8192 // Stop on tables without EOT
+
+/* PIIX3 IDE function */
+#define IDE_VENDOR 0x8086
+#define IDE_DEVICE 0x7010
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define IDE_PROG_IF_BUS_MASTER 0x80
+
 #define PACKET_AWAIT_COMMAND 1
 #define PACKET_DATA_TRANSMIT 2
 #define PACKET_COMMAND_COMPLETE 3
@@ -80,6 +124,13 @@ struct SCSI_packet
     u8 control;
 } __packed;
 
+struct prd_entry
+{
+    u32 address;
+    u16 byte_count; // 0 means 64 KB
+    u16 flags;
+} __attribute__((packed));
+
 static u8 selected_drive = 0;
 
 static void ignore_outb(u16 port, u8 data, void *params)
@@ -101,29 +152,740 @@ static struct SCSI_packet curr_pkt = { 0 };
 static u32 byte_read = 0;
 
 static u8 to_send[CD_BLOCK_SZ];
+static const u8 *current_block = to_send; // Block read by data_inw
 static u32 byte_sent = 0;
 
-static void handle_scsi_packet(int disk_fd)
+/* Current READ(12) transfer */
+static u32 transfer_active = 0;
+static u32 transfer_lba = 0; // Next block to load in to_send
+static u32 transfer_remaining = 0; // Blocks not loaded in to_send yet
+
+static block_cache_t *block_cache = NULL;
+static struct disk disk = { 0 }; // Replaced under readahead.lock
+
+/**
+ * Sequential reads are detected when a request starts where the previous one
+ * ended. The following blocks are then read on the readahead thread, which
+ * works on [window_start, window_end) one chunk at a time.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    u32 started;
+    u32 next_lba; // End of the previous request
+    u32 scheduled_end; // End of the blocks already read or being read ahead
+    u32 window_start;
+    u32 window_end;
+    u32 loading_start; // Chunk being read by the thread
+    u32 loading_end;
+    u32 generation; // Incremented when the disk is replaced
+} readahead = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * mmap backend, blocks are served straight from the page cache. The advice
+ * given to the kernel follows the access pattern of the guest.
+ */
+static struct
+{
+    const u8 *data;
+    size_t size;
+    u32 next_lba; // End of the previous request
+    u32 sequential_streak;
+    u32 random_streak;
+    s32 advice;
+    u64 willneed_end; // End of the range already given to MADV_WILLNEED
+} disk_map = { .advice = MADV_NORMAL };
+
+static void map_set_advice(s32 advice)
+{
+    if (disk_map.advice == advice)
+    {
+        return;
+    }
+
+    madvise((void *)disk_map.data, disk_map.size, advice);
+    disk_map.advice = advice;
+}
+
+static void map_advise(u32 lba, u32 length)
+{
+    u64 end = (u64)lba + length;
+
+    if (length != 0 && lba == disk_map.next_lba)
+    {
+        disk_map.sequential_streak++;
+        disk_map.random_streak = 0;
+    }
+    else
+    {
+        disk_map.random_streak++;
+        disk_map.sequential_streak = 0;
+    }
+
+    disk_map.next_lba = end;
+
+    if (disk_map.random_streak >= ATAPI_PATTERN_STREAK)
+    {
+        // Kernel readahead would only waste memory
+        map_set_advice(MADV_RANDOM);
+        disk_map.willneed_end = 0;
+        return;
+    }
+
+    if (disk_map.sequential_streak < ATAPI_PATTERN_STREAK)
+    {
+        return;
+    }
+
+    map_set_advice(MADV_SEQUENTIAL);
+
+    // Start reading the next blocks asynchronously, refilling the window
+    // once half of it has been consumed
+    u64 offset = end * CD_BLOCK_SZ;
+    u64 window = ATAPI_READAHEAD_BLKS * CD_BLOCK_SZ;
+
+    if (disk_map.willneed_end >= offset + window / 2
+        && disk_map.willneed_end <= offset + window)
+    {
+        return;
+    }
+
+    u64 start = disk_map.willneed_end;
+    u64 stop = offset + window;
+
+    if (start < offset || start > stop)
+    {
+        start = offset;
+    }
+
+    if (stop > disk_map.size)
+    {
+        stop = disk_map.size;
+    }
+
+    if (start >= stop)
+    {
+        return;
+    }
+
+    u64 page_mask = (u64)sysconf(_SC_PAGESIZE) - 1;
+    u64 aligned = start & ~page_mask;
+
+    madvise((void *)(disk_map.data + aligned), stop - aligned, MADV_WILLNEED);
+    disk_map.willneed_end = stop;
+}
+
+static void map_load_block(u32 lba)
+{
+    u64 offset = (u64)lba * CD_BLOCK_SZ;
+
+    if (offset + CD_BLOCK_SZ <= disk_map.size)
+    {
+        current_block = disk_map.data + offset;
+        return;
+    }
+
+    // Last partial block or past the end of the disk
+    memset(to_send, 0, CD_BLOCK_SZ);
+
+    if (offset < disk_map.size)
+    {
+        memcpy(to_send, disk_map.data + offset, disk_map.size - offset);
+    }
+
+    current_block = to_send;
+}
+
+/**
+ * Read `count` blocks starting at `lba` with a single read and cache them,
+ * unless the disk was replaced since `generation`
+ *
+ * @return the number of whole blocks read
+ */
+static u32 read_blocks(const struct disk *image,
+                       u32 generation,
+                       u32 lba,
+                       u32 count,
+                       u8 *buffer)
+{
+    struct iovec iov = { .iov_base = buffer,
+                         .iov_len = (size_t)count * CD_BLOCK_SZ };
+    ssize_t r = image->readv(image->image, &iov, 1, (u64)lba * CD_BLOCK_SZ);
+
+    if (r <= 0)
+    {
+        return 0;
+    }
+
+    u32 blocks = r / CD_BLOCK_SZ;
+
+    pthread_mutex_lock(&readahead.lock);
+
+    for (u32 i = 0; i < blocks && generation == readahead.generation; ++i)
+    {
+        block_cache_write(block_cache, lba + i, buffer + i * CD_BLOCK_SZ);
+    }
+
+    pthread_mutex_unlock(&readahead.lock);
+
+    return blocks;
+}
+
+static void *readahead_thread(void *params)
+{
+    (void)params;
+    static u8 buffer[ATAPI_READ_CHUNK_BLKS * CD_BLOCK_SZ];
+
+    pthread_mutex_lock(&readahead.lock);
+
+    for (;;)
+    {
+        while (readahead.window_start == readahead.window_end)
+        {
+            pthread_cond_wait(&readahead.cond, &readahead.lock);
+        }
+
+        u32 start = readahead.window_start;
+        u32 count = readahead.window_end - start;
+
+        if (count > ATAPI_READ_CHUNK_BLKS)
+        {
+            count = ATAPI_READ_CHUNK_BLKS;
+        }
+
+        readahead.window_start += count;
+
+        // Blocks still cached from an earlier read are not read again
+        while (count != 0 && block_cache_contains(block_cache, start))
+        {
+            start++;
+            count--;
+        }
+
+        if (count == 0)
+        {
+            pthread_cond_broadcast(&readahead.cond);
+            continue;
+        }
+
+        // atapi_init_disk waits for this chunk before replacing the disk
+        struct disk image = disk;
+        u32 generation = readahead.generation;
+        readahead.loading_start = start;
+        readahead.loading_end = start + count;
+
+        pthread_mutex_unlock(&readahead.lock);
+        u32 blocks = read_blocks(&image, generation, start, count, buffer);
+        pthread_mutex_lock(&readahead.lock);
+
+        if (blocks < count)
+        {
+            // End of the disk
+            readahead.window_start = readahead.window_end;
+        }
+
+        readahead.loading_start = 0;
+        readahead.loading_end = 0;
+        pthread_cond_broadcast(&readahead.cond);
+    }
+
+    return NULL;
+}
+
+static void readahead_update(u32 lba, u32 length)
+{
+    u32 end = lba + length;
+
+    pthread_mutex_lock(&readahead.lock);
+
+    if (!readahead.started)
+    {
+        pthread_mutex_unlock(&readahead.lock);
+        return;
+    }
+
+    if (length == 0 || lba != readahead.next_lba)
+    {
+        // Random access, the pending blocks will not be used
+        readahead.window_start = readahead.window_end;
+    }
+    else
+    {
+        if (readahead.scheduled_end < end
+            || readahead.scheduled_end > end + ATAPI_READAHEAD_BLKS)
+        {
+            // The guest caught up with the readahead
+            readahead.scheduled_end = end;
+            readahead.window_start = end;
+            readahead.window_end = end;
+        }
+
+        // Refill once half of the window has been consumed
+        if (readahead.scheduled_end - end < ATAPI_READAHEAD_BLKS / 2)
+        {
+            if (readahead.window_start == readahead.window_end)
+            {
+                readahead.window_start = readahead.scheduled_end;
+            }
+
+            readahead.window_end = end + ATAPI_READAHEAD_BLKS;
+            readahead.scheduled_end = readahead.window_end;
+            pthread_cond_signal(&readahead.cond);
+        }
+    }
+
+    readahead.next_lba = end;
+
+    pthread_mutex_unlock(&readahead.lock);
+}
+
+/**
+ * Load the next block of the transfer in to_send
+ */
+static void load_next_block(void)
+{
+    static u8 buffer[ATAPI_READ_CHUNK_BLKS * CD_BLOCK_SZ];
+    u32 lba = transfer_lba;
+
+    transfer_lba++;
+    transfer_remaining--;
+    byte_sent = 0;
+
+    if (disk_map.data != NULL)
+    {
+        map_load_block(lba);
+        return;
+    }
+
+    current_block = to_send;
+
+    // Wait for the readahead thread if it is about to read this block
+    pthread_mutex_lock(&readahead.lock);
+
+    while ((lba >= readahead.loading_start && lba < readahead.loading_end)
+           || (lba >= readahead.window_start && lba < readahead.window_end))
+    {
+        pthread_cond_wait(&readahead.cond, &readahead.lock);
+    }
+
+    struct disk image = disk;
+    u32 generation = readahead.generation;
+    pthread_mutex_unlock(&readahead.lock);
+
+    if (block_cache_read(block_cache, lba, to_send))
+    {
+        return;
+    }
+
+    // Read the rest of the transfer in as few syscalls as possible
+    u32 count = transfer_remaining + 1;
+
+    if (count > ATAPI_READ_CHUNK_BLKS)
+    {
+        count = ATAPI_READ_CHUNK_BLKS;
+    }
+
+    if (read_blocks(&image, generation, lba, count, buffer) != 0)
+    {
+        memcpy(to_send, buffer, CD_BLOCK_SZ);
+    }
+    else
+    {
+        // Past the end of the disk
+        memset(to_send, 0, CD_BLOCK_SZ);
+    }
+}
+
+/**
+ * @return 1 if the command transfers data, 0 otherwise
+ */
+static u32 handle_scsi_packet(void)
 {
     if (curr_pkt.op_code != READ_12)
     {
         fprintf(stderr, "SCSI Op code not supported: %d\n", curr_pkt.op_code);
-        return;
+        return 0;
     }
 
     u32 lba = curr_pkt.lba_lo | (curr_pkt.lba_milo << 8)
         | (curr_pkt.lba_mihi << 16) | (curr_pkt.lba_hi) << 24;
-    lseek(disk_fd, lba * CD_BLOCK_SZ, SEEK_SET);
-    int i = read(disk_fd, to_send, CD_BLOCK_SZ);
-    (void)i;
-    byte_sent = 0;
+    u32 length = curr_pkt.transfer_length_lo
+        | (curr_pkt.transfer_length_milo << 8)
+        | (curr_pkt.transfer_length_mihi << 16)
+        | (curr_pkt.transfer_length_hi << 24);
+
+    if (disk_map.data != NULL)
+    {
+        map_advise(lba, length);
+    }
+    else
+    {
+        readahead_update(lba, length);
+    }
+
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    transfer_lba = lba;
+    transfer_remaining = length;
+    transfer_active = 1;
+    load_next_block();
+
+    return 1;
+}
+
+/**
+ * Bytes left in the transfer, reported in the byte count registers
+ */
+static u32 transfer_byte_count(void)
+{
+    u64 count = CD_BLOCK_SZ - byte_sent;
+
+    count += (u64)transfer_remaining * CD_BLOCK_SZ;
+
+    return count > ATAPI_MAX_BYTE_COUNT ? ATAPI_MAX_BYTE_COUNT : count;
+}
+
+/**
+ * Bus master IDE function. A PACKET command sent with the DMA feature has its
+ * data written in guest memory through the PRD table once the guest starts
+ * the bus master, followed by IRQ14. The whole transfer costs a few exits
+ * instead of one per data word.
+ */
+static struct
+{
+    vm_t *vm;
+    struct pci_device pci;
+    u16 base; // I/O base of the registers, 0 when not decoded
+    u8 command;
+    u8 status;
+    u32 prd_table;
+    u8 features;
+    u32 dma_mode; // The current PACKET command uses DMA
+    u32 packet_ready; // The DMA packet has been received
+    u32 dma_done; // The DMA packet has been completed
+    u32 irq_raised;
+} bmide = { 0 };
+
+struct prd_cursor
+{
+    u64 entry_address;
+    u32 address;
+    u32 remaining;
+    u32 last;
+    u32 nb_entries;
+};
+
+/**
+ * Copy data to the buffers described by the PRD table
+ *
+ * @return 1 on success, 0 if the table is too short or invalid
+ */
+static u32 prd_write(struct prd_cursor *cursor, const u8 *data, u32 len)
+{
+    while (len != 0)
+    {
+        if (cursor->remaining == 0)
+        {
+            struct prd_entry entry;
+
+            if (cursor->last || cursor->nb_entries++ == PRD_MAX_ENTRIES
+                || memory_read(bmide.vm,
+                               cursor->entry_address,
+                               (u8 *)&entry,
+                               sizeof(entry))
+                    != sizeof(entry))
+            {
+                return 0;
+            }
+
+            cursor->entry_address += sizeof(entry);
+            cursor->address = entry.address & ~0x1U;
+            cursor->remaining =
+                entry.byte_count == 0 ? PRD_MAX_BYTES : entry.byte_count;
+            cursor->last = (entry.flags & PRD_EOT) != 0;
+        }
+
+        u32 size = len < cursor->remaining ? len : cursor->remaining;
+
+        if (memory_write(bmide.vm, cursor->address, (u8 *)data, size)
+            != (s64)size)
+        {
+            return 0;
+        }
+
+        cursor->address += size;
+        cursor->remaining -= size;
+        data += size;
+        len -= size;
+    }
+
+    return 1;
+}
+
+static void dma_transfer(void)
+{
+    struct prd_cursor cursor = { .entry_address = bmide.prd_table };
+    u32 error = 0;
+
+    bmide.packet_ready = 0;
+    byte_read = 0;
+
+    if (handle_scsi_packet())
+    {
+        for (;;)
+        {
+            if (!prd_write(&cursor, current_block, CD_BLOCK_SZ))
+            {
+                error = 1;
+                break;
+            }
+
+            if (transfer_remaining == 0)
+            {
+                break;
+            }
+
+            load_next_block();
+        }
+    }
+
+    transfer_active = 0;
+    bmide.dma_done = 1;
+
+    // Active stays set when the PRD table is larger than the transfer
+    bmide.status &= ~(BM_STATUS_ACTIVE | BM_STATUS_ERROR);
+    bmide.status |= BM_STATUS_IRQ;
+
+    if (error)
+    {
+        bmide.status |= BM_STATUS_ERROR;
+    }
+    else if (!cursor.last || cursor.remaining != 0)
+    {
+        bmide.status |= BM_STATUS_ACTIVE;
+    }
+
+    if (bmide.vm != NULL && !bmide.irq_raised)
+    {
+        vm_irq_line(bmide.vm, ATAPI_IRQ, 1);
+        bmide.irq_raised = 1;
+    }
+}
+
+static void dma_try_start(void)
+{
+    if (bmide.packet_ready && (bmide.command & BM_COMMAND_START)
+        && (bmide.command & BM_COMMAND_READ))
+    {
+        dma_transfer();
+    }
+}
+
+static u8 bm_read(u32 offset)
+{
+    switch (offset)
+    {
+    case BM_COMMAND:
+        return bmide.command;
+    case BM_STATUS:
+        return bmide.status;
+    case BM_PRD_TABLE:
+    case BM_PRD_TABLE + 1:
+    case BM_PRD_TABLE + 2:
+    case BM_PRD_TABLE + 3:
+        return bmide.prd_table >> ((offset - BM_PRD_TABLE) * 8);
+    default:
+        return 0;
+    }
+}
+
+static void bm_write(u32 offset, u8 data)
+{
+    switch (offset)
+    {
+    case BM_COMMAND:
+        if ((data & BM_COMMAND_START) && !(bmide.command & BM_COMMAND_START))
+        {
+            bmide.status |= BM_STATUS_ACTIVE;
+        }
+        else if (!(data & BM_COMMAND_START))
+        {
+            bmide.status &= ~BM_STATUS_ACTIVE;
+        }
+
+        bmide.command = data & (BM_COMMAND_START | BM_COMMAND_READ);
+        dma_try_start();
+        break;
+    case BM_STATUS: {
+        // Error and interrupt bits are cleared by writing 1
+        u8 clear = data & (BM_STATUS_ERROR | BM_STATUS_IRQ);
+        u8 capable = BM_STATUS_DRIVE0_DMA | BM_STATUS_DRIVE1_DMA;
+
+        bmide.status = ((bmide.status & ~clear) & ~capable) | (data & capable);
+        break;
+    }
+    case BM_PRD_TABLE:
+    case BM_PRD_TABLE + 1:
+    case BM_PRD_TABLE + 2:
+    case BM_PRD_TABLE + 3: {
+        u32 shift = (offset - BM_PRD_TABLE) * 8;
+
+        bmide.prd_table &= ~(0xFFU << shift);
+        bmide.prd_table |= (u32)data << shift;
+        bmide.prd_table &= ~0x3U;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static u8 bm_inb(u16 port, void *params)
+{
+    (void)params;
+    return bm_read(port - bmide.base);
+}
+
+static u16 bm_inw(u16 port, void *params)
+{
+    (void)params;
+    u32 offset = port - bmide.base;
+
+    return bm_read(offset) | (bm_read(offset + 1) << 8);
+}
+
+static u32 bm_inl(u16 port, void *params)
+{
+    (void)params;
+    u32 offset = port - bmide.base;
+    u32 value = 0;
+
+    for (u32 i = 0; i < 4; ++i)
+    {
+        value |= (u32)bm_read(offset + i) << (i * 8);
+    }
+
+    return value;
+}
+
+static void bm_outb(u16 port, u8 data, void *params)
+{
+    (void)params;
+    bm_write(port - bmide.base, data);
+}
+
+static void bm_outw(u16 port, u16 data, void *params)
+{
+    (void)params;
+    u32 offset = port - bmide.base;
+
+    bm_write(offset, data & 0xFF);
+    bm_write(offset + 1, data >> 8);
+}
+
+static void bm_outl(u16 port, u32 data, void *params)
+{
+    (void)params;
+    u32 offset = port - bmide.base;
+
+    for (u32 i = 0; i < 4; ++i)
+    {
+        bm_write(offset + i, (data >> (i * 8)) & 0xFF);
+    }
+}
+
+/**
+ * Move the bus master registers where the guest programmed BAR4
+ */
+static void bm_config_changed(struct pci_device *dev)
+{
+    u32 base = 0;
+
+    if (pci_config_read16(dev, PCI_COMMAND) & PCI_COMMAND_IO)
+    {
+        base = pci_bar_address(dev, BM_BAR);
+    }
+
+    if (base > 0xFFFF - BM_NB_PORTS)
+    {
+        base = 0;
+    }
+
+    if (base == bmide.base)
+    {
+        return;
+    }
+
+    for (u16 i = 0; bmide.base != 0 && i < BM_NB_PORTS; ++i)
+    {
+        io_unregister_handler(bmide.base + i);
+    }
+
+    bmide.base = base;
+
+    struct handler bm_handler = {
+        .inb_handler = bm_inb,
+        .inw_handler = bm_inw,
+        .inl_handler = bm_inl,
+        .outb_handler = bm_outb,
+        .outw_handler = bm_outw,
+        .outl_handler = bm_outl,
+    };
+
+    for (u16 i = 0; base != 0 && i < BM_NB_PORTS; ++i)
+    {
+        io_register_handler(base + i, bm_handler);
+    }
+}
+
+/**
+ * Expose the controller as a PCI IDE function in compatibility mode, with
+ * the bus master registers at ATAPI_BMIDE_BASE like a firmware would do.
+ */
+static void bm_init(vm_t *vm)
+{
+    bmide.vm = vm;
+    bmide.status = BM_STATUS_DRIVE0_DMA;
+
+    if (bmide.pci.slot > 0)
+    {
+        return;
+    }
+
+    struct pci_device *dev = &bmide.pci;
+
+    pci_config_write16(dev, PCI_VENDOR_ID, IDE_VENDOR);
+    pci_config_write16(dev, PCI_DEVICE_ID, IDE_DEVICE);
+    pci_config_write16(dev, PCI_COMMAND, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+    dev->config[PCI_CLASS] = PCI_CLASS_STORAGE;
+    dev->config[PCI_SUBCLASS] = PCI_SUBCLASS_IDE;
+    dev->config[PCI_PROG_IF] = IDE_PROG_IF_BUS_MASTER;
+    dev->config[PCI_INTERRUPT_LINE] = ATAPI_IRQ;
+    pci_config_write32(dev, PCI_BAR(BM_BAR), ATAPI_BMIDE_BASE | PCI_BAR_IO);
+    dev->bar_size[BM_BAR] = BM_BAR_SIZE;
+    dev->config_changed = bm_config_changed;
+
+    if (pci_register(dev) < 0)
+    {
+        fprintf(stderr, "Failed to register the IDE PCI function\n");
+    }
+
+    bm_config_changed(dev);
 }
 
 static int receiving = 0;
-static int sending = 0;
 
 static u8 signature_inb(u16 port, void *params)
 {
+    (void)params;
+
     // Only supporting one drive on PRIMARY PORT MASTER
     if (selected_drive != ATA_PORT_MASTER)
     {
@@ -133,26 +895,46 @@ static u8 signature_inb(u16 port, void *params)
     switch (port)
     {
     case ATA_REG_SECTOR_COUNT(PRIMARY_REG):
-        if (sending)
+        if (bmide.dma_done)
         {
-            byte_sent = 0;
-            sending = 0;
+            return PACKET_COMMAND_COMPLETE;
+        }
+        if (transfer_active)
+        {
+            if (byte_sent < CD_BLOCK_SZ || transfer_remaining != 0)
+            {
+                return PACKET_DATA_TRANSMIT;
+            }
+
+            transfer_active = 0;
             return PACKET_COMMAND_COMPLETE;
         }
         if (receiving)
         {
-            int disk_fd = (int)(u64)params;
-            handle_scsi_packet(disk_fd);
             byte_read = 0;
             receiving = 0;
-            return PACKET_DATA_TRANSMIT;
+
+            if (handle_scsi_packet())
+            {
+                return PACKET_DATA_TRANSMIT;
+            }
+
+            return PACKET_COMMAND_COMPLETE;
         }
         return ATAPI_SIG_SC;
     case ATA_REG_LBA_LO(PRIMARY_REG):
         return ATAPI_SIG_LBA_LO;
     case ATA_REG_LBA_MI(PRIMARY_REG):
+        if (transfer_active)
+        {
+            return transfer_byte_count() & 0xFF;
+        }
         return ATAPI_SIG_LBA_MI;
     case ATA_REG_LBA_HI(PRIMARY_REG):
+        if (transfer_active)
+        {
+            return transfer_byte_count() >> 8;
+        }
         return ATAPI_SIG_LBA_HI;
     default:
         return 0;
@@ -163,10 +945,47 @@ static u8 status_inb(u16 port, void *params)
 {
     (void)port;
     (void)params;
+
+    // Reading the status acknowledges the interrupt
+    if (bmide.irq_raised)
+    {
+        vm_irq_line(bmide.vm, ATAPI_IRQ, 0);
+        bmide.irq_raised = 0;
+    }
+
+    if (bmide.dma_done)
+    {
+        return RDY;
+    }
+
     // Always ready to receive data and never busy
     return DRQ;
 }
 
+static void features_outb(u16 port, u8 data, void *params)
+{
+    (void)port;
+    (void)params;
+    bmide.features = data;
+}
+
+static void command_outb(u16 port, u8 data, void *params)
+{
+    (void)port;
+    (void)params;
+
+    if (data != PACKET)
+    {
+        return;
+    }
+
+    byte_read = 0;
+    receiving = 0;
+    bmide.dma_mode = (bmide.features & FEATURES_DMA) != 0;
+    bmide.packet_ready = 0;
+    bmide.dma_done = 0;
+}
+
 static void data_outw(u16 port, u16 data, void *params)
 {
     (void)port;
@@ -176,35 +995,66 @@ static void data_outw(u16 port, u16 data, void *params)
         return;
     }
 
-    receiving = 1;
     *((u16 *)((u8 *)&curr_pkt + byte_read)) = data;
     byte_read += 2;
+
+    if (!bmide.dma_mode)
+    {
+        receiving = 1;
+        return;
+    }
+
+    if (byte_read == sizeof(struct SCSI_packet))
+    {
+        bmide.packet_ready = 1;
+        dma_try_start();
+    }
 }
 
 static u16 data_inw(u16 port, void *params)
 {
     (void)port;
     (void)params;
-    if (byte_sent >= CD_BLOCK_SZ)
+
+    if (!transfer_active)
     {
         return 0;
     }
 
-    sending = 1;
-    u16 word = *((u16 *)(to_send + byte_sent));
+    if (byte_sent >= CD_BLOCK_SZ)
+    {
+        if (transfer_remaining == 0)
+        {
+            return 0;
+        }
+
+        load_next_block();
+    }
+
+    u16 word = *((u16 *)(current_block + byte_sent));
     byte_sent += 2;
     return word;
 }
 
-void atapi_init(vm_t *vm, int disk_fd)
+static void map_release(void)
 {
-    (void)vm; // TODO handle per-vm IO
+    if (disk_map.data != NULL)
+    {
+        munmap((void *)disk_map.data, disk_map.size);
+        disk_map.data = NULL;
+        disk_map.size = 0;
+    }
+}
 
+static void register_handlers(vm_t *vm)
+{
     struct handler ignore_outb_handler = { .outb_handler = ignore_outb };
     io_register_handler(PRIMARY_DCR, ignore_outb_handler);
     io_register_handler(SECONDARY_DCR, ignore_outb_handler);
-    io_register_handler(ATA_REG_FEATURES(PRIMARY_REG), ignore_outb_handler);
     io_register_handler(ATA_REG_FEATURES(SECONDARY_REG), ignore_outb_handler);
+
+    struct handler features_handler = { .outb_handler = features_outb };
+    io_register_handler(ATA_REG_FEATURES(PRIMARY_REG), features_handler);
     io_register_handler(ATA_REG_SECTOR_COUNT(PRIMARY_REG), ignore_outb_handler);
     io_register_handler(ATA_REG_SECTOR_COUNT(SECONDARY_REG),
                         ignore_outb_handler);
@@ -216,7 +1066,6 @@ void atapi_init(vm_t *vm, int disk_fd)
     struct handler signature_inb_handler = {
         .inb_handler = signature_inb,
         .outb_handler = ignore_outb,
-        .params = (void *)(u64)disk_fd,
     };
 
     for (int i = 2; i <= 5; i++)
@@ -233,7 +1082,99 @@ void atapi_init(vm_t *vm, int disk_fd)
 
     struct handler status_handler = {
         .inb_handler = status_inb,
-        .outb_handler = ignore_outb,
+        .outb_handler = command_outb,
     };
     io_register_handler(ATA_REG_STATUS(PRIMARY_REG), status_handler);
+
+    bm_init(vm);
+}
+
+void atapi_init(vm_t *vm, int disk_fd)
+{
+    atapi_init_disk(vm, raw_disk(disk_fd));
+}
+
+void atapi_init_disk(vm_t *vm, struct disk image)
+{
+    map_release();
+
+    if (block_cache == NULL)
+    {
+        block_cache = block_cache_new(CD_BLOCK_SZ, ATAPI_BLK_CACHE_SZ);
+    }
+
+    if (block_cache == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the ATAPI block cache\n");
+    }
+
+    pthread_mutex_lock(&readahead.lock);
+    readahead.window_start = readahead.window_end;
+
+    // The chunk being read comes from the previous disk
+    while (readahead.loading_start != readahead.loading_end)
+    {
+        pthread_cond_wait(&readahead.cond, &readahead.lock);
+    }
+
+    disk = image;
+    readahead.generation++;
+    block_cache_clear(block_cache);
+
+    if (!readahead.started && block_cache != NULL)
+    {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, readahead_thread, NULL) == 0)
+        {
+            pthread_detach(thread);
+            readahead.started = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Failed to start the ATAPI readahead thread\n");
+        }
+    }
+
+    pthread_mutex_unlock(&readahead.lock);
+
+    register_handlers(vm);
+}
+
+s32 atapi_init_mmap(vm_t *vm, int disk_fd)
+{
+    struct stat stat;
+
+    if (fstat(disk_fd, &stat) < 0 || stat.st_size == 0)
+    {
+        fprintf(stderr, "Cannot map the ATAPI disk\n");
+        return 0;
+    }
+
+    void *data = mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, disk_fd, 0);
+
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map the ATAPI disk\n");
+        return 0;
+    }
+
+    map_release();
+
+    disk_map.data = data;
+    disk_map.size = stat.st_size;
+    disk_map.next_lba = 0;
+    disk_map.sequential_streak = 0;
+    disk_map.random_streak = 0;
+    disk_map.advice = MADV_NORMAL;
+    disk_map.willneed_end = 0;
+
+    register_handlers(vm);
+
+    return 1;
+}
+
+void atapi_cache_stats(u64 *hits, u64 *misses)
+{
+    block_cache_stats(block_cache, hits, misses);
 }
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include <blackhv/pixel.h>
+#include <blackhv/queue.h>
+#include <criterion/criterion.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Microbenchmarks, run with make bench and not part of make tests */
+
+#define MB (1 << 20)
+#define THROUGHPUT_SIZE (512 * MB)
+
+static void *producer(void *params)
+{
+    queue_t *q = params;
+    unsigned char buffer[4096] = { 0 };
+    size_t sent = 0;
+
+    while (sent < THROUGHPUT_SIZE)
+    {
+        size_t w = queue_write(q, buffer, sizeof(buffer));
+
+        if (w == 0)
+        {
+            sched_yield();
+        }
+
+        sent += w;
+    }
+
+    return NULL;
+}
+
+Test(queue, queue_throughput)
+{
+    queue_t *q = queue_new(MB);
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, producer, q);
+
+    unsigned char buffer[4096];
+    size_t received = 0;
+
+    while (received < THROUGHPUT_SIZE)
+    {
+        size_t r = queue_read(q, buffer, sizeof(buffer));
+
+        if (r == 0)
+        {
+            sched_yield();
+        }
+
+        received += r;
+    }
+
+    pthread_join(thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    cr_log_info("queue throughput: %.0f MB/s",
+                THROUGHPUT_SIZE / MB / elapsed);
+    cr_assert_eq(received, THROUGHPUT_SIZE);
+
+    queue_destroy(q);
+}
+
+#define PIXEL_WIDTH 1280
+#define PIXEL_HEIGHT 1024
+#define PIXEL_FRAMES 100
+
+static const u32 pixel_bpps[] = { 8, 15, 16, 24, 32 };
+
+Test(pixel, pixel_throughput)
+{
+    u64 nb_pixels = PIXEL_WIDTH * PIXEL_HEIGHT;
+    u8 *src = calloc(nb_pixels, 4);
+    u32 *out = malloc(nb_pixels * 4);
+    u32 palette[256] = { 0 };
+    u32 best = pixel_get_isa();
+
+    for (u32 isa = PIXEL_ISA_SCALAR; isa <= PIXEL_ISA_AVX2; ++isa)
+    {
+        if (!pixel_set_isa(isa))
+        {
+            continue;
+        }
+
+        for (u32 b = 0; b < sizeof(pixel_bpps) / sizeof(*pixel_bpps); ++b)
+        {
+            struct timespec start;
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            for (u32 i = 0; i < PIXEL_FRAMES; ++i)
+            {
+                pixel_convert(out, src, nb_pixels, pixel_bpps[b], palette);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            double elapsed = (end.tv_sec - start.tv_sec) * 1e6
+                + (end.tv_nsec - start.tv_nsec) / 1e3;
+
+            cr_log_info("pixel isa %u, %u bpp: %.0f us per %ux%u frame",
+                        isa,
+                        pixel_bpps[b],
+                        elapsed / PIXEL_FRAMES,
+                        PIXEL_WIDTH,
+                        PIXEL_HEIGHT);
+        }
+    }
+
+    pixel_set_isa(best);
+    free(src);
+    free(out);
+}
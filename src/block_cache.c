@@ -0,0 +1,282 @@
+#include <blackhv/block_cache.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t hash_index(block_cache_t *cache, u64 index)
+{
+    // Fibonacci hashing, consecutive blocks land in different buckets
+    return (index * 0x9E3779B97F4A7C15ULL >> 32) & cache->buckets_mask;
+}
+
+static struct block_cache_entry *lookup(block_cache_t *cache, u64 index)
+{
+    struct block_cache_entry *entry = cache->buckets[hash_index(cache, index)];
+
+    while (entry != NULL && entry->index != index)
+    {
+        entry = entry->hash_next;
+    }
+
+    return entry;
+}
+
+static void lru_unlink(block_cache_t *cache, struct block_cache_entry *entry)
+{
+    if (entry->prev != NULL)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        cache->head = entry->next;
+    }
+
+    if (entry->next != NULL)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        cache->tail = entry->prev;
+    }
+}
+
+static void lru_push_front(block_cache_t *cache,
+                           struct block_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+
+    if (cache->head != NULL)
+    {
+        cache->head->prev = entry;
+    }
+    else
+    {
+        cache->tail = entry;
+    }
+
+    cache->head = entry;
+}
+
+static void hash_remove(block_cache_t *cache, struct block_cache_entry *entry)
+{
+    size_t bucket = hash_index(cache, entry->index);
+    struct block_cache_entry **it = &cache->buckets[bucket];
+
+    while (*it != entry)
+    {
+        it = &(*it)->hash_next;
+    }
+
+    *it = entry->hash_next;
+}
+
+static void hash_insert(block_cache_t *cache, struct block_cache_entry *entry)
+{
+    size_t bucket = hash_index(cache, entry->index);
+
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+}
+
+block_cache_t *block_cache_new(size_t block_size, size_t nb_blocks)
+{
+    if (block_size == 0 || nb_blocks == 0)
+    {
+        return NULL;
+    }
+
+    block_cache_t *cache = calloc(1, sizeof(block_cache_t));
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    // Twice as many buckets as blocks keeps the chains short
+    size_t nb_buckets = 1;
+
+    while (nb_buckets < nb_blocks * 2)
+    {
+        nb_buckets <<= 1;
+    }
+
+    cache->block_size = block_size;
+    cache->nb_blocks = nb_blocks;
+    cache->buckets_mask = nb_buckets - 1;
+    cache->entries = calloc(nb_blocks, sizeof(struct block_cache_entry));
+    cache->buckets = calloc(nb_buckets, sizeof(struct block_cache_entry *));
+    cache->data = malloc(nb_blocks * block_size);
+
+    if (cache->entries == NULL || cache->buckets == NULL || cache->data == NULL)
+    {
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache->data);
+        free(cache);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < nb_blocks; ++i)
+    {
+        cache->entries[i].data = cache->data + i * block_size;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+void block_cache_destroy(block_cache_t *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache->data);
+    free(cache);
+}
+
+s32 block_cache_read(block_cache_t *cache, u64 index, u8 *buffer)
+{
+    if (cache == NULL)
+    {
+        return 0;
+    }
+
+    return block_cache_read_at(cache, index, 0, cache->block_size, buffer);
+}
+
+s32 block_cache_read_at(block_cache_t *cache,
+                        u64 index,
+                        size_t offset,
+                        size_t len,
+                        u8 *buffer)
+{
+    if (cache == NULL || buffer == NULL || offset > cache->block_size
+        || len > cache->block_size - offset)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    struct block_cache_entry *entry = lookup(cache, index);
+
+    if (entry == NULL)
+    {
+        cache->misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    cache->hits++;
+
+    if (entry != cache->head)
+    {
+        lru_unlink(cache, entry);
+        lru_push_front(cache, entry);
+    }
+
+    memcpy(buffer, entry->data + offset, len);
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return 1;
+}
+
+void block_cache_write(block_cache_t *cache, u64 index, const u8 *buffer)
+{
+    if (cache == NULL || buffer == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    struct block_cache_entry *entry = lookup(cache, index);
+
+    if (entry != NULL)
+    {
+        lru_unlink(cache, entry);
+    }
+    else if (cache->used < cache->nb_blocks)
+    {
+        entry = &cache->entries[cache->used++];
+        entry->index = index;
+        hash_insert(cache, entry);
+    }
+    else
+    {
+        // Reuse the least recently used block
+        entry = cache->tail;
+        lru_unlink(cache, entry);
+        hash_remove(cache, entry);
+        entry->index = index;
+        hash_insert(cache, entry);
+    }
+
+    lru_push_front(cache, entry);
+    memcpy(entry->data, buffer, cache->block_size);
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+s32 block_cache_contains(block_cache_t *cache, u64 index)
+{
+    if (cache == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    s32 found = lookup(cache, index) != NULL;
+    pthread_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+void block_cache_clear(block_cache_t *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    memset(cache->buckets, 0,
+           (cache->buckets_mask + 1) * sizeof(struct block_cache_entry *));
+    cache->used = 0;
+    cache->head = NULL;
+    cache->tail = NULL;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void block_cache_stats(block_cache_t *cache, u64 *hits, u64 *misses)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (hits != NULL)
+    {
+        *hits = cache->hits;
+    }
+
+    if (misses != NULL)
+    {
+        *misses = cache->misses;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
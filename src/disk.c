@@ -0,0 +1,56 @@
+#include <blackhv/disk.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static u64 fd_size(int fd)
+{
+    struct stat stat;
+
+    if (fstat(fd, &stat) < 0)
+    {
+        return 0;
+    }
+
+    if (S_ISBLK(stat.st_mode))
+    {
+        u64 size = 0;
+
+        return ioctl(fd, BLKGETSIZE64, &size) < 0 ? 0 : size;
+    }
+
+    return stat.st_size;
+}
+
+static ssize_t raw_readv(void *image,
+                         const struct iovec *iov,
+                         u32 nb_iov,
+                         u64 offset)
+{
+    return preadv((int)(u64)image, iov, nb_iov, offset);
+}
+
+static ssize_t raw_writev(void *image,
+                          const struct iovec *iov,
+                          u32 nb_iov,
+                          u64 offset)
+{
+    return pwritev((int)(u64)image, iov, nb_iov, offset);
+}
+
+static s32 raw_flush(void *image)
+{
+    return fdatasync((int)(u64)image) == 0;
+}
+
+struct disk raw_disk(int fd)
+{
+    struct disk disk = { .image = (void *)(u64)fd,
+                         .size = fd_size(fd),
+                         .readv = raw_readv,
+                         .writev = raw_writev,
+                         .flush = raw_flush };
+
+    return disk;
+}
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include <blackhv/headless.h>
+#include <blackhv/memory.h>
+#include <blackhv/recorder.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VRAM_PAGES (VBE_VRAM_SIZE / PAGE_SIZE)
+
+struct headless
+{
+    vm_t *vm;
+    u64 framebuffer_phys;
+    s32 fd;
+    u8 *memory; // The whole memfd
+    struct headless_header *header;
+    vbe_t *vbe;
+    u32 generation;
+    u64 dirty[VRAM_PAGES / 64];
+
+    u32 fps;
+    pthread_t thread;
+    u32 stop;
+
+    pthread_mutex_t recorder_lock;
+    recorder_t *recorder;
+};
+
+/**
+ * Add the rows covering the video memory bytes [start, end) of the visible
+ * frame to the damage, the last rectangle grows once there are too many
+ */
+static void add_rows(struct headless_header *header, u64 start, u64 end)
+{
+    u32 first_row = (start - header->offset) / header->pitch;
+    u32 last_row = (end - 1 - header->offset) / header->pitch;
+
+    if (header->nb_rects > 0)
+    {
+        struct headless_rect *last = &header->rects[header->nb_rects - 1];
+
+        // Runs of pages usually share a row
+        if (last->y + last->height >= first_row
+            || header->nb_rects == HEADLESS_MAX_RECTS)
+        {
+            last->height = last_row - last->y + 1;
+            return;
+        }
+    }
+
+    struct headless_rect *rect = &header->rects[header->nb_rects++];
+    rect->x = 0;
+    rect->y = first_row;
+    rect->width = header->width;
+    rect->height = last_row - first_row + 1;
+}
+
+static void set_mode(headless_t *headless, struct vbe_mode *mode)
+{
+    struct headless_header *header = headless->header;
+
+    if (mode->bpp == 8)
+    {
+        vbe_get_palette(headless->vbe, header->palette);
+    }
+
+    header->width = mode->width;
+    header->height = mode->height;
+    header->pitch = mode->pitch;
+    header->bpp = mode->bpp;
+    header->offset = mode->offset;
+}
+
+/**
+ * Readers see an odd sequence while the header changes
+ */
+static void begin_frame(struct headless_header *header, u32 sequence)
+{
+    __atomic_store_n(&header->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header->nb_rects = 0;
+}
+
+/**
+ * Add the dirty pages of the visible frame to the damage
+ *
+ * @return 1 if a frame was started, 0 if nothing changed
+ */
+static u32 add_damage(headless_t *headless, u32 sequence)
+{
+    struct headless_header *header = headless->header;
+    u64 start = header->offset;
+    u64 end = start + (u64)header->pitch * header->height;
+    u32 started = 0;
+
+    for (u64 page = start / PAGE_SIZE; page * PAGE_SIZE < end;)
+    {
+        if (!(headless->dirty[page / 64] & (1ULL << (page % 64))))
+        {
+            ++page;
+            continue;
+        }
+
+        if (!started)
+        {
+            begin_frame(header, sequence);
+            started = 1;
+        }
+
+        u64 first = page * PAGE_SIZE;
+
+        while (page * PAGE_SIZE < end
+               && (headless->dirty[page / 64] & (1ULL << (page % 64))))
+        {
+            ++page;
+        }
+
+        u64 last = page * PAGE_SIZE < end ? page * PAGE_SIZE : end;
+
+        add_rows(header, first > start ? first : start, last);
+    }
+
+    return started;
+}
+
+/**
+ * Record the rectangles of the frame just published
+ */
+static void record_frame(headless_t *headless)
+{
+    struct headless_header *header = headless->header;
+    struct vbe_mode mode = { .width = header->width,
+                             .height = header->height,
+                             .bpp = header->bpp,
+                             .pitch = header->pitch,
+                             .offset = header->offset };
+
+    pthread_mutex_lock(&headless->recorder_lock);
+
+    if (headless->recorder != NULL)
+    {
+        recorder_begin_frame(headless->recorder,
+                             &mode,
+                             headless->memory + mode.offset,
+                             header->palette);
+
+        for (u32 i = 0; i < header->nb_rects; ++i)
+        {
+            recorder_add_rows(headless->recorder,
+                              header->rects[i].y,
+                              header->rects[i].height);
+        }
+
+        recorder_end_frame(headless->recorder);
+    }
+
+    pthread_mutex_unlock(&headless->recorder_lock);
+}
+
+s32 headless_update(headless_t *headless)
+{
+    struct headless_header *header = headless->header;
+    struct vbe_mode mode;
+    u32 generation = vbe_get_mode(headless->vbe, &mode);
+
+    if (!memory_get_dirty_log(
+            headless->vm, headless->framebuffer_phys, headless->dirty))
+    {
+        return 0;
+    }
+
+    u32 sequence = header->sequence;
+    u32 published = 1;
+
+    if (generation != headless->generation)
+    {
+        begin_frame(header, sequence);
+        set_mode(headless, &mode);
+        add_rows(header, mode.offset, mode.offset + mode.pitch * mode.height);
+        headless->generation = generation;
+    }
+    else
+    {
+        published = add_damage(headless, sequence);
+    }
+
+    if (published)
+    {
+        __atomic_store_n(&header->sequence, sequence + 2, __ATOMIC_RELEASE);
+        syscall(
+            SYS_futex, &header->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        record_frame(headless);
+    }
+
+    // Consumers read the new frame from now on, a page flip is complete
+    vbe_set_presented(headless->vbe, headless->generation);
+
+    return published;
+}
+
+static void *headless_thread(void *arg)
+{
+    headless_t *headless = arg;
+    u64 interval_ns = 1000000000ULL / headless->fps;
+    struct timespec interval = { .tv_sec = interval_ns / 1000000000ULL,
+                                 .tv_nsec = interval_ns % 1000000000ULL };
+
+    while (!__atomic_load_n(&headless->stop, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&interval, NULL);
+        headless_update(headless);
+    }
+
+    return NULL;
+}
+
+static void headless_free(headless_t *headless)
+{
+    vbe_destroy(headless->vbe);
+    pthread_mutex_destroy(&headless->recorder_lock);
+
+    if (headless->memory != NULL)
+    {
+        munmap(headless->memory, HEADLESS_SIZE);
+    }
+
+    if (headless->fd >= 0)
+    {
+        close(headless->fd);
+    }
+
+    free(headless);
+}
+
+static s32 create_memfd(void)
+{
+    s32 fd =
+        memfd_create("blackhv-framebuffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // Consumers can map it without fearing a SIGBUS
+    if (ftruncate(fd, HEADLESS_SIZE) < 0
+        || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+            < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+headless_t *headless_new(vm_t *vm, u64 framebuffer_phys, u32 fps)
+{
+    headless_t *headless = calloc(1, sizeof(headless_t));
+
+    if (headless == NULL)
+    {
+        return NULL;
+    }
+
+    headless->vm = vm;
+    headless->framebuffer_phys = framebuffer_phys;
+    pthread_mutex_init(&headless->recorder_lock, NULL);
+    headless->fps = fps;
+    headless->fd = create_memfd();
+
+    if (headless->fd < 0)
+    {
+        fprintf(stderr, "Failed to create the framebuffer memfd\n");
+        headless_free(headless);
+        return NULL;
+    }
+
+    headless->memory = mmap(NULL,
+                            HEADLESS_SIZE,
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED,
+                            headless->fd,
+                            0);
+
+    if (headless->memory == MAP_FAILED)
+    {
+        headless->memory = NULL;
+        headless_free(headless);
+        return NULL;
+    }
+
+    struct headless_header *header =
+        (struct headless_header *)(headless->memory + HEADLESS_HEADER_OFFSET);
+
+    header->magic = HEADLESS_MAGIC;
+    header->version = HEADLESS_VERSION;
+    headless->header = header;
+
+    // The guest writes straight into the memfd, its stores are logged
+    if (memory_map_file(vm,
+                        framebuffer_phys,
+                        VBE_VRAM_SIZE,
+                        headless->fd,
+                        MEMORY_LOG_DIRTY)
+        == 0)
+    {
+        fprintf(stderr, "Failed to allocate framebuffer memory.\n");
+        headless_free(headless);
+        return NULL;
+    }
+
+    headless->vbe = vbe_new(vm, framebuffer_phys);
+
+    if (headless->vbe == NULL)
+    {
+        memory_unmap(vm, framebuffer_phys);
+        headless_free(headless);
+        return NULL;
+    }
+
+    struct vbe_mode mode;
+
+    headless->generation = vbe_get_mode(headless->vbe, &mode);
+    set_mode(headless, &mode);
+
+    if (fps > 0
+        && pthread_create(&headless->thread, NULL, headless_thread, headless)
+            != 0)
+    {
+        vbe_destroy(headless->vbe);
+        headless->vbe = NULL;
+        memory_unmap(vm, framebuffer_phys);
+        headless_free(headless);
+        return NULL;
+    }
+
+    return headless;
+}
+
+void headless_destroy(headless_t *headless)
+{
+    if (headless == NULL)
+    {
+        return;
+    }
+
+    if (headless->fps > 0)
+    {
+        __atomic_store_n(&headless->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(headless->thread, NULL);
+    }
+
+    headless_free(headless);
+}
+
+s32 headless_get_fd(headless_t *headless)
+{
+    return headless->fd;
+}
+
+void headless_set_recorder(headless_t *headless, recorder_t *recorder)
+{
+    pthread_mutex_lock(&headless->recorder_lock);
+    headless->recorder = recorder;
+    pthread_mutex_unlock(&headless->recorder_lock);
+}
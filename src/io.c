@@ -59,3 +59,25 @@ s32 io_handle_inw(u16 port, u16 *output)
     // TODO: handle this correctly
     return 0;
 }
+
+s32 io_handle_outl(u16 port, u32 data)
+{
+    if (handlers[port].outl_handler != NULL)
+    {
+        handlers[port].outl_handler(port, data, handlers[port].params);
+        return 1;
+    }
+
+    return 0;
+}
+
+s32 io_handle_inl(u16 port, u32 *output)
+{
+    if (handlers[port].inl_handler != NULL)
+    {
+        *output = handlers[port].inl_handler(port, handlers[port].params);
+        return 1;
+    }
+
+    return 0;
+}
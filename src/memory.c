@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
+
 #include <blackhv/memory.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
@@ -25,7 +28,25 @@ static struct memory_entry *find_entry(vm_t *vm, u64 addr)
     return NULL;
 }
 
-static struct memory_entry *allocate_usable(vm_t *vm, u64 phys_addr, u64 size)
+/**
+ * Host stores into framebuffer and file slots are not in the dirty log, so
+ * they are accepted as long as the guest itself may write there.
+ */
+static struct memory_entry *find_writable_entry(vm_t *vm, u64 addr)
+{
+    struct memory_entry *entry = find_entry(vm, addr);
+
+    if (entry == NULL || entry->type == MEMORY_MMIO
+        || (entry->flags & KVM_MEM_READONLY))
+    {
+        return NULL;
+    }
+
+    return entry;
+}
+
+static struct memory_entry *
+allocate_usable(vm_t *vm, u64 phys_addr, u64 size, u32 type)
 {
     struct memory_entry *entry = malloc(sizeof(struct memory_entry));
 
@@ -48,9 +69,12 @@ static struct memory_entry *allocate_usable(vm_t *vm, u64 phys_addr, u64 size)
         return NULL;
     }
 
+    // Guest writes to the framebuffer are logged to find the damaged pages
+    u32 flags = type == MEMORY_FRAMEBUFFER ? KVM_MEM_LOG_DIRTY_PAGES : 0;
+
     // Add the memory to vm
     struct kvm_userspace_memory_region region = { .slot = vm->mem->next_slot,
-                                                  .flags = 0,
+                                                  .flags = flags,
                                                   .guest_phys_addr = phys_addr,
                                                   .memory_size = size,
                                                   .userspace_addr =
@@ -67,7 +91,8 @@ static struct memory_entry *allocate_usable(vm_t *vm, u64 phys_addr, u64 size)
     entry->memory_ptr = mem_ptr;
     entry->size = size;
     entry->slot = vm->mem->next_slot;
-    entry->type = MEMORY_USABLE;
+    entry->type = type;
+    entry->flags = flags;
 
     vm->mem->next_slot += 1;
 
@@ -88,6 +113,60 @@ static struct memory_entry *allocate_mmio(u64 phys, u64 size)
     entry->size = size;
     entry->slot = 0;
     entry->type = MEMORY_MMIO;
+    entry->flags = 0;
+
+    return entry;
+}
+
+static struct memory_entry *
+map_file(vm_t *vm, u64 phys_addr, u64 size, int fd, u32 flags)
+{
+    struct memory_entry *entry = malloc(sizeof(struct memory_entry));
+
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    u32 read_only = (flags & MEMORY_READ_ONLY) != 0;
+    u32 kvm_flags = (read_only ? KVM_MEM_READONLY : 0)
+        | (flags & MEMORY_LOG_DIRTY ? KVM_MEM_LOG_DIRTY_PAGES : 0);
+    void *mem_ptr = mmap(NULL,
+                         size,
+                         read_only ? PROT_READ : PROT_READ | PROT_WRITE,
+                         MAP_SHARED,
+                         fd,
+                         0);
+
+    if (mem_ptr == MAP_FAILED)
+    {
+        free(entry);
+        return NULL;
+    }
+
+    struct kvm_userspace_memory_region region = {
+        .slot = vm->mem->next_slot,
+        .flags = kvm_flags,
+        .guest_phys_addr = phys_addr,
+        .memory_size = size,
+        .userspace_addr = (u64)mem_ptr
+    };
+
+    if (ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) == -1)
+    {
+        munmap(mem_ptr, size);
+        free(entry);
+        return NULL;
+    }
+
+    entry->guest_phys = phys_addr;
+    entry->memory_ptr = mem_ptr;
+    entry->size = size;
+    entry->slot = vm->mem->next_slot;
+    entry->type = MEMORY_FILE;
+    entry->flags = kvm_flags;
+
+    vm->mem->next_slot += 1;
 
     return entry;
 }
@@ -114,13 +193,8 @@ static s32 check_addr_available(vm_t *vm, u64 phys_addr, u64 size)
     return 1;
 }
 
-s32 memory_alloc(vm_t *vm, u64 phys_addr, u64 size, u32 type)
+static s32 add_memory(vm_t *vm, u64 phys_addr, u64 size, u32 type)
 {
-    if (vm == NULL)
-    {
-        return 0;
-    }
-
     if (check_addr_available(vm, phys_addr, size) == 0)
     {
         fprintf(stderr,
@@ -135,7 +209,7 @@ s32 memory_alloc(vm_t *vm, u64 phys_addr, u64 size, u32 type)
     {
     case MEMORY_FRAMEBUFFER:
     case MEMORY_USABLE:
-        entry = allocate_usable(vm, phys_addr, size);
+        entry = allocate_usable(vm, phys_addr, size, type);
         break;
     case MEMORY_MMIO:
         entry = allocate_mmio(phys_addr, size);
@@ -152,62 +226,193 @@ s32 memory_alloc(vm_t *vm, u64 phys_addr, u64 size, u32 type)
     return 1;
 }
 
+s32 memory_alloc(vm_t *vm, u64 phys_addr, u64 size, u32 type)
+{
+    if (vm == NULL)
+    {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&vm->mem->lock);
+    s32 r = add_memory(vm, phys_addr, size, type);
+    pthread_rwlock_unlock(&vm->mem->lock);
+
+    return r;
+}
+
+static s32 add_file(vm_t *vm, u64 phys_addr, u64 size, int fd, u32 flags)
+{
+    if (check_addr_available(vm, phys_addr, size) == 0)
+    {
+        fprintf(stderr,
+                "Address not available at %llx for %lld bytes\n",
+                phys_addr,
+                size);
+        return 0;
+    }
+
+    struct memory_entry *entry = map_file(vm, phys_addr, size, fd, flags);
+
+    if (entry == NULL)
+    {
+        fprintf(stderr, "Failed to map the file at %llx\n", phys_addr);
+        return 0;
+    }
+
+    linked_list_add(vm->mem->memory_entries, entry);
+
+    return 1;
+}
+
+s32 memory_map_file(vm_t *vm, u64 phys_addr, u64 size, int fd, u32 flags)
+{
+    if (vm == NULL || size == 0 || !is_align(phys_addr) || !is_align(size))
+    {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&vm->mem->lock);
+    s32 r = add_file(vm, phys_addr, size, fd, flags);
+    pthread_rwlock_unlock(&vm->mem->lock);
+
+    return r;
+}
+
+static s32 remove_memory(vm_t *vm, u64 phys_addr)
+{
+    struct linked_list_elt *current = vm->mem->memory_entries->head;
+
+    for (u32 i = 0; current != NULL; ++i, current = current->next)
+    {
+        struct memory_entry *entry = (struct memory_entry *)current->value;
+
+        if (entry->guest_phys != phys_addr)
+        {
+            continue;
+        }
+
+        // A slot of size 0 deletes it, mmio ranges have no slot
+        struct kvm_userspace_memory_region region = { .slot = entry->slot,
+                                                      .guest_phys_addr =
+                                                          phys_addr };
+
+        if (entry->type != MEMORY_MMIO
+            && ioctl(vm->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) == -1)
+        {
+            fprintf(stderr, "Failed to unmap the memory at %llx\n", phys_addr);
+            return 0;
+        }
+
+        return linked_list_remove_at(vm->mem->memory_entries, i);
+    }
+
+    return 0;
+}
+
+s32 memory_unmap(vm_t *vm, u64 phys_addr)
+{
+    if (vm == NULL)
+    {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&vm->mem->lock);
+    s32 r = remove_memory(vm, phys_addr);
+    pthread_rwlock_unlock(&vm->mem->lock);
+
+    return r;
+}
+
+void memory_hold(vm_t *vm)
+{
+    pthread_rwlock_rdlock(&vm->mem->lock);
+}
+
+void memory_release(vm_t *vm)
+{
+    pthread_rwlock_unlock(&vm->mem->lock);
+}
+
 s64 memory_write(vm_t *vm, u64 dest, u8 *buffer, u64 size)
 {
-    struct memory_entry *entry = find_entry(vm, dest);
+    pthread_rwlock_rdlock(&vm->mem->lock);
+    struct memory_entry *entry = find_writable_entry(vm, dest);
 
-    if (entry == NULL || entry->type != MEMORY_USABLE)
+    if (entry == NULL)
     {
+        pthread_rwlock_unlock(&vm->mem->lock);
         return -1;
     }
 
     u64 base_address = dest - entry->guest_phys;
     u64 mem_limit = entry->size - base_address;
     u8 *ptr = (u8 *)entry->memory_ptr;
-    u64 written = 0;
+    u64 written = size < mem_limit ? size : mem_limit;
 
-    for (; written < mem_limit && written < size; ++written)
-    {
-        ptr[base_address + written] = buffer[written];
-    }
+    memcpy(ptr + base_address, buffer, written);
+    pthread_rwlock_unlock(&vm->mem->lock);
 
     return (s64)written;
 }
 
 s64 memory_read(vm_t *vm, u64 src_phys, u8 *buffer, u64 size)
 {
+    pthread_rwlock_rdlock(&vm->mem->lock);
     struct memory_entry *entry = find_entry(vm, src_phys);
 
     if (entry == NULL
-        || (entry->type != MEMORY_USABLE && entry->type != MEMORY_FRAMEBUFFER))
+        || (entry->type != MEMORY_USABLE && entry->type != MEMORY_FRAMEBUFFER
+            && entry->type != MEMORY_FILE))
     {
+        pthread_rwlock_unlock(&vm->mem->lock);
         return -1;
     }
 
     u64 base_address = src_phys - entry->guest_phys;
     u64 mem_limit = entry->size - base_address;
     u8 *ptr = (u8 *)entry->memory_ptr;
-    u64 read = 0;
-    for (; read < mem_limit && read < size; ++read)
+    u64 read = size < mem_limit ? size : mem_limit;
+
+    memcpy(buffer, ptr + base_address, read);
+    pthread_rwlock_unlock(&vm->mem->lock);
+
+    return (s64)read;
+}
+
+s32 memory_get_dirty_log(vm_t *vm, u64 phys_addr, u64 *bitmap)
+{
+    pthread_rwlock_rdlock(&vm->mem->lock);
+    struct memory_entry *entry = find_entry(vm, phys_addr);
+
+    if (entry == NULL || !(entry->flags & KVM_MEM_LOG_DIRTY_PAGES))
     {
-        buffer[read] = ptr[base_address + read];
+        pthread_rwlock_unlock(&vm->mem->lock);
+        return 0;
     }
 
-    return (s64)read;
+    struct kvm_dirty_log log = { .slot = entry->slot,
+                                 .dirty_bitmap = bitmap };
+    s32 r = ioctl(vm->vm_fd, KVM_GET_DIRTY_LOG, &log) == 0;
+
+    pthread_rwlock_unlock(&vm->mem->lock);
+
+    return r;
 }
 
 void *memory_get_ptr(vm_t *vm, u64 addr)
 {
-    struct memory_entry *entry = find_entry(vm, addr);
+    pthread_rwlock_rdlock(&vm->mem->lock);
+    struct memory_entry *entry = find_writable_entry(vm, addr);
+    void *ptr = NULL;
 
-    if (entry == NULL || entry->type != MEMORY_USABLE)
+    if (entry != NULL)
     {
-        return 0x0;
+        ptr = (u8 *)entry->memory_ptr + (addr - entry->guest_phys);
     }
 
-    u64 ptr = (u64)entry->memory_ptr;
+    pthread_rwlock_unlock(&vm->mem->lock);
 
-    return (void *)(ptr + (addr - entry->guest_phys));
+    return ptr;
 }
 
 struct e820_table *e820_table_get(vm_t *vm)
@@ -219,11 +424,13 @@ struct e820_table *e820_table_get(vm_t *vm)
         return NULL;
     }
 
+    pthread_rwlock_rdlock(&vm->mem->lock);
     table->length = linked_list_size(vm->mem->memory_entries);
     table->entries = malloc(sizeof(struct e820_entry) * table->length);
 
     if (table->entries == NULL)
     {
+        pthread_rwlock_unlock(&vm->mem->lock);
         free(table);
         return NULL;
     }
@@ -242,6 +449,8 @@ struct e820_table *e820_table_get(vm_t *vm)
         current = current->next;
     }
 
+    pthread_rwlock_unlock(&vm->mem->lock);
+
     return table;
 }
 
@@ -265,7 +474,7 @@ static void free_memory_entry(void *ptr)
 
     struct memory_entry *entry = (struct memory_entry *)ptr;
 
-    if (entry->type == MEMORY_USABLE)
+    if (entry->type != MEMORY_MMIO)
     {
         munmap(entry->memory_ptr, entry->size);
     }
@@ -291,6 +500,15 @@ memory_t *memory_new()
         return NULL;
     }
 
+    // A thread in memory_hold takes the lock again for reading, which must
+    // not wait behind a memory_unmap
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_READER_NP);
+    pthread_rwlock_init(&mem->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
     return mem;
 }
 
@@ -302,5 +520,6 @@ void memory_destroy(memory_t *mem)
     }
 
     linked_list_free(mem->memory_entries);
+    pthread_rwlock_destroy(&mem->lock);
     free(mem);
 }
\ No newline at end of file
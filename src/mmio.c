@@ -54,7 +54,7 @@ void mmio_handle_write(u64 address, u8 data[8], u32 len)
 {
     for (s32 i = 0; i < MAX_MMIO_REGION_COUNT; ++i)
     {
-        if (mmio_regions[i].base_address <= address
+        if (mmio_regions[i].id != -1 && mmio_regions[i].base_address <= address
             && mmio_regions[i].high_address > address
             && mmio_regions[i].write_handler != NULL)
         {
@@ -62,4 +62,22 @@ void mmio_handle_write(u64 address, u8 data[8], u32 len)
                 &mmio_regions[i], address, data, len, mmio_regions[i].data);
         }
     }
-}
\ No newline at end of file
+}
+
+void mmio_handle_read(u64 address, u8 data[8], u32 len)
+{
+    // Unhandled reads return 0
+    memset(data, 0, 8);
+
+    for (s32 i = 0; i < MAX_MMIO_REGION_COUNT; ++i)
+    {
+        if (mmio_regions[i].id != -1 && mmio_regions[i].base_address <= address
+            && mmio_regions[i].high_address > address
+            && mmio_regions[i].read_handler != NULL)
+        {
+            mmio_regions[i].read_handler(
+                &mmio_regions[i], address, data, len, mmio_regions[i].data);
+            return;
+        }
+    }
+}
@@ -0,0 +1,653 @@
+#include <blackhv/block_cache.h>
+#include <blackhv/overlay.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MIN_CLUSTER_BITS 9
+#define MAX_CLUSTER_BITS 21
+#define L2_CACHE_BLOCK 512 // Bytes of L2 table per cache entry
+#define L2_CACHE_BLOCKS 4096 // 2 MB of L2 entries
+#define MAX_IOV 1024
+
+struct overlay
+{
+    int fd;
+    int base_fd;
+    u64 base_size;
+    u64 size;
+    u64 cluster_size;
+    u32 cluster_bits;
+    u32 l2_entries; // Per L2 table
+    u32 l1_size;
+    u64 l1_offset;
+    u64 *l1;
+    block_cache_t *l2_cache;
+    pthread_mutex_t lock; // Allocations, L2 updates and L2 cache fills
+    u64 end; // Where the next cluster is allocated
+};
+
+static u64 cluster_align(u64 value, u64 cluster_size)
+{
+    return (value + cluster_size - 1) & ~(cluster_size - 1);
+}
+
+static u32 l1_entries(u64 size, u32 cluster_bits)
+{
+    u64 l2_coverage = (1ULL << cluster_bits) / sizeof(u64) << cluster_bits;
+
+    return (size + l2_coverage - 1) / l2_coverage;
+}
+
+s32 overlay_create(const char *path, const char *base_path, u32 cluster_bits)
+{
+    struct overlay_header header;
+    struct stat stat;
+
+    if (cluster_bits < MIN_CLUSTER_BITS || cluster_bits > MAX_CLUSTER_BITS
+        || strlen(base_path) >= OVERLAY_BASE_PATH_MAX)
+    {
+        return 0;
+    }
+
+    int base_fd = open(base_path, O_RDONLY);
+
+    if (base_fd < 0)
+    {
+        fprintf(stderr, "Failed to open the base image %s\n", base_path);
+        return 0;
+    }
+
+    s32 r = fstat(base_fd, &stat);
+
+    close(base_fd);
+
+    if (r < 0)
+    {
+        return 0;
+    }
+
+    u64 cluster_size = 1ULL << cluster_bits;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = OVERLAY_MAGIC;
+    header.version = OVERLAY_VERSION;
+    header.cluster_bits = cluster_bits;
+    header.size = stat.st_size;
+    header.l1_size = l1_entries(header.size, cluster_bits);
+    header.l1_offset = cluster_align(sizeof(header), cluster_size);
+    strcpy(header.base_path, base_path);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to create the overlay %s\n", path);
+        return 0;
+    }
+
+    // The L1 table starts empty, zeros come from the truncate
+    u64 end = header.l1_offset
+        + cluster_align(header.l1_size * sizeof(u64), cluster_size);
+
+    r = ftruncate(fd, end) == 0
+        && pwrite(fd, &header, sizeof(header), 0) == sizeof(header)
+        && fsync(fd) == 0;
+
+    close(fd);
+
+    return r;
+}
+
+static void overlay_free(overlay_t *overlay)
+{
+    block_cache_destroy(overlay->l2_cache);
+    free(overlay->l1);
+
+    if (overlay->base_fd >= 0)
+    {
+        close(overlay->base_fd);
+    }
+
+    if (overlay->fd >= 0)
+    {
+        close(overlay->fd);
+    }
+
+    free(overlay);
+}
+
+static u32 check_header(struct overlay_header *header)
+{
+    return header->magic == OVERLAY_MAGIC && header->version == OVERLAY_VERSION
+        && header->cluster_bits >= MIN_CLUSTER_BITS
+        && header->cluster_bits <= MAX_CLUSTER_BITS
+        && header->l1_size == l1_entries(header->size, header->cluster_bits)
+        && memchr(header->base_path, '\0', OVERLAY_BASE_PATH_MAX) != NULL;
+}
+
+overlay_t *overlay_open(const char *path)
+{
+    struct overlay_header header;
+    struct stat stat;
+    overlay_t *overlay = calloc(1, sizeof(overlay_t));
+
+    if (overlay == NULL)
+    {
+        return NULL;
+    }
+
+    overlay->base_fd = -1;
+    overlay->fd = open(path, O_RDWR);
+
+    if (overlay->fd < 0
+        || pread(overlay->fd, &header, sizeof(header), 0) != sizeof(header)
+        || !check_header(&header) || fstat(overlay->fd, &stat) < 0)
+    {
+        fprintf(stderr, "%s is not a valid overlay\n", path);
+        overlay_free(overlay);
+        return NULL;
+    }
+
+    overlay->cluster_bits = header.cluster_bits;
+    overlay->cluster_size = 1ULL << header.cluster_bits;
+    overlay->l2_entries = overlay->cluster_size / sizeof(u64);
+    overlay->size = header.size;
+    overlay->l1_size = header.l1_size;
+    overlay->l1_offset = header.l1_offset;
+    overlay->end = cluster_align(stat.st_size, overlay->cluster_size);
+    overlay->l1 = calloc(overlay->l1_size + 1, sizeof(u64));
+    overlay->l2_cache = block_cache_new(L2_CACHE_BLOCK, L2_CACHE_BLOCKS);
+
+    size_t l1_bytes = overlay->l1_size * sizeof(u64);
+
+    if (overlay->l1 == NULL || overlay->l2_cache == NULL
+        || pread(overlay->fd, overlay->l1, l1_bytes, overlay->l1_offset)
+            != (ssize_t)l1_bytes)
+    {
+        overlay_free(overlay);
+        return NULL;
+    }
+
+    overlay->base_fd = open(header.base_path, O_RDONLY);
+
+    if (overlay->base_fd < 0 || fstat(overlay->base_fd, &stat) < 0)
+    {
+        fprintf(stderr, "Failed to open the base image %s\n", header.base_path);
+        overlay_free(overlay);
+        return NULL;
+    }
+
+    overlay->base_size = stat.st_size;
+    pthread_mutex_init(&overlay->lock, NULL);
+
+    return overlay;
+}
+
+void overlay_close(overlay_t *overlay)
+{
+    if (overlay == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_destroy(&overlay->lock);
+    overlay_free(overlay);
+}
+
+/**
+ * Find where a cluster is stored in the overlay
+ *
+ * @return 1 on success with `entry` set (0 if the cluster is not allocated),
+ * 0 on an I/O error
+ */
+static u32 lookup(overlay_t *overlay, u64 cluster, u64 *entry, u32 locked)
+{
+    u64 table = __atomic_load_n(&overlay->l1[cluster / overlay->l2_entries],
+                                __ATOMIC_ACQUIRE);
+
+    if (table == 0)
+    {
+        *entry = 0;
+        return 1;
+    }
+
+    u64 address = table + (cluster % overlay->l2_entries) * sizeof(u64);
+    u64 block = address / L2_CACHE_BLOCK;
+    u64 entries[L2_CACHE_BLOCK / sizeof(u64)];
+
+    if (!block_cache_read(overlay->l2_cache, block, (u8 *)entries))
+    {
+        // Filled under the lock so that stale entries never replace an update
+        if (!locked)
+        {
+            pthread_mutex_lock(&overlay->lock);
+        }
+
+        u32 ok = block_cache_read(overlay->l2_cache, block, (u8 *)entries)
+            || pread(overlay->fd,
+                     entries,
+                     L2_CACHE_BLOCK,
+                     block * L2_CACHE_BLOCK)
+                == L2_CACHE_BLOCK;
+
+        if (ok)
+        {
+            block_cache_write(overlay->l2_cache, block, (u8 *)entries);
+        }
+
+        if (!locked)
+        {
+            pthread_mutex_unlock(&overlay->lock);
+        }
+
+        if (!ok)
+        {
+            return 0;
+        }
+    }
+
+    *entry = entries[(address % L2_CACHE_BLOCK) / sizeof(u64)];
+
+    return 1;
+}
+
+/**
+ * Point the L2 entry of a cluster at `offset`, called with the lock held
+ */
+static u32 set_entry(overlay_t *overlay, u64 cluster, u64 offset)
+{
+    u64 index = cluster / overlay->l2_entries;
+    u64 table = overlay->l1[index];
+
+    if (table == 0)
+    {
+        // New clusters are zeroed by extending the file
+        table = overlay->end;
+
+        if (ftruncate(overlay->fd, table + overlay->cluster_size) < 0
+            || pwrite(overlay->fd,
+                      &table,
+                      sizeof(table),
+                      overlay->l1_offset + index * sizeof(u64))
+                != sizeof(table))
+        {
+            return 0;
+        }
+
+        overlay->end += overlay->cluster_size;
+        __atomic_store_n(&overlay->l1[index], table, __ATOMIC_RELEASE);
+    }
+
+    u64 address = table + (cluster % overlay->l2_entries) * sizeof(u64);
+
+    if (pwrite(overlay->fd, &offset, sizeof(offset), address) != sizeof(offset))
+    {
+        return 0;
+    }
+
+    u64 block = address / L2_CACHE_BLOCK;
+    u64 entries[L2_CACHE_BLOCK / sizeof(u64)];
+
+    if (block_cache_read(overlay->l2_cache, block, (u8 *)entries))
+    {
+        entries[(address % L2_CACHE_BLOCK) / sizeof(u64)] = offset;
+        block_cache_write(overlay->l2_cache, block, (u8 *)entries);
+    }
+
+    return 1;
+}
+
+/**
+ * Copy the `len` bytes of `src` starting at `skip` to `dst`
+ *
+ * @return the number of iovecs in `dst`
+ */
+static u32 iov_slice(const struct iovec *src,
+                     u32 nb_iov,
+                     u64 skip,
+                     u64 len,
+                     struct iovec *dst)
+{
+    u32 count = 0;
+
+    for (u32 i = 0; i < nb_iov && len != 0; ++i)
+    {
+        u64 size = src[i].iov_len;
+
+        if (skip >= size)
+        {
+            skip -= size;
+            continue;
+        }
+
+        size -= skip;
+        size = size < len ? size : len;
+        dst[count].iov_base = (u8 *)src[i].iov_base + skip;
+        dst[count].iov_len = size;
+        count++;
+        len -= size;
+        skip = 0;
+    }
+
+    return count;
+}
+
+static u64 iov_size(const struct iovec *iov, u32 nb_iov)
+{
+    u64 size = 0;
+
+    for (u32 i = 0; i < nb_iov; ++i)
+    {
+        size += iov[i].iov_len;
+    }
+
+    return size;
+}
+
+/**
+ * Length of the run starting at `offset` whose clusters are all unallocated
+ * or stored contiguously in the overlay, so one system call serves it
+ *
+ * @return 1 on success, 0 on an I/O error
+ */
+static u32 find_run(overlay_t *overlay,
+                    u64 offset,
+                    u64 max,
+                    u64 *entry,
+                    u64 *run)
+{
+    u64 cluster = offset >> overlay->cluster_bits;
+    u64 in_cluster = offset & (overlay->cluster_size - 1);
+    u64 next;
+
+    if (!lookup(overlay, cluster, entry, 0))
+    {
+        return 0;
+    }
+
+    *run = overlay->cluster_size - in_cluster;
+
+    while (*run < max)
+    {
+        if (!lookup(overlay, ++cluster, &next, 0))
+        {
+            return 0;
+        }
+
+        if ((*entry == 0) != (next == 0)
+            || (next != 0 && next != *entry + in_cluster + *run))
+        {
+            break;
+        }
+
+        *run += overlay->cluster_size;
+    }
+
+    *run = *run < max ? *run : max;
+
+    return 1;
+}
+
+/**
+ * Read a range of unallocated clusters from the base image
+ */
+static u32 read_base(overlay_t *overlay,
+                     struct iovec *iov,
+                     u32 nb_iov,
+                     u64 offset,
+                     u64 len)
+{
+    u64 from_base = 0;
+    struct iovec part[MAX_IOV];
+
+    if (offset < overlay->base_size)
+    {
+        from_base = overlay->base_size - offset < len
+            ? overlay->base_size - offset
+            : len;
+    }
+
+    u32 nb_part = iov_slice(iov, nb_iov, 0, from_base, part);
+
+    if (from_base != 0
+        && preadv(overlay->base_fd, part, nb_part, offset)
+            != (ssize_t)from_base)
+    {
+        return 0;
+    }
+
+    // Past the end of the base image
+    nb_part = iov_slice(iov, nb_iov, from_base, len - from_base, part);
+
+    for (u32 i = 0; i < nb_part; ++i)
+    {
+        memset(part[i].iov_base, 0, part[i].iov_len);
+    }
+
+    return 1;
+}
+
+ssize_t overlay_readv(overlay_t *overlay,
+                      const struct iovec *iov,
+                      u32 nb_iov,
+                      u64 offset)
+{
+    u64 len = iov_size(iov, nb_iov);
+    struct iovec part[MAX_IOV];
+
+    if (nb_iov > MAX_IOV)
+    {
+        return -1;
+    }
+
+    // Short read at the end of the disk like preadv
+    if (offset >= overlay->size)
+    {
+        return 0;
+    }
+
+    len = len < overlay->size - offset ? len : overlay->size - offset;
+
+    for (u64 done = 0; done < len;)
+    {
+        u64 entry;
+        u64 run;
+
+        if (!find_run(overlay, offset + done, len - done, &entry, &run))
+        {
+            return -1;
+        }
+
+        u32 nb_part = iov_slice(iov, nb_iov, done, run, part);
+        u64 in_cluster = (offset + done) & (overlay->cluster_size - 1);
+
+        if (entry == 0)
+        {
+            if (!read_base(overlay, part, nb_part, offset + done, run))
+            {
+                return -1;
+            }
+        }
+        else if (preadv(overlay->fd, part, nb_part, entry + in_cluster)
+                 != (ssize_t)run)
+        {
+            return -1;
+        }
+
+        done += run;
+    }
+
+    return len;
+}
+
+/**
+ * First write to a cluster: allocate it at the end of the overlay with the
+ * data of the base image around the written range. Allocations are
+ * serialized, only the first write to each cluster takes this path.
+ */
+static u32 allocate_write(overlay_t *overlay,
+                          struct iovec *iov,
+                          u32 nb_iov,
+                          u64 offset,
+                          u64 len)
+{
+    u64 cluster = offset >> overlay->cluster_bits;
+    u64 in_cluster = offset & (overlay->cluster_size - 1);
+    u64 entry;
+    u32 ok = 0;
+
+    pthread_mutex_lock(&overlay->lock);
+
+    // Another thread may have allocated the cluster meanwhile
+    if (!lookup(overlay, cluster, &entry, 1))
+    {
+        pthread_mutex_unlock(&overlay->lock);
+        return 0;
+    }
+
+    if (entry != 0)
+    {
+        pthread_mutex_unlock(&overlay->lock);
+        return pwritev(overlay->fd, iov, nb_iov, entry + in_cluster)
+            == (ssize_t)len;
+    }
+
+    entry = overlay->end;
+
+    if (len == overlay->cluster_size)
+    {
+        ok = pwritev(overlay->fd, iov, nb_iov, entry) == (ssize_t)len;
+    }
+    else
+    {
+        u8 *data = malloc(overlay->cluster_size);
+        struct iovec whole = { .iov_base = data,
+                               .iov_len = overlay->cluster_size };
+
+        ok = data != NULL
+            && read_base(overlay,
+                         &whole,
+                         1,
+                         cluster << overlay->cluster_bits,
+                         overlay->cluster_size);
+
+        for (u32 i = 0, copied = 0; ok && i < nb_iov; ++i)
+        {
+            memcpy(data + in_cluster + copied, iov[i].iov_base, iov[i].iov_len);
+            copied += iov[i].iov_len;
+        }
+
+        ok = ok
+            && pwrite(overlay->fd, data, overlay->cluster_size, entry)
+                == (ssize_t)overlay->cluster_size;
+        free(data);
+    }
+
+    // The data is written before the L2 entry points to it
+    if (ok)
+    {
+        overlay->end += overlay->cluster_size;
+        ok = set_entry(overlay, cluster, entry);
+    }
+
+    pthread_mutex_unlock(&overlay->lock);
+
+    return ok;
+}
+
+ssize_t overlay_writev(overlay_t *overlay,
+                       const struct iovec *iov,
+                       u32 nb_iov,
+                       u64 offset)
+{
+    u64 len = iov_size(iov, nb_iov);
+    struct iovec part[MAX_IOV];
+
+    if (nb_iov > MAX_IOV || offset > overlay->size
+        || len > overlay->size - offset)
+    {
+        return -1;
+    }
+
+    for (u64 done = 0; done < len;)
+    {
+        u64 entry;
+        u64 run;
+
+        if (!find_run(overlay, offset + done, len - done, &entry, &run))
+        {
+            return -1;
+        }
+
+        u64 in_cluster = (offset + done) & (overlay->cluster_size - 1);
+
+        // Unallocated clusters are allocated one by one
+        if (entry == 0)
+        {
+            u64 cluster_left = overlay->cluster_size - in_cluster;
+
+            run = run < cluster_left ? run : cluster_left;
+        }
+
+        u32 nb_part = iov_slice(iov, nb_iov, done, run, part);
+
+        if (entry == 0)
+        {
+            if (!allocate_write(overlay, part, nb_part, offset + done, run))
+            {
+                return -1;
+            }
+        }
+        else if (pwritev(overlay->fd, part, nb_part, entry + in_cluster)
+                 != (ssize_t)run)
+        {
+            return -1;
+        }
+
+        done += run;
+    }
+
+    return len;
+}
+
+s32 overlay_flush(overlay_t *overlay)
+{
+    return fdatasync(overlay->fd) == 0;
+}
+
+static ssize_t overlay_disk_readv(void *image,
+                                  const struct iovec *iov,
+                                  u32 nb_iov,
+                                  u64 offset)
+{
+    return overlay_readv(image, iov, nb_iov, offset);
+}
+
+static ssize_t overlay_disk_writev(void *image,
+                                   const struct iovec *iov,
+                                   u32 nb_iov,
+                                   u64 offset)
+{
+    return overlay_writev(image, iov, nb_iov, offset);
+}
+
+static s32 overlay_disk_flush(void *image)
+{
+    return overlay_flush(image);
+}
+
+struct disk overlay_disk(overlay_t *overlay)
+{
+    struct disk disk = { .image = overlay,
+                         .size = overlay->size,
+                         .readv = overlay_disk_readv,
+                         .writev = overlay_disk_writev,
+                         .flush = overlay_disk_flush };
+
+    return disk;
+}
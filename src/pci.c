@@ -0,0 +1,262 @@
+#include <blackhv/io.h>
+#include <blackhv/pci.h>
+#include <stddef.h>
+
+#define CONFIG_ENABLE (1U << 31)
+
+/* Intel 440FX host bridge */
+#define HOST_BRIDGE_VENDOR 0x8086
+#define HOST_BRIDGE_DEVICE 0x1237
+#define PCI_CLASS_BRIDGE 0x06
+
+static struct pci_device *devices[PCI_MAX_DEVICES] = { 0 };
+static struct pci_device host_bridge = { 0 };
+static u32 config_address = 0;
+
+u32 pci_bar_address(struct pci_device *dev, u32 bar)
+{
+    u32 value = pci_config_read32(dev, PCI_BAR(bar));
+
+    return (value & PCI_BAR_IO) ? value & ~0x3U : value & ~0xFU;
+}
+
+/**
+ * Device and register targeted by the configuration address, NULL when no
+ * device answers.
+ */
+static struct pci_device *selected_device(u32 *offset)
+{
+    if ((config_address & CONFIG_ENABLE) == 0)
+    {
+        return NULL;
+    }
+
+    u32 bus = (config_address >> 16) & 0xFF;
+    u32 slot = (config_address >> 11) & 0x1F;
+    u32 function = (config_address >> 8) & 0x7;
+
+    if (bus != 0 || function != 0)
+    {
+        return NULL;
+    }
+
+    *offset = config_address & 0xFC;
+
+    return devices[slot];
+}
+
+static u32 is_writable(u32 offset)
+{
+    return offset == PCI_COMMAND || offset == PCI_COMMAND + 1
+        || offset == PCI_CACHE_LINE_SIZE || offset == PCI_LATENCY_TIMER
+        || (offset >= PCI_BAR(0) && offset < PCI_BAR(PCI_NB_BARS))
+        || offset == PCI_INTERRUPT_LINE;
+}
+
+static u8 bar_type(struct pci_device *dev, u32 bar)
+{
+    u8 low = dev->config[PCI_BAR(bar)];
+
+    return (low & PCI_BAR_IO) ? low & 0x3 : low & 0xF;
+}
+
+/**
+ * Restore the type bits of a BAR and clear the bits below its size, this is
+ * how the guest discovers the size by writing all ones.
+ */
+static void fix_bar(struct pci_device *dev, u32 bar, u8 type)
+{
+    u32 value = pci_config_read32(dev, PCI_BAR(bar));
+    u32 size = dev->bar_size[bar];
+
+    if (size == 0)
+    {
+        pci_config_write32(dev, PCI_BAR(bar), 0);
+        return;
+    }
+
+    pci_config_write32(dev, PCI_BAR(bar), (value & ~(size - 1)) | type);
+}
+
+static void config_write(u16 port, u32 data, u32 len)
+{
+    u32 offset = 0;
+    struct pci_device *dev = selected_device(&offset);
+
+    if (dev == NULL)
+    {
+        return;
+    }
+
+    offset += port - PCI_CONFIG_DATA;
+
+    u8 types[PCI_NB_BARS];
+    u32 changed = 0;
+
+    for (u32 bar = 0; bar < PCI_NB_BARS; ++bar)
+    {
+        types[bar] = bar_type(dev, bar);
+    }
+
+    for (u32 i = 0; i < len && offset + i < PCI_CONFIG_SIZE; ++i)
+    {
+        u32 byte_offset = offset + i;
+
+        if (!is_writable(byte_offset))
+        {
+            continue;
+        }
+
+        dev->config[byte_offset] = (data >> (i * 8)) & 0xFF;
+
+        // Command register or BARs
+        changed |= byte_offset < PCI_CACHE_LINE_SIZE
+            || (byte_offset >= PCI_BAR(0)
+                && byte_offset < PCI_BAR(PCI_NB_BARS));
+    }
+
+    for (u32 bar = 0; bar < PCI_NB_BARS; ++bar)
+    {
+        fix_bar(dev, bar, types[bar]);
+    }
+
+    if (changed && dev->config_changed != NULL)
+    {
+        dev->config_changed(dev);
+    }
+}
+
+static u32 config_read(u16 port, u32 len)
+{
+    u32 offset = 0;
+    struct pci_device *dev = selected_device(&offset);
+
+    if (dev == NULL)
+    {
+        // No device, the bus returns all ones
+        return 0xFFFFFFFF;
+    }
+
+    offset += port - PCI_CONFIG_DATA;
+
+    u32 value = 0;
+
+    for (u32 i = 0; i < len && offset + i < PCI_CONFIG_SIZE; ++i)
+    {
+        value |= (u32)dev->config[offset + i] << (i * 8);
+    }
+
+    return value;
+}
+
+static void address_outl(u16 port, u32 data, void *params)
+{
+    (void)port;
+    (void)params;
+    config_address = data;
+}
+
+static u32 address_inl(u16 port, void *params)
+{
+    (void)port;
+    (void)params;
+    return config_address;
+}
+
+static void data_outb(u16 port, u8 data, void *params)
+{
+    (void)params;
+    config_write(port, data, 1);
+}
+
+static void data_outw(u16 port, u16 data, void *params)
+{
+    (void)params;
+    config_write(port, data, 2);
+}
+
+static void data_outl(u16 port, u32 data, void *params)
+{
+    (void)params;
+    config_write(port, data, 4);
+}
+
+static u8 data_inb(u16 port, void *params)
+{
+    (void)params;
+    return config_read(port, 1);
+}
+
+static u16 data_inw(u16 port, void *params)
+{
+    (void)params;
+    return config_read(port, 2);
+}
+
+static u32 data_inl(u16 port, void *params)
+{
+    (void)params;
+    return config_read(port, 4);
+}
+
+void pci_init(void)
+{
+    struct handler address_handler = {
+        .outl_handler = address_outl,
+        .inl_handler = address_inl,
+    };
+    io_register_handler(PCI_CONFIG_ADDRESS, address_handler);
+
+    struct handler data_handler = {
+        .outb_handler = data_outb,
+        .outw_handler = data_outw,
+        .outl_handler = data_outl,
+        .inb_handler = data_inb,
+        .inw_handler = data_inw,
+        .inl_handler = data_inl,
+    };
+
+    for (u16 i = 0; i < 4; ++i)
+    {
+        io_register_handler(PCI_CONFIG_DATA + i, data_handler);
+    }
+
+    if (devices[0] == NULL)
+    {
+        pci_config_write16(&host_bridge, PCI_VENDOR_ID, HOST_BRIDGE_VENDOR);
+        pci_config_write16(&host_bridge, PCI_DEVICE_ID, HOST_BRIDGE_DEVICE);
+        host_bridge.config[PCI_CLASS] = PCI_CLASS_BRIDGE;
+        host_bridge.slot = 0;
+        devices[0] = &host_bridge;
+    }
+}
+
+s32 pci_register(struct pci_device *dev)
+{
+    // Slot 0 is kept for the host bridge
+    for (s32 i = 1; i < PCI_MAX_DEVICES; ++i)
+    {
+        if (devices[i] == NULL)
+        {
+            devices[i] = dev;
+            dev->slot = i;
+
+            for (u32 bar = 0; bar < PCI_NB_BARS; ++bar)
+            {
+                fix_bar(dev, bar, bar_type(dev, bar));
+            }
+
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void pci_unregister(s32 slot)
+{
+    if (slot > 0 && slot < PCI_MAX_DEVICES)
+    {
+        devices[slot] = NULL;
+    }
+}
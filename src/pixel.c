@@ -0,0 +1,416 @@
+#include <blackhv/pixel.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <string.h>
+
+#define ALPHA 0xFF000000
+
+typedef void (*convert_fn)(u32 *dst,
+                           const u8 *src,
+                           u64 nb_pixels,
+                           const u32 *palette);
+
+struct kernels
+{
+    convert_fn pal8;
+    convert_fn rgb555;
+    convert_fn rgb565;
+    convert_fn bgr24;
+    convert_fn xrgb32;
+};
+
+/* Scalar kernels, also used for the tails of the vector ones */
+
+static u32 expand5(u32 value)
+{
+    return (value << 3) | (value >> 2);
+}
+
+static u32 expand6(u32 value)
+{
+    return (value << 2) | (value >> 4);
+}
+
+static void scalar_pal8(u32 *dst, const u8 *src, u64 n, const u32 *palette)
+{
+    for (u64 i = 0; i < n; ++i)
+    {
+        dst[i] = palette[src[i]] | ALPHA;
+    }
+}
+
+static void scalar_rgb555(u32 *dst, const u8 *src, u64 n, const u32 *palette)
+{
+    (void)palette;
+
+    for (u64 i = 0; i < n; ++i)
+    {
+        u16 p;
+
+        memcpy(&p, src + i * 2, sizeof(p));
+        dst[i] = ALPHA | expand5((p >> 10) & 0x1F) << 16
+            | expand5((p >> 5) & 0x1F) << 8 | expand5(p & 0x1F);
+    }
+}
+
+static void scalar_rgb565(u32 *dst, const u8 *src, u64 n, const u32 *palette)
+{
+    (void)palette;
+
+    for (u64 i = 0; i < n; ++i)
+    {
+        u16 p;
+
+        memcpy(&p, src + i * 2, sizeof(p));
+        dst[i] = ALPHA | expand5(p >> 11) << 16
+            | expand6((p >> 5) & 0x3F) << 8 | expand5(p & 0x1F);
+    }
+}
+
+static void scalar_bgr24(u32 *dst, const u8 *src, u64 n, const u32 *palette)
+{
+    (void)palette;
+
+    for (u64 i = 0; i < n; ++i)
+    {
+        const u8 *p = src + i * 3;
+
+        dst[i] = ALPHA | p[2] << 16 | p[1] << 8 | p[0];
+    }
+}
+
+static void scalar_xrgb32(u32 *dst, const u8 *src, u64 n, const u32 *palette)
+{
+    (void)palette;
+
+    for (u64 i = 0; i < n; ++i)
+    {
+        u32 p;
+
+        memcpy(&p, src + i * 4, sizeof(p));
+        dst[i] = p | ALPHA;
+    }
+}
+
+/*
+ * SSE2 kernels, 8 pixels per iteration. SSE2 has no byte shuffle and no
+ * gather, 8 and 24 bits pixels stay scalar.
+ */
+
+/**
+ * Interleave the 8 bits channels, one per 16 bits lane, into 8 pixels
+ */
+static void sse2_store(u32 *dst, __m128i r, __m128i g, __m128i b)
+{
+    __m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+    __m128i ar = _mm_or_si128(r, _mm_set1_epi16((short)0xFF00));
+
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(gb, ar));
+    _mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(gb, ar));
+}
+
+static __m128i sse2_expand5(__m128i value)
+{
+    return _mm_or_si128(_mm_slli_epi16(value, 3), _mm_srli_epi16(value, 2));
+}
+
+static void sse2_rgb555(u32 *dst, const u8 *src, u64 n, const u32 *palette)
+{
+    const __m128i mask = _mm_set1_epi16(0x1F);
+    u64 i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        __m128i r = _mm_and_si128(_mm_srli_epi16(p, 10), mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask);
+        __m128i b = _mm_and_si128(p, mask);
+
+        sse2_store(
+            dst + i, sse2_expand5(r), sse2_expand5(g), sse2_expand5(b));
+    }
+
+    scalar_rgb555(dst + i, src + i * 2, n - i, palette);
+}
+
+static void sse2_rgb565(u32 *dst, const u8 *src, u64 n, const u32 *palette)
+{
+    const __m128i mask5 = _mm_set1_epi16(0x1F);
+    const __m128i mask6 = _mm_set1_epi16(0x3F);
+    u64 i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        __m128i r = _mm_srli_epi16(p, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+        __m128i b = _mm_and_si128(p, mask5);
+
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        sse2_store(dst + i, sse2_expand5(r), g, sse2_expand5(b));
+    }
+
+    scalar_rgb565(dst + i, src + i * 2, n - i, palette);
+}
+
+static void sse2_xrgb32(u32 *dst, const u8 *src, u64 n, const u32 *palette)
+{
+    const __m128i alpha = _mm_set1_epi32((int)ALPHA);
+    u64 i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + i * 4));
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(p, alpha));
+    }
+
+    scalar_xrgb32(dst + i, src + i * 4, n - i, palette);
+}
+
+/* AVX2 kernels, 16 pixels per iteration or 8 for 8 and 24 bits pixels */
+
+/**
+ * Interleave the 8 bits channels into 16 pixels. The unpacks work within
+ * each 128 bits lane, so the channels are given with the quadwords 1 and 2
+ * swapped.
+ */
+__attribute__((target("avx2"))) static void avx2_store(u32 *dst,
+                                                       __m256i r,
+                                                       __m256i g,
+                                                       __m256i b)
+{
+    __m256i gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+    __m256i ar = _mm256_or_si256(r, _mm256_set1_epi16((short)0xFF00));
+
+    _mm256_storeu_si256((__m256i *)dst, _mm256_unpacklo_epi16(gb, ar));
+    _mm256_storeu_si256((__m256i *)(dst + 8), _mm256_unpackhi_epi16(gb, ar));
+}
+
+__attribute__((target("avx2"))) static __m256i avx2_load16(const u8 *src)
+{
+    __m256i p = _mm256_loadu_si256((const __m256i *)src);
+
+    return _mm256_permute4x64_epi64(p, 0xD8);
+}
+
+__attribute__((target("avx2"))) static __m256i avx2_expand5(__m256i value)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(value, 3),
+                           _mm256_srli_epi16(value, 2));
+}
+
+__attribute__((target("avx2"))) static void avx2_pal8(u32 *dst,
+                                                      const u8 *src,
+                                                      u64 n,
+                                                      const u32 *palette)
+{
+    const __m256i alpha = _mm256_set1_epi32((int)ALPHA);
+    u64 i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i p = _mm_loadl_epi64((const __m128i *)(src + i));
+        __m256i index = _mm256_cvtepu8_epi32(p);
+        __m256i color =
+            _mm256_i32gather_epi32((const int *)palette, index, 4);
+
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_or_si256(color, alpha));
+    }
+
+    scalar_pal8(dst + i, src + i, n - i, palette);
+}
+
+__attribute__((target("avx2"))) static void avx2_rgb555(u32 *dst,
+                                                        const u8 *src,
+                                                        u64 n,
+                                                        const u32 *palette)
+{
+    const __m256i mask = _mm256_set1_epi16(0x1F);
+    u64 i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i p = avx2_load16(src + i * 2);
+        __m256i r = _mm256_and_si256(_mm256_srli_epi16(p, 10), mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask);
+        __m256i b = _mm256_and_si256(p, mask);
+
+        avx2_store(
+            dst + i, avx2_expand5(r), avx2_expand5(g), avx2_expand5(b));
+    }
+
+    scalar_rgb555(dst + i, src + i * 2, n - i, palette);
+}
+
+__attribute__((target("avx2"))) static void avx2_rgb565(u32 *dst,
+                                                        const u8 *src,
+                                                        u64 n,
+                                                        const u32 *palette)
+{
+    const __m256i mask5 = _mm256_set1_epi16(0x1F);
+    const __m256i mask6 = _mm256_set1_epi16(0x3F);
+    u64 i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i p = avx2_load16(src + i * 2);
+        __m256i r = _mm256_srli_epi16(p, 11);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask6);
+        __m256i b = _mm256_and_si256(p, mask5);
+
+        g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+        avx2_store(dst + i, avx2_expand5(r), g, avx2_expand5(b));
+    }
+
+    scalar_rgb565(dst + i, src + i * 2, n - i, palette);
+}
+
+__attribute__((target("avx2"))) static void avx2_bgr24(u32 *dst,
+                                                       const u8 *src,
+                                                       u64 n,
+                                                       const u32 *palette)
+{
+    // Each lane spreads 4 pixels of 3 bytes over 4 bytes
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                             6, 7, 8, -1, 9, 10, 11, -1,
+                                             0, 1, 2, -1, 3, 4, 5, -1,
+                                             6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)ALPHA);
+    u64 i = 0;
+
+    // The second load reads 4 bytes past the 8 pixels
+    for (; i + 10 <= n; i += 8)
+    {
+        const u8 *p = src + i * 3;
+        __m128i low = _mm_loadu_si128((const __m128i *)p);
+        __m128i high = _mm_loadu_si128((const __m128i *)(p + 12));
+        __m256i pixels =
+            _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+
+        pixels = _mm256_shuffle_epi8(pixels, shuffle);
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_or_si256(pixels, alpha));
+    }
+
+    scalar_bgr24(dst + i, src + i * 3, n - i, palette);
+}
+
+__attribute__((target("avx2"))) static void avx2_xrgb32(u32 *dst,
+                                                        const u8 *src,
+                                                        u64 n,
+                                                        const u32 *palette)
+{
+    const __m256i alpha = _mm256_set1_epi32((int)ALPHA);
+    u64 i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(p, alpha));
+    }
+
+    scalar_xrgb32(dst + i, src + i * 4, n - i, palette);
+}
+
+static const struct kernels kernels[] = {
+    [PIXEL_ISA_SCALAR] = { scalar_pal8,
+                           scalar_rgb555,
+                           scalar_rgb565,
+                           scalar_bgr24,
+                           scalar_xrgb32 },
+    [PIXEL_ISA_SSE2] = { scalar_pal8,
+                         sse2_rgb555,
+                         sse2_rgb565,
+                         scalar_bgr24,
+                         sse2_xrgb32 },
+    [PIXEL_ISA_AVX2] = { avx2_pal8,
+                         avx2_rgb555,
+                         avx2_rgb565,
+                         avx2_bgr24,
+                         avx2_xrgb32 },
+};
+
+static pthread_once_t isa_once = PTHREAD_ONCE_INIT;
+static u32 isa;
+
+static s32 isa_supported(u32 value)
+{
+    switch (value)
+    {
+    case PIXEL_ISA_SCALAR:
+        return 1;
+    case PIXEL_ISA_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case PIXEL_ISA_AVX2:
+        return __builtin_cpu_supports("avx2");
+    default:
+        return 0;
+    }
+}
+
+static void detect_isa(void)
+{
+    __builtin_cpu_init();
+
+    isa = PIXEL_ISA_SCALAR;
+
+    if (isa_supported(PIXEL_ISA_AVX2))
+    {
+        isa = PIXEL_ISA_AVX2;
+    }
+    else if (isa_supported(PIXEL_ISA_SSE2))
+    {
+        isa = PIXEL_ISA_SSE2;
+    }
+}
+
+u32 pixel_get_isa(void)
+{
+    pthread_once(&isa_once, detect_isa);
+
+    return __atomic_load_n(&isa, __ATOMIC_RELAXED);
+}
+
+s32 pixel_set_isa(u32 value)
+{
+    pthread_once(&isa_once, detect_isa);
+
+    if (!isa_supported(value))
+    {
+        return 0;
+    }
+
+    __atomic_store_n(&isa, value, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void pixel_convert(u32 *dst,
+                   const u8 *src,
+                   u64 nb_pixels,
+                   u32 bpp,
+                   const u32 *palette)
+{
+    const struct kernels *k = &kernels[pixel_get_isa()];
+
+    switch (bpp)
+    {
+    case 8:
+        k->pal8(dst, src, nb_pixels, palette);
+        break;
+    case 15:
+        k->rgb555(dst, src, nb_pixels, palette);
+        break;
+    case 16:
+        k->rgb565(dst, src, nb_pixels, palette);
+        break;
+    case 24:
+        k->bgr24(dst, src, nb_pixels, palette);
+        break;
+    case 32:
+        k->xrgb32(dst, src, nb_pixels, palette);
+        break;
+    }
+}
@@ -0,0 +1,883 @@
+#include <blackhv/io.h>
+#include <blackhv/ps2.h>
+#include <blackhv/queue.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+/* Status register bits */
+#define STATUS_OBF 0x01 // Output buffer full
+#define STATUS_SYSFLAG 0x04
+#define STATUS_COMMAND 0x08 // Last write was to the command port
+#define STATUS_UNLOCKED 0x10 // Keyboard not inhibited
+#define STATUS_AUX 0x20 // Output buffer holds mouse data
+
+/* Command byte bits */
+#define CMD_KBD_INT 0x01
+#define CMD_AUX_INT 0x02
+#define CMD_SYSFLAG 0x04
+#define CMD_KBD_DISABLE 0x10
+#define CMD_AUX_DISABLE 0x20
+#define CMD_TRANSLATE 0x40
+
+#define CMD_DEFAULT \
+    (CMD_KBD_INT | CMD_SYSFLAG | CMD_AUX_DISABLE | CMD_TRANSLATE)
+
+/* Controller commands */
+#define CTRL_READ_CMD 0x20
+#define CTRL_WRITE_CMD 0x60
+#define CTRL_AUX_DISABLE 0xA7
+#define CTRL_AUX_ENABLE 0xA8
+#define CTRL_AUX_TEST 0xA9
+#define CTRL_SELF_TEST 0xAA
+#define CTRL_KBD_TEST 0xAB
+#define CTRL_KBD_DISABLE 0xAD
+#define CTRL_KBD_ENABLE 0xAE
+#define CTRL_READ_OUTPUT 0xD0
+#define CTRL_WRITE_OUTPUT 0xD1
+#define CTRL_WRITE_KBD_OUTPUT 0xD2
+#define CTRL_WRITE_AUX_OUTPUT 0xD3
+#define CTRL_WRITE_AUX 0xD4
+
+/* Device commands and replies */
+#define DEV_SET_LEDS 0xED // Keyboard
+#define DEV_ECHO 0xEE // Keyboard
+#define DEV_SCANCODE_SET 0xF0 // Keyboard
+#define DEV_SET_RESOLUTION 0xE8 // Mouse
+#define DEV_STATUS 0xE9 // Mouse
+#define DEV_GET_ID 0xF2
+#define DEV_SET_RATE 0xF3 // Typematic rate of the keyboard
+#define DEV_ENABLE 0xF4
+#define DEV_DISABLE 0xF5
+#define DEV_DEFAULTS 0xF6
+#define DEV_RESET 0xFF
+#define DEV_ACK 0xFA
+#define DEV_SELF_TEST_OK 0xAA
+
+/* Mouse packet bits */
+#define PACKET_ALWAYS 0x08
+#define PACKET_X_SIGN 0x10
+#define PACKET_Y_SIGN 0x20
+
+#define MOUSE_ID_WHEEL 3 // IntelliMouse, 4 bytes packets
+
+#define MOVE_MAX 255 // Per packet, the 9 bits deltas go down to -256
+#define WHEEL_MAX 7
+
+#define E0(CODE) (0x100 | (CODE)) // Extended key
+#define USAGE_PRINT_SCREEN 0x46
+#define USAGE_PAUSE 0x48
+#define KEY_MAX_BYTES 6 // Pause
+
+#define BATCH_EVENTS 64 // Read from a queue at once
+
+struct key_event
+{
+    u16 usage;
+    u16 pressed;
+};
+
+struct mouse_event
+{
+    s16 dx; // PS/2 direction, up is positive
+    s16 dy;
+    s8 dz;
+    u8 buttons;
+    u8 padding[2];
+};
+
+struct fifo
+{
+    u8 data[PS2_FIFO_SIZE];
+    u32 head;
+    u32 count;
+};
+
+struct ps2
+{
+    vm_t *vm; // NULL when the interrupts are not wired
+
+    // Filled by the producer thread, always drained with the lock held so
+    // there is a single consumer at a time
+    queue_t *keys;
+    queue_t *moves;
+
+    // i8042 state, protected by lock
+    pthread_mutex_t lock;
+    u8 command; // Command byte
+    u8 status; // STATUS_COMMAND only, the other bits are computed
+    u8 pending; // Controller command waiting for its data byte, 0 if none
+    u8 output; // Output buffer
+    u8 output_full;
+    u8 output_aux;
+    u8 controller_full; // A controller reply waits for the output buffer
+    u8 controller_reply;
+    u8 kbd_irq_level;
+    u8 aux_irq_level;
+
+    // Keyboard
+    struct fifo kbd_fifo;
+    u8 kbd_pending; // Command waiting for its parameter, 0 if none
+    u8 kbd_enabled;
+
+    // Mouse
+    struct fifo aux_fifo;
+    u8 aux_pending;
+    u8 aux_enabled; // Data reporting
+    u8 aux_id;
+    u8 aux_rate;
+    u8 aux_resolution;
+    u8 aux_rates[3]; // Last sample rates set, to detect the wheel sequence
+};
+
+/* HID keyboard page usage to set 1 scan code */
+static const u16 set1_codes[0xE8] = {
+    [0x04] = 0x1E, [0x05] = 0x30, [0x06] = 0x2E, [0x07] = 0x20,
+    [0x08] = 0x12, [0x09] = 0x21, [0x0A] = 0x22, [0x0B] = 0x23,
+    [0x0C] = 0x17, [0x0D] = 0x24, [0x0E] = 0x25, [0x0F] = 0x26,
+    [0x10] = 0x32, [0x11] = 0x31, [0x12] = 0x18, [0x13] = 0x19,
+    [0x14] = 0x10, [0x15] = 0x13, [0x16] = 0x1F, [0x17] = 0x14,
+    [0x18] = 0x16, [0x19] = 0x2F, [0x1A] = 0x11, [0x1B] = 0x2D,
+    [0x1C] = 0x15, [0x1D] = 0x2C, [0x1E] = 0x02, [0x1F] = 0x03,
+    [0x20] = 0x04, [0x21] = 0x05, [0x22] = 0x06, [0x23] = 0x07,
+    [0x24] = 0x08, [0x25] = 0x09, [0x26] = 0x0A, [0x27] = 0x0B,
+    [0x28] = 0x1C, [0x29] = 0x01, [0x2A] = 0x0E, [0x2B] = 0x0F,
+    [0x2C] = 0x39, [0x2D] = 0x0C, [0x2E] = 0x0D, [0x2F] = 0x1A,
+    [0x30] = 0x1B, [0x31] = 0x2B, [0x32] = 0x2B, [0x33] = 0x27,
+    [0x34] = 0x28, [0x35] = 0x29, [0x36] = 0x33, [0x37] = 0x34,
+    [0x38] = 0x35, [0x39] = 0x3A, [0x3A] = 0x3B, [0x3B] = 0x3C,
+    [0x3C] = 0x3D, [0x3D] = 0x3E, [0x3E] = 0x3F, [0x3F] = 0x40,
+    [0x40] = 0x41, [0x41] = 0x42, [0x42] = 0x43, [0x43] = 0x44,
+    [0x44] = 0x57, [0x45] = 0x58, [0x47] = 0x46, [0x49] = E0(0x52),
+    [0x4A] = E0(0x47), [0x4B] = E0(0x49), [0x4C] = E0(0x53),
+    [0x4D] = E0(0x4F), [0x4E] = E0(0x51), [0x4F] = E0(0x4D),
+    [0x50] = E0(0x4B), [0x51] = E0(0x50), [0x52] = E0(0x48),
+    [0x53] = 0x45, [0x54] = E0(0x35), [0x55] = 0x37, [0x56] = 0x4A,
+    [0x57] = 0x4E, [0x58] = E0(0x1C), [0x59] = 0x4F, [0x5A] = 0x50,
+    [0x5B] = 0x51, [0x5C] = 0x4B, [0x5D] = 0x4C, [0x5E] = 0x4D,
+    [0x5F] = 0x47, [0x60] = 0x48, [0x61] = 0x49, [0x62] = 0x52,
+    [0x63] = 0x53, [0x64] = 0x56, [0x65] = E0(0x5D), [0xE0] = 0x1D,
+    [0xE1] = 0x2A, [0xE2] = 0x38, [0xE3] = E0(0x5B), [0xE4] = E0(0x1D),
+    [0xE5] = 0x36, [0xE6] = E0(0x38), [0xE7] = E0(0x5C),
+};
+
+static u32 fifo_free(struct fifo *fifo)
+{
+    return PS2_FIFO_SIZE - fifo->count;
+}
+
+static void fifo_push(struct fifo *fifo, u8 data)
+{
+    if (fifo->count >= PS2_FIFO_SIZE)
+    {
+        return;
+    }
+
+    fifo->data[(fifo->head + fifo->count) % PS2_FIFO_SIZE] = data;
+    fifo->count += 1;
+}
+
+static u8 fifo_pop(struct fifo *fifo)
+{
+    u8 data = fifo->data[fifo->head];
+
+    fifo->head = (fifo->head + 1) % PS2_FIFO_SIZE;
+    fifo->count -= 1;
+
+    return data;
+}
+
+static void fifo_clear(struct fifo *fifo)
+{
+    fifo->head = 0;
+    fifo->count = 0;
+}
+
+static void push_key(struct fifo *fifo, u32 usage, u32 pressed)
+{
+    u8 release = pressed ? 0 : 0x80;
+
+    if (usage == USAGE_PRINT_SCREEN)
+    {
+        // Sent as fake shift + keypad *
+        u8 shift = pressed ? 0x2A : 0xAA;
+        u8 star = 0x37 | release;
+
+        fifo_push(fifo, 0xE0);
+        fifo_push(fifo, pressed ? shift : star);
+        fifo_push(fifo, 0xE0);
+        fifo_push(fifo, pressed ? star : shift);
+        return;
+    }
+
+    if (usage == USAGE_PAUSE)
+    {
+        // Ctrl + NumLock, make and break at once when pressed
+        static const u8 pause[] = { 0xE1, 0x1D, 0x45, 0xE1, 0x9D, 0xC5 };
+
+        for (u32 i = 0; pressed && i < sizeof(pause); ++i)
+        {
+            fifo_push(fifo, pause[i]);
+        }
+        return;
+    }
+
+    u16 code = set1_codes[usage];
+
+    if ((code & 0x100) != 0)
+    {
+        fifo_push(fifo, 0xE0);
+    }
+
+    fifo_push(fifo, (code & 0x7F) | release);
+}
+
+static void push_packet(ps2_t *ps2, struct mouse_event *event)
+{
+    u8 flags = PACKET_ALWAYS | (event->buttons & 0x7);
+
+    flags |= event->dx < 0 ? PACKET_X_SIGN : 0;
+    flags |= event->dy < 0 ? PACKET_Y_SIGN : 0;
+
+    fifo_push(&ps2->aux_fifo, flags);
+    fifo_push(&ps2->aux_fifo, event->dx & 0xFF);
+    fifo_push(&ps2->aux_fifo, event->dy & 0xFF);
+
+    if (ps2->aux_id == MOUSE_ID_WHEEL)
+    {
+        fifo_push(&ps2->aux_fifo, (u8)event->dz);
+    }
+}
+
+static s32 clamp(s32 value, s32 max)
+{
+    return value > max ? max : value < -max ? -max : value;
+}
+
+/**
+ * Send the accumulated motion of `event`, as many packets as the deltas need
+ */
+static void push_motion(ps2_t *ps2, struct mouse_event *event)
+{
+    s32 dx = event->dx;
+    s32 dy = event->dy;
+
+    do
+    {
+        struct mouse_event packet = *event;
+        packet.dx = clamp(dx, MOVE_MAX);
+        packet.dy = clamp(dy, MOVE_MAX);
+        push_packet(ps2, &packet);
+
+        dx -= packet.dx;
+        dy -= packet.dy;
+        event->dz = 0;
+    } while (dx != 0 || dy != 0);
+}
+
+/**
+ * Move the queued key events to the keyboard FIFO, in batches
+ */
+static void drain_keys(ps2_t *ps2)
+{
+    struct key_event events[BATCH_EVENTS];
+
+    while (1)
+    {
+        u32 count = BATCH_EVENTS;
+
+        if (ps2->kbd_enabled)
+        {
+            u32 room = fifo_free(&ps2->kbd_fifo) / KEY_MAX_BYTES;
+            count = room < count ? room : count;
+        }
+
+        if (count == 0)
+        {
+            return;
+        }
+
+        size_t size =
+            queue_read(ps2->keys, (u8 *)events, sizeof(events[0]) * count);
+
+        // The keyboard does not scan while disabled, the keys are lost
+        for (u32 i = 0; ps2->kbd_enabled && i < size / sizeof(events[0]); ++i)
+        {
+            push_key(&ps2->kbd_fifo, events[i].usage, events[i].pressed);
+        }
+
+        if (size < sizeof(events[0]) * count)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * Move the queued mouse events to the mouse FIFO, in batches. Consecutive
+ * moves with the same buttons are merged in a single packet, as the mouse
+ * would report them at its sample rate.
+ */
+static void drain_moves(ps2_t *ps2)
+{
+    struct mouse_event events[BATCH_EVENTS];
+    u32 packet_size = ps2->aux_id == MOUSE_ID_WHEEL ? 4 : 3;
+
+    while (1)
+    {
+        u32 count = BATCH_EVENTS;
+
+        if (ps2->aux_enabled)
+        {
+            // Each event is within one packet range, merged ones as well
+            u32 room = fifo_free(&ps2->aux_fifo) / packet_size;
+            count = room < count ? room : count;
+        }
+
+        if (count == 0)
+        {
+            return;
+        }
+
+        size_t size =
+            queue_read(ps2->moves, (u8 *)events, sizeof(events[0]) * count);
+        u32 read = size / sizeof(events[0]);
+        struct mouse_event motion = { 0 };
+        u32 merged = 0;
+
+        for (u32 i = 0; ps2->aux_enabled && i < read; ++i)
+        {
+            if (merged > 0 && events[i].buttons == motion.buttons
+                && events[i].dz == 0)
+            {
+                motion.dx += events[i].dx;
+                motion.dy += events[i].dy;
+                merged += 1;
+                continue;
+            }
+
+            if (merged > 0)
+            {
+                push_motion(ps2, &motion);
+            }
+
+            motion = events[i];
+            merged = 1;
+        }
+
+        if (merged > 0)
+        {
+            push_motion(ps2, &motion);
+        }
+
+        if (read < count)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * Load the output buffer when the guest has read it, the controller replies
+ * first then the keyboard then the mouse
+ */
+static void fill_output(ps2_t *ps2)
+{
+    if (ps2->output_full)
+    {
+        return;
+    }
+
+    if (ps2->controller_full)
+    {
+        ps2->output = ps2->controller_reply;
+        ps2->output_aux = 0;
+        ps2->controller_full = 0;
+    }
+    else if ((ps2->command & CMD_KBD_DISABLE) == 0 && ps2->kbd_fifo.count > 0)
+    {
+        ps2->output = fifo_pop(&ps2->kbd_fifo);
+        ps2->output_aux = 0;
+    }
+    else if ((ps2->command & CMD_AUX_DISABLE) == 0 && ps2->aux_fifo.count > 0)
+    {
+        ps2->output = fifo_pop(&ps2->aux_fifo);
+        ps2->output_aux = 1;
+    }
+    else
+    {
+        return;
+    }
+
+    ps2->output_full = 1;
+}
+
+static void set_irq_lines(ps2_t *ps2)
+{
+    u8 kbd_level = ps2->output_full && !ps2->output_aux
+        && (ps2->command & CMD_KBD_INT) != 0;
+    u8 aux_level = ps2->output_full && ps2->output_aux
+        && (ps2->command & CMD_AUX_INT) != 0;
+
+    if (ps2->vm != NULL && kbd_level != ps2->kbd_irq_level)
+    {
+        vm_irq_line(ps2->vm, PS2_KEYBOARD_IRQ, kbd_level);
+    }
+
+    if (ps2->vm != NULL && aux_level != ps2->aux_irq_level)
+    {
+        vm_irq_line(ps2->vm, PS2_MOUSE_IRQ, aux_level);
+    }
+
+    ps2->kbd_irq_level = kbd_level;
+    ps2->aux_irq_level = aux_level;
+}
+
+/**
+ * Refresh the output buffer and the interrupt lines, must be called with the
+ * lock held after each state change
+ */
+static void update_irq(ps2_t *ps2)
+{
+    fill_output(ps2);
+    set_irq_lines(ps2);
+}
+
+static void controller_reply(ps2_t *ps2, u8 data)
+{
+    ps2->controller_reply = data;
+    ps2->controller_full = 1;
+}
+
+static void keyboard_reset(ps2_t *ps2)
+{
+    ps2->kbd_pending = 0;
+    ps2->kbd_enabled = 1;
+}
+
+static void mouse_reset(ps2_t *ps2)
+{
+    ps2->aux_pending = 0;
+    ps2->aux_enabled = 0;
+    ps2->aux_id = 0;
+    ps2->aux_rate = 100;
+    ps2->aux_resolution = 2;
+}
+
+static void keyboard_write(ps2_t *ps2, u8 data)
+{
+    struct fifo *fifo = &ps2->kbd_fifo;
+
+    // The keyboard clears its buffer when it receives a byte
+    fifo_clear(fifo);
+
+    if (ps2->kbd_pending != 0)
+    {
+        u8 command = ps2->kbd_pending;
+        ps2->kbd_pending = 0;
+        fifo_push(fifo, DEV_ACK);
+
+        if (command == DEV_SCANCODE_SET && data == 0)
+        {
+            // Set 2, translated to set 1 by the controller
+            fifo_push(fifo, 0x41);
+        }
+        return;
+    }
+
+    switch (data)
+    {
+    case DEV_SET_LEDS:
+    case DEV_SCANCODE_SET:
+    case DEV_SET_RATE:
+        ps2->kbd_pending = data;
+        fifo_push(fifo, DEV_ACK);
+        break;
+    case DEV_ECHO:
+        fifo_push(fifo, DEV_ECHO);
+        break;
+    case DEV_GET_ID:
+        // MF2 keyboard, translated
+        fifo_push(fifo, DEV_ACK);
+        fifo_push(fifo, 0xAB);
+        fifo_push(fifo, 0x41);
+        break;
+    case DEV_ENABLE:
+        ps2->kbd_enabled = 1;
+        fifo_push(fifo, DEV_ACK);
+        break;
+    case DEV_DISABLE:
+        ps2->kbd_enabled = 0;
+        fifo_push(fifo, DEV_ACK);
+        break;
+    case DEV_RESET:
+        keyboard_reset(ps2);
+        fifo_push(fifo, DEV_ACK);
+        fifo_push(fifo, DEV_SELF_TEST_OK);
+        break;
+    default:
+        fifo_push(fifo, DEV_ACK);
+        break;
+    }
+}
+
+static void mouse_set_rate(ps2_t *ps2, u8 rate)
+{
+    ps2->aux_rate = rate;
+    ps2->aux_rates[0] = ps2->aux_rates[1];
+    ps2->aux_rates[1] = ps2->aux_rates[2];
+    ps2->aux_rates[2] = rate;
+
+    // Magic sequence enabling the wheel
+    if (ps2->aux_rates[0] == 200 && ps2->aux_rates[1] == 100
+        && ps2->aux_rates[2] == 80)
+    {
+        ps2->aux_id = MOUSE_ID_WHEEL;
+    }
+}
+
+static void mouse_write(ps2_t *ps2, u8 data)
+{
+    struct fifo *fifo = &ps2->aux_fifo;
+
+    fifo_clear(fifo);
+
+    if (ps2->aux_pending != 0)
+    {
+        if (ps2->aux_pending == DEV_SET_RATE)
+        {
+            mouse_set_rate(ps2, data);
+        }
+        else
+        {
+            ps2->aux_resolution = data & 0x3;
+        }
+
+        ps2->aux_pending = 0;
+        fifo_push(fifo, DEV_ACK);
+        return;
+    }
+
+    switch (data)
+    {
+    case DEV_SET_RESOLUTION:
+    case DEV_SET_RATE:
+        ps2->aux_pending = data;
+        fifo_push(fifo, DEV_ACK);
+        break;
+    case DEV_STATUS:
+        fifo_push(fifo, DEV_ACK);
+        fifo_push(fifo, ps2->aux_enabled ? 0x20 : 0x00);
+        fifo_push(fifo, ps2->aux_resolution);
+        fifo_push(fifo, ps2->aux_rate);
+        break;
+    case DEV_GET_ID:
+        fifo_push(fifo, DEV_ACK);
+        fifo_push(fifo, ps2->aux_id);
+        break;
+    case DEV_ENABLE:
+        ps2->aux_enabled = 1;
+        fifo_push(fifo, DEV_ACK);
+        break;
+    case DEV_DISABLE:
+        ps2->aux_enabled = 0;
+        fifo_push(fifo, DEV_ACK);
+        break;
+    case DEV_DEFAULTS:
+        ps2->aux_enabled = 0;
+        ps2->aux_rate = 100;
+        ps2->aux_resolution = 2;
+        fifo_push(fifo, DEV_ACK);
+        break;
+    case DEV_RESET:
+        mouse_reset(ps2);
+        fifo_push(fifo, DEV_ACK);
+        fifo_push(fifo, DEV_SELF_TEST_OK);
+        fifo_push(fifo, 0x00);
+        break;
+    default:
+        // Scaling, stream and remote modes are accepted and ignored
+        fifo_push(fifo, DEV_ACK);
+        break;
+    }
+}
+
+static void write_data(ps2_t *ps2, u8 data)
+{
+    u8 command = ps2->pending;
+    ps2->pending = 0;
+
+    switch (command)
+    {
+    case CTRL_WRITE_CMD:
+        ps2->command = data;
+        break;
+    case CTRL_WRITE_OUTPUT:
+        // The A20 gate is always enabled and the reset line is not wired
+        break;
+    case CTRL_WRITE_KBD_OUTPUT:
+        fifo_push(&ps2->kbd_fifo, data);
+        break;
+    case CTRL_WRITE_AUX_OUTPUT:
+        fifo_push(&ps2->aux_fifo, data);
+        break;
+    case CTRL_WRITE_AUX:
+        mouse_write(ps2, data);
+        break;
+    default:
+        keyboard_write(ps2, data);
+        break;
+    }
+}
+
+static void write_command(ps2_t *ps2, u8 data)
+{
+    switch (data)
+    {
+    case CTRL_READ_CMD:
+        controller_reply(ps2, ps2->command);
+        break;
+    case CTRL_WRITE_CMD:
+    case CTRL_WRITE_OUTPUT:
+    case CTRL_WRITE_KBD_OUTPUT:
+    case CTRL_WRITE_AUX_OUTPUT:
+    case CTRL_WRITE_AUX:
+        ps2->pending = data;
+        break;
+    case CTRL_AUX_DISABLE:
+        ps2->command |= CMD_AUX_DISABLE;
+        break;
+    case CTRL_AUX_ENABLE:
+        ps2->command &= ~CMD_AUX_DISABLE;
+        break;
+    case CTRL_AUX_TEST:
+    case CTRL_KBD_TEST:
+        controller_reply(ps2, 0x00);
+        break;
+    case CTRL_SELF_TEST:
+        controller_reply(ps2, 0x55);
+        break;
+    case CTRL_KBD_DISABLE:
+        ps2->command |= CMD_KBD_DISABLE;
+        break;
+    case CTRL_KBD_ENABLE:
+        ps2->command &= ~CMD_KBD_DISABLE;
+        break;
+    case CTRL_READ_OUTPUT:
+        // System reset deasserted, A20 enabled
+        controller_reply(ps2, 0x03);
+        break;
+    default:
+        // Output port pulses and the password are not supported
+        break;
+    }
+}
+
+static void ps2_outb(u16 port, u8 data, void *params)
+{
+    if (params == NULL)
+    {
+        errx(1, "ps2: params cannot be null");
+    }
+
+    ps2_t *ps2 = (ps2_t *)params;
+
+    pthread_mutex_lock(&ps2->lock);
+
+    if (port == PS2_COMMAND)
+    {
+        ps2->status |= STATUS_COMMAND;
+        ps2->pending = 0;
+        write_command(ps2, data);
+    }
+    else
+    {
+        ps2->status &= ~STATUS_COMMAND;
+        write_data(ps2, data);
+    }
+
+    update_irq(ps2);
+
+    pthread_mutex_unlock(&ps2->lock);
+}
+
+static u8 ps2_inb(u16 port, void *params)
+{
+    if (params == NULL)
+    {
+        errx(1, "ps2: params cannot be null");
+    }
+
+    ps2_t *ps2 = (ps2_t *)params;
+    u8 value = 0;
+
+    pthread_mutex_lock(&ps2->lock);
+
+    drain_keys(ps2);
+    drain_moves(ps2);
+
+    if (port == PS2_STATUS)
+    {
+        fill_output(ps2);
+
+        value = ps2->status | STATUS_UNLOCKED;
+        value |= (ps2->command & CMD_SYSFLAG) != 0 ? STATUS_SYSFLAG : 0;
+        value |= ps2->output_full ? STATUS_OBF : 0;
+        value |= ps2->output_full && ps2->output_aux ? STATUS_AUX : 0;
+    }
+    else
+    {
+        // Reading an empty buffer returns the previous byte again
+        value = ps2->output;
+        ps2->output_full = 0;
+
+        // Lower the line before loading the next byte, each byte is an edge
+        set_irq_lines(ps2);
+    }
+
+    update_irq(ps2);
+
+    pthread_mutex_unlock(&ps2->lock);
+
+    return value;
+}
+
+ps2_t *ps2_new(vm_t *vm)
+{
+    ps2_t *ps2 = calloc(1, sizeof(ps2_t));
+
+    if (ps2 == NULL)
+    {
+        return NULL;
+    }
+
+    ps2->keys = queue_new(PS2_QUEUE_EVENTS * sizeof(struct key_event));
+    ps2->moves = queue_new(PS2_QUEUE_EVENTS * sizeof(struct mouse_event));
+
+    if (ps2->keys == NULL || ps2->moves == NULL)
+    {
+        if (ps2->keys != NULL)
+        {
+            queue_destroy(ps2->keys);
+        }
+
+        if (ps2->moves != NULL)
+        {
+            queue_destroy(ps2->moves);
+        }
+
+        free(ps2);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ps2->lock, NULL);
+    ps2->vm = vm;
+    ps2->command = CMD_DEFAULT;
+    keyboard_reset(ps2);
+    mouse_reset(ps2);
+
+    if (vm != NULL)
+    {
+        vm_irq_line(vm, PS2_KEYBOARD_IRQ, 0);
+        vm_irq_line(vm, PS2_MOUSE_IRQ, 0);
+    }
+
+    struct handler handler = { .inb_handler = ps2_inb,
+                               .outb_handler = ps2_outb,
+                               .params = ps2 };
+
+    io_register_handler(PS2_DATA, handler);
+    io_register_handler(PS2_COMMAND, handler);
+
+    return ps2;
+}
+
+void ps2_destroy(ps2_t *ps2)
+{
+    if (ps2 == NULL)
+    {
+        return;
+    }
+
+    io_unregister_handler(PS2_DATA);
+    io_unregister_handler(PS2_COMMAND);
+
+    if (ps2->vm != NULL && ps2->kbd_irq_level != 0)
+    {
+        vm_irq_line(ps2->vm, PS2_KEYBOARD_IRQ, 0);
+    }
+
+    if (ps2->vm != NULL && ps2->aux_irq_level != 0)
+    {
+        vm_irq_line(ps2->vm, PS2_MOUSE_IRQ, 0);
+    }
+
+    pthread_mutex_destroy(&ps2->lock);
+    queue_destroy(ps2->keys);
+    queue_destroy(ps2->moves);
+    free(ps2);
+}
+
+void ps2_key(ps2_t *ps2, u32 usage, u32 pressed)
+{
+    if (ps2 == NULL || usage >= sizeof(set1_codes) / sizeof(set1_codes[0]))
+    {
+        return;
+    }
+
+    if (set1_codes[usage] == 0 && usage != USAGE_PRINT_SCREEN
+        && usage != USAGE_PAUSE)
+    {
+        return;
+    }
+
+    struct key_event event = { .usage = usage, .pressed = pressed != 0 };
+
+    // Dropped when the queue is full, as a keyboard overrun
+    queue_write(ps2->keys, (u8 *)&event, sizeof(event));
+}
+
+void ps2_mouse(ps2_t *ps2, s32 dx, s32 dy, s32 dz, u32 buttons)
+{
+    if (ps2 == NULL)
+    {
+        return;
+    }
+
+    // Each event fits in one packet, large moves are split
+    dy = -dy;
+    dz = clamp(-dz, WHEEL_MAX);
+
+    do
+    {
+        struct mouse_event event = { .dx = clamp(dx, MOVE_MAX),
+                                     .dy = clamp(dy, MOVE_MAX),
+                                     .dz = dz,
+                                     .buttons = buttons & 0x7 };
+
+        if (queue_write(ps2->moves, (u8 *)&event, sizeof(event)) == 0)
+        {
+            return;
+        }
+
+        dx -= event.dx;
+        dy -= event.dy;
+        dz = 0;
+    } while (dx != 0 || dy != 0);
+}
+
+void ps2_flush(ps2_t *ps2)
+{
+    if (ps2 == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&ps2->lock);
+
+    drain_keys(ps2);
+    drain_moves(ps2);
+    update_irq(ps2);
+
+    pthread_mutex_unlock(&ps2->lock);
+}
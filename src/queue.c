@@ -1,16 +1,37 @@
 #include <blackhv/queue.h>
-#include <pthread.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+static size_t round_up_pow2(size_t size)
+{
+    size_t pow2 = 1;
+
+    while (pow2 < size)
+    {
+        pow2 <<= 1;
+    }
+
+    return pow2;
+}
 
 queue_t *queue_new(size_t buffer_size)
 {
-    queue_t *queue = malloc(sizeof(queue_t));
+    if (buffer_size == 0)
+    {
+        return NULL;
+    }
+
+    queue_t *queue = aligned_alloc(QUEUE_CACHE_LINE, sizeof(queue_t));
 
     if (queue == NULL)
     {
         return NULL;
     }
 
+    buffer_size = round_up_pow2(buffer_size);
     queue->buffer = malloc(buffer_size);
 
     if (queue->buffer == NULL)
@@ -20,70 +41,156 @@ queue_t *queue_new(size_t buffer_size)
     }
 
     queue->buffer_size = buffer_size;
-    queue->front = 0;
-    queue->rear = 0;
-    queue->is_full = 0;
-    pthread_mutex_init(&queue->mutex, NULL);
+    queue->mask = buffer_size - 1;
+    atomic_init(&queue->front, 0);
+    atomic_init(&queue->rear, 0);
+    queue->front_cache = 0;
+    queue->rear_cache = 0;
 
     return queue;
 }
 
 size_t queue_write(queue_t *queue, u8 *buffer, size_t size)
 {
-    if (queue == NULL || size == 0 || queue->is_full == 1)
+    if (queue == NULL || buffer == NULL || size == 0)
     {
         return 0;
     }
 
-    pthread_mutex_lock(&queue->mutex);
+    // Only the producer modifies rear
+    size_t rear = atomic_load_explicit(&queue->rear, memory_order_relaxed);
+    size_t available = queue->buffer_size - (rear - queue->front_cache);
 
-    size_t i = 0;
-    do
+    if (available < size)
     {
-        queue->buffer[queue->rear] = buffer[i];
-        queue->rear = (queue->rear + 1) % queue->buffer_size;
+        // Refresh our view of the consumer, pairs with the release in
+        // queue_read so the bytes it consumed can be overwritten.
+        queue->front_cache =
+            atomic_load_explicit(&queue->front, memory_order_acquire);
+        available = queue->buffer_size - (rear - queue->front_cache);
+    }
 
-        ++i;
-    } while (queue->front != queue->rear && i < size);
+    if (size > available)
+    {
+        size = available;
+    }
 
-    if (queue->front == queue->rear)
+    if (size == 0)
     {
-        queue->is_full = 1;
+        return 0;
     }
 
-    pthread_mutex_unlock(&queue->mutex);
+    // At most two copies, one up to the end of the buffer and one for the
+    // part that wraps around.
+    size_t offset = rear & queue->mask;
+    size_t first = queue->buffer_size - offset;
+
+    if (first > size)
+    {
+        first = size;
+    }
 
-    return i;
+    memcpy(queue->buffer + offset, buffer, first);
+    memcpy(queue->buffer, buffer + first, size - first);
+
+    // Publish the bytes to the consumer
+    atomic_store_explicit(&queue->rear, rear + size, memory_order_release);
+
+    return size;
 }
 
 size_t queue_read(queue_t *queue, u8 *buffer, size_t size)
 {
-    if (queue == NULL || size == 0
-        || (queue->is_full == 0 && queue->front == queue->rear))
+    if (queue == NULL || buffer == NULL || size == 0)
     {
         return 0;
     }
 
-    pthread_mutex_lock(&queue->mutex);
+    // Only the consumer modifies front
+    size_t front = atomic_load_explicit(&queue->front, memory_order_relaxed);
+    size_t available = queue->rear_cache - front;
 
-    size_t i = 0;
+    if (available < size)
+    {
+        // Pairs with the release in queue_write so the bytes are visible
+        queue->rear_cache =
+            atomic_load_explicit(&queue->rear, memory_order_acquire);
+        available = queue->rear_cache - front;
+    }
 
-    do
+    if (size > available)
     {
-        buffer[i] = queue->buffer[queue->front];
-        queue->front = (queue->front + 1) % queue->buffer_size;
+        size = available;
+    }
 
-        ++i;
-    } while (queue->front != queue->rear && i < size);
+    if (size == 0)
+    {
+        return 0;
+    }
 
-    if (i != 0)
+    size_t offset = front & queue->mask;
+    size_t first = queue->buffer_size - offset;
+
+    if (first > size)
     {
-        queue->is_full = 0;
+        first = size;
     }
 
-    pthread_mutex_unlock(&queue->mutex);
+    memcpy(buffer, queue->buffer + offset, first);
+    memcpy(buffer + first, queue->buffer, size - first);
+
+    // Give the space back to the producer
+    atomic_store_explicit(&queue->front, front + size, memory_order_release);
+
+    return size;
+}
+
+static s64 now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (s64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+size_t queue_read_wait(queue_t *queue,
+                       s32 event_fd,
+                       u8 *buffer,
+                       size_t size,
+                       s32 timeout_ms)
+{
+    s64 deadline = now_ms() + timeout_ms;
+
+    for (;;)
+    {
+        // The queue is always checked before sleeping, a write happening
+        // after this check leaves the eventfd readable so no wakeup is lost.
+        size_t r = queue_read(queue, buffer, size);
+
+        if (r != 0 || queue == NULL || size == 0)
+        {
+            return r;
+        }
+
+        s32 wait = -1;
 
-    return i;
+        if (timeout_ms >= 0)
+        {
+            s64 remaining = deadline - now_ms();
+            wait = remaining > 0 ? (s32)remaining : 0;
+        }
+
+        struct pollfd pfd = { .fd = event_fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, wait) == 0)
+        {
+            // Timeout, check the queue one last time
+            return queue_read(queue, buffer, size);
+        }
+
+        eventfd_t value;
+        eventfd_read(event_fd, &value);
+    }
 }
 
 u32 queue_empty(queue_t *queue)
@@ -93,7 +200,10 @@ u32 queue_empty(queue_t *queue)
         return 0;
     }
 
-    return queue->is_full != 1 && queue->front == queue->rear;
+    size_t front = atomic_load_explicit(&queue->front, memory_order_acquire);
+    size_t rear = atomic_load_explicit(&queue->rear, memory_order_acquire);
+
+    return front == rear;
 }
 
 void queue_destroy(queue_t *queue)
@@ -0,0 +1,749 @@
+#include <blackhv/pixel.h>
+#include <blackhv/recorder.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Shorter runs of a color are cheaper to copy than to fill
+#define FILL_MIN 4
+
+struct pending_range
+{
+    u32 first_row;
+    u32 nb_rows;
+};
+
+/**
+ * Rows copied from the guest by the screen thread, waiting to be encoded
+ */
+struct pending_frame
+{
+    struct pending_frame *next;
+    u64 timestamp_us;
+    u32 width;
+    u32 height;
+    u32 bpp;
+    u32 palette[256];
+
+    struct pending_range *ranges;
+    u32 nb_ranges;
+    u8 *rows; // Packed, width pixels each
+    u64 size;
+    u64 capacity;
+};
+
+struct recorder
+{
+    int fd;
+    u64 start_us;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pending_frame *head;
+    struct pending_frame *tail;
+    u64 pending_bytes;
+    u32 stop;
+    struct recorder_stats stats;
+
+    // Frame being copied by the screen thread
+    struct pending_frame *frame;
+    const u8 *source;
+    u32 source_pitch;
+    u32 need_full; // The previous frame is missing from the recording
+
+    // Encoder state, owned by the recorder thread
+    u32 width;
+    u32 height;
+    u32 *previous;
+    u32 *row;
+    u32 *ops;
+    u64 nb_ops;
+    u64 skip; // Unchanged pixels not covered by an op yet
+};
+
+struct recording
+{
+    int fd;
+    u32 width;
+    u32 height;
+    u32 *pixels;
+    u32 *ops;
+    u32 ops_capacity;
+};
+
+static u64 now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static u32 bytes_per_pixel(u32 bpp)
+{
+    return (bpp + 7) / 8;
+}
+
+static s32 write_all(int fd, const void *buffer, u64 size)
+{
+    const u8 *data = buffer;
+
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+
+        if (written <= 0)
+        {
+            return 0;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return 1;
+}
+
+static s32 read_all(int fd, void *buffer, u64 size)
+{
+    u8 *data = buffer;
+
+    while (size > 0)
+    {
+        ssize_t nb_read = read(fd, data, size);
+
+        if (nb_read <= 0)
+        {
+            return 0;
+        }
+
+        data += nb_read;
+        size -= nb_read;
+    }
+
+    return 1;
+}
+
+static void free_frame(struct pending_frame *frame)
+{
+    if (frame == NULL)
+    {
+        return;
+    }
+
+    free(frame->ranges);
+    free(frame->rows);
+    free(frame);
+}
+
+/* Encoder, on the recorder thread */
+
+static void emit(recorder_t *recorder, u32 op, u32 count)
+{
+    recorder->ops[recorder->nb_ops++] = op << RECORDER_OP_SHIFT | count;
+}
+
+static void flush_skip(recorder_t *recorder)
+{
+    while (recorder->skip > 0)
+    {
+        u32 count = recorder->skip < RECORDER_COUNT_MASK ? recorder->skip
+                                                         : RECORDER_COUNT_MASK;
+
+        emit(recorder, RECORDER_OP_SKIP, count);
+        recorder->skip -= count;
+    }
+}
+
+static u32 fill_length(const u32 *row, u32 i, u32 width)
+{
+    u32 j = i + 1;
+
+    while (j < width && row[j] == row[i])
+    {
+        ++j;
+    }
+
+    return j - i;
+}
+
+/**
+ * Encode a converted row against the same row of the previous frame
+ */
+static void encode_row(recorder_t *recorder, const u32 *row, const u32 *old)
+{
+    u32 width = recorder->width;
+    u32 i = 0;
+
+    while (i < width)
+    {
+        if (row[i] == old[i])
+        {
+            recorder->skip += 1;
+            ++i;
+            continue;
+        }
+
+        flush_skip(recorder);
+
+        u32 length = fill_length(row, i, width);
+
+        if (length >= FILL_MIN)
+        {
+            emit(recorder, RECORDER_OP_FILL, length);
+            recorder->ops[recorder->nb_ops++] = row[i];
+            i += length;
+            continue;
+        }
+
+        // Literal pixels until an unchanged one or a long run
+        u32 start = i;
+
+        while (i < width && row[i] != old[i]
+               && fill_length(row, i, width) < FILL_MIN)
+        {
+            ++i;
+        }
+
+        emit(recorder, RECORDER_OP_COPY, i - start);
+        memcpy(recorder->ops + recorder->nb_ops,
+               row + start,
+               (i - start) * sizeof(u32));
+        recorder->nb_ops += i - start;
+    }
+}
+
+/**
+ * Follow a new frame size, the delta starts again from a black frame
+ *
+ * @return 1 on success, 0 on failure
+ */
+static s32 resize_encoder(recorder_t *recorder, u32 width, u32 height)
+{
+    u64 nb_pixels = (u64)width * height;
+
+    free(recorder->previous);
+    free(recorder->row);
+    free(recorder->ops);
+
+    // At worst a row alternates single unchanged and changed pixels
+    recorder->previous = calloc(nb_pixels, sizeof(u32));
+    recorder->row = malloc(width * sizeof(u32));
+    recorder->ops = malloc((2 * nb_pixels + 2 * height + 2) * sizeof(u32));
+    recorder->width = width;
+    recorder->height = height;
+
+    return recorder->previous != NULL && recorder->row != NULL
+        && recorder->ops != NULL;
+}
+
+static void encode_frame(recorder_t *recorder, struct pending_frame *frame)
+{
+    u32 resized =
+        frame->width != recorder->width || frame->height != recorder->height;
+
+    if (resized && !resize_encoder(recorder, frame->width, frame->height))
+    {
+        recorder->width = 0;
+        return;
+    }
+
+    u32 row_bytes = frame->width * bytes_per_pixel(frame->bpp);
+    const u8 *rows = frame->rows;
+    u64 position = 0; // Next pixel to describe
+
+    recorder->nb_ops = 0;
+    recorder->skip = 0;
+
+    for (u32 r = 0; r < frame->nb_ranges; ++r)
+    {
+        struct pending_range *range = &frame->ranges[r];
+
+        for (u32 y = range->first_row; y < range->first_row + range->nb_rows;
+             ++y)
+        {
+            u32 *old = recorder->previous + (u64)y * frame->width;
+
+            pixel_convert(
+                recorder->row, rows, frame->width, frame->bpp, frame->palette);
+            recorder->skip += (u64)y * frame->width - position;
+            encode_row(recorder, recorder->row, old);
+            memcpy(old, recorder->row, frame->width * sizeof(u32));
+
+            position = (u64)(y + 1) * frame->width;
+            rows += row_bytes;
+        }
+    }
+
+    // The guest rewrote the same pixels, a new size is still recorded
+    if (recorder->nb_ops == 0 && !resized)
+    {
+        return;
+    }
+
+    struct recorder_frame header = { .timestamp_us = frame->timestamp_us,
+                                     .width = frame->width,
+                                     .height = frame->height,
+                                     .size = recorder->nb_ops * sizeof(u32) };
+
+    if (!write_all(recorder->fd, &header, sizeof(header))
+        || !write_all(recorder->fd, recorder->ops, header.size))
+    {
+        fprintf(stderr, "Failed to write a recorded frame\n");
+        return;
+    }
+
+    pthread_mutex_lock(&recorder->lock);
+    recorder->stats.frames += 1;
+    recorder->stats.bytes += sizeof(header) + header.size;
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+static void *recorder_thread(void *arg)
+{
+    recorder_t *recorder = arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&recorder->lock);
+
+        while (recorder->head == NULL && !recorder->stop)
+        {
+            pthread_cond_wait(&recorder->cond, &recorder->lock);
+        }
+
+        // The queued frames are written before stopping
+        struct pending_frame *frame = recorder->head;
+
+        if (frame == NULL)
+        {
+            pthread_mutex_unlock(&recorder->lock);
+            return NULL;
+        }
+
+        recorder->head = frame->next;
+
+        if (recorder->head == NULL)
+        {
+            recorder->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&recorder->lock);
+
+        encode_frame(recorder, frame);
+
+        pthread_mutex_lock(&recorder->lock);
+        recorder->pending_bytes -= frame->size;
+        pthread_mutex_unlock(&recorder->lock);
+
+        free_frame(frame);
+    }
+}
+
+recorder_t *recorder_new(const char *path)
+{
+    recorder_t *recorder = calloc(1, sizeof(recorder_t));
+
+    if (recorder == NULL)
+    {
+        return NULL;
+    }
+
+    recorder->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    struct recorder_header header = { .magic = RECORDER_MAGIC,
+                                      .version = RECORDER_VERSION };
+
+    if (recorder->fd < 0 || !write_all(recorder->fd, &header, sizeof(header)))
+    {
+        fprintf(stderr, "Failed to create the recording %s\n", path);
+
+        if (recorder->fd >= 0)
+        {
+            close(recorder->fd);
+        }
+
+        free(recorder);
+        return NULL;
+    }
+
+    pthread_mutex_init(&recorder->lock, NULL);
+    pthread_cond_init(&recorder->cond, NULL);
+    recorder->start_us = now_us();
+    recorder->need_full = 1;
+
+    if (pthread_create(&recorder->thread, NULL, recorder_thread, recorder)
+        != 0)
+    {
+        pthread_cond_destroy(&recorder->cond);
+        pthread_mutex_destroy(&recorder->lock);
+        close(recorder->fd);
+        free(recorder);
+        return NULL;
+    }
+
+    return recorder;
+}
+
+void recorder_destroy(recorder_t *recorder)
+{
+    if (recorder == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&recorder->lock);
+    recorder->stop = 1;
+    pthread_cond_signal(&recorder->cond);
+    pthread_mutex_unlock(&recorder->lock);
+    pthread_join(recorder->thread, NULL);
+
+    free_frame(recorder->frame);
+    free(recorder->previous);
+    free(recorder->row);
+    free(recorder->ops);
+    pthread_cond_destroy(&recorder->cond);
+    pthread_mutex_destroy(&recorder->lock);
+    close(recorder->fd);
+    free(recorder);
+}
+
+/* Producer, on the screen thread */
+
+void recorder_begin_frame(recorder_t *recorder,
+                          const struct vbe_mode *mode,
+                          const u8 *frame,
+                          const u32 *palette)
+{
+    pthread_mutex_lock(&recorder->lock);
+    u32 late = recorder->pending_bytes > RECORDER_MAX_PENDING;
+
+    if (late)
+    {
+        recorder->stats.dropped += 1;
+    }
+
+    pthread_mutex_unlock(&recorder->lock);
+
+    // The next recorded frame has to be complete
+    if (late)
+    {
+        recorder->need_full = 1;
+        return;
+    }
+
+    struct pending_frame *pending = calloc(1, sizeof(struct pending_frame));
+
+    if (pending == NULL)
+    {
+        recorder->need_full = 1;
+        return;
+    }
+
+    pending->timestamp_us = now_us() - recorder->start_us;
+    pending->width = mode->width;
+    pending->height = mode->height;
+    pending->bpp = mode->bpp;
+
+    if (mode->bpp == 8)
+    {
+        memcpy(pending->palette, palette, sizeof(pending->palette));
+    }
+
+    recorder->frame = pending;
+    recorder->source = frame;
+    recorder->source_pitch = mode->pitch;
+
+    if (recorder->need_full)
+    {
+        recorder_add_rows(recorder, 0, mode->height);
+        recorder->need_full = 0;
+    }
+}
+
+/**
+ * @return 1 on success, 0 on failure
+ */
+static s32 grow_frame(struct pending_frame *frame, u64 size)
+{
+    if (frame->size + size <= frame->capacity)
+    {
+        return 1;
+    }
+
+    u64 capacity = frame->capacity ? frame->capacity : size;
+
+    while (capacity < frame->size + size)
+    {
+        capacity *= 2;
+    }
+
+    u8 *rows = realloc(frame->rows, capacity);
+
+    if (rows == NULL)
+    {
+        return 0;
+    }
+
+    frame->rows = rows;
+    frame->capacity = capacity;
+    return 1;
+}
+
+void recorder_add_rows(recorder_t *recorder, u32 first_row, u32 nb_rows)
+{
+    struct pending_frame *frame = recorder->frame;
+
+    if (frame == NULL || first_row >= frame->height)
+    {
+        return;
+    }
+
+    if (nb_rows > frame->height - first_row)
+    {
+        nb_rows = frame->height - first_row;
+    }
+
+    // Runs of dirty pages may share a row, and a complete frame has all of
+    // them already
+    struct pending_range *last =
+        frame->nb_ranges > 0 ? &frame->ranges[frame->nb_ranges - 1] : NULL;
+    u32 last_end = last != NULL ? last->first_row + last->nb_rows : 0;
+
+    if (last != NULL && first_row < last_end)
+    {
+        if (first_row + nb_rows <= last_end)
+        {
+            return;
+        }
+
+        nb_rows -= last_end - first_row;
+        first_row = last_end;
+    }
+
+    u32 row_bytes = frame->width * bytes_per_pixel(frame->bpp);
+
+    if (!grow_frame(frame, (u64)nb_rows * row_bytes))
+    {
+        free_frame(frame);
+        recorder->frame = NULL;
+        recorder->need_full = 1;
+        return;
+    }
+
+    if (last != NULL && first_row == last_end)
+    {
+        last->nb_rows += nb_rows;
+    }
+    else
+    {
+        struct pending_range *ranges =
+            realloc(frame->ranges,
+                    (frame->nb_ranges + 1) * sizeof(struct pending_range));
+
+        if (ranges == NULL)
+        {
+            free_frame(frame);
+            recorder->frame = NULL;
+            recorder->need_full = 1;
+            return;
+        }
+
+        frame->ranges = ranges;
+        frame->ranges[frame->nb_ranges].first_row = first_row;
+        frame->ranges[frame->nb_ranges].nb_rows = nb_rows;
+        frame->nb_ranges += 1;
+    }
+
+    for (u32 y = first_row; y < first_row + nb_rows; ++y)
+    {
+        memcpy(frame->rows + frame->size,
+               recorder->source + (u64)y * recorder->source_pitch,
+               row_bytes);
+        frame->size += row_bytes;
+    }
+}
+
+void recorder_end_frame(recorder_t *recorder)
+{
+    struct pending_frame *frame = recorder->frame;
+
+    recorder->frame = NULL;
+
+    if (frame == NULL)
+    {
+        return;
+    }
+
+    if (frame->nb_ranges == 0)
+    {
+        free_frame(frame);
+        return;
+    }
+
+    pthread_mutex_lock(&recorder->lock);
+
+    if (recorder->tail != NULL)
+    {
+        recorder->tail->next = frame;
+    }
+    else
+    {
+        recorder->head = frame;
+    }
+
+    recorder->tail = frame;
+    recorder->pending_bytes += frame->size;
+    pthread_cond_signal(&recorder->cond);
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+void recorder_get_stats(recorder_t *recorder, struct recorder_stats *stats)
+{
+    pthread_mutex_lock(&recorder->lock);
+    *stats = recorder->stats;
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+/* Decoder */
+
+recording_t *recording_open(const char *path)
+{
+    struct recorder_header header;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if (!read_all(fd, &header, sizeof(header)) || header.magic != RECORDER_MAGIC
+        || header.version != RECORDER_VERSION)
+    {
+        fprintf(stderr, "%s is not a valid recording\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    recording_t *recording = calloc(1, sizeof(recording_t));
+
+    if (recording == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    recording->fd = fd;
+    return recording;
+}
+
+void recording_close(recording_t *recording)
+{
+    if (recording == NULL)
+    {
+        return;
+    }
+
+    close(recording->fd);
+    free(recording->pixels);
+    free(recording->ops);
+    free(recording);
+}
+
+/**
+ * @return 1 on success, 0 if the ops do not fit the frame
+ */
+static s32 apply_ops(recording_t *recording, u32 nb_ops)
+{
+    u64 nb_pixels = (u64)recording->width * recording->height;
+    u64 position = 0;
+    u32 i = 0;
+
+    while (i < nb_ops)
+    {
+        u32 op = recording->ops[i] >> RECORDER_OP_SHIFT;
+        u32 count = recording->ops[i] & RECORDER_COUNT_MASK;
+        u32 *pixels = recording->pixels + position;
+
+        i += 1;
+
+        if (position + count > nb_pixels)
+        {
+            return 0;
+        }
+
+        if (op == RECORDER_OP_FILL && i < nb_ops)
+        {
+            for (u32 j = 0; j < count; ++j)
+            {
+                pixels[j] = recording->ops[i];
+            }
+
+            i += 1;
+        }
+        else if (op == RECORDER_OP_COPY && count <= nb_ops - i)
+        {
+            memcpy(pixels, recording->ops + i, count * sizeof(u32));
+            i += count;
+        }
+        else if (op != RECORDER_OP_SKIP)
+        {
+            return 0;
+        }
+
+        position += count;
+    }
+
+    return 1;
+}
+
+const u32 *recording_next(recording_t *recording,
+                          struct recorder_frame *frame)
+{
+    if (!read_all(recording->fd, frame, sizeof(*frame)))
+    {
+        return NULL;
+    }
+
+    if (frame->width != recording->width || frame->height != recording->height)
+    {
+        free(recording->pixels);
+        recording->pixels = calloc((u64)frame->width * frame->height, 4);
+        recording->width = frame->width;
+        recording->height = frame->height;
+
+        if (recording->pixels == NULL)
+        {
+            recording->width = 0;
+            return NULL;
+        }
+    }
+
+    if (frame->size > recording->ops_capacity)
+    {
+        u32 *ops = realloc(recording->ops, frame->size);
+
+        if (ops == NULL)
+        {
+            return NULL;
+        }
+
+        recording->ops = ops;
+        recording->ops_capacity = frame->size;
+    }
+
+    if (!read_all(recording->fd, recording->ops, frame->size)
+        || !apply_ops(recording, frame->size / sizeof(u32)))
+    {
+        fprintf(stderr, "Corrupted recorded frame\n");
+        return NULL;
+    }
+
+    return recording->pixels;
+}
@@ -1,9 +1,24 @@
 #include <SDL2/SDL.h>
-#include <blackhv/framebuffer.h>
 #include <blackhv/memory.h>
+#include <blackhv/pixel.h>
+#include <blackhv/ps2.h>
+#include <blackhv/recorder.h>
 #include <blackhv/types.h>
+#include <blackhv/vbe.h>
+#include <blackhv/vga_text.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+#define VRAM_PAGES (VBE_VRAM_SIZE / PAGE_SIZE)
+
+// Damage is polled less often once the screen has been static for a while
+#define IDLE_FRAMES 30
+#define IDLE_INTERVAL_US 100000
+
+#define TITLE "blackhv"
+#define TITLE_GRABBED "blackhv - Ctrl+Alt+G releases the mouse"
 
 struct screen
 {
@@ -11,36 +26,385 @@ struct screen
     SDL_Renderer *renderer;
     SDL_Texture *texture;
     u64 framebuffer_phys;
+    u8 *vram; // Host mapping of the framebuffer slot
+    vbe_t *vbe;
+    struct vbe_mode mode; // Of the texture
+    u32 generation;
+    u32 palette[256];
+    u64 dirty[VRAM_PAGES / 64];
+    u32 full_update; // The texture content is not valid yet
+    u32 max_fps;
+
+    // VGA text mode, shown until the guest sets a mode or draws into the
+    // framebuffer
+    u32 text_mode;
+    u16 *text_cells;
+    vga_text_t *text;
+    SDL_Texture *text_texture;
+
+    pthread_mutex_t recorder_lock;
+    recorder_t *recorder;
+
+    // Input is forwarded to the PS/2 devices, by the render thread only
+    ps2_t *ps2;
+    u32 buttons; // SDL_BUTTON masks held
+    u32 grabbed; // The mouse is hidden and only moves the guest pointer
+
+    pthread_mutex_t stats_lock;
+    struct screen_stats stats;
 };
 
-static void screen_update(vm_t *vm)
+static u64 now_us(void)
 {
-    if (vm == NULL || vm->screen == NULL)
-        return;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Follow the mode set by the guest: the texture and the window are resized
+ * to it. The texture stays in ARGB8888, the other depths are converted
+ * during the upload.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static u32 screen_set_mode(screen_t *screen)
+{
+    struct vbe_mode mode;
+    u32 generation = vbe_get_mode(screen->vbe, &mode);
+
+    if (screen->texture != NULL && generation == screen->generation)
+    {
+        return 1;
+    }
+
+    // A page flip or a palette change keeps the texture
+    if (screen->texture == NULL || mode.width != screen->mode.width
+        || mode.height != screen->mode.height)
+    {
+        if (screen->texture != NULL)
+        {
+            SDL_DestroyTexture(screen->texture);
+        }
+
+        screen->texture = SDL_CreateTexture(screen->renderer,
+                                            SDL_PIXELFORMAT_ARGB8888,
+                                            SDL_TEXTUREACCESS_STREAMING,
+                                            mode.width,
+                                            mode.height);
+        if (screen->texture == NULL)
+        {
+            printf("SDL ERROR: Could not create texture: %s\n",
+                   SDL_GetError());
+            return 0;
+        }
+
+        SDL_SetWindowSize(screen->window, mode.width, mode.height);
+    }
+
+    if (mode.bpp == 8)
+    {
+        vbe_get_palette(screen->vbe, screen->palette);
+    }
+
+    screen->mode = mode;
+    screen->generation = generation;
+    screen->full_update = 1;
+
+    return 1;
+}
 
+/**
+ * Convert the rows straight from the guest memory into the locked texture
+ */
+static void convert_rows(screen_t *screen, SDL_Rect *rect, u8 *rows)
+{
+    struct vbe_mode *mode = &screen->mode;
     void *pixels;
     int pitch;
 
-    if (SDL_LockTexture(vm->screen->texture, NULL, &pixels, &pitch) < 0)
+    if (SDL_LockTexture(screen->texture, rect, &pixels, &pitch) < 0)
     {
         printf("Couldn't lock texture: %s\n", SDL_GetError());
         return;
     }
 
-    // Read guest framebuffer into SDL texture pixels.
-    memory_read(vm,
-                vm->screen->framebuffer_phys,
-                pixels,
-                FB_WIDTH * FB_HEIGHT * FB_BPP);
-    SDL_UnlockTexture(vm->screen->texture);
+    for (s32 row = 0; row < rect->h; ++row)
+    {
+        pixel_convert((u32 *)((u8 *)pixels + row * pitch),
+                      rows + row * mode->pitch,
+                      mode->width,
+                      mode->bpp,
+                      screen->palette);
+    }
+
+    SDL_UnlockTexture(screen->texture);
+}
+
+/**
+ * Upload the rows [first_row, last_row] of the visible frame, the texture
+ * is the only copy of the guest pixels
+ *
+ * @return number of bytes uploaded
+ */
+static u64 upload_rows(vm_t *vm, u64 first_row, u64 last_row)
+{
+    screen_t *screen = vm->screen;
+    struct vbe_mode *mode = &screen->mode;
+    u8 *rows = screen->vram + mode->offset + first_row * mode->pitch;
+    SDL_Rect rect = { .x = 0,
+                      .y = first_row,
+                      .w = mode->width,
+                      .h = last_row - first_row + 1 };
+
+    if (mode->bpp != 32)
+    {
+        convert_rows(screen, &rect, rows);
+    }
+    else if (SDL_UpdateTexture(screen->texture, &rect, rows, mode->pitch) < 0)
+    {
+        printf("Couldn't update texture: %s\n", SDL_GetError());
+    }
+
+    if (screen->recorder != NULL)
+    {
+        recorder_add_rows(screen->recorder, first_row, rect.h);
+    }
+
+    // The last row stops at the frame width
+    return (rect.h - 1) * mode->pitch + mode->width * ((mode->bpp + 7) / 8);
+}
+
+/**
+ * Upload the visible pages written by the guest since the last update, each
+ * run of dirty pages is a single sub-rectangle of whole rows
+ *
+ * @return number of bytes uploaded, 0 if the texture did not change
+ */
+static u64 upload_damage(vm_t *vm)
+{
+    screen_t *screen = vm->screen;
+    struct vbe_mode *mode = &screen->mode;
+
+    if (!memory_get_dirty_log(vm, screen->framebuffer_phys, screen->dirty))
+    {
+        // Without dirty logging the whole framebuffer is uploaded every time
+        screen->full_update = 1;
+    }
+
+    if (screen->full_update)
+    {
+        screen->full_update = 0;
+        return upload_rows(vm, 0, mode->height - 1);
+    }
+
+    u64 uploaded = 0;
+    u64 start = mode->offset;
+    u64 end = start + (u64)mode->pitch * mode->height;
+
+    for (u64 page = start / PAGE_SIZE; page * PAGE_SIZE < end;)
+    {
+        if (!(screen->dirty[page / 64] & (1ULL << (page % 64))))
+        {
+            ++page;
+            continue;
+        }
+
+        u64 first = page * PAGE_SIZE;
+
+        while (page * PAGE_SIZE < end
+               && (screen->dirty[page / 64] & (1ULL << (page % 64))))
+        {
+            ++page;
+        }
+
+        u64 last = page * PAGE_SIZE < end ? page * PAGE_SIZE : end;
+
+        first = first > start ? first : start;
+
+        u64 first_row = (first - start) / mode->pitch;
+        u64 last_row = (last - 1 - start) / mode->pitch;
+
+        uploaded += upload_rows(vm, first_row, last_row);
+    }
+
+    return uploaded;
+}
+
+/**
+ * Leave the text mode for good once the guest sets a VBE mode or writes into
+ * the default framebuffer. The framebuffer is then uploaded completely.
+ *
+ * @return 1 if the screen is still in text mode, 0 otherwise
+ */
+static u32 check_text_mode(vm_t *vm)
+{
+    screen_t *screen = vm->screen;
+    struct vbe_mode *mode = &screen->mode;
+    struct vbe_mode current;
+    u32 written = 0;
+
+    if (!screen->text_mode)
+    {
+        return 0;
+    }
+
+    if (memory_get_dirty_log(vm, screen->framebuffer_phys, screen->dirty))
+    {
+        u64 end = mode->offset + (u64)mode->pitch * mode->height;
+
+        for (u64 page = mode->offset / PAGE_SIZE; page * PAGE_SIZE < end;
+             ++page)
+        {
+            written |= (screen->dirty[page / 64] >> (page % 64)) & 1;
+        }
+    }
+
+    if (!written && vbe_get_mode(screen->vbe, &current) == screen->generation)
+    {
+        return 1;
+    }
+
+    screen->text_mode = 0;
+    screen->full_update = 1;
+    SDL_DestroyTexture(screen->text_texture);
+    screen->text_texture = NULL;
+    SDL_SetWindowSize(screen->window, mode->width, mode->height);
+
+    return 0;
+}
+
+/**
+ * Render the text cells changed since the last update and upload their rows
+ *
+ * @return number of bytes uploaded, 0 if the texture did not change
+ */
+static u64 upload_text(screen_t *screen)
+{
+    u32 first_row;
+    u32 last_row;
+
+    if (vga_text_render(screen->text, screen->text_cells, &first_row, &last_row)
+        == 0)
+    {
+        return 0;
+    }
+
+    const u32 *frame = vga_text_get_frame(screen->text);
+    u32 pitch = VGA_TEXT_WIDTH * sizeof(u32);
+    SDL_Rect rect = { .x = 0,
+                      .y = first_row,
+                      .w = VGA_TEXT_WIDTH,
+                      .h = last_row - first_row + 1 };
+
+    if (SDL_UpdateTexture(screen->text_texture,
+                          &rect,
+                          frame + first_row * VGA_TEXT_WIDTH,
+                          pitch)
+        < 0)
+    {
+        printf("Couldn't update texture: %s\n", SDL_GetError());
+    }
+
+    if (screen->recorder != NULL)
+    {
+        struct vbe_mode mode = { .width = VGA_TEXT_WIDTH,
+                                 .height = VGA_TEXT_HEIGHT,
+                                 .bpp = 32,
+                                 .pitch = pitch };
+
+        recorder_begin_frame(screen->recorder, &mode, (u8 *)frame, NULL);
+        recorder_add_rows(screen->recorder, first_row, rect.h);
+        recorder_end_frame(screen->recorder);
+    }
+
+    return (u64)rect.h * pitch;
+}
+
+/**
+ * The uploaded rows are also the damage of the recorded frame
+ *
+ * @return number of bytes uploaded, 0 if the texture did not change
+ */
+static u64 screen_update(vm_t *vm)
+{
+    if (vm == NULL || vm->screen == NULL)
+        return 0;
+
+    screen_t *screen = vm->screen;
+
+    if (check_text_mode(vm))
+    {
+        pthread_mutex_lock(&screen->recorder_lock);
+        u64 uploaded = upload_text(screen);
+        pthread_mutex_unlock(&screen->recorder_lock);
+
+        return uploaded;
+    }
+
+    if (!screen_set_mode(screen))
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&screen->recorder_lock);
+
+    if (screen->recorder != NULL)
+    {
+        recorder_begin_frame(screen->recorder,
+                             &screen->mode,
+                             screen->vram + screen->mode.offset,
+                             screen->palette);
+    }
+
+    u64 uploaded = upload_damage(vm);
+
+    if (screen->recorder != NULL)
+    {
+        recorder_end_frame(screen->recorder);
+    }
+
+    pthread_mutex_unlock(&screen->recorder_lock);
+
+    return uploaded;
+}
+
+/**
+ * Like a PC, start in text mode when the guest has memory at 0xB8000. The
+ * screen works without it if it cannot be set up.
+ */
+static void screen_init_text(vm_t *vm, screen_t *screen)
+{
+    screen->text_cells = memory_get_ptr(vm, VGA_TEXT_ADDRESS);
+
+    if (screen->text_cells == NULL)
+    {
+        return;
+    }
+
+    screen->text = vga_text_new();
+    screen->text_texture = SDL_CreateTexture(screen->renderer,
+                                             SDL_PIXELFORMAT_ARGB8888,
+                                             SDL_TEXTUREACCESS_STREAMING,
+                                             VGA_TEXT_WIDTH,
+                                             VGA_TEXT_HEIGHT);
+
+    if (screen->text == NULL || screen->text_texture == NULL)
+    {
+        fprintf(stderr, "Failed to set up the VGA text mode\n");
+        return;
+    }
+
+    SDL_SetWindowSize(screen->window, VGA_TEXT_WIDTH, VGA_TEXT_HEIGHT);
+    screen->text_mode = 1;
 }
 
 s64 screen_init(vm_t *vm, u64 framebuffer_phys)
 {
-    if (memory_alloc(vm,
-                     framebuffer_phys,
-                     align_up(FB_WIDTH * FB_HEIGHT * FB_BPP),
-                     MEMORY_FRAMEBUFFER)
+    // Sized for the largest mode, pages are only allocated once written
+    if (memory_alloc(vm, framebuffer_phys, VBE_VRAM_SIZE, MEMORY_FRAMEBUFFER)
         == 0)
     {
         fprintf(stderr, "Failed to allocate framebuffer memory.\n");
@@ -49,17 +413,35 @@ s64 screen_init(vm_t *vm, u64 framebuffer_phys)
 
     SDL_Init(SDL_INIT_VIDEO);
 
-    screen_t *screen = malloc(sizeof(screen_t));
+    screen_t *screen = calloc(1, sizeof(screen_t));
+
+    if (screen == NULL)
+    {
+        return 0;
+    }
 
-    screen->window = SDL_CreateWindow("blackhv",
+    screen->vram = memory_get_ptr(vm, framebuffer_phys);
+    screen->vbe = vbe_new(vm, framebuffer_phys);
+
+    if (screen->vbe == NULL)
+    {
+        free(screen);
+        return 0;
+    }
+
+    struct vbe_mode mode;
+    vbe_get_mode(screen->vbe, &mode);
+
+    screen->window = SDL_CreateWindow(TITLE,
                                       SDL_WINDOWPOS_CENTERED,
                                       SDL_WINDOWPOS_CENTERED,
-                                      FB_WIDTH,
-                                      FB_HEIGHT,
+                                      mode.width,
+                                      mode.height,
                                       0);
     if (screen->window == NULL)
     {
         printf("SDL ERROR: Creating window\n");
+        vbe_destroy(screen->vbe);
         free(screen);
         return 0;
     }
@@ -71,29 +453,195 @@ s64 screen_init(vm_t *vm, u64 framebuffer_phys)
     {
         printf("SDL ERROR: creating renderer: %s\n", SDL_GetError());
         SDL_DestroyWindow(screen->window);
+        vbe_destroy(screen->vbe);
         free(screen);
         return 0;
     }
 
-    screen->texture = SDL_CreateTexture(screen->renderer,
-                                        SDL_PIXELFORMAT_ARGB8888,
-                                        SDL_TEXTUREACCESS_STREAMING,
-                                        FB_WIDTH,
-                                        FB_HEIGHT);
-    if (screen->texture == NULL)
+    if (!screen_set_mode(screen))
     {
-        printf("SDL ERROR: Could not create texture: %s\n", SDL_GetError());
         SDL_DestroyRenderer(screen->renderer);
         SDL_DestroyWindow(screen->window);
+        vbe_destroy(screen->vbe);
         free(screen);
         return 0;
     }
 
     screen->framebuffer_phys = framebuffer_phys;
+    screen->max_fps = SCREEN_MAX_FPS;
+    screen_init_text(vm, screen);
+    pthread_mutex_init(&screen->stats_lock, NULL);
+    pthread_mutex_init(&screen->recorder_lock, NULL);
     vm->screen = screen;
     return 1;
 }
 
+/**
+ * Time between two damage checks, longer once the screen is static
+ */
+static u64 frame_interval(screen_t *screen, u32 idle_frames)
+{
+    u32 max_fps = __atomic_load_n(&screen->max_fps, __ATOMIC_RELAXED);
+    u64 interval = 1000000 / max_fps;
+
+    if (idle_frames >= IDLE_FRAMES && interval < IDLE_INTERVAL_US)
+    {
+        return IDLE_INTERVAL_US;
+    }
+
+    return interval;
+}
+
+static void record_frame(screen_t *screen,
+                         u64 uploaded,
+                         u32 presented,
+                         u64 frame_us)
+{
+    struct screen_stats *stats = &screen->stats;
+
+    pthread_mutex_lock(&screen->stats_lock);
+
+    stats->polls += 1;
+    stats->uploaded_bytes += uploaded;
+
+    if (presented)
+    {
+        stats->frames += 1;
+        stats->last_frame_us = frame_us;
+        stats->total_frame_us += frame_us;
+
+        if (frame_us > stats->max_frame_us)
+        {
+            stats->max_frame_us = frame_us;
+        }
+    }
+
+    pthread_mutex_unlock(&screen->stats_lock);
+}
+
+static u32 ps2_buttons(u32 mask)
+{
+    u32 buttons = 0;
+
+    buttons |= (mask & SDL_BUTTON_LMASK) != 0 ? PS2_BUTTON_LEFT : 0;
+    buttons |= (mask & SDL_BUTTON_RMASK) != 0 ? PS2_BUTTON_RIGHT : 0;
+    buttons |= (mask & SDL_BUTTON_MMASK) != 0 ? PS2_BUTTON_MIDDLE : 0;
+
+    return buttons;
+}
+
+/**
+ * Grab the mouse or release it. The guest only gets relative moves, the
+ * host cursor would not stay on top of the guest pointer.
+ */
+static void grab_mouse(screen_t *screen, u32 grab)
+{
+    SDL_SetRelativeMouseMode(grab ? SDL_TRUE : SDL_FALSE);
+    SDL_SetWindowTitle(screen->window, grab ? TITLE_GRABBED : TITLE);
+    screen->grabbed = grab;
+    screen->buttons = 0;
+}
+
+static u32 is_release_key(SDL_KeyboardEvent *key)
+{
+    return (key->keysym.mod & KMOD_CTRL) != 0
+           && (key->keysym.mod & KMOD_ALT) != 0
+           && key->keysym.scancode == SDL_SCANCODE_G;
+}
+
+/**
+ * Queue a keyboard or mouse event for the guest, it is delivered with the
+ * whole batch of events by ps2_flush. The mouse is grabbed by a click in the
+ * window, its events are only forwarded while grabbed.
+ */
+static void forward_input(screen_t *screen, SDL_Event *e)
+{
+    switch (e->type)
+    {
+    case SDL_KEYDOWN:
+        if (screen->grabbed && is_release_key(&e->key))
+        {
+            grab_mouse(screen, 0);
+            break;
+        }
+        // fallthrough
+    case SDL_KEYUP:
+        // SDL scan codes are USB HID usages, repeats are typematic presses
+        ps2_key(screen->ps2, e->key.keysym.scancode, e->type == SDL_KEYDOWN);
+        break;
+    case SDL_MOUSEMOTION:
+        if (screen->grabbed)
+        {
+            screen->buttons = e->motion.state;
+            ps2_mouse(screen->ps2,
+                      e->motion.xrel,
+                      e->motion.yrel,
+                      0,
+                      ps2_buttons(screen->buttons));
+        }
+        break;
+    case SDL_MOUSEBUTTONDOWN:
+        if (!screen->grabbed)
+        {
+            // The grabbing click is not sent to the guest
+            grab_mouse(screen, 1);
+            break;
+        }
+
+        screen->buttons |= SDL_BUTTON(e->button.button);
+        ps2_mouse(screen->ps2, 0, 0, 0, ps2_buttons(screen->buttons));
+        break;
+    case SDL_MOUSEBUTTONUP:
+        if (screen->grabbed)
+        {
+            screen->buttons &= ~SDL_BUTTON(e->button.button);
+            ps2_mouse(screen->ps2, 0, 0, 0, ps2_buttons(screen->buttons));
+        }
+        break;
+    case SDL_MOUSEWHEEL:
+        if (screen->grabbed)
+        {
+            ps2_mouse(
+                screen->ps2, 0, 0, e->wheel.y, ps2_buttons(screen->buttons));
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Handle a window or input event
+ *
+ * @return 0 when the window is closed, 1 otherwise
+ */
+static u32 handle_event(screen_t *screen,
+                        SDL_Event *e,
+                        u32 *redraw,
+                        u32 *idle_frames)
+{
+    if (e->type == SDL_QUIT)
+    {
+        return 0;
+    }
+
+    // The window content may have been lost
+    if (e->type == SDL_WINDOWEVENT)
+    {
+        *redraw = 1;
+    }
+
+    if (screen->ps2 != NULL)
+    {
+        forward_input(screen, e);
+    }
+
+    // Input usually makes the guest draw, damage is polled at full rate again
+    *idle_frames = 0;
+
+    return 1;
+}
+
 void *screen_run(void *params)
 {
     vm_t *vm = (vm_t *)params;
@@ -102,30 +650,114 @@ void *screen_run(void *params)
         return NULL;
     }
 
+    screen_t *screen = vm->screen;
     SDL_Event e;
+    u32 redraw = 1;
+    u32 idle_frames = 0;
+    u64 last_poll = now_us();
+
     while (1)
     {
-        while (SDL_PollEvent(&e))
+        u64 now = now_us();
+        u64 next_poll = last_poll + frame_interval(screen, idle_frames);
+
+        // Sleep until the next damage check or an event
+        if (now < next_poll)
         {
-            if (e.type == SDL_QUIT)
+            if (SDL_WaitEventTimeout(&e, (next_poll - now + 999) / 1000))
             {
-                return NULL;
+                do
+                {
+                    if (!handle_event(screen, &e, &redraw, &idle_frames))
+                    {
+                        return NULL;
+                    }
+                } while (SDL_PollEvent(&e));
+
+                // The guest is interrupted once for the whole batch
+                ps2_flush(screen->ps2);
             }
+
+            continue;
         }
 
-        // Calculates to 60 fps
-        SDL_Delay(1000 / 60);
+        last_poll = now;
+
+        u64 uploaded = screen_update(vm);
+        u32 present = uploaded > 0 || redraw;
+
+        // A static screen costs neither an upload nor a present
+        if (present)
+        {
+            redraw = 0;
+            idle_frames = 0;
+
+            SDL_RenderClear(screen->renderer);
+            SDL_RenderCopy(screen->renderer,
+                           screen->text_mode ? screen->text_texture
+                                             : screen->texture,
+                           NULL,
+                           NULL);
+            SDL_RenderPresent(screen->renderer);
 
-        screen_update(vm);
+            // The guest may now draw into the buffer it flipped from
+            vbe_set_presented(screen->vbe, screen->generation);
+        }
+        else if (idle_frames < IDLE_FRAMES)
+        {
+            idle_frames += 1;
+        }
 
-        SDL_RenderClear(vm->screen->renderer);
-        SDL_RenderCopy(vm->screen->renderer, vm->screen->texture, NULL, NULL);
-        SDL_RenderPresent(vm->screen->renderer);
+        record_frame(screen, uploaded, present, now_us() - now);
     }
 
     return NULL;
 }
 
+void screen_set_max_fps(vm_t *vm, u32 fps)
+{
+    if (vm == NULL || vm->screen == NULL || fps == 0)
+    {
+        return;
+    }
+
+    __atomic_store_n(&vm->screen->max_fps, fps, __ATOMIC_RELAXED);
+}
+
+void screen_get_stats(vm_t *vm, struct screen_stats *stats)
+{
+    if (vm == NULL || vm->screen == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&vm->screen->stats_lock);
+    *stats = vm->screen->stats;
+    pthread_mutex_unlock(&vm->screen->stats_lock);
+}
+
+void screen_set_recorder(vm_t *vm, recorder_t *recorder)
+{
+    if (vm == NULL || vm->screen == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&vm->screen->recorder_lock);
+    vm->screen->recorder = recorder;
+    pthread_mutex_unlock(&vm->screen->recorder_lock);
+}
+
+void screen_set_ps2(vm_t *vm, ps2_t *ps2)
+{
+    if (vm == NULL || vm->screen == NULL)
+    {
+        return;
+    }
+
+    vm->screen->ps2 = ps2;
+}
+
 void screen_uninit(vm_t *vm)
 {
     if (vm == NULL || vm->screen == NULL)
@@ -133,8 +765,18 @@ void screen_uninit(vm_t *vm)
         return;
     }
 
+    if (vm->screen->text_texture != NULL)
+    {
+        SDL_DestroyTexture(vm->screen->text_texture);
+    }
+
+    vga_text_destroy(vm->screen->text);
     SDL_DestroyTexture(vm->screen->texture);
     SDL_DestroyRenderer(vm->screen->renderer);
     SDL_DestroyWindow(vm->screen->window);
     SDL_Quit();
+
+    vbe_destroy(vm->screen->vbe);
+    pthread_mutex_destroy(&vm->screen->stats_lock);
+    pthread_mutex_destroy(&vm->screen->recorder_lock);
 }
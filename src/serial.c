@@ -1,7 +1,10 @@
 #include <blackhv/io.h>
 #include <blackhv/serial.h>
+#include <blackhv/vm.h>
 #include <err.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 // Registers
 #define THR 0x0 // Transmitter Holding Buffer, write
@@ -17,12 +20,197 @@
 #define MSR 0x6 // Modem status register, read
 #define SR 0x7 // Scratch Register, read and write
 
+/* IER bits */
+#define IER_RDA (1 << 0) // Received data available
+#define IER_THRE (1 << 1) // Transmitter holding register empty
+#define IER_RLS (1 << 2) // Receiver line status
+#define IER_MSI (1 << 3) // Modem status
+
+/* IIR values */
+#define IIR_NO_INT 0x01
+#define IIR_THRE 0x02
+#define IIR_RDA 0x04
+#define IIR_CTI 0x0C // Character timeout
+#define IIR_FIFO_ENABLED 0xC0
+
+/* FCR bits */
+#define FCR_ENABLE (1 << 0)
+#define FCR_CLEAR_RX (1 << 1)
+#define FCR_CLEAR_TX (1 << 2)
+#define FCR_TRIGGER(FCR) (((FCR) >> 6) & 0x3)
+
+/* LCR bits */
+#define LCR_DLAB (1 << 7)
+
+/* MCR bits */
+#define MCR_DTR (1 << 0)
+#define MCR_RTS (1 << 1)
+#define MCR_OUT1 (1 << 2)
+#define MCR_OUT2 (1 << 3)
+#define MCR_LOOP (1 << 4)
+
+/* LSR bits */
+#define LSR_DR (1 << 0) // Data ready
+#define LSR_THRE (1 << 5) // THR empty
+#define LSR_TEMT (1 << 6) // Transmitter empty
+
+/* MSR bits */
+#define MSR_CTS (1 << 4)
+#define MSR_DSR (1 << 5)
+#define MSR_RI (1 << 6)
+#define MSR_DCD (1 << 7)
+
+static const u8 rx_trigger_levels[] = { 1, 4, 8, 14 };
+
 static void write_data(serial_t *serial, u8 data)
 {
-    queue_write(serial->guest_queue, &data, 1);
+    if (queue_write(serial->guest_queue, &data, 1) == 1)
+    {
+        // Wake up host consumers waiting for data
+        eventfd_write(serial->event_fd, 1);
+    }
+}
+
+static u8 fifo_size(serial_t *serial)
+{
+    return (serial->fcr & FCR_ENABLE) != 0 ? SERIAL_FIFO_SIZE : 1;
+}
+
+static void rx_fifo_push(serial_t *serial, u8 data)
+{
+    if (serial->rx_count >= fifo_size(serial))
+    {
+        // Overrun, the character is lost
+        return;
+    }
+
+    u8 index = (serial->rx_head + serial->rx_count) % SERIAL_FIFO_SIZE;
+    serial->rx_fifo[index] = data;
+    serial->rx_count += 1;
+}
+
+static u8 rx_fifo_pop(serial_t *serial)
+{
+    if (serial->rx_count == 0)
+    {
+        return 0;
+    }
+
+    u8 data = serial->rx_fifo[serial->rx_head];
+    serial->rx_head = (serial->rx_head + 1) % SERIAL_FIFO_SIZE;
+    serial->rx_count -= 1;
+
+    return data;
+}
+
+/**
+ * Move the data written by the host into the receiver FIFO. The host queue
+ * acts as the wire, the FIFO only holds what the UART has received.
+ */
+static void rx_fifo_fill(serial_t *serial)
+{
+    if ((serial->mcr & MCR_LOOP) != 0)
+    {
+        // In loopback mode the receiver is disconnected from the wire
+        return;
+    }
+
+    while (serial->rx_count < fifo_size(serial))
+    {
+        u8 data = 0;
+
+        if (queue_read(serial->host_queue, &data, 1) == 0)
+        {
+            return;
+        }
+
+        rx_fifo_push(serial, data);
+    }
+}
+
+static u8 get_iir(serial_t *serial)
+{
+    u8 iir = IIR_NO_INT;
+    u8 trigger = 1;
+
+    if ((serial->fcr & FCR_ENABLE) != 0)
+    {
+        trigger = rx_trigger_levels[FCR_TRIGGER(serial->fcr)];
+    }
+
+    if ((serial->ier & IER_RDA) != 0 && serial->rx_count >= trigger)
+    {
+        iir = IIR_RDA;
+    }
+    else if ((serial->ier & IER_RDA) != 0 && serial->rx_count > 0)
+    {
+        // Transmission is instantaneous so the character timeout expires as
+        // soon as the host stops writing.
+        iir = IIR_CTI;
+    }
+    else if ((serial->ier & IER_THRE) != 0 && serial->thr_interrupt)
+    {
+        iir = IIR_THRE;
+    }
+
+    if ((serial->fcr & FCR_ENABLE) != 0)
+    {
+        iir |= IIR_FIFO_ENABLED;
+    }
+
+    return iir;
+}
+
+/**
+ * Refresh the receiver and the state of the interrupt line, must be called
+ * with the lock held after each state change.
+ */
+static void update_irq(serial_t *serial)
+{
+    rx_fifo_fill(serial);
+
+    u8 level = (get_iir(serial) & IIR_NO_INT) == 0;
+
+    if (serial->vm != NULL && level != serial->irq_level)
+    {
+        vm_irq_line(serial->vm, serial->irq, level);
+    }
+
+    serial->irq_level = level;
+}
+
+static u8 get_msr(serial_t *serial)
+{
+    if ((serial->mcr & MCR_LOOP) == 0)
+    {
+        // The host side is always connected and ready
+        return MSR_DCD | MSR_DSR | MSR_CTS;
+    }
+
+    // Modem control outputs are wired to the modem status inputs
+    u8 msr = 0;
+    msr |= (serial->mcr & MCR_RTS) != 0 ? MSR_CTS : 0;
+    msr |= (serial->mcr & MCR_DTR) != 0 ? MSR_DSR : 0;
+    msr |= (serial->mcr & MCR_OUT1) != 0 ? MSR_RI : 0;
+    msr |= (serial->mcr & MCR_OUT2) != 0 ? MSR_DCD : 0;
+
+    return msr;
+}
+
+static void write_fcr(serial_t *serial, u8 data)
+{
+    // Toggling the FIFO mode clears the FIFOs
+    if (((serial->fcr ^ data) & FCR_ENABLE) != 0 || (data & FCR_CLEAR_RX) != 0)
+    {
+        serial->rx_head = 0;
+        serial->rx_count = 0;
+    }
+
+    // The transmitter FIFO is drained to the host immediately, there is
+    // nothing to clear for FCR_CLEAR_TX.
+    serial->fcr = data & ~(FCR_CLEAR_RX | FCR_CLEAR_TX);
 }
 
-#include <stdio.h>
 static void serial_outb(u16 port, u8 data, void *params)
 {
     if (params == NULL)
@@ -34,15 +222,63 @@ static void serial_outb(u16 port, u8 data, void *params)
 
     u16 serial_register = port - serial->port;
 
+    pthread_mutex_lock(&serial->lock);
+
     switch (serial_register)
     {
     case THR:
-        write_data(serial, data);
+        if ((serial->lcr & LCR_DLAB) != 0)
+        {
+            serial->dll = data;
+        }
+        else if ((serial->mcr & MCR_LOOP) != 0)
+        {
+            rx_fifo_push(serial, data);
+            serial->thr_interrupt = 1;
+        }
+        else
+        {
+            // The byte leaves the transmitter at once, THR is empty again
+            write_data(serial, data);
+            serial->thr_interrupt = 1;
+        }
+        break;
+    case IER:
+        if ((serial->lcr & LCR_DLAB) != 0)
+        {
+            serial->dlh = data;
+        }
+        else
+        {
+            // Enabling THRE interrupts while THR is empty raises one
+            if ((data & IER_THRE) != 0 && (serial->ier & IER_THRE) == 0)
+            {
+                serial->thr_interrupt = 1;
+            }
+
+            serial->ier = data & (IER_RDA | IER_THRE | IER_RLS | IER_MSI);
+        }
+        break;
+    case FCR:
+        write_fcr(serial, data);
+        break;
+    case LCR:
+        serial->lcr = data;
+        break;
+    case MCR:
+        serial->mcr = data & 0x1F;
+        break;
+    case SR:
+        serial->scr = data;
         break;
     default:
-        fprintf(stderr, "serial: register not supported yet %x\n", port);
+        // LSR and MSR writes are ignored
         break;
     }
+
+    update_irq(serial);
+
+    pthread_mutex_unlock(&serial->lock);
 }
 
 static u8 serial_inb(u16 port, void *params)
@@ -54,31 +290,60 @@ static u8 serial_inb(u16 port, void *params)
 
     serial_t *serial = (serial_t *)params;
     u16 serial_port = port - serial->port;
+    u8 value = 0x0;
+
+    pthread_mutex_lock(&serial->lock);
 
     switch (serial_port)
     {
-    case RBR: {
-        u8 data = 0;
-
-        queue_read(serial->host_queue, &data, 1);
+    case RBR:
+        if ((serial->lcr & LCR_DLAB) != 0)
+        {
+            value = serial->dll;
+        }
+        else
+        {
+            rx_fifo_fill(serial);
+            value = rx_fifo_pop(serial);
+        }
+        break;
+    case IER:
+        value = (serial->lcr & LCR_DLAB) != 0 ? serial->dlh : serial->ier;
+        break;
+    case IIR:
+        rx_fifo_fill(serial);
+        value = get_iir(serial);
 
-        return data;
+        // Reading IIR acknowledges the THRE interrupt
+        if ((value & 0xF) == IIR_THRE)
+        {
+            serial->thr_interrupt = 0;
+        }
+        break;
+    case LCR:
+        value = serial->lcr;
+        break;
+    case MCR:
+        value = serial->mcr;
+        break;
+    case LSR:
+        rx_fifo_fill(serial);
+        // Transmitter is always empty and ready to receive more data
+        value = LSR_THRE | LSR_TEMT | (serial->rx_count > 0 ? LSR_DR : 0);
+        break;
+    case MSR:
+        value = get_msr(serial);
+        break;
+    case SR:
+        value = serial->scr;
+        break;
     }
-    case LSR: {
-        u8 line_status = 0x0;
 
-        // Data ready and serial ready to receive more data
-        line_status |=
-            ((!queue_empty(serial->host_queue)) & 0x1) | (0x1 << 0x5);
+    update_irq(serial);
 
-        return line_status;
-    }
-    default:
-        fprintf(stderr, "serial: register not supported yet %x\n", port);
-    }
+    pthread_mutex_unlock(&serial->lock);
 
-    // Unreachable
-    return 0x0;
+    return value;
 }
 
 serial_t *serial_new(u16 port, size_t internal_buffer_size)
@@ -107,6 +372,31 @@ serial_t *serial_new(u16 port, size_t internal_buffer_size)
         return NULL;
     }
 
+    serial->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (serial->event_fd < 0)
+    {
+        queue_destroy(serial->guest_queue);
+        queue_destroy(serial->host_queue);
+        free(serial);
+        return NULL;
+    }
+
+    pthread_mutex_init(&serial->lock, NULL);
+    serial->vm = NULL;
+    serial->irq = 0;
+    serial->irq_level = 0;
+    serial->ier = 0;
+    serial->lcr = 0;
+    serial->mcr = 0;
+    serial->fcr = 0;
+    serial->scr = 0;
+    serial->dll = 0;
+    serial->dlh = 0;
+    serial->thr_interrupt = 0;
+    serial->rx_head = 0;
+    serial->rx_count = 0;
+
     struct handler handler = { .inb_handler = serial_inb,
                                .outb_handler = serial_outb,
                                .params = serial };
@@ -120,6 +410,26 @@ serial_t *serial_new(u16 port, size_t internal_buffer_size)
     return serial;
 }
 
+s32 serial_set_irq(serial_t *serial, vm_t *vm, u32 irq)
+{
+    if (serial == NULL || vm == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&serial->lock);
+
+    serial->vm = vm;
+    serial->irq = irq;
+    serial->irq_level = 0;
+    s32 r = vm_irq_line(vm, irq, 0);
+    update_irq(serial);
+
+    pthread_mutex_unlock(&serial->lock);
+
+    return r;
+}
+
 void serial_destroy(serial_t *serial)
 {
     if (serial == NULL)
@@ -133,6 +443,13 @@ void serial_destroy(serial_t *serial)
         io_unregister_handler(serial->port + i);
     }
 
+    if (serial->vm != NULL && serial->irq_level != 0)
+    {
+        vm_irq_line(serial->vm, serial->irq, 0);
+    }
+
+    pthread_mutex_destroy(&serial->lock);
+    close(serial->event_fd);
     queue_destroy(serial->guest_queue);
     queue_destroy(serial->host_queue);
     free(serial);
@@ -148,6 +465,30 @@ size_t serial_read(serial_t *serial, u8 *buffer, size_t len)
     return queue_read(serial->guest_queue, buffer, len);
 }
 
+size_t serial_read_timeout(serial_t *serial,
+                           u8 *buffer,
+                           size_t len,
+                           s32 timeout_ms)
+{
+    if (serial == NULL || buffer == NULL)
+    {
+        return -1;
+    }
+
+    return queue_read_wait(
+        serial->guest_queue, serial->event_fd, buffer, len, timeout_ms);
+}
+
+s32 serial_get_eventfd(serial_t *serial)
+{
+    if (serial == NULL)
+    {
+        return -1;
+    }
+
+    return serial->event_fd;
+}
+
 size_t serial_write(serial_t *serial, u8 *buffer, size_t len)
 {
     if (serial == NULL || buffer == NULL)
@@ -155,5 +496,13 @@ size_t serial_write(serial_t *serial, u8 *buffer, size_t len)
         return -1;
     }
 
-    return queue_write(serial->host_queue, buffer, len);
+    // host_queue has a single producer, the lock serializes the host writers
+    pthread_mutex_lock(&serial->lock);
+    size_t written = queue_write(serial->host_queue, buffer, len);
+
+    // Let the receiver pick the data up and raise the interrupt
+    update_irq(serial);
+    pthread_mutex_unlock(&serial->lock);
+
+    return written;
 }
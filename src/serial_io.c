@@ -0,0 +1,814 @@
+#define _GNU_SOURCE
+
+#include <blackhv/linked_list.h>
+#include <blackhv/serial_io.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define OUT_BUFFER_SIZE (64 * 1024) // Power of two
+#define IN_BUFFER_SIZE 4096
+#define MAX_EVENTS 64
+#define INPUT_RETRY_MS 10
+
+/* Event sources */
+#define SOURCE_STOP 0
+#define SOURCE_DEVICE 1
+#define SOURCE_FD 2
+#define SOURCE_LISTEN 3
+#define SOURCE_OUT 4 // out_fd when it differs from in_fd
+
+struct backend;
+
+struct io_source
+{
+    u32 kind;
+    struct backend *backend;
+};
+
+struct backend
+{
+    struct chardev dev;
+    s32 in_fd;
+    s32 out_fd;
+    s32 listen_fd; // Unix socket backend
+    s32 pty_slave_fd; // Kept open so the master never reports a hangup
+    u8 owns_fds; // Close in_fd/out_fd on destroy
+    u8 in_polled; // in_fd is registered in epoll
+    u8 out_polled; // out_fd is registered in epoll on its own
+    u8 out_blocked; // The last write would have blocked
+    u8 in_hangup; // in_fd hung up, read again once the input is delivered
+    u32 in_events;
+    u32 out_events;
+
+    struct io_source device_source;
+    struct io_source fd_source;
+    struct io_source listen_source;
+    struct io_source out_source;
+
+    // Guest output waiting to be written, head and tail are free-running
+    u8 out[OUT_BUFFER_SIZE];
+    size_t out_head;
+    size_t out_tail;
+
+    // Guest input not yet accepted by the device
+    u8 in[IN_BUFFER_SIZE];
+    size_t in_off;
+    size_t in_len;
+};
+
+struct serial_io
+{
+    pthread_t thread;
+    s32 epoll_fd;
+    s32 stop_fd;
+    struct io_source stop_source;
+    pthread_mutex_t lock; // Protects backends
+    linked_list_t *backends;
+};
+
+static size_t serial_chardev_read(void *device, u8 *buffer, size_t len)
+{
+    return serial_read(device, buffer, len);
+}
+
+static size_t serial_chardev_write(void *device, u8 *buffer, size_t len)
+{
+    return serial_write(device, buffer, len);
+}
+
+struct chardev serial_chardev(serial_t *serial)
+{
+    struct chardev dev = { .device = serial,
+                           .read = serial_chardev_read,
+                           .write = serial_chardev_write,
+                           .event_fd = serial_get_eventfd(serial) };
+
+    return dev;
+}
+
+static size_t console_chardev_read(void *device, u8 *buffer, size_t len)
+{
+    return virtio_console_read(device, buffer, len);
+}
+
+static size_t console_chardev_write(void *device, u8 *buffer, size_t len)
+{
+    return virtio_console_write(device, buffer, len);
+}
+
+struct chardev virtio_console_chardev(virtio_console_t *console)
+{
+    struct chardev dev = { .device = console,
+                           .read = console_chardev_read,
+                           .write = console_chardev_write,
+                           .event_fd = virtio_console_get_eventfd(console) };
+
+    return dev;
+}
+
+static void modify_events(serial_io_t *io,
+                          struct io_source *source,
+                          s32 fd,
+                          u32 *current,
+                          u32 events)
+{
+    if (*current == events)
+    {
+        return;
+    }
+
+    struct epoll_event event = { .events = events, .data.ptr = source };
+
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0)
+    {
+        *current = events;
+    }
+}
+
+/**
+ * Only poll for input when the device accepted the previous one, and for
+ * output when a write would have blocked. Everything is level-triggered.
+ */
+static void update_events(serial_io_t *io, struct backend *b)
+{
+    u32 in_events = b->in_len == 0 ? EPOLLIN : 0;
+    u32 out_events = b->out_blocked ? EPOLLOUT : 0;
+
+    if (b->in_polled && b->in_fd == b->out_fd)
+    {
+        modify_events(
+            io, &b->fd_source, b->in_fd, &b->in_events, in_events | out_events);
+        return;
+    }
+
+    if (b->in_polled)
+    {
+        modify_events(io, &b->fd_source, b->in_fd, &b->in_events, in_events);
+    }
+
+    if (b->out_polled)
+    {
+        modify_events(
+            io, &b->out_source, b->out_fd, &b->out_events, out_events);
+    }
+}
+
+/**
+ * Gather everything the guest wrote into the output buffer, reading directly
+ * into the free space of the ring.
+ */
+static void pull_output(struct backend *b)
+{
+    while (b->out_tail - b->out_head < OUT_BUFFER_SIZE)
+    {
+        size_t offset = b->out_tail & (OUT_BUFFER_SIZE - 1);
+        size_t free_space = OUT_BUFFER_SIZE - (b->out_tail - b->out_head);
+        size_t contiguous = OUT_BUFFER_SIZE - offset;
+
+        if (contiguous > free_space)
+        {
+            contiguous = free_space;
+        }
+
+        size_t r = b->dev.read(b->dev.device, b->out + offset, contiguous);
+
+        if (r == 0 || r == (size_t)-1)
+        {
+            return;
+        }
+
+        b->out_tail += r;
+    }
+}
+
+/**
+ * Write the pending output with a single writev (two iovecs when the ring
+ * wraps around).
+ *
+ * @return 1 if the output buffer has been emptied
+ */
+static u32 flush_output(serial_io_t *io, struct backend *b)
+{
+    while (b->out_head != b->out_tail)
+    {
+        if (b->out_fd < 0)
+        {
+            // Nobody is listening
+            b->out_head = b->out_tail;
+            break;
+        }
+
+        size_t offset = b->out_head & (OUT_BUFFER_SIZE - 1);
+        size_t pending = b->out_tail - b->out_head;
+        size_t first = OUT_BUFFER_SIZE - offset;
+
+        if (first > pending)
+        {
+            first = pending;
+        }
+
+        struct iovec iov[2] = {
+            { .iov_base = b->out + offset, .iov_len = first },
+            { .iov_base = b->out, .iov_len = pending - first },
+        };
+
+        ssize_t w = writev(b->out_fd, iov, pending == first ? 1 : 2);
+
+        if (w < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (w < 0 && errno == EAGAIN)
+        {
+            b->out_blocked = 1;
+            update_events(io, b);
+            return 0;
+        }
+
+        if (w < 0)
+        {
+            // The output is gone, drop what the guest writes from now on
+            b->out_head = b->out_tail;
+            break;
+        }
+
+        b->out_head += w;
+    }
+
+    b->out_blocked = 0;
+    update_events(io, b);
+
+    return 1;
+}
+
+static void process_output(serial_io_t *io, struct backend *b)
+{
+    // Reading makes room in the device queue, loop until the device is
+    // drained or the backend cannot take more data.
+    for (;;)
+    {
+        size_t previous_tail = b->out_tail;
+
+        pull_output(b);
+
+        if (!flush_output(io, b) || b->out_tail == previous_tail)
+        {
+            return;
+        }
+    }
+}
+
+static void push_input(struct backend *b)
+{
+    if (b->in_len == 0)
+    {
+        return;
+    }
+
+    size_t w = b->dev.write(b->dev.device, b->in + b->in_off, b->in_len);
+
+    if (w == (size_t)-1)
+    {
+        w = 0;
+    }
+
+    b->in_off += w;
+    b->in_len -= w;
+}
+
+static void close_client(serial_io_t *io, struct backend *b)
+{
+    epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, b->in_fd, NULL);
+    close(b->in_fd);
+    b->in_fd = -1;
+    b->out_fd = -1;
+    b->in_polled = 0;
+    b->out_blocked = 0;
+    b->in_hangup = 0;
+    b->in_len = 0;
+}
+
+static void read_input(serial_io_t *io, struct backend *b)
+{
+    if (b->in_len != 0 || b->in_fd < 0)
+    {
+        return;
+    }
+
+    ssize_t r = read(b->in_fd, b->in, IN_BUFFER_SIZE);
+
+    if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+    {
+        if (b->listen_fd >= 0)
+        {
+            close_client(io, b);
+        }
+        else
+        {
+            // End of input, the output side stays usable
+            epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, b->in_fd, NULL);
+            b->in_polled = 0;
+            b->in_hangup = 0;
+
+            if (b->in_fd == b->out_fd)
+            {
+                b->out_polled = 0;
+            }
+
+            b->in_fd = -1;
+        }
+
+        return;
+    }
+
+    if (r > 0)
+    {
+        b->in_off = 0;
+        b->in_len = r;
+        push_input(b);
+        update_events(io, b);
+    }
+}
+
+static void accept_client(serial_io_t *io, struct backend *b)
+{
+    s32 client =
+        accept4(b->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (client < 0)
+    {
+        return;
+    }
+
+    if (b->in_fd >= 0)
+    {
+        close_client(io, b);
+    }
+
+    struct epoll_event event = { .events = EPOLLIN,
+                                 .data.ptr = &b->fd_source };
+
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, client, &event) < 0)
+    {
+        close(client);
+        return;
+    }
+
+    b->in_fd = client;
+    b->out_fd = client;
+    b->in_polled = 1;
+    b->in_events = EPOLLIN;
+}
+
+static void handle_event(serial_io_t *io, struct epoll_event *event)
+{
+    struct io_source *source = event->data.ptr;
+    struct backend *b = source->backend;
+
+    switch (source->kind)
+    {
+    case SOURCE_DEVICE: {
+        eventfd_t value;
+        eventfd_read(b->dev.event_fd, &value);
+        process_output(io, b);
+        break;
+    }
+    case SOURCE_FD:
+        if ((event->events & EPOLLOUT) != 0)
+        {
+            process_output(io, b);
+        }
+
+        if ((event->events & (EPOLLHUP | EPOLLERR)) != 0)
+        {
+            // Reported even when not polled, so stop polling until the
+            // device took the input already read, then read to the end
+            push_input(b);
+
+            if (b->in_len != 0)
+            {
+                epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, b->in_fd, NULL);
+                b->in_polled = 0;
+                b->in_hangup = 1;
+                break;
+            }
+        }
+
+        if ((event->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0)
+        {
+            read_input(io, b);
+        }
+        break;
+    case SOURCE_OUT:
+        if ((event->events & (EPOLLHUP | EPOLLERR)) != 0)
+        {
+            // Stop polling, the next writev fails and drops the output
+            epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, b->out_fd, NULL);
+            b->out_polled = 0;
+        }
+
+        process_output(io, b);
+        break;
+    case SOURCE_LISTEN:
+        accept_client(io, b);
+        break;
+    }
+}
+
+static void *io_thread(void *params)
+{
+    serial_io_t *io = params;
+    struct epoll_event events[MAX_EVENTS];
+    u32 input_pending = 0;
+
+    // Get EPIPE instead of being killed when a reader goes away
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;)
+    {
+        // The device queues do not signal when they have room again, retry
+        // pending input periodically.
+        s32 timeout = input_pending ? INPUT_RETRY_MS : -1;
+        s32 n = epoll_wait(io->epoll_fd, events, MAX_EVENTS, timeout);
+
+        pthread_mutex_lock(&io->lock);
+
+        for (s32 i = 0; i < n; ++i)
+        {
+            struct io_source *source = events[i].data.ptr;
+
+            if (source->kind == SOURCE_STOP)
+            {
+                pthread_mutex_unlock(&io->lock);
+                return NULL;
+            }
+
+            handle_event(io, &events[i]);
+        }
+
+        input_pending = 0;
+
+        for (struct linked_list_elt *elt = io->backends->head; elt != NULL;
+             elt = elt->next)
+        {
+            struct backend *b = elt->value;
+
+            if (b->in_len != 0)
+            {
+                push_input(b);
+                update_events(io, b);
+            }
+
+            // The rest of the input after a hangup is read as the device
+            // takes it, until the end of input
+            if (b->in_hangup && b->in_len == 0)
+            {
+                read_input(io, b);
+            }
+
+            input_pending |= b->in_len != 0 || b->in_hangup;
+        }
+
+        pthread_mutex_unlock(&io->lock);
+    }
+
+    return NULL;
+}
+
+static void backend_free(void *ptr)
+{
+    struct backend *b = ptr;
+
+    if (b->owns_fds && b->out_fd >= 0)
+    {
+        close(b->out_fd);
+    }
+
+    if (b->owns_fds && b->in_fd >= 0 && b->in_fd != b->out_fd)
+    {
+        close(b->in_fd);
+    }
+
+    if (b->listen_fd >= 0)
+    {
+        close(b->listen_fd);
+    }
+
+    if (b->pty_slave_fd >= 0)
+    {
+        close(b->pty_slave_fd);
+    }
+
+    free(b);
+}
+
+serial_io_t *serial_io_new(void)
+{
+    serial_io_t *io = malloc(sizeof(serial_io_t));
+
+    if (io == NULL)
+    {
+        return NULL;
+    }
+
+    io->backends = linked_list_new(backend_free);
+    io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    io->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    io->stop_source.kind = SOURCE_STOP;
+    io->stop_source.backend = NULL;
+    pthread_mutex_init(&io->lock, NULL);
+
+    struct epoll_event event = { .events = EPOLLIN,
+                                 .data.ptr = &io->stop_source };
+
+    if (io->backends == NULL || io->epoll_fd < 0 || io->stop_fd < 0
+        || epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, io->stop_fd, &event) < 0
+        || pthread_create(&io->thread, NULL, io_thread, io) != 0)
+    {
+        linked_list_free(io->backends);
+        close(io->epoll_fd);
+        close(io->stop_fd);
+        pthread_mutex_destroy(&io->lock);
+        free(io);
+        return NULL;
+    }
+
+    return io;
+}
+
+void serial_io_destroy(serial_io_t *io)
+{
+    if (io == NULL)
+    {
+        return;
+    }
+
+    eventfd_write(io->stop_fd, 1);
+    pthread_join(io->thread, NULL);
+
+    linked_list_free(io->backends);
+    close(io->epoll_fd);
+    close(io->stop_fd);
+    pthread_mutex_destroy(&io->lock);
+    free(io);
+}
+
+static struct backend *backend_new(struct chardev dev)
+{
+    struct backend *b = malloc(sizeof(struct backend));
+
+    if (b == NULL)
+    {
+        return NULL;
+    }
+
+    b->dev = dev;
+    b->in_fd = -1;
+    b->out_fd = -1;
+    b->listen_fd = -1;
+    b->pty_slave_fd = -1;
+    b->owns_fds = 1;
+    b->in_polled = 0;
+    b->out_polled = 0;
+    b->out_blocked = 0;
+    b->in_hangup = 0;
+    b->in_events = 0;
+    b->out_events = 0;
+    b->device_source.kind = SOURCE_DEVICE;
+    b->device_source.backend = b;
+    b->fd_source.kind = SOURCE_FD;
+    b->fd_source.backend = b;
+    b->listen_source.kind = SOURCE_LISTEN;
+    b->listen_source.backend = b;
+    b->out_source.kind = SOURCE_OUT;
+    b->out_source.backend = b;
+    b->out_head = 0;
+    b->out_tail = 0;
+    b->in_off = 0;
+    b->in_len = 0;
+
+    return b;
+}
+
+/**
+ * Register the backend file descriptors and hand it over to the I/O thread
+ */
+static s32 backend_add(serial_io_t *io, struct backend *b)
+{
+    struct epoll_event event = { .events = EPOLLIN,
+                                 .data.ptr = &b->device_source };
+
+    pthread_mutex_lock(&io->lock);
+
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, b->dev.event_fd, &event) < 0)
+    {
+        pthread_mutex_unlock(&io->lock);
+        backend_free(b);
+        return 0;
+    }
+
+    if (b->listen_fd >= 0)
+    {
+        event.data.ptr = &b->listen_source;
+        epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, b->listen_fd, &event);
+    }
+
+    if (b->in_fd >= 0)
+    {
+        event.data.ptr = &b->fd_source;
+
+        // Regular files cannot be polled, there is simply no input then
+        if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, b->in_fd, &event) == 0)
+        {
+            b->in_polled = 1;
+            b->in_events = EPOLLIN;
+        }
+        else
+        {
+            b->in_fd = -1;
+        }
+    }
+
+    if (b->out_fd >= 0 && b->out_fd != b->in_fd)
+    {
+        // Only polled for EPOLLOUT when a write would block. Regular files
+        // cannot be polled but never block either.
+        event.events = 0;
+        event.data.ptr = &b->out_source;
+
+        b->out_polled =
+            epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, b->out_fd, &event) == 0;
+    }
+
+    linked_list_add(io->backends, b);
+
+    // Forward what the guest wrote before the backend was attached
+    process_output(io, b);
+
+    pthread_mutex_unlock(&io->lock);
+
+    return 1;
+}
+
+s32 serial_io_add_fd(serial_io_t *io,
+                     struct chardev dev,
+                     s32 in_fd,
+                     s32 out_fd)
+{
+    if (io == NULL || dev.read == NULL)
+    {
+        return 0;
+    }
+
+    struct backend *b = backend_new(dev);
+
+    if (b == NULL)
+    {
+        return 0;
+    }
+
+    b->in_fd = in_fd;
+    b->out_fd = out_fd;
+    b->owns_fds = 0;
+
+    return backend_add(io, b);
+}
+
+s32 serial_io_add_file(serial_io_t *io, struct chardev dev, const char *path)
+{
+    if (io == NULL || dev.read == NULL || path == NULL)
+    {
+        return 0;
+    }
+
+    s32 fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    struct backend *b = backend_new(dev);
+
+    if (b == NULL)
+    {
+        close(fd);
+        return 0;
+    }
+
+    b->out_fd = fd;
+
+    return backend_add(io, b);
+}
+
+s32 serial_io_add_pty(serial_io_t *io,
+                      struct chardev dev,
+                      char *name,
+                      size_t name_len)
+{
+    if (io == NULL || dev.read == NULL || name == NULL)
+    {
+        return 0;
+    }
+
+    s32 master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+    if (master < 0)
+    {
+        return 0;
+    }
+
+    struct termios termios;
+
+    if (grantpt(master) < 0 || unlockpt(master) < 0
+        || ptsname_r(master, name, name_len) != 0
+        || tcgetattr(master, &termios) < 0)
+    {
+        close(master);
+        return 0;
+    }
+
+    // The guest does its own line discipline
+    cfmakeraw(&termios);
+    tcsetattr(master, TCSANOW, &termios);
+
+    struct backend *b = backend_new(dev);
+
+    if (b == NULL)
+    {
+        close(master);
+        return 0;
+    }
+
+    b->in_fd = master;
+    b->out_fd = master;
+    b->pty_slave_fd = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+
+    return backend_add(io, b);
+}
+
+s32 serial_io_add_unix(serial_io_t *io, struct chardev dev, const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (io == NULL || dev.read == NULL || path == NULL
+        || strlen(path) >= sizeof(addr.sun_path))
+    {
+        return 0;
+    }
+
+    strcpy(addr.sun_path, path);
+
+    s32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    // Only a socket left by a previous run is replaced
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && (!S_ISSOCK(st.st_mode) || unlink(path) < 0))
+    {
+        fprintf(stderr, "%s exists and is not a socket\n", path);
+        close(fd);
+        return 0;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(fd, 1) < 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    struct backend *b = backend_new(dev);
+
+    if (b == NULL)
+    {
+        close(fd);
+        return 0;
+    }
+
+    b->listen_fd = fd;
+
+    return backend_add(io, b);
+}
@@ -1,5 +1,36 @@
+#define _GNU_SOURCE
+
+#include <blackhv/ahci.h>
+#include <blackhv/block_cache.h>
+#include <blackhv/framebuffer.h>
+#include <blackhv/headless.h>
+#include <blackhv/io.h>
+#include <blackhv/memory.h>
+#include <blackhv/mmio.h>
+#include <blackhv/overlay.h>
+#include <blackhv/pixel.h>
+#include <blackhv/ps2.h>
 #include <blackhv/queue.h>
+#include <blackhv/recorder.h>
+#include <blackhv/serial.h>
+#include <blackhv/serial_io.h>
+#include <blackhv/vbe.h>
+#include <blackhv/vga_text.h>
+#include <blackhv/virtio.h>
+#include <blackhv/vnc.h>
+#include <blackhv/zimage.h>
 #include <criterion/criterion.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 Test(queue, queue_create)
 {
@@ -7,7 +38,7 @@ Test(queue, queue_create)
 
     cr_assert_neq(q, NULL);
     cr_assert_eq(q->buffer_size, 1024);
-    cr_assert_eq(q->is_full, 0);
+    cr_assert_eq(queue_empty(q), 1);
     cr_assert_eq(q->front, 0);
     cr_assert_eq(q->rear, 0);
 }
@@ -51,4 +82,1863 @@ Test(queue, queue_add_multiple)
 
     cr_assert_eq(queue_empty(q), 1);
     cr_assert_eq(queue_read(q, &r, sizeof(char)), 0);
-}
\ No newline at end of file
+}
+
+Test(queue, queue_size_power_of_two)
+{
+    queue_t *q = queue_new(1000);
+
+    cr_assert_neq(q, NULL);
+    cr_assert_eq(q->buffer_size, 1024);
+    cr_assert_eq(queue_new(0), NULL);
+
+    queue_destroy(q);
+}
+
+Test(queue, queue_full)
+{
+    queue_t *q = queue_new(16);
+    unsigned char buffer[32];
+
+    for (unsigned char i = 0; i < 32; ++i)
+    {
+        buffer[i] = i;
+    }
+
+    // Only the first 16 bytes fit
+    cr_assert_eq(queue_write(q, buffer, 32), 16);
+    cr_assert_eq(queue_write(q, buffer, 1), 0);
+
+    unsigned char readed[32] = { 0 };
+
+    cr_assert_eq(queue_read(q, readed, 32), 16);
+    cr_assert_arr_eq(readed, buffer, 16);
+    cr_assert_eq(queue_empty(q), 1);
+
+    queue_destroy(q);
+}
+
+Test(queue, queue_wrap_around)
+{
+    queue_t *q = queue_new(16);
+
+    unsigned char value = 0;
+    unsigned char expected = 0;
+
+    // 5 is not a divisor of 16, writes regularly cross the end of the buffer
+    for (size_t round = 0; round < 100; ++round)
+    {
+        unsigned char buffer[5];
+
+        for (size_t i = 0; i < sizeof(buffer); ++i)
+        {
+            buffer[i] = value++;
+        }
+
+        cr_assert_eq(queue_write(q, buffer, sizeof(buffer)), sizeof(buffer));
+
+        unsigned char readed[5];
+
+        cr_assert_eq(queue_read(q, readed, sizeof(readed)), sizeof(readed));
+
+        for (size_t i = 0; i < sizeof(readed); ++i)
+        {
+            cr_assert_eq(readed[i], expected++);
+        }
+    }
+
+    cr_assert_eq(queue_empty(q), 1);
+
+    queue_destroy(q);
+}
+
+#define MB (1 << 20)
+#define STRESS_SIZE (16 * MB)
+
+static void *producer(void *params)
+{
+    queue_t *q = params;
+    unsigned char buffer[4096];
+    size_t sent = 0;
+    size_t chunk = 1;
+
+    while (sent < STRESS_SIZE)
+    {
+        // Vary the chunk size to hit all the wrap around cases
+        size_t len = chunk;
+        chunk = chunk % (sizeof(buffer) - 1) + 1;
+
+        if (len > STRESS_SIZE - sent)
+        {
+            len = STRESS_SIZE - sent;
+        }
+
+        for (size_t i = 0; i < len; ++i)
+        {
+            buffer[i] = (sent + i) % 251;
+        }
+
+        size_t w = queue_write(q, buffer, len);
+
+        if (w == 0)
+        {
+            sched_yield();
+        }
+
+        sent += w;
+    }
+
+    return NULL;
+}
+
+Test(queue, queue_concurrent_stress)
+{
+    queue_t *q = queue_new(4096);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, producer, q);
+
+    unsigned char buffer[3000];
+    size_t received = 0;
+    size_t chunk = 1;
+
+    while (received < STRESS_SIZE)
+    {
+        size_t r = queue_read(q, buffer, chunk);
+        chunk = chunk % (sizeof(buffer) - 1) + 1;
+
+        if (r == 0)
+        {
+            sched_yield();
+        }
+
+        for (size_t i = 0; i < r; ++i)
+        {
+            cr_assert_eq(buffer[i], (received + i) % 251);
+        }
+
+        received += r;
+    }
+
+    pthread_join(thread, NULL);
+
+    cr_assert_eq(queue_empty(q), 1);
+
+    queue_destroy(q);
+}
+
+/* 16550 registers, from the base port */
+#define UART_DLL 0
+#define UART_DLH 1
+#define UART_IER 1
+#define UART_IIR 2
+#define UART_FCR 2
+#define UART_LCR 3
+#define UART_LSR 5
+
+static u8 uart_read(u16 reg)
+{
+    u8 value = 0;
+
+    io_handle_inb(COM1 + reg, &value);
+    return value;
+}
+
+Test(serial, serial_divisor_latch)
+{
+    serial_t *serial = serial_new(COM1, 64);
+    u8 data = 0;
+
+    // With DLAB set, the first two registers are the divisor latch
+    io_handle_outb(COM1 + UART_LCR, 0x83);
+    io_handle_outb(COM1 + UART_DLL, 0x0C);
+    io_handle_outb(COM1 + UART_DLH, 0x01);
+    cr_assert_eq(uart_read(UART_LCR), 0x83);
+    cr_assert_eq(uart_read(UART_DLL), 0x0C);
+    cr_assert_eq(uart_read(UART_DLH), 0x01);
+    cr_assert_eq(serial_read(serial, &data, 1), 0);
+
+    io_handle_outb(COM1 + UART_LCR, 0x03);
+    io_handle_outb(COM1 + UART_IER, 0x01);
+    io_handle_outb(COM1, 'x');
+    cr_assert_eq(uart_read(UART_IER), 0x01);
+    cr_assert_eq(serial_read(serial, &data, 1), 1);
+    cr_assert_eq(data, 'x');
+
+    io_handle_outb(COM1 + UART_LCR, 0x83);
+    cr_assert_eq(uart_read(UART_DLL), 0x0C);
+    cr_assert_eq(uart_read(UART_DLH), 0x01);
+
+    serial_destroy(serial);
+}
+
+Test(serial, serial_fifo_trigger)
+{
+    serial_t *serial = serial_new(COM1, 64);
+    u8 data[16] = { 0 };
+
+    // FIFO enabled with a trigger level of 8 bytes
+    io_handle_outb(COM1 + UART_FCR, 0x81);
+    io_handle_outb(COM1 + UART_IER, 0x01);
+    cr_assert_eq(uart_read(UART_IIR), 0xC1);
+
+    // Below the trigger level, only the character timeout is reported
+    cr_assert_eq(serial_write(serial, data, 7), 7);
+    cr_assert_eq(uart_read(UART_IIR), 0xCC);
+    cr_assert_eq(serial_write(serial, data, 1), 1);
+    cr_assert_eq(uart_read(UART_IIR), 0xC4);
+
+    // The receiver FIFO holds 16 bytes, the rest waits on the wire
+    cr_assert_eq(serial_write(serial, data, 16), 16);
+
+    for (u32 i = 0; i < 24; ++i)
+    {
+        cr_assert_eq(uart_read(UART_IIR) & 0x01, 0);
+        uart_read(0);
+    }
+
+    cr_assert_eq(uart_read(UART_IIR), 0xC1);
+
+    // Disabling the FIFO brings the trigger level back to one byte
+    io_handle_outb(COM1 + UART_FCR, 0x00);
+    cr_assert_eq(serial_write(serial, data, 1), 1);
+    cr_assert_eq(uart_read(UART_IIR), 0x04);
+
+    serial_destroy(serial);
+}
+
+Test(serial, serial_iir_priority)
+{
+    serial_t *serial = serial_new(COM1, 64);
+    u8 data = 'y';
+
+    // Enabling THRE interrupts while THR is empty raises one
+    io_handle_outb(COM1 + UART_IER, 0x03);
+    cr_assert_eq(serial_write(serial, &data, 1), 1);
+
+    // Received data comes first and reading IIR does not acknowledge THRE
+    cr_assert_eq(uart_read(UART_IIR), 0x04);
+    cr_assert_eq(uart_read(0), 'y');
+    cr_assert_eq(uart_read(UART_IIR), 0x02);
+    cr_assert_eq(uart_read(UART_IIR), 0x01);
+
+    // Writing THR raises it again
+    io_handle_outb(COM1, 'z');
+    cr_assert_eq(uart_read(UART_IIR), 0x02);
+
+    serial_destroy(serial);
+}
+
+/**
+ * Read what the host sent as the guest does, polling the line status
+ */
+static void serial_guest_read(u16 port, u8 *buffer, u32 len)
+{
+    for (u32 i = 0, tries = 0; i < len; ++tries)
+    {
+        u8 lsr = 0;
+
+        cr_assert_lt(tries, 5000);
+        io_handle_inb(port + UART_LSR, &lsr);
+
+        if ((lsr & 0x01) == 0)
+        {
+            usleep(1000);
+            continue;
+        }
+
+        io_handle_inb(port, &buffer[i++]);
+    }
+}
+
+static void serial_host_read(s32 fd, char *buffer, u32 len)
+{
+    for (u32 off = 0; off < len;)
+    {
+        ssize_t r = read(fd, buffer + off, len - off);
+        cr_assert_gt(r, 0);
+        off += r;
+    }
+}
+
+static void serial_guest_write(u16 port, const char *data)
+{
+    for (u32 i = 0; data[i] != '\0'; ++i)
+    {
+        io_handle_outb(port, data[i]);
+    }
+}
+
+Test(serial_io, serial_io_pipe_hangup)
+{
+    serial_t *serial = serial_new(COM1, 16);
+    serial_io_t *io = serial_io_new();
+    s32 in[2];
+    s32 out[2];
+    u8 input[100];
+    u8 received[100];
+    char output[3] = { 0 };
+
+    cr_assert_eq(pipe(in), 0);
+    cr_assert_eq(pipe(out), 0);
+    cr_assert_eq(
+        serial_io_add_fd(io, serial_chardev(serial), in[0], out[1]), 1);
+
+    serial_guest_write(COM1, "ok");
+    serial_host_read(out[0], output, 2);
+    cr_assert_str_eq(output, "ok");
+
+    // More than the device queue holds, then the writer goes away
+    for (u32 i = 0; i < sizeof(input); ++i)
+    {
+        input[i] = i;
+    }
+
+    cr_assert_eq(write(in[1], input, sizeof(input)), sizeof(input));
+    close(in[1]);
+    serial_guest_read(COM1, received, sizeof(received));
+    cr_assert_arr_eq(received, input, sizeof(input));
+
+    serial_io_destroy(io);
+    serial_destroy(serial);
+    close(in[0]);
+    close(out[0]);
+    close(out[1]);
+}
+
+Test(serial_io, serial_io_socketpair)
+{
+    serial_t *serial = serial_new(COM2, 64);
+    serial_io_t *io = serial_io_new();
+    s32 fds[2];
+    char buffer[6] = { 0 };
+
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    cr_assert_eq(
+        serial_io_add_fd(io, serial_chardev(serial), fds[0], fds[0]), 1);
+
+    cr_assert_eq(write(fds[1], "hello", 5), 5);
+    serial_guest_read(COM2, (u8 *)buffer, 5);
+    cr_assert_str_eq(buffer, "hello");
+
+    serial_guest_write(COM2, "world");
+    serial_host_read(fds[1], buffer, 5);
+    cr_assert_str_eq(buffer, "world");
+
+    serial_io_destroy(io);
+    serial_destroy(serial);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+Test(serial_io, serial_io_unix_path)
+{
+    serial_t *serial = serial_new(COM1, 64);
+    serial_io_t *io = serial_io_new();
+    char dir[] = "/tmp/blackhv_serial_XXXXXX";
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char buffer[3] = { 0 };
+
+    cr_assert_neq(mkdtemp(dir), NULL);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/serial.sock", dir);
+
+    // A file which is not a socket is left alone
+    s32 fd = open(addr.sun_path, O_WRONLY | O_CREAT, 0644);
+    close(fd);
+    cr_assert_eq(serial_io_add_unix(io, serial_chardev(serial), addr.sun_path),
+                 0);
+    cr_assert_eq(access(addr.sun_path, F_OK), 0);
+    unlink(addr.sun_path);
+
+    // A socket left by a previous run is replaced
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    cr_assert_eq(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    close(fd);
+    cr_assert_eq(serial_io_add_unix(io, serial_chardev(serial), addr.sun_path),
+                 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    cr_assert_eq(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    cr_assert_eq(write(fd, "in", 2), 2);
+    serial_guest_read(COM1, (u8 *)buffer, 2);
+    cr_assert_str_eq(buffer, "in");
+
+    serial_guest_write(COM1, "up");
+    serial_host_read(fd, buffer, 2);
+    cr_assert_str_eq(buffer, "up");
+
+    close(fd);
+    serial_io_destroy(io);
+    serial_destroy(serial);
+    unlink(addr.sun_path);
+    cr_assert_eq(rmdir(dir), 0);
+}
+
+Test(block_cache, block_cache_hit_miss)
+{
+    block_cache_t *cache = block_cache_new(16, 4);
+    u8 block[16];
+    u8 readed[16];
+    u64 hits = 0;
+    u64 misses = 0;
+
+    cr_assert_neq(cache, NULL);
+    cr_assert_eq(block_cache_read(cache, 42, readed), 0);
+
+    memset(block, 0xAB, sizeof(block));
+    block_cache_write(cache, 42, block);
+
+    cr_assert_eq(block_cache_read(cache, 42, readed), 1);
+    cr_assert_arr_eq(block, readed, sizeof(block));
+
+    block_cache_stats(cache, &hits, &misses);
+    cr_assert_eq(hits, 1);
+    cr_assert_eq(misses, 1);
+
+    block_cache_destroy(cache);
+}
+
+Test(block_cache, block_cache_read_at)
+{
+    block_cache_t *cache = block_cache_new(16, 4);
+    u8 block[16];
+    u8 readed[16];
+
+    for (u32 i = 0; i < sizeof(block); ++i)
+    {
+        block[i] = i;
+    }
+
+    block_cache_write(cache, 3, block);
+    memset(readed, 0xFF, sizeof(readed));
+
+    cr_assert_eq(block_cache_read_at(cache, 3, 10, 6, readed), 1);
+    cr_assert_arr_eq(readed, block + 10, 6);
+    cr_assert_eq(readed[6], 0xFF);
+
+    // Ranges outside of the block and missing blocks
+    cr_assert_eq(block_cache_read_at(cache, 3, 10, 7, readed), 0);
+    cr_assert_eq(block_cache_read_at(cache, 3, 17, 0, readed), 0);
+    cr_assert_eq(block_cache_read_at(cache, 4, 0, 1, readed), 0);
+
+    block_cache_destroy(cache);
+}
+
+Test(block_cache, block_cache_lru_eviction)
+{
+    block_cache_t *cache = block_cache_new(8, 4);
+    u8 block[8];
+
+    for (u8 i = 0; i < 4; ++i)
+    {
+        memset(block, i, sizeof(block));
+        block_cache_write(cache, i, block);
+    }
+
+    // Block 0 becomes the most recently used, 1 is evicted
+    cr_assert_eq(block_cache_read(cache, 0, block), 1);
+    cr_assert_eq(block[0], 0);
+
+    memset(block, 4, sizeof(block));
+    block_cache_write(cache, 4, block);
+
+    cr_assert_eq(block_cache_contains(cache, 0), 1);
+    cr_assert_eq(block_cache_contains(cache, 1), 0);
+    cr_assert_eq(block_cache_contains(cache, 2), 1);
+    cr_assert_eq(block_cache_contains(cache, 3), 1);
+    cr_assert_eq(block_cache_contains(cache, 4), 1);
+
+    cr_assert_eq(block_cache_read(cache, 4, block), 1);
+    cr_assert_eq(block[7], 4);
+
+    block_cache_destroy(cache);
+}
+
+Test(block_cache, block_cache_update)
+{
+    block_cache_t *cache = block_cache_new(8, 2);
+    u8 block[8];
+
+    memset(block, 1, sizeof(block));
+    block_cache_write(cache, 7, block);
+    memset(block, 2, sizeof(block));
+    block_cache_write(cache, 7, block);
+    block_cache_write(cache, 8, block);
+
+    // Updating a block does not use a new entry
+    cr_assert_eq(block_cache_contains(cache, 7), 1);
+    cr_assert_eq(block_cache_contains(cache, 8), 1);
+    cr_assert_eq(block_cache_read(cache, 7, block), 1);
+    cr_assert_eq(block[0], 2);
+
+    cr_assert_eq(block_cache_new(0, 2), NULL);
+
+    block_cache_destroy(cache);
+}
+
+Test(block_cache, block_cache_clear)
+{
+    block_cache_t *cache = block_cache_new(8, 2);
+    u8 block[8] = { 0 };
+
+    block_cache_write(cache, 1, block);
+    block_cache_write(cache, 2, block);
+    block_cache_clear(cache);
+
+    cr_assert_eq(block_cache_contains(cache, 1), 0);
+    cr_assert_eq(block_cache_contains(cache, 2), 0);
+
+    // The entries are reused after a clear
+    block_cache_write(cache, 3, block);
+    block_cache_write(cache, 4, block);
+    block_cache_write(cache, 5, block);
+
+    cr_assert_eq(block_cache_contains(cache, 3), 0);
+    cr_assert_eq(block_cache_contains(cache, 4), 1);
+    cr_assert_eq(block_cache_contains(cache, 5), 1);
+
+    block_cache_destroy(cache);
+}
+
+/**
+ * Create an empty file named after `path`, whose XXXXXX suffix is replaced
+ */
+static void temp_file(char *path)
+{
+    int fd = mkstemp(path);
+
+    cr_assert_geq(fd, 0);
+    close(fd);
+}
+
+static void overlay_setup_base(const char *path, u8 value, size_t size)
+{
+    u8 data[4096];
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    memset(data, value, sizeof(data));
+
+    for (size_t i = 0; i < size; i += sizeof(data))
+    {
+        cr_assert_eq(write(fd, data, sizeof(data)), sizeof(data));
+    }
+
+    close(fd);
+}
+
+Test(overlay, overlay_copy_on_write)
+{
+    u8 buffer[8192];
+    struct iovec iov = { .iov_base = buffer, .iov_len = sizeof(buffer) };
+    char base[] = "/tmp/blackhv_base_XXXXXX";
+    char path[] = "/tmp/blackhv_overlay_XXXXXX";
+
+    temp_file(base);
+    temp_file(path);
+    overlay_setup_base(base, 0xAA, 1 << 20);
+    cr_assert_eq(overlay_create(path, base, 12), 1);
+
+    overlay_t *overlay = overlay_open(path);
+    cr_assert_neq(overlay, NULL);
+
+    // Write across two clusters, the rest of them comes from the base
+    memset(buffer, 0x55, 100);
+    iov.iov_len = 100;
+    cr_assert_eq(overlay_writev(overlay, &iov, 1, 4096 - 50), 100);
+
+    iov.iov_len = sizeof(buffer);
+    cr_assert_eq(overlay_readv(overlay, &iov, 1, 0), sizeof(buffer));
+    cr_assert_eq(buffer[4096 - 51], 0xAA);
+    cr_assert_eq(buffer[4096 - 50], 0x55);
+    cr_assert_eq(buffer[4096 + 49], 0x55);
+    cr_assert_eq(buffer[4096 + 50], 0xAA);
+
+    // Short read at the end of the disk
+    cr_assert_eq(overlay_readv(overlay, &iov, 1, (1 << 20) - 4096), 4096);
+
+    overlay_close(overlay);
+
+    // The base image is never written
+    int fd = open(base, O_RDONLY);
+    cr_assert_eq(pread(fd, buffer, 100, 4096 - 50), 100);
+    cr_assert_eq(buffer[0], 0xAA);
+    close(fd);
+
+    unlink(path);
+    unlink(base);
+}
+
+Test(overlay, overlay_reopen)
+{
+    u8 buffer[4096];
+    struct iovec iov = { .iov_base = buffer, .iov_len = sizeof(buffer) };
+    char base[] = "/tmp/blackhv_base_XXXXXX";
+    char path[] = "/tmp/blackhv_overlay_XXXXXX";
+
+    temp_file(base);
+    temp_file(path);
+    overlay_setup_base(base, 0x11, 1 << 20);
+    cr_assert_eq(overlay_create(path, base, 16), 1);
+
+    overlay_t *overlay = overlay_open(path);
+    memset(buffer, 0x22, sizeof(buffer));
+    cr_assert_eq(overlay_writev(overlay, &iov, 1, 65536 * 3), sizeof(buffer));
+    cr_assert_eq(overlay_flush(overlay), 1);
+    overlay_close(overlay);
+
+    overlay = overlay_open(path);
+    cr_assert_neq(overlay, NULL);
+    cr_assert_eq(overlay_disk(overlay).size, 1 << 20);
+    cr_assert_eq(overlay_readv(overlay, &iov, 1, 65536 * 3), sizeof(buffer));
+    cr_assert_eq(buffer[0], 0x22);
+    cr_assert_eq(overlay_readv(overlay, &iov, 1, 65536 * 4), sizeof(buffer));
+    cr_assert_eq(buffer[0], 0x11);
+    overlay_close(overlay);
+
+    cr_assert_eq(overlay_open(base), NULL);
+
+    unlink(path);
+    unlink(base);
+}
+
+Test(zimage, zimage_roundtrip)
+{
+    u8 buffer[8192];
+    struct iovec iov[2] = { { .iov_base = buffer, .iov_len = 100 },
+                            { .iov_base = buffer + 100, .iov_len = 8092 } };
+    u64 hits;
+    u64 misses;
+    char raw[] = "/tmp/blackhv_raw_XXXXXX";
+    char path[] = "/tmp/blackhv_zimage_XXXXXX";
+
+    // Half zeros, half incompressible data, with a short last chunk
+    int in_fd = mkstemp(raw);
+    cr_assert_geq(in_fd, 0);
+    for (u32 i = 0; i < 40000; ++i)
+    {
+        u8 value = i < 20000 ? 0 : (i * 2654435761U) >> 24;
+        cr_assert_eq(write(in_fd, &value, 1), 1);
+    }
+
+    lseek(in_fd, 0, SEEK_SET);
+    int out_fd = mkstemp(path);
+    cr_assert_geq(out_fd, 0);
+    cr_assert_eq(zimage_convert(in_fd, out_fd, 4096, 6), 1);
+    close(out_fd);
+
+    zimage_t *zimage = zimage_open(path);
+    cr_assert_neq(zimage, NULL);
+    cr_assert_eq(zimage_disk(zimage).size, 40000);
+
+    // Across chunk boundaries and the two halves
+    cr_assert_eq(zimage_readv(zimage, iov, 2, 16000), sizeof(buffer));
+    for (u32 i = 0; i < sizeof(buffer); ++i)
+    {
+        u8 value = 0;
+        cr_assert_eq(pread(in_fd, &value, 1, 16000 + i), 1);
+        cr_assert_eq(buffer[i], value);
+    }
+
+    // Cached chunks are not decompressed again
+    cr_assert_eq(zimage_readv(zimage, iov, 1, 16000), 100);
+    zimage_stats(zimage, &hits, &misses);
+    cr_assert_eq(misses, 3);
+    cr_assert_eq(hits, 1);
+
+    // Short read at the end of the image
+    cr_assert_eq(zimage_readv(zimage, iov, 2, 36000), 4000);
+    cr_assert_eq(zimage_readv(zimage, iov, 2, 40000), 0);
+
+    zimage_close(zimage);
+    close(in_fd);
+
+    cr_assert_eq(zimage_open(raw), NULL);
+
+    unlink(path);
+    unlink(raw);
+}
+
+/**
+ * vm without KVM whose guest RAM is a plain mapping at address 0, for the
+ * devices which only access it with the memory functions
+ */
+static vm_t *fake_vm(u64 size)
+{
+    vm_t *vm = calloc(1, sizeof(vm_t));
+    struct memory_entry *ram = calloc(1, sizeof(struct memory_entry));
+
+    cr_assert_neq(vm, NULL);
+    cr_assert_neq(ram, NULL);
+
+    vm->kvm_fd = -1;
+    vm->vm_fd = -1;
+    vm->vcpu_fd = -1;
+    vm->mem = memory_new();
+    cr_assert_neq(vm->mem, NULL);
+
+    ram->memory_ptr = mmap(NULL,
+                           size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1,
+                           0);
+    cr_assert_neq(ram->memory_ptr, MAP_FAILED);
+    ram->size = size;
+    ram->type = MEMORY_USABLE;
+    linked_list_add(vm->mem->memory_entries, ram);
+
+    return vm;
+}
+
+static void fake_vm_free(vm_t *vm)
+{
+    memory_destroy(vm->mem);
+    free(vm);
+}
+
+#define AHCI_PX(REG) (0x100 + (REG))
+#define AHCI_PX_CLB 0x00
+#define AHCI_PX_FB 0x08
+#define AHCI_PX_IS 0x10
+#define AHCI_PX_CMD 0x18
+#define AHCI_PX_TFD 0x20
+#define AHCI_PX_SACT 0x34
+#define AHCI_PX_CI 0x38
+#define AHCI_CLB 0x1000
+#define AHCI_FB 0x2000
+#define AHCI_TABLES 0x4000 // 0x100 bytes per slot
+#define AHCI_SECTORS 64
+
+static void abar_write(u32 offset, u32 value)
+{
+    u8 data[8] = { 0 };
+
+    memcpy(data, &value, sizeof(value));
+    mmio_handle_write(AHCI_ABAR_BASE + offset, data, sizeof(value));
+}
+
+static u32 abar_read(u32 offset)
+{
+    u8 data[8];
+    u32 value;
+
+    mmio_handle_read(AHCI_ABAR_BASE + offset, data, sizeof(value));
+    memcpy(&value, data, sizeof(value));
+
+    return value;
+}
+
+/**
+ * Wait for the workers to clear the `mask` bits of a port register
+ */
+static void ahci_wait(u32 reg, u32 mask)
+{
+    for (u32 tries = 0; abar_read(AHCI_PX(reg)) & mask; ++tries)
+    {
+        cr_assert_lt(tries, 5000);
+        usleep(1000);
+    }
+}
+
+/**
+ * Disk of AHCI_SECTORS sectors whose bytes are the sector number, and an
+ * HBA with port 0 started
+ */
+static ahci_t *ahci_setup(vm_t *vm, char *path, int *fd)
+{
+    u8 sector[512];
+
+    *fd = mkstemp(path);
+    cr_assert_geq(*fd, 0);
+
+    for (u32 i = 0; i < AHCI_SECTORS; ++i)
+    {
+        memset(sector, i, sizeof(sector));
+        cr_assert_eq(write(*fd, sector, sizeof(sector)), sizeof(sector));
+    }
+
+    mmio_init();
+    ahci_t *ahci = ahci_new(vm, AHCI_IRQ, raw_disk(*fd));
+    cr_assert_neq(ahci, NULL);
+
+    abar_write(AHCI_PX(AHCI_PX_CLB), AHCI_CLB);
+    abar_write(AHCI_PX(AHCI_PX_FB), AHCI_FB);
+    abar_write(AHCI_PX(AHCI_PX_CMD), 0x11); // FRE | ST
+
+    return ahci;
+}
+
+/**
+ * Fill the command header, the command FIS and the PRD table of a slot, each
+ * PRD entry is one sector at `buffer` + 1 KB * index
+ */
+static void ahci_command(vm_t *vm,
+                         u32 slot,
+                         u8 command,
+                         u64 lba,
+                         u32 count,
+                         u32 buffer,
+                         u32 nb_prd)
+{
+    u8 header[32] = { 0 };
+    u8 fis[20] = { 0 };
+    u32 table = AHCI_TABLES + slot * 0x100;
+
+    header[0] = sizeof(fis) / 4;
+    header[2] = nb_prd;
+    memcpy(header + 8, &table, sizeof(table));
+    memory_write(vm, AHCI_CLB + slot * sizeof(header), header, sizeof(header));
+
+    fis[0] = 0x27; // Register host to device
+    fis[1] = 0x80; // Command
+    fis[2] = command;
+    fis[7] = 0x40; // LBA mode
+
+    for (u32 i = 0; i < 3; ++i)
+    {
+        fis[4 + i] = lba >> (8 * i);
+        fis[8 + i] = lba >> (24 + 8 * i);
+    }
+
+    // Queued commands have the count in the features and the tag in count
+    if (command == 0x60 || command == 0x61)
+    {
+        fis[3] = count;
+        fis[11] = count >> 8;
+        fis[12] = slot << 3;
+    }
+    else
+    {
+        fis[12] = count;
+        fis[13] = count >> 8;
+    }
+
+    memory_write(vm, table, fis, sizeof(fis));
+
+    for (u32 i = 0; i < nb_prd; ++i)
+    {
+        u32 prd[4] = { buffer + i * 1024, 0, 0, 511 };
+
+        memory_write(vm, table + 0x80 + i * sizeof(prd), (u8 *)prd, 16);
+    }
+}
+
+static void ahci_check_sector(vm_t *vm, u64 address, u8 value)
+{
+    u8 sector[512];
+
+    cr_assert_eq(memory_read(vm, address, sector, sizeof(sector)), 512);
+
+    for (u32 i = 0; i < sizeof(sector); ++i)
+    {
+        cr_assert_eq(sector[i], value);
+    }
+}
+
+/**
+ * The last command of the slots in `bits` was aborted
+ */
+static void ahci_check_abort(u32 bits)
+{
+    ahci_wait(AHCI_PX_CI, bits);
+    cr_assert_eq(abar_read(AHCI_PX(AHCI_PX_TFD)), 0x441); // ABRT, DRDY, ERR
+    cr_assert_neq(abar_read(AHCI_PX(AHCI_PX_IS)) & (1U << 30), 0);
+    abar_write(AHCI_PX(AHCI_PX_IS), ~0U);
+}
+
+Test(ahci, ahci_command_decoding)
+{
+    char path[] = "/tmp/blackhv_ahci_XXXXXX";
+    vm_t *vm = fake_vm(MB_1);
+    u32 prdbc = 0;
+    u8 type = 0;
+    int fd;
+    ahci_t *ahci = ahci_setup(vm, path, &fd);
+
+    // READ DMA EXT scattered over three PRD entries
+    ahci_command(vm, 0, 0x25, 5, 3, 0x10000, 3);
+    abar_write(AHCI_PX(AHCI_PX_CI), 1);
+    ahci_wait(AHCI_PX_CI, 1);
+
+    for (u32 i = 0; i < 3; ++i)
+    {
+        ahci_check_sector(vm, 0x10000 + i * 1024, 5 + i);
+    }
+
+    memory_read(vm, AHCI_CLB + 4, (u8 *)&prdbc, sizeof(prdbc));
+    cr_assert_eq(prdbc, 3 * 512);
+    cr_assert_eq(abar_read(AHCI_PX(AHCI_PX_TFD)), 0x50); // DRDY, DSC
+    cr_assert_neq(abar_read(AHCI_PX(AHCI_PX_IS)) & 1, 0); // D2H FIS
+    memory_read(vm, AHCI_FB + 0x40, &type, 1);
+    cr_assert_eq(type, 0x34);
+
+    // 28 bits READ DMA
+    ahci_command(vm, 1, 0xC8, 2, 1, 0x20000, 1);
+    abar_write(AHCI_PX(AHCI_PX_CI), 1U << 1);
+    ahci_wait(AHCI_PX_CI, 1U << 1);
+    ahci_check_sector(vm, 0x20000, 2);
+
+    // The PRD table is shorter than the transfer
+    ahci_command(vm, 2, 0x25, 0, 2, 0x30000, 1);
+    abar_write(AHCI_PX(AHCI_PX_CI), 1U << 2);
+    ahci_check_abort(1U << 2);
+
+    // Buffer outside of the guest RAM
+    ahci_command(vm, 3, 0x25, 0, 1, 2 * MB_1, 1);
+    abar_write(AHCI_PX(AHCI_PX_CI), 1U << 3);
+    ahci_check_abort(1U << 3);
+
+    // Past the end of the disk
+    ahci_command(vm, 4, 0x25, AHCI_SECTORS - 1, 2, 0x30000, 2);
+    abar_write(AHCI_PX(AHCI_PX_CI), 1U << 4);
+    ahci_check_abort(1U << 4);
+
+    // Not a register host to device FIS, rejected when issued
+    ahci_command(vm, 5, 0x25, 0, 1, 0x30000, 1);
+    memory_write(vm, AHCI_TABLES + 5 * 0x100, (u8 *)"\x34", 1);
+    abar_write(AHCI_PX(AHCI_PX_CI), 1U << 5);
+    cr_assert_eq(abar_read(AHCI_PX(AHCI_PX_CI)), 0);
+    ahci_check_abort(1U << 5);
+
+    ahci_destroy(ahci);
+    fake_vm_free(vm);
+    close(fd);
+    unlink(path);
+}
+
+Test(ahci, ahci_ncq_slots)
+{
+    char path[] = "/tmp/blackhv_ahci_XXXXXX";
+    vm_t *vm = fake_vm(MB_1);
+    u8 sector[512];
+    u32 prdbc = 0;
+    u8 type = 0;
+    int fd;
+    ahci_t *ahci = ahci_setup(vm, path, &fd);
+
+    // Queued commands leave PxCI as soon as they are issued
+    ahci_command(vm, 3, 0x60, 10, 2, 0x10000, 2);
+    ahci_command(vm, 7, 0x60, 20, 1, 0x20000, 1);
+    abar_write(AHCI_PX(AHCI_PX_SACT), 0x88);
+    abar_write(AHCI_PX(AHCI_PX_CI), 0x88);
+    cr_assert_eq(abar_read(AHCI_PX(AHCI_PX_CI)), 0);
+
+    // Each tag is cleared from PxSACT by a Set Device Bits FIS
+    ahci_wait(AHCI_PX_SACT, 0x88);
+    ahci_check_sector(vm, 0x10000, 10);
+    ahci_check_sector(vm, 0x10000 + 1024, 11);
+    ahci_check_sector(vm, 0x20000, 20);
+    memory_read(vm, AHCI_CLB + 3 * 32 + 4, (u8 *)&prdbc, sizeof(prdbc));
+    cr_assert_eq(prdbc, 2 * 512);
+    cr_assert_neq(abar_read(AHCI_PX(AHCI_PX_IS)) & (1U << 3), 0);
+    memory_read(vm, AHCI_FB + 0x58, &type, 1);
+    cr_assert_eq(type, 0xA1);
+
+    // Queued write
+    memset(sector, 0xEE, sizeof(sector));
+    memory_write(vm, 0x30000, sector, sizeof(sector));
+    ahci_command(vm, 1, 0x61, 30, 1, 0x30000, 1);
+    abar_write(AHCI_PX(AHCI_PX_SACT), 1U << 1);
+    abar_write(AHCI_PX(AHCI_PX_CI), 1U << 1);
+    ahci_wait(AHCI_PX_SACT, 1U << 1);
+    cr_assert_eq(pread(fd, sector, sizeof(sector), 30 * 512), 512);
+    cr_assert_eq(sector[0], 0xEE);
+    cr_assert_eq(sector[511], 0xEE);
+
+    // Stopping the port forgets the tags, then commands are ignored
+    abar_write(AHCI_PX(AHCI_PX_SACT), 1U << 9);
+    cr_assert_eq(abar_read(AHCI_PX(AHCI_PX_SACT)), 1U << 9);
+    abar_write(AHCI_PX(AHCI_PX_CMD), 0x10); // FRE
+    cr_assert_eq(abar_read(AHCI_PX(AHCI_PX_SACT)), 0);
+    abar_write(AHCI_PX(AHCI_PX_CI), 1);
+    cr_assert_eq(abar_read(AHCI_PX(AHCI_PX_CI)), 0);
+
+    ahci_destroy(ahci);
+    fake_vm_free(vm);
+    close(fd);
+    unlink(path);
+}
+
+static void dispi_write(u16 index, u16 value)
+{
+    io_handle_outw(VBE_DISPI_IOPORT_INDEX, index);
+    io_handle_outw(VBE_DISPI_IOPORT_DATA, value);
+}
+
+static u16 dispi_read(u16 index)
+{
+    u16 value = 0;
+
+    io_handle_outw(VBE_DISPI_IOPORT_INDEX, index);
+    io_handle_inw(VBE_DISPI_IOPORT_DATA, &value);
+
+    return value;
+}
+
+Test(vbe, vbe_register_validation)
+{
+    vm_t *vm = fake_vm(VBE_VRAM_SIZE);
+    vbe_t *vbe = vbe_new(vm, 0);
+    struct vbe_mode mode;
+
+    cr_assert_neq(vbe, NULL);
+    u32 generation = vbe_get_mode(vbe, &mode);
+    cr_assert_eq(mode.width, FB_WIDTH);
+    cr_assert_eq(mode.bpp, FB_BPP * 8);
+
+    // Only the known interface versions are accepted
+    dispi_write(VBE_DISPI_INDEX_ID, 0xB0C2);
+    dispi_write(VBE_DISPI_INDEX_ID, 0x1234);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_ID), 0xB0C2);
+
+    // Widths are multiples of 8, up to the maximum mode
+    dispi_write(VBE_DISPI_INDEX_XRES, 1024);
+    dispi_write(VBE_DISPI_INDEX_XRES, 1001);
+    dispi_write(VBE_DISPI_INDEX_XRES, VBE_MAX_XRES + 8);
+    dispi_write(VBE_DISPI_INDEX_XRES, 0);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_XRES), 1024);
+    dispi_write(VBE_DISPI_INDEX_YRES, 768);
+    dispi_write(VBE_DISPI_INDEX_YRES, VBE_MAX_YRES + 1);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_YRES), 768);
+    dispi_write(VBE_DISPI_INDEX_BPP, 16);
+    dispi_write(VBE_DISPI_INDEX_BPP, 12);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_BPP), 16);
+
+    dispi_write(VBE_DISPI_INDEX_ENABLE,
+                VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED);
+    cr_assert_neq(vbe_get_mode(vbe, &mode), generation);
+    cr_assert_eq(mode.width, 1024);
+    cr_assert_eq(mode.height, 768);
+    cr_assert_eq(mode.bpp, 16);
+    cr_assert_eq(mode.pitch, 1024 * 2);
+    cr_assert_eq(mode.offset, 0);
+
+    // The geometry is fixed while the display is enabled
+    dispi_write(VBE_DISPI_INDEX_XRES, 640);
+    dispi_write(VBE_DISPI_INDEX_BPP, 32);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_XRES), 1024);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_BPP), 16);
+
+    // Capabilities
+    dispi_write(VBE_DISPI_INDEX_ENABLE,
+                VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED
+                    | VBE_DISPI_GETCAPS);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_XRES), VBE_MAX_XRES);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_YRES), VBE_MAX_YRES);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_BPP), VBE_MAX_BPP);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_VIDEO_MEMORY_64K),
+                 VBE_VRAM_SIZE / 0x10000);
+
+    // Back to the default mode once disabled
+    dispi_write(VBE_DISPI_INDEX_ENABLE, 0);
+    vbe_get_mode(vbe, &mode);
+    cr_assert_eq(mode.width, FB_WIDTH);
+    cr_assert_eq(mode.height, FB_HEIGHT);
+
+    vbe_destroy(vbe);
+    fake_vm_free(vm);
+}
+
+Test(vbe, vbe_offset_clamping)
+{
+    vm_t *vm = fake_vm(VBE_VRAM_SIZE);
+    vbe_t *vbe = vbe_new(vm, 0);
+    struct vbe_mode mode;
+
+    dispi_write(VBE_DISPI_INDEX_XRES, 1024);
+    dispi_write(VBE_DISPI_INDEX_YRES, 768);
+    dispi_write(VBE_DISPI_INDEX_BPP, 32);
+    dispi_write(VBE_DISPI_INDEX_ENABLE,
+                VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED);
+
+    // The virtual width is at least the visible one, the height fills the
+    // video memory
+    dispi_write(VBE_DISPI_INDEX_VIRT_WIDTH, 800);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_VIRT_WIDTH), 1024);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_VIRT_HEIGHT),
+                 VBE_VRAM_SIZE / (1024 * 4));
+
+    dispi_write(VBE_DISPI_INDEX_VIRT_WIDTH, 2048);
+    dispi_write(VBE_DISPI_INDEX_VIRT_WIDTH, VBE_MAX_XRES * 2 + 8);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_VIRT_WIDTH), 2048);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_VIRT_HEIGHT),
+                 VBE_VRAM_SIZE / (2048 * 4));
+
+    // The visible area stays in the video memory
+    dispi_write(VBE_DISPI_INDEX_X_OFFSET, 5000);
+    dispi_write(VBE_DISPI_INDEX_Y_OFFSET, 0xFFFF);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_X_OFFSET), 2048 - 1024);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_Y_OFFSET),
+                 VBE_VRAM_SIZE / (2048 * 4) - 768);
+
+    vbe_get_mode(vbe, &mode);
+    cr_assert_eq(mode.pitch, 2048 * 4);
+    cr_assert_eq(mode.offset,
+                 (u64)(VBE_VRAM_SIZE / (2048 * 4) - 768) * 2048 * 4
+                     + 1024 * 4);
+    cr_assert_leq(mode.offset + (u64)mode.pitch * (mode.height - 1)
+                      + mode.width * 4,
+                  VBE_VRAM_SIZE);
+
+    // Enabling again resets the panning
+    dispi_write(VBE_DISPI_INDEX_ENABLE, 0);
+    dispi_write(VBE_DISPI_INDEX_ENABLE,
+                VBE_DISPI_ENABLED | VBE_DISPI_NOCLEARMEM);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_X_OFFSET), 0);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_Y_OFFSET), 0);
+    cr_assert_eq(dispi_read(VBE_DISPI_INDEX_VIRT_WIDTH), 1024);
+
+    vbe_destroy(vbe);
+    fake_vm_free(vm);
+}
+
+#define VIRTQ_TEST_BASE 0xD0000000
+#define VIRTQ_TEST_NUM 8
+
+static void virtio_reg_write(u32 offset, u32 value)
+{
+    u8 data[8] = { 0 };
+
+    memcpy(data, &value, sizeof(value));
+    mmio_handle_write(VIRTQ_TEST_BASE + offset, data, sizeof(value));
+}
+
+static u32 virtio_reg_read(u32 offset)
+{
+    u8 data[8];
+    u32 value;
+
+    mmio_handle_read(VIRTQ_TEST_BASE + offset, data, sizeof(value));
+    memcpy(&value, data, sizeof(value));
+
+    return value;
+}
+
+/**
+ * Negotiate `features` and set up queue 0 like a driver, with the
+ * descriptors at 0x1000, the avail ring at 0x2000 and the used ring at 0x3000
+ */
+static struct virtq *virtio_setup(struct virtio_device *dev,
+                                  vm_t *vm,
+                                  u64 features)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->device_id = VIRTIO_ID_CONSOLE;
+    dev->device_features = features;
+    dev->num_queues = 1;
+
+    mmio_init();
+    cr_assert_eq(virtio_device_init(dev, vm, VIRTQ_TEST_BASE, 5), 1);
+
+    features |= VIRTIO_FEATURE(VIRTIO_F_VERSION_1);
+    virtio_reg_write(0x070, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    virtio_reg_write(0x024, 0);
+    virtio_reg_write(0x020, features);
+    virtio_reg_write(0x024, 1);
+    virtio_reg_write(0x020, features >> 32);
+    virtio_reg_write(0x070,
+                     VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER
+                         | VIRTIO_STATUS_FEATURES_OK);
+    cr_assert_neq(virtio_reg_read(0x070) & VIRTIO_STATUS_FEATURES_OK, 0);
+
+    virtio_reg_write(0x030, 0);
+    virtio_reg_write(0x038, VIRTQ_TEST_NUM);
+    virtio_reg_write(0x080, 0x1000);
+    virtio_reg_write(0x090, 0x2000);
+    virtio_reg_write(0x0A0, 0x3000);
+    virtio_reg_write(0x044, 1);
+    cr_assert_eq(virtio_reg_read(0x044), 1);
+
+    return &dev->queues[0];
+}
+
+/**
+ * Make the chain starting at `head` available, like the driver
+ */
+static void virtq_make_available(struct virtq *vq, u16 head)
+{
+    vq->avail->ring[vq->avail->idx % vq->num] = head;
+    __atomic_store_n(&vq->avail->idx, vq->avail->idx + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return 1 if the device raised a queue interrupt since the last call
+ */
+static u32 virtq_interrupted(void)
+{
+    u32 status = virtio_reg_read(0x060) & VIRTIO_INT_VRING;
+
+    virtio_reg_write(0x064, status);
+
+    return status != 0;
+}
+
+Test(virtio, virtq_pop_push)
+{
+    vm_t *vm = fake_vm(MB_1);
+    struct virtio_device dev;
+    struct virtq_chain chain;
+    struct virtq *vq = virtio_setup(&dev, vm, 0);
+
+    // Readable header followed by a writable buffer, then a single buffer
+    vq->desc[0] = (struct virtq_desc){ 0x10000, 16, VIRTQ_DESC_F_NEXT, 1 };
+    vq->desc[1] = (struct virtq_desc){ 0x11000, 32, VIRTQ_DESC_F_WRITE, 0 };
+    vq->desc[2] = (struct virtq_desc){ 0x12000, 8, 0, 0 };
+    virtq_make_available(vq, 0);
+    virtq_make_available(vq, 2);
+
+    cr_assert_eq(virtq_pop(&dev, vq, &chain), 1);
+    cr_assert_eq(chain.head, 0);
+    cr_assert_eq(chain.out_num, 1);
+    cr_assert_eq(chain.in_num, 1);
+    cr_assert_eq(chain.iov[0].iov_base, memory_get_ptr(vm, 0x10000));
+    cr_assert_eq(chain.iov[0].iov_len, 16);
+    cr_assert_eq(chain.iov[1].iov_base, memory_get_ptr(vm, 0x11000));
+    cr_assert_eq(chain.iov[1].iov_len, 32);
+
+    cr_assert_eq(virtq_pop(&dev, vq, &chain), 1);
+    cr_assert_eq(chain.head, 2);
+    cr_assert_eq(chain.out_num, 1);
+    cr_assert_eq(chain.in_num, 0);
+    cr_assert_eq(virtq_pop(&dev, vq, &chain), 0);
+
+    // Completed out of order
+    virtq_push(vq, 2, 0);
+    virtq_push(vq, 0, 32);
+    cr_assert_eq(vq->used->idx, 2);
+    cr_assert_eq(vq->used->ring[0].id, 2);
+    cr_assert_eq(vq->used->ring[1].id, 0);
+    cr_assert_eq(vq->used->ring[1].len, 32);
+
+    // Malformed chains go back to the driver and are skipped: readable after
+    // writable, outside of the guest RAM, and a loop longer than the queue
+    vq->desc[3] = (struct virtq_desc){
+        0x13000, 8, VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE, 4
+    };
+    vq->desc[4] = (struct virtq_desc){ 0x14000, 8, 0, 0 };
+    vq->desc[5] = (struct virtq_desc){ 2 * MB_1, 8, 0, 0 };
+    vq->desc[6] = (struct virtq_desc){ 0x16000, 8, VIRTQ_DESC_F_NEXT, 6 };
+    virtq_make_available(vq, 3);
+    virtq_make_available(vq, 5);
+    virtq_make_available(vq, 6);
+    virtq_make_available(vq, VIRTQ_TEST_NUM);
+    cr_assert_eq(virtq_pop(&dev, vq, &chain), 0);
+    cr_assert_eq(vq->used->idx, 6);
+
+    for (u32 i = 2; i < 6; ++i)
+    {
+        cr_assert_eq(vq->used->ring[i].len, 0);
+    }
+
+    cr_assert_eq(vq->used->ring[2].id, 3);
+    cr_assert_eq(vq->used->ring[5].id, VIRTQ_TEST_NUM);
+
+    // The rings wrap around
+    for (u32 i = 0; i < VIRTQ_TEST_NUM; ++i)
+    {
+        virtq_make_available(vq, 2);
+        cr_assert_eq(virtq_pop(&dev, vq, &chain), 1);
+        virtq_push(vq, chain.head, i);
+    }
+
+    u16 last = vq->used->idx - 1;
+
+    cr_assert_eq(vq->used->idx, 6 + VIRTQ_TEST_NUM);
+    cr_assert_eq(vq->used->ring[last % VIRTQ_TEST_NUM].len, 7);
+
+    virtio_device_uninit(&dev);
+    fake_vm_free(vm);
+}
+
+Test(virtio, virtq_notify_flags)
+{
+    vm_t *vm = fake_vm(MB_1);
+    struct virtio_device dev;
+    struct virtq *vq = virtio_setup(&dev, vm, 0);
+
+    virtq_push(vq, 0, 0);
+    virtq_notify(&dev, vq);
+    cr_assert_eq(virtq_interrupted(), 1);
+
+    // Nothing new since the last interrupt
+    virtq_notify(&dev, vq);
+    cr_assert_eq(virtq_interrupted(), 0);
+
+    vq->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    virtq_push(vq, 0, 0);
+    virtq_notify(&dev, vq);
+    cr_assert_eq(virtq_interrupted(), 0);
+
+    // Kicks are suppressed with the used ring flags
+    virtq_disable_notify(&dev, vq);
+    cr_assert_eq(vq->used->flags, VIRTQ_USED_F_NO_NOTIFY);
+    cr_assert_eq(virtq_enable_notify(&dev, vq), 0);
+    cr_assert_eq(vq->used->flags, 0);
+
+    virtio_device_uninit(&dev);
+    fake_vm_free(vm);
+}
+
+Test(virtio, virtq_event_idx)
+{
+    vm_t *vm = fake_vm(MB_1);
+    struct virtio_device dev;
+    struct virtq_chain chain;
+    struct virtq *vq =
+        virtio_setup(&dev, vm, VIRTIO_FEATURE(VIRTIO_RING_F_EVENT_IDX));
+    u16 *used_event = &vq->avail->ring[vq->num];
+    u16 *avail_event = (u16 *)&vq->used->ring[vq->num];
+
+    cr_assert_eq(virtio_has_feature(&dev, VIRTIO_RING_F_EVENT_IDX), 1);
+
+    // The driver asks for an interrupt once the used index passes used_event
+    *used_event = 0;
+    virtq_push(vq, 0, 0);
+    virtq_notify(&dev, vq);
+    cr_assert_eq(virtq_interrupted(), 1);
+
+    *used_event = 5;
+    virtq_push(vq, 0, 0);
+    virtq_push(vq, 0, 0);
+    virtq_notify(&dev, vq);
+    cr_assert_eq(virtq_interrupted(), 0);
+
+    virtq_push(vq, 0, 0);
+    virtq_push(vq, 0, 0);
+    virtq_push(vq, 0, 0);
+    virtq_notify(&dev, vq);
+    cr_assert_eq(virtq_interrupted(), 1);
+
+    // The used index passed used_event between two batches
+    virtq_push(vq, 0, 0);
+    virtq_notify(&dev, vq);
+    cr_assert_eq(virtq_interrupted(), 0);
+
+    // The flags are not used, avail_event tells where to kick
+    vq->desc[0] = (struct virtq_desc){ 0x10000, 16, 0, 0 };
+    virtq_make_available(vq, 0);
+    virtq_disable_notify(&dev, vq);
+    cr_assert_eq(vq->used->flags, 0);
+    cr_assert_eq(virtq_pop(&dev, vq, &chain), 1);
+    cr_assert_eq(virtq_enable_notify(&dev, vq), 0);
+    cr_assert_eq(*avail_event, 1);
+
+    // A chain made available before the kicks are enabled again
+    virtq_make_available(vq, 0);
+    cr_assert_eq(virtq_enable_notify(&dev, vq), 1);
+
+    virtio_device_uninit(&dev);
+    fake_vm_free(vm);
+}
+
+static const u32 pixel_bpps[] = { 8, 15, 16, 24, 32 };
+
+Test(pixel, pixel_convert_values)
+{
+    u32 palette[256] = { [7] = 0x123456 };
+    u8 pal8[] = { 7 };
+    u8 rgb555[] = { 0x1F, 0x7C }; // Red 31, blue 31
+    u8 rgb565[] = { 0xE0, 0x07 }; // Green 63
+    u8 bgr24[] = { 0x11, 0x22, 0x33 };
+    u8 xrgb32[] = { 0x11, 0x22, 0x33, 0x00 };
+    u32 out;
+
+    pixel_convert(&out, pal8, 1, 8, palette);
+    cr_assert_eq(out, 0xFF123456);
+    pixel_convert(&out, rgb555, 1, 15, NULL);
+    cr_assert_eq(out, 0xFFFF00FF);
+    pixel_convert(&out, rgb565, 1, 16, NULL);
+    cr_assert_eq(out, 0xFF00FF00);
+    pixel_convert(&out, bgr24, 1, 24, NULL);
+    cr_assert_eq(out, 0xFF332211);
+    pixel_convert(&out, xrgb32, 1, 32, NULL);
+    cr_assert_eq(out, 0xFF332211);
+}
+
+Test(pixel, pixel_isas_match)
+{
+    // Odd length for the scalar tails
+    u64 nb_pixels = 1021;
+    u8 *src = malloc(nb_pixels * 4);
+    u32 *expected = malloc(nb_pixels * 4);
+    u32 *out = malloc(nb_pixels * 4);
+    u32 palette[256];
+    u32 best = pixel_get_isa();
+
+    for (u32 i = 0; i < nb_pixels * 4; ++i)
+    {
+        src[i] = (i * 2654435761U) >> 24;
+    }
+
+    for (u32 i = 0; i < 256; ++i)
+    {
+        palette[i] = i * 0x010203;
+    }
+
+    for (u32 b = 0; b < sizeof(pixel_bpps) / sizeof(*pixel_bpps); ++b)
+    {
+        cr_assert_eq(pixel_set_isa(PIXEL_ISA_SCALAR), 1);
+        pixel_convert(expected, src, nb_pixels, pixel_bpps[b], palette);
+
+        for (u32 isa = PIXEL_ISA_SSE2; isa <= PIXEL_ISA_AVX2; ++isa)
+        {
+            if (!pixel_set_isa(isa))
+            {
+                continue;
+            }
+
+            pixel_convert(out, src, nb_pixels, pixel_bpps[b], palette);
+            cr_assert_arr_eq(out, expected, nb_pixels * 4);
+        }
+    }
+
+    pixel_set_isa(best);
+    free(src);
+    free(expected);
+    free(out);
+}
+
+Test(recorder, recorder_roundtrip)
+{
+    struct vbe_mode mode = { .width = 16, .height = 8, .bpp = 32, .pitch = 80 };
+    u32 frame[20 * 8] = { 0 }; // 4 pixels of padding per row
+    u32 palette[256] = { [1] = 0x00FF00 };
+    u8 small[8 * 4] = { 0 };
+    struct recorder_frame header;
+    char path[] = "/tmp/blackhv_recording_XXXXXX";
+
+    temp_file(path);
+
+    for (u32 i = 0; i < 20 * 8; ++i)
+    {
+        frame[i] = i < 40 ? 0x123456 : i;
+    }
+
+    recorder_t *recorder = recorder_new(path);
+    cr_assert_neq(recorder, NULL);
+
+    // The first frame is complete whatever the damage
+    recorder_begin_frame(recorder, &mode, (u8 *)frame, NULL);
+    recorder_end_frame(recorder);
+
+    // Only the damaged rows are recorded, unchanged ones are skipped
+    frame[3 * 20 + 2] = 0xABCDEF;
+    frame[6 * 20 + 15] = 0xFEDCBA;
+    frame[7 * 20] = 0x111111;
+    recorder_begin_frame(recorder, &mode, (u8 *)frame, NULL);
+    recorder_add_rows(recorder, 2, 2);
+    recorder_add_rows(recorder, 3, 5);
+    recorder_end_frame(recorder);
+
+    // Same pixels, no frame
+    recorder_begin_frame(recorder, &mode, (u8 *)frame, NULL);
+    recorder_add_rows(recorder, 0, 8);
+    recorder_end_frame(recorder);
+
+    struct vbe_mode small_mode = {
+        .width = 8, .height = 4, .bpp = 8, .pitch = 8
+    };
+
+    small[9] = 1;
+    recorder_begin_frame(recorder, &small_mode, small, palette);
+    recorder_add_rows(recorder, 1, 1);
+    recorder_end_frame(recorder);
+
+    recorder_destroy(recorder);
+
+    recording_t *recording = recording_open(path);
+    cr_assert_neq(recording, NULL);
+
+    for (u32 i = 0; i < 2; ++i)
+    {
+        const u32 *pixels = recording_next(recording, &header);
+        cr_assert_neq(pixels, NULL);
+        cr_assert_eq(header.width, 16);
+        cr_assert_eq(header.height, 8);
+
+        for (u32 p = 0; p < 16 * 8; ++p)
+        {
+            u32 expected = frame[p / 16 * 20 + p % 16] | 0xFF000000;
+
+            // The first frame misses the later changes
+            if (i == 0 && (p == 3 * 16 + 2 || p == 6 * 16 + 15 || p == 7 * 16))
+            {
+                continue;
+            }
+
+            cr_assert_eq(pixels[p], expected);
+        }
+    }
+
+    const u32 *pixels = recording_next(recording, &header);
+    cr_assert_neq(pixels, NULL);
+    cr_assert_eq(header.width, 8);
+    cr_assert_eq(pixels[9], 0xFF00FF00);
+    cr_assert_eq(pixels[0], 0);
+    cr_assert_eq(recording_next(recording, &header), NULL);
+    recording_close(recording);
+
+    unlink(path);
+}
+
+Test(vga_text, vga_text_render)
+{
+    vga_text_t *text = vga_text_new();
+    u16 cells[VGA_TEXT_CELLS] = { 0 };
+    u32 first_row;
+    u32 last_row;
+
+    cr_assert_neq(text, NULL);
+
+    // White on blue 'A', its first row is 0x0C
+    cells[0] = 0x1F00 | 'A';
+    cr_assert_eq(vga_text_render(text, cells, &first_row, &last_row),
+                 VGA_TEXT_CELLS);
+    cr_assert_eq(first_row, 0);
+    cr_assert_eq(last_row, VGA_TEXT_HEIGHT - 1);
+
+    const u32 *frame = vga_text_get_frame(text);
+    cr_assert_eq(frame[0], 0xFF0000AA);
+    cr_assert_eq(frame[2], 0xFFFFFFFF);
+    cr_assert_eq(frame[VGA_TEXT_WIDTH + 3], 0xFFFFFFFF);
+    cr_assert_eq(frame[VGA_GLYPH_WIDTH], 0xFF000000);
+
+    // Only the changed cells are rendered
+    cr_assert_eq(vga_text_render(text, cells, &first_row, &last_row), 0);
+    cells[3 * VGA_TEXT_COLS + 5] = 0x0400 | 0xDB;
+    cr_assert_eq(vga_text_render(text, cells, &first_row, &last_row), 1);
+    cr_assert_eq(first_row, 3 * VGA_GLYPH_HEIGHT);
+    cr_assert_eq(last_row, 4 * VGA_GLYPH_HEIGHT - 1);
+    cr_assert_eq(frame[3 * VGA_GLYPH_HEIGHT * VGA_TEXT_WIDTH
+                       + 5 * VGA_GLYPH_WIDTH],
+                 0xFFAA0000);
+
+    vga_text_destroy(text);
+}
+
+static void vnc_read(s32 fd, void *buffer, u64 size)
+{
+    for (u64 off = 0; off < size;)
+    {
+        ssize_t r = read(fd, (u8 *)buffer + off, size - off);
+        cr_assert_gt(r, 0);
+        off += r;
+    }
+}
+
+static u32 vnc_read_u16(s32 fd)
+{
+    u8 buffer[2];
+
+    vnc_read(fd, buffer, 2);
+    return (buffer[0] << 8) | buffer[1];
+}
+
+static u32 vnc_read_pixel(s32 fd)
+{
+    u32 pixel;
+
+    vnc_read(fd, &pixel, 4);
+    return pixel;
+}
+
+/**
+ * Decode a hextile update into `fb`, the first rectangle is returned
+ */
+static void vnc_read_update(s32 fd, u32 *fb, u32 stride, u32 *rect)
+{
+    u8 header[4];
+
+    vnc_read(fd, header, 4);
+    cr_assert_eq(header[0], 0);
+
+    for (u32 nb_rects = (header[2] << 8) | header[3], i = 0; i < nb_rects;
+         ++i)
+    {
+        u32 x = vnc_read_u16(fd);
+        u32 y = vnc_read_u16(fd);
+        u32 width = vnc_read_u16(fd);
+        u32 height = vnc_read_u16(fd);
+        u8 encoding[4];
+
+        vnc_read(fd, encoding, 4);
+        cr_assert_eq(encoding[3], VNC_ENCODING_HEXTILE);
+
+        if (i == 0)
+        {
+            rect[0] = x;
+            rect[1] = y;
+            rect[2] = width;
+            rect[3] = height;
+        }
+
+        for (u32 ty = y; ty < y + height; ty += VNC_TILE)
+        {
+            for (u32 tx = x; tx < x + width; tx += VNC_TILE)
+            {
+                u32 tw = x + width - tx < VNC_TILE ? x + width - tx : VNC_TILE;
+                u32 th =
+                    y + height - ty < VNC_TILE ? y + height - ty : VNC_TILE;
+                u32 fg = 0;
+                u8 mask;
+
+                vnc_read(fd, &mask, 1);
+
+                for (u32 p = 0; p < tw * th; ++p)
+                {
+                    u32 *pixel = &fb[(ty + p / tw) * stride + tx + p % tw];
+
+                    if (mask & VNC_HEXTILE_RAW)
+                    {
+                        *pixel = vnc_read_pixel(fd);
+                    }
+                    else if (p == 0)
+                    {
+                        // Shared tiles always carry their background
+                        cr_assert(mask & VNC_HEXTILE_BACKGROUND);
+                        *pixel = vnc_read_pixel(fd);
+                    }
+                    else
+                    {
+                        *pixel = fb[ty * stride + tx];
+                    }
+                }
+
+                if (mask & VNC_HEXTILE_RAW
+                    || !(mask & VNC_HEXTILE_ANY_SUBRECTS))
+                {
+                    continue;
+                }
+
+                if (mask & VNC_HEXTILE_FOREGROUND)
+                {
+                    fg = vnc_read_pixel(fd);
+                }
+
+                u8 nb_subrects;
+
+                vnc_read(fd, &nb_subrects, 1);
+
+                for (u32 s = 0; s < nb_subrects; ++s)
+                {
+                    u8 sub[2];
+                    u32 color =
+                        mask & VNC_HEXTILE_COLOURED ? vnc_read_pixel(fd) : fg;
+
+                    vnc_read(fd, sub, 2);
+
+                    for (u32 sy = 0; sy <= (sub[1] & 0xF); ++sy)
+                    {
+                        for (u32 sx = 0; sx <= (sub[1] >> 4); ++sx)
+                        {
+                            fb[(ty + (sub[0] & 0xF) + sy) * stride + tx
+                               + (sub[0] >> 4) + sx] = color;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+Test(vnc, vnc_updates)
+{
+    s32 memfd = memfd_create("blackhv-test", 0);
+    cr_assert_geq(memfd, 0);
+    cr_assert_eq(ftruncate(memfd, HEADLESS_SIZE), 0);
+
+    u8 *memory =
+        mmap(NULL, HEADLESS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    struct headless_header *header =
+        (struct headless_header *)(memory + HEADLESS_HEADER_OFFSET);
+    u32 *pixels = (u32 *)memory;
+    u32 fb[40 * 20];
+
+    // Uniform tiles, two colors and many colors
+    for (u32 i = 0; i < 40 * 20; ++i)
+    {
+        pixels[i] = i % 40 < 16 ? 0x123456 : i % 40 < 32 ? (i & 4) << 20 : i;
+    }
+
+    header->magic = HEADLESS_MAGIC;
+    header->version = HEADLESS_VERSION;
+    header->width = 40;
+    header->height = 20;
+    header->pitch = 40 * 4;
+    header->bpp = 32;
+
+    // The socket is removed by vnc_destroy, then its directory at the end
+    char dir[] = "/tmp/blackhv_vnc_XXXXXX";
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    cr_assert_neq(mkdtemp(dir), NULL);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/vnc.sock", dir);
+
+    vnc_t *vnc = vnc_new(memfd);
+    cr_assert_neq(vnc, NULL);
+    cr_assert_eq(vnc_add_unix(vnc, addr.sun_path), 1);
+
+    s32 fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    cr_assert_eq(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+
+    u8 buffer[32];
+
+    vnc_read(fd, buffer, 12);
+    cr_assert_eq(memcmp(buffer, "RFB 003.008\n", 12), 0);
+    cr_assert_eq(write(fd, "RFB 003.008\n\1", 13), 13);
+    vnc_read(fd, buffer, 6); // Security types and result
+    cr_assert_eq(buffer[1], 1);
+    cr_assert_eq(write(fd, "\1", 1), 1);
+    vnc_read(fd, buffer, 24 + 7); // ServerInit and the name
+    cr_assert_eq((buffer[0] << 8) | buffer[1], 40);
+    cr_assert_eq((buffer[2] << 8) | buffer[3], 20);
+
+    u8 encodings[] = { 2, 0, 0, 1, 0, 0, 0, VNC_ENCODING_HEXTILE };
+    u8 full[] = { 3, 0, 0, 0, 0, 0, 0, 40, 0, 20 };
+    u8 incremental[] = { 3, 1, 0, 0, 0, 0, 0, 40, 0, 20 };
+    u32 rect[4];
+
+    cr_assert_eq(write(fd, encodings, sizeof(encodings)), sizeof(encodings));
+    cr_assert_eq(write(fd, full, sizeof(full)), sizeof(full));
+    vnc_read_update(fd, fb, 40, rect);
+
+    for (u32 i = 0; i < 40 * 20; ++i)
+    {
+        cr_assert_eq(fb[i] & 0xFFFFFF, pixels[i]);
+    }
+
+    // Only the damaged tile is sent again
+    pixels[18 * 40 + 35] = 0xABCDEF;
+    header->nb_rects = 1;
+    header->rects[0] = (struct headless_rect){ 35, 18, 1, 1 };
+    __atomic_store_n(&header->sequence, 2, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &header->sequence, FUTEX_WAKE, 1, NULL, NULL, 0);
+
+    cr_assert_eq(write(fd, incremental, sizeof(incremental)),
+                 sizeof(incremental));
+    vnc_read_update(fd, fb, 40, rect);
+    cr_assert_eq(rect[0], 32);
+    cr_assert_eq(rect[1], 16);
+    cr_assert_eq(rect[2], 8);
+    cr_assert_eq(rect[3], 4);
+    cr_assert_eq(fb[18 * 40 + 35] & 0xFFFFFF, 0xABCDEF);
+
+    // Raw BGR233 pixels, then a colour map of the same layout
+    u8 raw[] = { 2, 0, 0, 1, 0, 0, 0, VNC_ENCODING_RAW };
+    u8 bgr233[20] = { 0, 0, 0, 0, 8, 8, 0, 1, 0, 7, 0, 7, 0, 3, 0, 3, 6 };
+    u8 colour_map[20] = { 0, 0, 0, 0, 8, 8, 0, 0 };
+    u8 update[4 + 2 * 12 + 40 * 20]; // A rectangle per row of tiles
+    u8 *bytes = update + 16;
+
+    cr_assert_eq(write(fd, raw, sizeof(raw)), sizeof(raw));
+    cr_assert_eq(write(fd, bgr233, sizeof(bgr233)), sizeof(bgr233));
+    cr_assert_eq(write(fd, full, sizeof(full)), sizeof(full));
+    vnc_read(fd, update, sizeof(update));
+    cr_assert_eq(bytes[0], 0x48); // 0x123456
+    cr_assert_eq(bytes[12 + 18 * 40 + 35], 0xF5); // 0xABCDEF
+
+    cr_assert_eq(write(fd, colour_map, sizeof(colour_map)),
+                 sizeof(colour_map));
+    vnc_read(fd, update, 6);
+    cr_assert_eq(update[0], 1);
+    cr_assert_eq((update[4] << 8) | update[5], 256);
+
+    for (u32 i = 0; i < 256; ++i)
+    {
+        vnc_read(fd, update, 6);
+    }
+
+    // The last colour is white
+    cr_assert_eq((update[0] << 8) | update[1], 0xFFFF);
+    cr_assert_eq(write(fd, full, sizeof(full)), sizeof(full));
+    vnc_read(fd, update, sizeof(update));
+    cr_assert_eq(bytes[0], 0x48);
+
+    // Keys reach the keyboard as set 1 scan codes
+    ps2_t *ps2 = ps2_new(NULL);
+    u8 key[] = { 4, 1, 0, 0, 0, 0, 0, 'A' };
+    u8 status = 0;
+    u8 data = 0;
+
+    cr_assert_not_null(ps2);
+    vnc_set_ps2(vnc, ps2);
+    cr_assert_eq(write(fd, key, sizeof(key)), sizeof(key));
+
+    for (u32 i = 0; i < 1000 && !(status & 0x01); ++i)
+    {
+        usleep(1000);
+        io_handle_inb(PS2_STATUS, &status);
+    }
+
+    io_handle_inb(PS2_DATA, &data);
+    cr_assert_eq(data, 0x1E);
+    vnc_set_ps2(vnc, NULL);
+    ps2_destroy(ps2);
+
+    close(fd);
+    vnc_destroy(vnc);
+    munmap(memory, HEADLESS_SIZE);
+    close(memfd);
+    cr_assert_eq(rmdir(dir), 0);
+}
+
+static u8 ps2_read(u8 *status)
+{
+    u8 data = 0;
+
+    io_handle_inb(PS2_STATUS, status);
+    io_handle_inb(PS2_DATA, &data);
+
+    return data;
+}
+
+Test(ps2, ps2_batches)
+{
+    ps2_t *ps2 = ps2_new(NULL);
+    cr_assert_not_null(ps2);
+
+    u8 status = 0;
+    io_handle_outb(PS2_COMMAND, 0xAA);
+    cr_assert_eq(ps2_read(&status), 0x55);
+    cr_assert_eq(status & 0x21, 0x01);
+
+    // A press then an extended release (up arrow)
+    ps2_key(ps2, 0x04, 1);
+    ps2_key(ps2, 0x52, 0);
+    ps2_flush(ps2);
+
+    u8 keys[] = { 0x1E, 0xE0, 0xC8 };
+    for (size_t i = 0; i < sizeof(keys); ++i)
+    {
+        cr_assert_eq(ps2_read(&status), keys[i]);
+    }
+
+    io_handle_inb(PS2_STATUS, &status);
+    cr_assert_eq(status & 0x01, 0);
+
+    // Enable the mouse port and the mouse data reporting
+    io_handle_outb(PS2_COMMAND, 0xA8);
+    io_handle_outb(PS2_COMMAND, 0xD4);
+    io_handle_outb(PS2_DATA, 0xF4);
+    cr_assert_eq(ps2_read(&status), 0xFA);
+    cr_assert_eq(status & 0x21, 0x21);
+
+    // The moves are merged then split at the packet range
+    ps2_mouse(ps2, 10, 5, 0, 0);
+    ps2_mouse(ps2, 20, -5, 0, 0);
+    ps2_mouse(ps2, 300, 0, 0, 0);
+    ps2_mouse(ps2, 0, 0, 0, PS2_BUTTON_LEFT);
+    ps2_flush(ps2);
+
+    u8 packets[] = { 0x08, 0xFF, 0x00, 0x08, 0x4B, 0x00, 0x09, 0x00, 0x00 };
+    for (size_t i = 0; i < sizeof(packets); ++i)
+    {
+        cr_assert_eq(ps2_read(&status), packets[i]);
+        cr_assert_eq(status & 0x21, 0x21);
+    }
+
+    io_handle_inb(PS2_STATUS, &status);
+    cr_assert_eq(status & 0x01, 0);
+
+    ps2_destroy(ps2);
+}
@@ -0,0 +1,196 @@
+#include <blackhv/uring.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static s32 io_uring_setup(u32 entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static s32 io_uring_enter(s32 fd, u32 to_submit, u32 min_complete, u32 flags)
+{
+    return syscall(
+        __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void *map_ring(s32 fd, size_t size, u64 offset)
+{
+    return mmap(NULL,
+                size,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE,
+                fd,
+                offset);
+}
+
+s32 uring_init(struct uring *ring, u32 entries)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = io_uring_setup(entries, &params);
+
+    if (ring->fd < 0)
+    {
+        return 0;
+    }
+
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(u32);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Both rings share a single mapping on recent kernels
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring =
+            map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    }
+
+    ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED
+        || ring->sqes == MAP_FAILED)
+    {
+        uring_destroy(ring);
+        return 0;
+    }
+
+    u8 *sq = ring->sq_ring;
+    u8 *cq = ring->cq_ring;
+
+    ring->sq_head = (u32 *)(sq + params.sq_off.head);
+    ring->sq_tail = (u32 *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(u32 *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (u32 *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_pending_tail = *ring->sq_tail;
+
+    ring->cq_head = (u32 *)(cq + params.cq_off.head);
+    ring->cq_tail = (u32 *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(u32 *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 1;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED
+        && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    u32 head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sq_pending_tail - head >= ring->sq_entries)
+    {
+        return NULL;
+    }
+
+    u32 index = ring->sq_pending_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    ring->sq_array[index] = index;
+    ring->sq_pending_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    return sqe;
+}
+
+s32 uring_submit(struct uring *ring)
+{
+    // Entries left by a short submission are submitted again
+    u32 to_submit = ring->sq_pending_tail
+        - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (to_submit == 0)
+    {
+        return 0;
+    }
+
+    // The entries must be visible before the tail
+    __atomic_store_n(ring->sq_tail, ring->sq_pending_tail, __ATOMIC_RELEASE);
+
+    s32 submitted;
+
+    do
+    {
+        submitted = io_uring_enter(ring->fd, to_submit, 0, 0);
+    } while (submitted < 0 && errno == EINTR);
+
+    return submitted;
+}
+
+s32 uring_wait(struct uring *ring)
+{
+    s32 r;
+
+    do
+    {
+        r = io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+    } while (r < 0 && errno == EINTR);
+
+    return r >= 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    u32 head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
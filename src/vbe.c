@@ -0,0 +1,511 @@
+#include <blackhv/framebuffer.h>
+#include <blackhv/io.h>
+#include <blackhv/memory.h>
+#include <blackhv/pci.h>
+#include <blackhv/vbe.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PCI_CLASS_DISPLAY 0x03
+#define PCI_BAR_PREFETCH 0x8
+#define VRAM_BAR 0
+
+#define REFRESH_PERIOD_US (1000000 / VBE_REFRESH_HZ)
+#define RETRACE_US 1000
+
+struct vbe
+{
+    vm_t *vm;
+    u64 vram_phys;
+    struct pci_device pci;
+    s32 pci_slot;
+
+    pthread_mutex_t lock;
+    u16 index;
+    u16 regs[VBE_DISPI_INDEX_NB];
+    struct vbe_mode mode;
+    u32 generation;
+    u32 presented; // Last generation shown by the screen
+
+    u8 dac[256][3]; // 6 bits components, 8 bits with VBE_DISPI_8BIT_DAC
+    u8 dac_read_index;
+    u8 dac_read_component;
+    u8 dac_write_index;
+    u8 dac_write_component;
+};
+
+static u32 bytes_per_pixel(u32 bpp)
+{
+    return (bpp + 7) / 8;
+}
+
+static u32 valid_bpp(u32 bpp)
+{
+    return bpp == 8 || bpp == 15 || bpp == 16 || bpp == 24 || bpp == 32;
+}
+
+static void default_mode(struct vbe_mode *mode)
+{
+    mode->width = FB_WIDTH;
+    mode->height = FB_HEIGHT;
+    mode->bpp = FB_BPP * 8;
+    mode->pitch = FB_WIDTH * FB_BPP;
+    mode->offset = 0;
+}
+
+/**
+ * Clamp the virtual size and the offsets so that the visible area fits in
+ * the video memory, then compute the mode. Called with the lock held.
+ */
+static void update_mode(vbe_t *vbe)
+{
+    u16 *regs = vbe->regs;
+    struct vbe_mode mode;
+
+    if (!(regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED))
+    {
+        default_mode(&mode);
+    }
+    else
+    {
+        u32 bytes = bytes_per_pixel(regs[VBE_DISPI_INDEX_BPP]);
+
+        if (regs[VBE_DISPI_INDEX_VIRT_WIDTH] < regs[VBE_DISPI_INDEX_XRES])
+        {
+            regs[VBE_DISPI_INDEX_VIRT_WIDTH] = regs[VBE_DISPI_INDEX_XRES];
+        }
+
+        u32 pitch = regs[VBE_DISPI_INDEX_VIRT_WIDTH] * bytes;
+        u32 virt_height = VBE_VRAM_SIZE / pitch;
+
+        regs[VBE_DISPI_INDEX_VIRT_HEIGHT] =
+            virt_height < 0xFFFF ? virt_height : 0xFFFF;
+
+        u32 max_x =
+            regs[VBE_DISPI_INDEX_VIRT_WIDTH] - regs[VBE_DISPI_INDEX_XRES];
+        u32 max_y =
+            regs[VBE_DISPI_INDEX_VIRT_HEIGHT] - regs[VBE_DISPI_INDEX_YRES];
+
+        if (regs[VBE_DISPI_INDEX_X_OFFSET] > max_x)
+        {
+            regs[VBE_DISPI_INDEX_X_OFFSET] = max_x;
+        }
+
+        if (regs[VBE_DISPI_INDEX_Y_OFFSET] > max_y)
+        {
+            regs[VBE_DISPI_INDEX_Y_OFFSET] = max_y;
+        }
+
+        mode.width = regs[VBE_DISPI_INDEX_XRES];
+        mode.height = regs[VBE_DISPI_INDEX_YRES];
+        mode.bpp = regs[VBE_DISPI_INDEX_BPP];
+        mode.pitch = pitch;
+        mode.offset = (u64)regs[VBE_DISPI_INDEX_Y_OFFSET] * pitch
+            + regs[VBE_DISPI_INDEX_X_OFFSET] * bytes;
+    }
+
+    if (mode.width != vbe->mode.width || mode.height != vbe->mode.height
+        || mode.bpp != vbe->mode.bpp || mode.pitch != vbe->mode.pitch
+        || mode.offset != vbe->mode.offset)
+    {
+        vbe->mode = mode;
+        vbe->generation++;
+    }
+}
+
+/**
+ * Clear the visible frame of the new mode, the rest of the video memory is
+ * left untouched so that it is never allocated if unused
+ */
+static void clear_vram(vbe_t *vbe)
+{
+    static u8 zeros[PAGE_SIZE] = { 0 };
+    u64 size = (u64)vbe->mode.pitch * vbe->mode.height;
+
+    for (u64 done = 0; done < size; done += PAGE_SIZE)
+    {
+        u64 len = size - done < PAGE_SIZE ? size - done : PAGE_SIZE;
+
+        memory_write(vbe->vm, vbe->vram_phys + done, zeros, len);
+    }
+}
+
+static void write_enable(vbe_t *vbe, u16 value)
+{
+    u16 *regs = vbe->regs;
+    u32 enabling = (value & VBE_DISPI_ENABLED)
+        && !(regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED);
+    u32 dac_changed =
+        (value ^ regs[VBE_DISPI_INDEX_ENABLE]) & VBE_DISPI_8BIT_DAC;
+
+    regs[VBE_DISPI_INDEX_ENABLE] = value;
+
+    if (enabling)
+    {
+        regs[VBE_DISPI_INDEX_X_OFFSET] = 0;
+        regs[VBE_DISPI_INDEX_Y_OFFSET] = 0;
+        regs[VBE_DISPI_INDEX_VIRT_WIDTH] = 0;
+    }
+
+    update_mode(vbe);
+
+    // The palette colors are scaled differently
+    if (dac_changed && vbe->mode.bpp == 8)
+    {
+        vbe->generation++;
+    }
+
+    if (enabling && !(value & VBE_DISPI_NOCLEARMEM))
+    {
+        clear_vram(vbe);
+    }
+}
+
+static void write_register(vbe_t *vbe, u16 index, u16 value)
+{
+    u16 *regs = vbe->regs;
+    u32 enabled = regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_ENABLED;
+
+    switch (index)
+    {
+    case VBE_DISPI_INDEX_ID:
+        if (value >= VBE_DISPI_ID0 && value <= VBE_DISPI_ID5)
+        {
+            regs[index] = value;
+        }
+        break;
+    // The geometry only changes while the display is disabled
+    case VBE_DISPI_INDEX_XRES:
+        if (!enabled && value > 0 && value <= VBE_MAX_XRES && value % 8 == 0)
+        {
+            regs[index] = value;
+        }
+        break;
+    case VBE_DISPI_INDEX_YRES:
+        if (!enabled && value > 0 && value <= VBE_MAX_YRES)
+        {
+            regs[index] = value;
+        }
+        break;
+    case VBE_DISPI_INDEX_BPP:
+        if (!enabled && valid_bpp(value))
+        {
+            regs[index] = value;
+        }
+        break;
+    case VBE_DISPI_INDEX_ENABLE:
+        write_enable(vbe, value);
+        break;
+    case VBE_DISPI_INDEX_BANK:
+        // Only the linear framebuffer is supported
+        regs[index] = value;
+        break;
+    case VBE_DISPI_INDEX_VIRT_WIDTH:
+        if (value <= VBE_MAX_XRES * 2)
+        {
+            regs[index] = value;
+            update_mode(vbe);
+        }
+        break;
+    case VBE_DISPI_INDEX_X_OFFSET:
+    case VBE_DISPI_INDEX_Y_OFFSET:
+        regs[index] = value;
+        update_mode(vbe);
+        break;
+    }
+}
+
+static u16 read_register(vbe_t *vbe, u16 index)
+{
+    u16 *regs = vbe->regs;
+
+    if (regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_GETCAPS)
+    {
+        switch (index)
+        {
+        case VBE_DISPI_INDEX_XRES:
+            return VBE_MAX_XRES;
+        case VBE_DISPI_INDEX_YRES:
+            return VBE_MAX_YRES;
+        case VBE_DISPI_INDEX_BPP:
+            return VBE_MAX_BPP;
+        }
+    }
+
+    if (index == VBE_DISPI_INDEX_VIDEO_MEMORY_64K)
+    {
+        return VBE_VRAM_SIZE / 0x10000;
+    }
+
+    return index < VBE_DISPI_INDEX_NB ? regs[index] : 0;
+}
+
+static void index_outw(u16 port, u16 value, void *params)
+{
+    vbe_t *vbe = params;
+    (void)port;
+
+    pthread_mutex_lock(&vbe->lock);
+    vbe->index = value;
+    pthread_mutex_unlock(&vbe->lock);
+}
+
+static u16 index_inw(u16 port, void *params)
+{
+    vbe_t *vbe = params;
+    (void)port;
+
+    pthread_mutex_lock(&vbe->lock);
+    u16 index = vbe->index;
+    pthread_mutex_unlock(&vbe->lock);
+
+    return index;
+}
+
+static void data_outw(u16 port, u16 value, void *params)
+{
+    vbe_t *vbe = params;
+    (void)port;
+
+    pthread_mutex_lock(&vbe->lock);
+    write_register(vbe, vbe->index, value);
+    pthread_mutex_unlock(&vbe->lock);
+}
+
+static u16 data_inw(u16 port, void *params)
+{
+    vbe_t *vbe = params;
+    (void)port;
+
+    pthread_mutex_lock(&vbe->lock);
+    u16 value = read_register(vbe, vbe->index);
+    pthread_mutex_unlock(&vbe->lock);
+
+    return value;
+}
+
+static void dac_outb(u16 port, u8 value, void *params)
+{
+    vbe_t *vbe = params;
+
+    pthread_mutex_lock(&vbe->lock);
+
+    switch (port)
+    {
+    case VBE_DAC_READ_INDEX:
+        vbe->dac_read_index = value;
+        vbe->dac_read_component = 0;
+        break;
+    case VBE_DAC_WRITE_INDEX:
+        vbe->dac_write_index = value;
+        vbe->dac_write_component = 0;
+        break;
+    case VBE_DAC_DATA:
+        vbe->dac[vbe->dac_write_index][vbe->dac_write_component] = value;
+
+        // The index moves to the next color after its blue component
+        if (++vbe->dac_write_component == 3)
+        {
+            vbe->dac_write_component = 0;
+            vbe->dac_write_index += 1;
+
+            // The frame has to be redrawn with the new color
+            if (vbe->mode.bpp == 8)
+            {
+                vbe->generation++;
+            }
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&vbe->lock);
+}
+
+static u8 dac_inb(u16 port, void *params)
+{
+    vbe_t *vbe = params;
+    u8 value = 0;
+
+    pthread_mutex_lock(&vbe->lock);
+
+    switch (port)
+    {
+    case VBE_DAC_WRITE_INDEX:
+        value = vbe->dac_write_index;
+        break;
+    case VBE_DAC_DATA:
+        value = vbe->dac[vbe->dac_read_index][vbe->dac_read_component];
+
+        if (++vbe->dac_read_component == 3)
+        {
+            vbe->dac_read_component = 0;
+            vbe->dac_read_index += 1;
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&vbe->lock);
+
+    return value;
+}
+
+/**
+ * The retrace is simulated during the last RETRACE_US of each refresh period,
+ * once the last flip is on screen
+ */
+static u8 status_inb(u16 port, void *params)
+{
+    vbe_t *vbe = params;
+    struct timespec ts;
+    (void)port;
+
+    pthread_mutex_lock(&vbe->lock);
+    u32 pending = vbe->presented != vbe->generation;
+    pthread_mutex_unlock(&vbe->lock);
+
+    if (pending)
+    {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    u64 now_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+
+    if (now_us % REFRESH_PERIOD_US >= REFRESH_PERIOD_US - RETRACE_US)
+    {
+        return VBE_VGA_STATUS_RETRACE | VBE_VGA_STATUS_BLANK;
+    }
+
+    return 0;
+}
+
+static void pci_setup(vbe_t *vbe)
+{
+    struct pci_device *dev = &vbe->pci;
+
+    pci_config_write16(dev, PCI_VENDOR_ID, VBE_PCI_VENDOR);
+    pci_config_write16(dev, PCI_DEVICE_ID, VBE_PCI_DEVICE);
+    pci_config_write16(dev, PCI_COMMAND, PCI_COMMAND_IO | PCI_COMMAND_MEMORY);
+    dev->config[PCI_CLASS] = PCI_CLASS_DISPLAY;
+    pci_config_write32(
+        dev, PCI_BAR(VRAM_BAR), (u32)vbe->vram_phys | PCI_BAR_PREFETCH);
+    dev->bar_size[VRAM_BAR] = VBE_VRAM_SIZE;
+    dev->data = vbe;
+}
+
+vbe_t *vbe_new(vm_t *vm, u64 vram_phys)
+{
+    vbe_t *vbe = calloc(1, sizeof(vbe_t));
+
+    if (vbe == NULL)
+    {
+        return NULL;
+    }
+
+    vbe->vm = vm;
+    vbe->vram_phys = vram_phys;
+    vbe->regs[VBE_DISPI_INDEX_ID] = VBE_DISPI_ID5;
+    vbe->regs[VBE_DISPI_INDEX_XRES] = FB_WIDTH;
+    vbe->regs[VBE_DISPI_INDEX_YRES] = FB_HEIGHT;
+    vbe->regs[VBE_DISPI_INDEX_BPP] = FB_BPP * 8;
+    default_mode(&vbe->mode);
+    pthread_mutex_init(&vbe->lock, NULL);
+
+    pci_setup(vbe);
+    vbe->pci_slot = pci_register(&vbe->pci);
+
+    struct handler index_handler = { .params = vbe,
+                                     .outw_handler = index_outw,
+                                     .inw_handler = index_inw };
+    struct handler data_handler = { .params = vbe,
+                                    .outw_handler = data_outw,
+                                    .inw_handler = data_inw };
+
+    struct handler dac_handler = { .params = vbe,
+                                   .outb_handler = dac_outb,
+                                   .inb_handler = dac_inb };
+
+    io_register_handler(VBE_DISPI_IOPORT_INDEX, index_handler);
+    io_register_handler(VBE_DISPI_IOPORT_DATA, data_handler);
+    io_register_handler(VBE_DAC_READ_INDEX, dac_handler);
+    io_register_handler(VBE_DAC_WRITE_INDEX, dac_handler);
+    io_register_handler(VBE_DAC_DATA, dac_handler);
+
+    struct handler status_handler = { .params = vbe,
+                                      .inb_handler = status_inb };
+
+    io_register_handler(VBE_VGA_STATUS, status_handler);
+
+    return vbe;
+}
+
+void vbe_destroy(vbe_t *vbe)
+{
+    if (vbe == NULL)
+    {
+        return;
+    }
+
+    io_unregister_handler(VBE_DISPI_IOPORT_INDEX);
+    io_unregister_handler(VBE_DISPI_IOPORT_DATA);
+    io_unregister_handler(VBE_DAC_READ_INDEX);
+    io_unregister_handler(VBE_DAC_WRITE_INDEX);
+    io_unregister_handler(VBE_DAC_DATA);
+    io_unregister_handler(VBE_VGA_STATUS);
+
+    if (vbe->pci_slot >= 0)
+    {
+        pci_unregister(vbe->pci_slot);
+    }
+
+    pthread_mutex_destroy(&vbe->lock);
+    free(vbe);
+}
+
+u32 vbe_get_mode(vbe_t *vbe, struct vbe_mode *mode)
+{
+    pthread_mutex_lock(&vbe->lock);
+    *mode = vbe->mode;
+    u32 generation = vbe->generation;
+    pthread_mutex_unlock(&vbe->lock);
+
+    return generation;
+}
+
+void vbe_get_palette(vbe_t *vbe, u32 *palette)
+{
+    pthread_mutex_lock(&vbe->lock);
+
+    u32 dac_8bit = vbe->regs[VBE_DISPI_INDEX_ENABLE] & VBE_DISPI_8BIT_DAC;
+
+    for (u32 i = 0; i < 256; ++i)
+    {
+        u32 color = 0;
+
+        for (u32 c = 0; c < 3; ++c)
+        {
+            u32 value = vbe->dac[i][c];
+
+            // 6 bits components are scaled to the full 8 bits range
+            if (!dac_8bit)
+            {
+                value = ((value & 0x3F) << 2) | ((value & 0x3F) >> 4);
+            }
+
+            color = (color << 8) | value;
+        }
+
+        palette[i] = color;
+    }
+
+    pthread_mutex_unlock(&vbe->lock);
+}
+
+void vbe_set_presented(vbe_t *vbe, u32 generation)
+{
+    pthread_mutex_lock(&vbe->lock);
+    vbe->presented = generation;
+    pthread_mutex_unlock(&vbe->lock);
+}
@@ -0,0 +1,428 @@
+#include <blackhv/vga_text.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GLYPH_PIXELS (VGA_GLYPH_WIDTH * VGA_GLYPH_HEIGHT)
+#define FIRST_ASCII 0x20
+#define LAST_ASCII 0x7E
+
+/* Line styles of the box drawing characters */
+#define NONE 0
+#define SINGLE 1
+#define DOUBLE 2
+
+/* The 16 text colors */
+static const u32 colors[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA,
+    0xAA5500, 0xAAAAAA, 0x555555, 0x5555FF, 0x55FF55, 0x55FFFF,
+    0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF,
+};
+
+/* 8x8 printable ASCII glyphs, bit 0 is the leftmost pixel */
+static const u8 ascii[LAST_ASCII - FIRST_ASCII + 1][8] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // space
+    { 0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00 }, // !
+    { 0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // "
+    { 0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00 }, // #
+    { 0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00 }, // $
+    { 0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00 }, // %
+    { 0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00 }, // &
+    { 0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 }, // '
+    { 0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00 }, // (
+    { 0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00 }, // )
+    { 0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00 }, // *
+    { 0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00 }, // +
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06 }, // ,
+    { 0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00 }, // -
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00 }, // .
+    { 0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00 }, // /
+    { 0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00 }, // 0
+    { 0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00 }, // 1
+    { 0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00 }, // 2
+    { 0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00 }, // 3
+    { 0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00 }, // 4
+    { 0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00 }, // 5
+    { 0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00 }, // 6
+    { 0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00 }, // 7
+    { 0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00 }, // 8
+    { 0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00 }, // 9
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00 }, // :
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06 }, // ;
+    { 0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00 }, // <
+    { 0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00 }, // =
+    { 0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00 }, // >
+    { 0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00 }, // ?
+    { 0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00 }, // @
+    { 0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00 }, // A
+    { 0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00 }, // B
+    { 0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00 }, // C
+    { 0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00 }, // D
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00 }, // E
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00 }, // F
+    { 0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00 }, // G
+    { 0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00 }, // H
+    { 0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 }, // I
+    { 0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00 }, // J
+    { 0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00 }, // K
+    { 0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00 }, // L
+    { 0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00 }, // M
+    { 0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00 }, // N
+    { 0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00 }, // O
+    { 0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00 }, // P
+    { 0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00 }, // Q
+    { 0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00 }, // R
+    { 0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00 }, // S
+    { 0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 }, // T
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00 }, // U
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 }, // V
+    { 0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00 }, // W
+    { 0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00 }, // X
+    { 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00 }, // Y
+    { 0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00 }, // Z
+    { 0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00 }, // [
+    { 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00 }, // backslash
+    { 0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00 }, // ]
+    { 0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00 }, // ^
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF }, // _
+    { 0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00 }, // `
+    { 0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00 }, // a
+    { 0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00 }, // b
+    { 0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00 }, // c
+    { 0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00 }, // d
+    { 0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00 }, // e
+    { 0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00 }, // f
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F }, // g
+    { 0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00 }, // h
+    { 0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 }, // i
+    { 0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E }, // j
+    { 0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00 }, // k
+    { 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 }, // l
+    { 0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00 }, // m
+    { 0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00 }, // n
+    { 0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00 }, // o
+    { 0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F }, // p
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78 }, // q
+    { 0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00 }, // r
+    { 0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00 }, // s
+    { 0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00 }, // t
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00 }, // u
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 }, // v
+    { 0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00 }, // w
+    { 0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00 }, // x
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F }, // y
+    { 0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00 }, // z
+    { 0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00 }, // {
+    { 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00 }, // |
+    { 0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00 }, // }
+    { 0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // ~
+};
+
+/* Up, down, left and right lines of the characters 0xB3 to 0xDA */
+static const u8 box_lines[0xDA - 0xB3 + 1][4] = {
+    { SINGLE, SINGLE, NONE, NONE }, // 0xB3
+    { SINGLE, SINGLE, SINGLE, NONE },
+    { SINGLE, SINGLE, DOUBLE, NONE },
+    { DOUBLE, DOUBLE, SINGLE, NONE },
+    { NONE, DOUBLE, SINGLE, NONE },
+    { NONE, SINGLE, DOUBLE, NONE },
+    { DOUBLE, DOUBLE, DOUBLE, NONE },
+    { DOUBLE, DOUBLE, NONE, NONE },
+    { NONE, DOUBLE, DOUBLE, NONE },
+    { DOUBLE, NONE, DOUBLE, NONE },
+    { DOUBLE, NONE, SINGLE, NONE },
+    { SINGLE, NONE, DOUBLE, NONE },
+    { NONE, SINGLE, SINGLE, NONE }, // 0xBF
+    { SINGLE, NONE, NONE, SINGLE },
+    { SINGLE, NONE, SINGLE, SINGLE },
+    { NONE, SINGLE, SINGLE, SINGLE },
+    { SINGLE, SINGLE, NONE, SINGLE },
+    { NONE, NONE, SINGLE, SINGLE },
+    { SINGLE, SINGLE, SINGLE, SINGLE },
+    { SINGLE, SINGLE, NONE, DOUBLE },
+    { DOUBLE, DOUBLE, NONE, SINGLE },
+    { DOUBLE, NONE, NONE, DOUBLE },
+    { NONE, DOUBLE, NONE, DOUBLE },
+    { DOUBLE, NONE, DOUBLE, DOUBLE },
+    { NONE, DOUBLE, DOUBLE, DOUBLE },
+    { DOUBLE, DOUBLE, NONE, DOUBLE },
+    { NONE, NONE, DOUBLE, DOUBLE },
+    { DOUBLE, DOUBLE, DOUBLE, DOUBLE },
+    { SINGLE, NONE, DOUBLE, DOUBLE }, // 0xCF
+    { DOUBLE, NONE, SINGLE, SINGLE },
+    { NONE, SINGLE, DOUBLE, DOUBLE },
+    { NONE, DOUBLE, SINGLE, SINGLE },
+    { DOUBLE, NONE, NONE, SINGLE },
+    { SINGLE, NONE, NONE, DOUBLE },
+    { NONE, SINGLE, NONE, DOUBLE },
+    { NONE, DOUBLE, NONE, SINGLE },
+    { DOUBLE, DOUBLE, SINGLE, SINGLE },
+    { SINGLE, SINGLE, DOUBLE, DOUBLE },
+    { SINGLE, NONE, SINGLE, NONE },
+    { NONE, SINGLE, NONE, SINGLE }, // 0xDA
+};
+
+struct glyph
+{
+    u32 pixels[GLYPH_PIXELS];
+    u16 cell;
+    u8 valid;
+};
+
+struct vga_text
+{
+    u8 font[256][VGA_GLYPH_HEIGHT]; // One byte per row, bit 0 on the left
+    struct glyph *cache;
+    u16 cells[VGA_TEXT_CELLS]; // Rendered in the frame
+    u32 rendered; // The frame holds every cell
+    u32 frame[VGA_TEXT_WIDTH * VGA_TEXT_HEIGHT];
+};
+
+static void set_pixels(u8 *glyph, u32 x0, u32 x1, u32 y0, u32 y1)
+{
+    for (u32 y = y0; y <= y1; ++y)
+    {
+        for (u32 x = x0; x <= x1; ++x)
+        {
+            glyph[y] |= 1 << x;
+        }
+    }
+}
+
+/**
+ * Single lines go through the pixel (3, 7), double lines are 3 pixels apart
+ * on each side of it
+ */
+static void draw_box(u8 *glyph, const u8 *lines)
+{
+    const u32 last_x = VGA_GLYPH_WIDTH - 1;
+    const u32 last_y = VGA_GLYPH_HEIGHT - 1;
+
+    if (lines[0] == SINGLE)
+    {
+        set_pixels(glyph, 3, 3, 0, 7);
+    }
+
+    if (lines[1] == SINGLE)
+    {
+        set_pixels(glyph, 3, 3, 7, last_y);
+    }
+
+    if (lines[2] == SINGLE)
+    {
+        set_pixels(glyph, 0, 3, 7, 7);
+    }
+
+    if (lines[3] == SINGLE)
+    {
+        set_pixels(glyph, 3, last_x, 7, 7);
+    }
+
+    if (lines[0] == DOUBLE)
+    {
+        set_pixels(glyph, 2, 2, 0, lines[2] == DOUBLE ? 6 : 9);
+        set_pixels(glyph, 5, 5, 0, lines[3] == DOUBLE ? 6 : 9);
+    }
+
+    if (lines[1] == DOUBLE)
+    {
+        set_pixels(glyph, 2, 2, lines[2] == DOUBLE ? 9 : 6, last_y);
+        set_pixels(glyph, 5, 5, lines[3] == DOUBLE ? 9 : 6, last_y);
+    }
+
+    if (lines[2] == DOUBLE)
+    {
+        set_pixels(glyph, 0, lines[0] == DOUBLE ? 2 : 5, 6, 6);
+        set_pixels(glyph, 0, lines[1] == DOUBLE ? 2 : 5, 9, 9);
+    }
+
+    if (lines[3] == DOUBLE)
+    {
+        set_pixels(glyph, lines[0] == DOUBLE ? 5 : 2, last_x, 6, 6);
+        set_pixels(glyph, lines[1] == DOUBLE ? 5 : 2, last_x, 9, 9);
+    }
+}
+
+/**
+ * ASCII glyphs have their rows doubled, box drawing, shades and blocks are
+ * drawn, the others are a hollow box
+ */
+static void build_font(u8 font[256][VGA_GLYPH_HEIGHT])
+{
+    const u32 half = VGA_GLYPH_HEIGHT / 2;
+
+    for (u32 c = 0; c < 256; ++c)
+    {
+        u8 *glyph = font[c];
+
+        if (c >= FIRST_ASCII && c <= LAST_ASCII)
+        {
+            for (u32 y = 0; y < VGA_GLYPH_HEIGHT; ++y)
+            {
+                glyph[y] = ascii[c - FIRST_ASCII][y / 2];
+            }
+        }
+        else if (c >= 0xB0 && c <= 0xB2)
+        {
+            // Light, medium and dark shades
+            for (u32 y = 0; y < VGA_GLYPH_HEIGHT; ++y)
+            {
+                u8 even = y % 2 == 0 ? 0x55 : 0xAA;
+
+                glyph[y] = c == 0xB0 ? (y % 2 == 0 ? 0x11 : 0x44)
+                           : c == 0xB1 ? even
+                                       : ~(y % 2 == 0 ? 0x44 : 0x11);
+            }
+        }
+        else if (c >= 0xB3 && c <= 0xDA)
+        {
+            draw_box(glyph, box_lines[c - 0xB3]);
+        }
+        else if (c == 0xDB)
+        {
+            set_pixels(glyph, 0, 7, 0, VGA_GLYPH_HEIGHT - 1);
+        }
+        else if (c == 0xDC)
+        {
+            set_pixels(glyph, 0, 7, half, VGA_GLYPH_HEIGHT - 1);
+        }
+        else if (c == 0xDD)
+        {
+            set_pixels(glyph, 0, 3, 0, VGA_GLYPH_HEIGHT - 1);
+        }
+        else if (c == 0xDE)
+        {
+            set_pixels(glyph, 4, 7, 0, VGA_GLYPH_HEIGHT - 1);
+        }
+        else if (c == 0xDF)
+        {
+            set_pixels(glyph, 0, 7, 0, half - 1);
+        }
+        else if (c == 0xFE)
+        {
+            set_pixels(glyph, 2, 5, 5, 10);
+        }
+        else if (c != 0 && c != 0xFF)
+        {
+            set_pixels(glyph, 1, 6, 3, 3);
+            set_pixels(glyph, 1, 6, 12, 12);
+            set_pixels(glyph, 1, 1, 3, 12);
+            set_pixels(glyph, 6, 6, 3, 12);
+        }
+    }
+}
+
+vga_text_t *vga_text_new(void)
+{
+    vga_text_t *text = calloc(1, sizeof(vga_text_t));
+
+    if (text == NULL)
+    {
+        return NULL;
+    }
+
+    // The pages of the unused entries are never touched
+    text->cache = calloc(VGA_GLYPH_CACHE_SIZE, sizeof(struct glyph));
+
+    if (text->cache == NULL)
+    {
+        free(text);
+        return NULL;
+    }
+
+    build_font(text->font);
+
+    return text;
+}
+
+void vga_text_destroy(vga_text_t *text)
+{
+    if (text == NULL)
+    {
+        return;
+    }
+
+    free(text->cache);
+    free(text);
+}
+
+/**
+ * Get the pixels of a cell, rasterized on the first use of its character and
+ * attribute
+ */
+static const u32 *get_glyph(vga_text_t *text, u16 cell)
+{
+    struct glyph *glyph =
+        &text->cache[(cell * 2654435761U) >> 20 & (VGA_GLYPH_CACHE_SIZE - 1)];
+
+    if (glyph->valid && glyph->cell == cell)
+    {
+        return glyph->pixels;
+    }
+
+    const u8 *rows = text->font[cell & 0xFF];
+    u32 foreground = 0xFF000000 | colors[(cell >> 8) & 0xF];
+    u32 background = 0xFF000000 | colors[(cell >> 12) & 0x7];
+    u32 *pixels = glyph->pixels;
+
+    for (u32 y = 0; y < VGA_GLYPH_HEIGHT; ++y)
+    {
+        for (u32 x = 0; x < VGA_GLYPH_WIDTH; ++x)
+        {
+            *pixels++ = (rows[y] >> x) & 1 ? foreground : background;
+        }
+    }
+
+    glyph->cell = cell;
+    glyph->valid = 1;
+
+    return glyph->pixels;
+}
+
+u32 vga_text_render(vga_text_t *text,
+                    const u16 *cells,
+                    u32 *first_row,
+                    u32 *last_row)
+{
+    u16 current[VGA_TEXT_CELLS];
+    u32 nb_rendered = 0;
+
+    // The guest may write while the cells are rendered
+    memcpy(current, cells, sizeof(current));
+
+    for (u32 i = 0; i < VGA_TEXT_CELLS; ++i)
+    {
+        if (text->rendered && current[i] == text->cells[i])
+        {
+            continue;
+        }
+
+        const u32 *glyph = get_glyph(text, current[i]);
+        u32 row = i / VGA_TEXT_COLS;
+        u32 *dst = text->frame + row * VGA_GLYPH_HEIGHT * VGA_TEXT_WIDTH
+                   + (i % VGA_TEXT_COLS) * VGA_GLYPH_WIDTH;
+
+        for (u32 y = 0; y < VGA_GLYPH_HEIGHT; ++y)
+        {
+            memcpy(dst + y * VGA_TEXT_WIDTH,
+                   glyph + y * VGA_GLYPH_WIDTH,
+                   VGA_GLYPH_WIDTH * sizeof(u32));
+        }
+
+        if (nb_rendered++ == 0)
+        {
+            *first_row = row * VGA_GLYPH_HEIGHT;
+        }
+
+        *last_row = (row + 1) * VGA_GLYPH_HEIGHT - 1;
+        text->cells[i] = current[i];
+    }
+
+    text->rendered = 1;
+
+    return nb_rendered;
+}
+
+const u32 *vga_text_get_frame(vga_text_t *text)
+{
+    return text->frame;
+}
@@ -0,0 +1,644 @@
+#include <blackhv/memory.h>
+#include <blackhv/mmio.h>
+#include <blackhv/virtio.h>
+#include <stdio.h>
+#include <string.h>
+
+/* virtio-mmio registers */
+#define MMIO_MAGIC_VALUE 0x000
+#define MMIO_VERSION 0x004
+#define MMIO_DEVICE_ID 0x008
+#define MMIO_VENDOR_ID 0x00C
+#define MMIO_DEVICE_FEATURES 0x010
+#define MMIO_DEVICE_FEATURES_SEL 0x014
+#define MMIO_DRIVER_FEATURES 0x020
+#define MMIO_DRIVER_FEATURES_SEL 0x024
+#define MMIO_QUEUE_SEL 0x030
+#define MMIO_QUEUE_NUM_MAX 0x034
+#define MMIO_QUEUE_NUM 0x038
+#define MMIO_QUEUE_READY 0x044
+#define MMIO_QUEUE_NOTIFY 0x050
+#define MMIO_INTERRUPT_STATUS 0x060
+#define MMIO_INTERRUPT_ACK 0x064
+#define MMIO_STATUS 0x070
+#define MMIO_QUEUE_DESC_LOW 0x080
+#define MMIO_QUEUE_DESC_HIGH 0x084
+#define MMIO_QUEUE_DRIVER_LOW 0x090
+#define MMIO_QUEUE_DRIVER_HIGH 0x094
+#define MMIO_QUEUE_DEVICE_LOW 0x0A0
+#define MMIO_QUEUE_DEVICE_HIGH 0x0A4
+#define MMIO_CONFIG_GENERATION 0x0FC
+#define MMIO_CONFIG 0x100
+
+#define MAGIC_VALUE 0x74726976 // "virt"
+#define MMIO_VERSION_2 2
+#define VENDOR_ID 0x56484B42 // "BKHV"
+
+/**
+ * Translate a guest physical range, the whole range must be backed by the
+ * same memory slot.
+ */
+static void *guest_ptr(vm_t *vm, u64 addr, u64 len)
+{
+    u8 *ptr = memory_get_ptr(vm, addr);
+
+    if (ptr == NULL || len == 0)
+    {
+        return ptr;
+    }
+
+    if (memory_get_ptr(vm, addr + len - 1) != ptr + len - 1)
+    {
+        return NULL;
+    }
+
+    return ptr;
+}
+
+static void set_interrupt(struct virtio_device *dev, u32 bits)
+{
+    pthread_mutex_lock(&dev->irq_lock);
+
+    // The line stays high until the driver acknowledges every cause
+    if (dev->interrupt_status == 0)
+    {
+        vm_irq_line(dev->vm, dev->irq, 1);
+    }
+
+    dev->interrupt_status |= bits;
+
+    pthread_mutex_unlock(&dev->irq_lock);
+}
+
+static void ack_interrupt(struct virtio_device *dev, u32 bits)
+{
+    pthread_mutex_lock(&dev->irq_lock);
+
+    u32 previous = dev->interrupt_status;
+    dev->interrupt_status &= ~bits;
+
+    if (previous != 0 && dev->interrupt_status == 0)
+    {
+        vm_irq_line(dev->vm, dev->irq, 0);
+    }
+
+    pthread_mutex_unlock(&dev->irq_lock);
+}
+
+static void queue_reset(struct virtq *vq)
+{
+    pthread_mutex_lock(&vq->lock);
+
+    vq->num = 0;
+    vq->ready = 0;
+    vq->desc_addr = 0;
+    vq->avail_addr = 0;
+    vq->used_addr = 0;
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+    vq->last_avail_idx = 0;
+    vq->used_idx = 0;
+    vq->signalled_used = 0;
+
+    pthread_mutex_unlock(&vq->lock);
+}
+
+static void device_reset(struct virtio_device *dev)
+{
+    for (u16 i = 0; i < dev->num_queues; ++i)
+    {
+        queue_reset(&dev->queues[i]);
+    }
+
+    dev->driver_features = 0;
+    dev->device_features_sel = 0;
+    dev->driver_features_sel = 0;
+    dev->queue_sel = 0;
+    dev->status = 0;
+    ack_interrupt(dev, VIRTIO_INT_VRING | VIRTIO_INT_CONFIG);
+
+    if (dev->reset != NULL)
+    {
+        dev->reset(dev);
+    }
+}
+
+static void queue_set_ready(struct virtio_device *dev, struct virtq *vq)
+{
+    if (vq->num == 0 || vq->num > VIRTQ_MAX_SIZE || (vq->num & (vq->num - 1)))
+    {
+        fprintf(stderr, "virtio: invalid queue size %u\n", vq->num);
+        return;
+    }
+
+    u64 desc_size = sizeof(struct virtq_desc) * vq->num;
+    // Rings are followed by used_event and avail_event
+    u64 avail_size = sizeof(struct virtq_avail) + sizeof(u16) * vq->num + 2;
+    u64 used_size = sizeof(struct virtq_used)
+        + sizeof(struct virtq_used_elem) * vq->num + 2;
+
+    pthread_mutex_lock(&vq->lock);
+
+    vq->desc = guest_ptr(dev->vm, vq->desc_addr, desc_size);
+    vq->avail = guest_ptr(dev->vm, vq->avail_addr, avail_size);
+    vq->used = guest_ptr(dev->vm, vq->used_addr, used_size);
+
+    if (vq->desc == NULL || vq->avail == NULL || vq->used == NULL)
+    {
+        fprintf(stderr, "virtio: queue rings not in guest memory\n");
+        dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+    }
+    else
+    {
+        vq->last_avail_idx = 0;
+        vq->used_idx = 0;
+        vq->signalled_used = 0;
+        vq->ready = 1;
+    }
+
+    pthread_mutex_unlock(&vq->lock);
+}
+
+static void write_status(struct virtio_device *dev, u32 status)
+{
+    if (status == 0)
+    {
+        device_reset(dev);
+        return;
+    }
+
+    if ((status & VIRTIO_STATUS_FEATURES_OK) != 0
+        && (dev->status & VIRTIO_STATUS_FEATURES_OK) == 0)
+    {
+        // The driver can only accept offered features, and we only speak the
+        // modern interface.
+        if ((dev->driver_features & ~dev->device_features) != 0
+            || !virtio_has_feature(dev, VIRTIO_F_VERSION_1))
+        {
+            status &= ~VIRTIO_STATUS_FEATURES_OK;
+        }
+    }
+
+    dev->status = status;
+}
+
+static void set_addr_low(u64 *addr, u32 value)
+{
+    *addr = (*addr & 0xFFFFFFFF00000000ULL) | value;
+}
+
+static void set_addr_high(u64 *addr, u32 value)
+{
+    *addr = (*addr & 0xFFFFFFFFULL) | ((u64)value << 32);
+}
+
+static void virtio_mmio_write(struct mmio_region *region,
+                              u64 address,
+                              u8 data[8],
+                              u32 len,
+                              void *arg)
+{
+    (void)region;
+    struct virtio_device *dev = arg;
+    u64 offset = address - dev->base_address;
+
+    if (offset >= MMIO_CONFIG)
+    {
+        offset -= MMIO_CONFIG;
+
+        if (offset + len > dev->config_size)
+        {
+            return;
+        }
+
+        if (dev->config_write != NULL)
+        {
+            dev->config_write(dev, offset, data, len);
+        }
+
+        return;
+    }
+
+    if (len != 4)
+    {
+        fprintf(stderr, "virtio: invalid register write size %u\n", len);
+        return;
+    }
+
+    u32 value = 0;
+    memcpy(&value, data, sizeof(value));
+
+    struct virtq *vq = NULL;
+
+    if (dev->queue_sel < dev->num_queues)
+    {
+        vq = &dev->queues[dev->queue_sel];
+    }
+
+    switch (offset)
+    {
+    case MMIO_DEVICE_FEATURES_SEL:
+        dev->device_features_sel = value;
+        break;
+    case MMIO_DRIVER_FEATURES:
+        if (dev->driver_features_sel < 2)
+        {
+            u32 shift = dev->driver_features_sel * 32;
+            dev->driver_features &= ~(0xFFFFFFFFULL << shift);
+            dev->driver_features |= (u64)value << shift;
+        }
+        break;
+    case MMIO_DRIVER_FEATURES_SEL:
+        dev->driver_features_sel = value;
+        break;
+    case MMIO_QUEUE_SEL:
+        dev->queue_sel = value;
+        break;
+    case MMIO_QUEUE_NUM:
+        if (vq != NULL)
+        {
+            vq->num = value;
+        }
+        break;
+    case MMIO_QUEUE_READY:
+        if (vq != NULL && value == 1)
+        {
+            queue_set_ready(dev, vq);
+        }
+        else if (vq != NULL)
+        {
+            pthread_mutex_lock(&vq->lock);
+            vq->ready = 0;
+            pthread_mutex_unlock(&vq->lock);
+        }
+        break;
+    case MMIO_QUEUE_NOTIFY:
+        if (value < dev->num_queues && dev->queues[value].ready
+            && dev->notify != NULL)
+        {
+            dev->notify(dev, value);
+        }
+        break;
+    case MMIO_INTERRUPT_ACK:
+        ack_interrupt(dev, value);
+        break;
+    case MMIO_STATUS:
+        write_status(dev, value);
+        break;
+    case MMIO_QUEUE_DESC_LOW:
+        if (vq != NULL)
+        {
+            set_addr_low(&vq->desc_addr, value);
+        }
+        break;
+    case MMIO_QUEUE_DESC_HIGH:
+        if (vq != NULL)
+        {
+            set_addr_high(&vq->desc_addr, value);
+        }
+        break;
+    case MMIO_QUEUE_DRIVER_LOW:
+        if (vq != NULL)
+        {
+            set_addr_low(&vq->avail_addr, value);
+        }
+        break;
+    case MMIO_QUEUE_DRIVER_HIGH:
+        if (vq != NULL)
+        {
+            set_addr_high(&vq->avail_addr, value);
+        }
+        break;
+    case MMIO_QUEUE_DEVICE_LOW:
+        if (vq != NULL)
+        {
+            set_addr_low(&vq->used_addr, value);
+        }
+        break;
+    case MMIO_QUEUE_DEVICE_HIGH:
+        if (vq != NULL)
+        {
+            set_addr_high(&vq->used_addr, value);
+        }
+        break;
+    default:
+        fprintf(stderr, "virtio: register not supported %llx\n", offset);
+        break;
+    }
+}
+
+static void virtio_mmio_read(struct mmio_region *region,
+                             u64 address,
+                             u8 data[8],
+                             u32 len,
+                             void *arg)
+{
+    (void)region;
+    struct virtio_device *dev = arg;
+    u64 offset = address - dev->base_address;
+
+    if (offset >= MMIO_CONFIG)
+    {
+        offset -= MMIO_CONFIG;
+
+        if (len <= 8 && offset + len <= dev->config_size)
+        {
+            memcpy(data, (u8 *)dev->config + offset, len);
+        }
+
+        return;
+    }
+
+    u32 value = 0;
+
+    switch (offset)
+    {
+    case MMIO_MAGIC_VALUE:
+        value = MAGIC_VALUE;
+        break;
+    case MMIO_VERSION:
+        value = MMIO_VERSION_2;
+        break;
+    case MMIO_DEVICE_ID:
+        value = dev->device_id;
+        break;
+    case MMIO_VENDOR_ID:
+        value = VENDOR_ID;
+        break;
+    case MMIO_DEVICE_FEATURES:
+        if (dev->device_features_sel < 2)
+        {
+            value = dev->device_features >> (dev->device_features_sel * 32);
+        }
+        break;
+    case MMIO_QUEUE_NUM_MAX:
+        value = dev->queue_sel < dev->num_queues ? VIRTQ_MAX_SIZE : 0;
+        break;
+    case MMIO_QUEUE_READY:
+        if (dev->queue_sel < dev->num_queues)
+        {
+            value = dev->queues[dev->queue_sel].ready;
+        }
+        break;
+    case MMIO_INTERRUPT_STATUS:
+        pthread_mutex_lock(&dev->irq_lock);
+        value = dev->interrupt_status;
+        pthread_mutex_unlock(&dev->irq_lock);
+        break;
+    case MMIO_STATUS:
+        value = dev->status;
+        break;
+    case MMIO_CONFIG_GENERATION:
+        value = __atomic_load_n(&dev->config_generation, __ATOMIC_ACQUIRE);
+        break;
+    default:
+        fprintf(stderr, "virtio: register not supported %llx\n", offset);
+        break;
+    }
+
+    memcpy(data, &value, len < sizeof(value) ? len : sizeof(value));
+}
+
+s32 virtio_device_init(struct virtio_device *dev,
+                       vm_t *vm,
+                       u64 base_address,
+                       u32 irq)
+{
+    if (dev == NULL || vm == NULL || dev->num_queues > VIRTIO_MAX_QUEUES)
+    {
+        return 0;
+    }
+
+    dev->vm = vm;
+    dev->base_address = base_address;
+    dev->irq = irq;
+    dev->device_features |= VIRTIO_FEATURE(VIRTIO_F_VERSION_1);
+    dev->config_generation = 0;
+    dev->interrupt_status = 0;
+    pthread_mutex_init(&dev->irq_lock, NULL);
+
+    for (u16 i = 0; i < dev->num_queues; ++i)
+    {
+        pthread_mutex_init(&dev->queues[i].lock, NULL);
+        queue_reset(&dev->queues[i]);
+    }
+
+    dev->driver_features = 0;
+    dev->device_features_sel = 0;
+    dev->driver_features_sel = 0;
+    dev->queue_sel = 0;
+    dev->status = 0;
+
+    struct mmio_region region = { .base_address = base_address,
+                                  .high_address =
+                                      base_address + VIRTIO_MMIO_SIZE,
+                                  .write_handler = virtio_mmio_write,
+                                  .read_handler = virtio_mmio_read,
+                                  .data = dev };
+
+    dev->mmio_id = mmio_register(vm, &region);
+
+    if (dev->mmio_id < 0)
+    {
+        virtio_device_uninit(dev);
+        return 0;
+    }
+
+    vm_irq_line(vm, irq, 0);
+
+    return 1;
+}
+
+void virtio_device_uninit(struct virtio_device *dev)
+{
+    if (dev == NULL)
+    {
+        return;
+    }
+
+    if (dev->mmio_id >= 0)
+    {
+        mmio_unregister(dev->mmio_id);
+        dev->mmio_id = -1;
+    }
+
+    ack_interrupt(dev, VIRTIO_INT_VRING | VIRTIO_INT_CONFIG);
+
+    for (u16 i = 0; i < dev->num_queues; ++i)
+    {
+        pthread_mutex_destroy(&dev->queues[i].lock);
+    }
+
+    pthread_mutex_destroy(&dev->irq_lock);
+}
+
+s32 virtq_pop(struct virtio_device *dev,
+              struct virtq *vq,
+              struct virtq_chain *chain)
+{
+    while (vq->ready)
+    {
+        // Pairs with the driver's write barrier before publishing avail->idx
+        u16 avail_idx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+
+        if (avail_idx == vq->last_avail_idx)
+        {
+            return 0;
+        }
+
+        u16 head = vq->avail->ring[vq->last_avail_idx % vq->num];
+        vq->last_avail_idx += 1;
+
+        chain->head = head;
+        chain->out_num = 0;
+        chain->in_num = 0;
+
+        u16 index = head;
+        u32 count = 0;
+        s32 valid = 1;
+
+        for (;;)
+        {
+            if (index >= vq->num || count >= VIRTQ_MAX_CHAIN)
+            {
+                valid = 0;
+                break;
+            }
+
+            struct virtq_desc *desc = &vq->desc[index];
+            void *ptr = guest_ptr(dev->vm, desc->addr, desc->len);
+
+            // Indirect descriptors are not offered, and device readable
+            // buffers must come before device writable ones.
+            if (ptr == NULL || (desc->flags & VIRTQ_DESC_F_INDIRECT) != 0
+                || ((desc->flags & VIRTQ_DESC_F_WRITE) == 0
+                    && chain->in_num != 0))
+            {
+                valid = 0;
+                break;
+            }
+
+            chain->iov[count].iov_base = ptr;
+            chain->iov[count].iov_len = desc->len;
+
+            if ((desc->flags & VIRTQ_DESC_F_WRITE) != 0)
+            {
+                chain->in_num += 1;
+            }
+            else
+            {
+                chain->out_num += 1;
+            }
+
+            count += 1;
+
+            if ((desc->flags & VIRTQ_DESC_F_NEXT) == 0)
+            {
+                break;
+            }
+
+            index = desc->next;
+        }
+
+        if (valid)
+        {
+            return 1;
+        }
+
+        fprintf(stderr, "virtio: malformed descriptor chain %u\n", head);
+        virtq_push(vq, head, 0);
+    }
+
+    return 0;
+}
+
+void virtq_push(struct virtq *vq, u16 head, u32 len)
+{
+    struct virtq_used_elem *elem = &vq->used->ring[vq->used_idx % vq->num];
+
+    elem->id = head;
+    elem->len = len;
+    vq->used_idx += 1;
+
+    // The element must be visible before the index
+    __atomic_store_n(&vq->used->idx, vq->used_idx, __ATOMIC_RELEASE);
+}
+
+void virtq_notify(struct virtio_device *dev, struct virtq *vq)
+{
+    u16 old = vq->signalled_used;
+    u16 new = vq->used_idx;
+
+    if (old == new)
+    {
+        return;
+    }
+
+    // Order the used->idx store before reading the driver's flags
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    u32 need_interrupt = 0;
+
+    if (virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+    {
+        u16 used_event =
+            __atomic_load_n(&vq->avail->ring[vq->num], __ATOMIC_RELAXED);
+        need_interrupt = (u16)(new - used_event - 1) < (u16)(new - old);
+    }
+    else
+    {
+        u16 flags = __atomic_load_n(&vq->avail->flags, __ATOMIC_RELAXED);
+        need_interrupt = (flags & VIRTQ_AVAIL_F_NO_INTERRUPT) == 0;
+    }
+
+    vq->signalled_used = new;
+
+    if (need_interrupt)
+    {
+        set_interrupt(dev, VIRTIO_INT_VRING);
+    }
+}
+
+void virtq_disable_notify(struct virtio_device *dev, struct virtq *vq)
+{
+    // With event index the driver only kicks when it goes past avail_event,
+    // which is left behind while processing.
+    if (!vq->ready || virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+    {
+        return;
+    }
+
+    vq->used->flags |= VIRTQ_USED_F_NO_NOTIFY;
+}
+
+u32 virtq_enable_notify(struct virtio_device *dev, struct virtq *vq)
+{
+    if (!vq->ready)
+    {
+        return 0;
+    }
+
+    if (virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+    {
+        u16 *avail_event = (u16 *)&vq->used->ring[vq->num];
+        __atomic_store_n(avail_event, vq->last_avail_idx, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        vq->used->flags &= ~VIRTQ_USED_F_NO_NOTIFY;
+    }
+
+    // Order the store above with the avail->idx read below, otherwise a chain
+    // made available concurrently could be missed.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE)
+        != vq->last_avail_idx;
+}
+
+void virtio_config_changed(struct virtio_device *dev)
+{
+    __atomic_add_fetch(&dev->config_generation, 1, __ATOMIC_RELEASE);
+    set_interrupt(dev, VIRTIO_INT_CONFIG);
+}
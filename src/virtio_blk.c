@@ -0,0 +1,587 @@
+#define _GNU_SOURCE
+
+#include <blackhv/disk.h>
+#include <blackhv/virtio_blk.h>
+#include <linux/falloc.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLK_SEG_MAX (VIRTQ_MAX_CHAIN - 2) // Header and status excluded
+#define BLK_MAX_DISCARD_SECTORS (1 << 22)
+#define BLK_ID "blackhv"
+
+static size_t iov_size(const struct iovec *iov, u32 nb_iov)
+{
+    size_t size = 0;
+
+    for (u32 i = 0; i < nb_iov; ++i)
+    {
+        size += iov[i].iov_len;
+    }
+
+    return size;
+}
+
+/**
+ * Copy `src` without its first `skip` bytes and last `trim` bytes to `dst`
+ *
+ * @return the number of iovecs in `dst`
+ */
+static u32 iov_slice(const struct iovec *src,
+                     u32 nb_iov,
+                     size_t skip,
+                     size_t trim,
+                     struct iovec *dst)
+{
+    size_t remaining = iov_size(src, nb_iov);
+    u32 count = 0;
+
+    if (remaining < skip + trim)
+    {
+        return 0;
+    }
+
+    remaining -= skip + trim;
+
+    for (u32 i = 0; i < nb_iov && remaining != 0; ++i)
+    {
+        size_t len = src[i].iov_len;
+
+        if (skip >= len)
+        {
+            skip -= len;
+            continue;
+        }
+
+        len -= skip;
+
+        if (len > remaining)
+        {
+            len = remaining;
+        }
+
+        dst[count].iov_base = (u8 *)src[i].iov_base + skip;
+        dst[count].iov_len = len;
+        count++;
+        remaining -= len;
+        skip = 0;
+    }
+
+    return count;
+}
+
+static size_t iov_to_buffer(const struct iovec *iov,
+                            u32 nb_iov,
+                            void *buffer,
+                            size_t len)
+{
+    size_t copied = 0;
+
+    for (u32 i = 0; i < nb_iov && copied < len; ++i)
+    {
+        size_t size = iov[i].iov_len;
+
+        if (size > len - copied)
+        {
+            size = len - copied;
+        }
+
+        memcpy((u8 *)buffer + copied, iov[i].iov_base, size);
+        copied += size;
+    }
+
+    return copied;
+}
+
+static size_t buffer_to_iov(const struct iovec *iov,
+                            u32 nb_iov,
+                            const void *buffer,
+                            size_t len)
+{
+    size_t copied = 0;
+
+    for (u32 i = 0; i < nb_iov && copied < len; ++i)
+    {
+        size_t size = iov[i].iov_len;
+
+        if (size > len - copied)
+        {
+            size = len - copied;
+        }
+
+        memcpy(iov[i].iov_base, (const u8 *)buffer + copied, size);
+        copied += size;
+    }
+
+    return copied;
+}
+
+static u32 in_bounds(virtio_blk_t *blk, u64 sector, u64 size)
+{
+    u64 nb_sectors = size / VIRTIO_BLK_SECTOR_SIZE;
+
+    return (size % VIRTIO_BLK_SECTOR_SIZE) == 0
+        && sector <= blk->config.capacity
+        && nb_sectors <= blk->config.capacity - sector;
+}
+
+static u32 complete_now(struct virtio_blk_request *req, u8 status)
+{
+    *req->status = status;
+    return 0;
+}
+
+/**
+ * Return the completed requests to the guest, with the queue lock held
+ *
+ * @return 1 if a request was returned, 0 otherwise
+ */
+static u32 reap_completions(struct virtio_blk_queue *queue)
+{
+    struct virtq *vq = &queue->blk->dev.queues[queue->index];
+    struct io_uring_cqe *cqe;
+    u32 pushed = 0;
+
+    while ((cqe = uring_peek_cqe(&queue->ring)) != NULL)
+    {
+        struct virtio_blk_request *req = (void *)cqe->user_data;
+        s32 res = cqe->res;
+
+        uring_cqe_seen(&queue->ring);
+
+        if (req == NULL)
+        {
+            queue->stopping = 1;
+            continue;
+        }
+
+        u32 ok = res >= 0 && (u32)res == req->size;
+
+        *req->status = ok ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+        queue->in_flight--;
+
+        // The queue may have been reset while the request was running
+        if (vq->ready)
+        {
+            virtq_push(vq, req->head, ok ? req->len + 1 : 1);
+            pushed = 1;
+        }
+    }
+
+    return pushed;
+}
+
+/**
+ * Get a submission entry, with the queue lock held. When the ring is full,
+ * the pending entries are submitted and the completions returned to make
+ * room, in case the kernel holds back submissions for a full completion
+ * ring.
+ *
+ * @return the entry, NULL if the ring is still full
+ */
+static struct io_uring_sqe *get_sqe(struct virtio_blk_queue *queue)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&queue->ring);
+
+    if (sqe != NULL)
+    {
+        return sqe;
+    }
+
+    uring_submit(&queue->ring);
+
+    if (reap_completions(queue))
+    {
+        virtq_notify(&queue->blk->dev,
+                     &queue->blk->dev.queues[queue->index]);
+    }
+
+    return uring_get_sqe(&queue->ring);
+}
+
+/**
+ * Turn a chain into an io_uring submission
+ *
+ * @return 1 if the request was submitted, 0 if it completed right away with
+ * its status written
+ */
+static u32 submit_request(struct virtio_blk_queue *queue,
+                          struct virtq_chain *chain,
+                          struct virtio_blk_request *req)
+{
+    virtio_blk_t *blk = queue->blk;
+    struct iovec *in = chain->iov + chain->out_num;
+    struct virtio_blk_req_header header;
+
+    if (iov_to_buffer(chain->iov, chain->out_num, &header, sizeof(header))
+        != sizeof(header))
+    {
+        return complete_now(req, VIRTIO_BLK_S_IOERR);
+    }
+
+    u64 offset = header.sector * VIRTIO_BLK_SECTOR_SIZE;
+    u64 discard_size = 0;
+    u8 opcode;
+
+    req->len = 0;
+
+    switch (header.type)
+    {
+    case VIRTIO_BLK_T_IN:
+        req->nb_iov = iov_slice(in, chain->in_num, 0, 1, req->iov);
+        req->size = iov_size(req->iov, req->nb_iov);
+        req->len = req->size;
+
+        if (!in_bounds(blk, header.sector, req->size))
+        {
+            return complete_now(req, VIRTIO_BLK_S_IOERR);
+        }
+
+        opcode = IORING_OP_READV;
+        break;
+    case VIRTIO_BLK_T_OUT:
+        req->nb_iov = iov_slice(
+            chain->iov, chain->out_num, sizeof(header), 0, req->iov);
+        req->size = iov_size(req->iov, req->nb_iov);
+
+        if (blk->read_only || !in_bounds(blk, header.sector, req->size))
+        {
+            return complete_now(req, VIRTIO_BLK_S_IOERR);
+        }
+
+        opcode = IORING_OP_WRITEV;
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        req->nb_iov = 0;
+        req->size = 0;
+        opcode = IORING_OP_FSYNC;
+        break;
+    case VIRTIO_BLK_T_DISCARD: {
+        struct iovec data[VIRTQ_MAX_CHAIN];
+        struct virtio_blk_discard discard;
+        u32 nb_data = iov_slice(
+            chain->iov, chain->out_num, sizeof(header), 0, data);
+
+        // A single segment is advertised in max_discard_seg
+        if (blk->read_only
+            || iov_to_buffer(data, nb_data, &discard, sizeof(discard))
+                != sizeof(discard)
+            || !in_bounds(blk,
+                          discard.sector,
+                          (u64)discard.num_sectors * VIRTIO_BLK_SECTOR_SIZE))
+        {
+            return complete_now(req, VIRTIO_BLK_S_IOERR);
+        }
+
+        req->nb_iov = 0;
+        req->size = 0;
+        opcode = IORING_OP_FALLOCATE;
+        offset = discard.sector * VIRTIO_BLK_SECTOR_SIZE;
+        discard_size = (u64)discard.num_sectors * VIRTIO_BLK_SECTOR_SIZE;
+        break;
+    }
+    case VIRTIO_BLK_T_GET_ID: {
+        struct iovec data[VIRTQ_MAX_CHAIN];
+        char id[VIRTIO_BLK_ID_BYTES] = BLK_ID;
+        u32 nb_data = iov_slice(in, chain->in_num, 0, 1, data);
+
+        req->len = buffer_to_iov(data, nb_data, id, sizeof(id));
+        return complete_now(req, VIRTIO_BLK_S_OK);
+    }
+    default:
+        return complete_now(req, VIRTIO_BLK_S_UNSUPP);
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(queue);
+
+    if (sqe == NULL)
+    {
+        return complete_now(req, VIRTIO_BLK_S_IOERR);
+    }
+
+    sqe->opcode = opcode;
+    sqe->fd = blk->disk_fd;
+    sqe->off = offset;
+    sqe->user_data = (u64)req;
+
+    if (opcode == IORING_OP_READV || opcode == IORING_OP_WRITEV)
+    {
+        sqe->addr = (u64)req->iov;
+        sqe->len = req->nb_iov;
+    }
+    else if (opcode == IORING_OP_FALLOCATE)
+    {
+        sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        sqe->addr = discard_size;
+    }
+
+    queue->in_flight++;
+
+    return 1;
+}
+
+static void process_queue(struct virtio_blk_queue *queue)
+{
+    virtio_blk_t *blk = queue->blk;
+    struct virtq *vq = &blk->dev.queues[queue->index];
+    struct virtq_chain chain;
+    u32 pushed = 0;
+
+    pthread_mutex_lock(&vq->lock);
+
+    do
+    {
+        virtq_disable_notify(&blk->dev, vq);
+
+        while (virtq_pop(&blk->dev, vq, &chain))
+        {
+            struct virtio_blk_request *req = &queue->requests[chain.head];
+            struct iovec *status = &chain.iov[chain.out_num + chain.in_num - 1];
+
+            // The status is the last byte of the device writable buffers
+            if (chain.in_num == 0 || status->iov_len == 0)
+            {
+                virtq_push(vq, chain.head, 0);
+                pushed = 1;
+                continue;
+            }
+
+            req->head = chain.head;
+            req->status = (u8 *)status->iov_base + status->iov_len - 1;
+
+            if (!submit_request(queue, &chain, req))
+            {
+                virtq_push(vq, chain.head, req->len + 1);
+                pushed = 1;
+            }
+        }
+    } while (virtq_enable_notify(&blk->dev, vq));
+
+    if (uring_submit(&queue->ring) < 0)
+    {
+        fprintf(stderr, "Failed to submit virtio-blk requests\n");
+    }
+
+    if (pushed)
+    {
+        virtq_notify(&blk->dev, vq);
+    }
+
+    pthread_mutex_unlock(&vq->lock);
+}
+
+/**
+ * Return the completed requests to the guest, with one interrupt per batch
+ * of completions
+ */
+static void *completion_thread(void *params)
+{
+    struct virtio_blk_queue *queue = params;
+    virtio_blk_t *blk = queue->blk;
+    struct virtq *vq = &blk->dev.queues[queue->index];
+
+    while (!queue->stopping || queue->in_flight != 0)
+    {
+        if (!uring_wait(&queue->ring))
+        {
+            fprintf(stderr, "Failed to wait for virtio-blk completions\n");
+            break;
+        }
+
+        pthread_mutex_lock(&vq->lock);
+
+        if (reap_completions(queue))
+        {
+            virtq_notify(&blk->dev, vq);
+        }
+
+        pthread_mutex_unlock(&vq->lock);
+    }
+
+    return NULL;
+}
+
+static void blk_notify(struct virtio_device *dev, u16 queue)
+{
+    virtio_blk_t *blk = dev->data;
+
+    if (queue < blk->nb_queues)
+    {
+        process_queue(&blk->queues[queue]);
+    }
+}
+
+/**
+ * Wake up the completion thread of a queue, it stops once nothing is in
+ * flight
+ */
+static void stop_queue(struct virtio_blk_queue *queue)
+{
+    struct virtq *vq = &queue->blk->dev.queues[queue->index];
+
+    pthread_mutex_lock(&vq->lock);
+    struct io_uring_sqe *sqe;
+
+    // The ring frees up as the requests in flight complete
+    while ((sqe = get_sqe(queue)) == NULL)
+    {
+        pthread_mutex_unlock(&vq->lock);
+        sched_yield();
+        pthread_mutex_lock(&vq->lock);
+    }
+
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = 0;
+    uring_submit(&queue->ring);
+    pthread_mutex_unlock(&vq->lock);
+
+    pthread_join(queue->thread, NULL);
+}
+
+static void blk_free(virtio_blk_t *blk)
+{
+    for (u16 i = 0; i < blk->nb_queues; ++i)
+    {
+        if (blk->queues[i].ring.fd >= 0)
+        {
+            uring_destroy(&blk->queues[i].ring);
+        }
+    }
+
+    free(blk->queues);
+    free(blk);
+}
+
+virtio_blk_t *virtio_blk_new(vm_t *vm,
+                             u64 base_address,
+                             u32 irq,
+                             int disk_fd,
+                             u32 flags,
+                             u16 nb_queues)
+{
+    if (nb_queues == 0 || nb_queues > VIRTIO_MAX_QUEUES)
+    {
+        fprintf(stderr, "Invalid number of virtio-blk queues\n");
+        return NULL;
+    }
+
+    virtio_blk_t *blk = calloc(1, sizeof(virtio_blk_t));
+
+    if (blk == NULL)
+    {
+        return NULL;
+    }
+
+    blk->queues = calloc(nb_queues, sizeof(struct virtio_blk_queue));
+
+    if (blk->queues == NULL)
+    {
+        free(blk);
+        return NULL;
+    }
+
+    blk->disk_fd = disk_fd;
+    blk->read_only = (flags & VIRTIO_BLK_READ_ONLY) != 0;
+    blk->nb_queues = nb_queues;
+
+    for (u16 i = 0; i < nb_queues; ++i)
+    {
+        blk->queues[i].blk = blk;
+        blk->queues[i].index = i;
+        blk->queues[i].ring.fd = -1;
+    }
+
+    for (u16 i = 0; i < nb_queues; ++i)
+    {
+        if (!uring_init(&blk->queues[i].ring, VIRTQ_MAX_SIZE))
+        {
+            fprintf(stderr, "Failed to setup io_uring\n");
+            blk_free(blk);
+            return NULL;
+        }
+    }
+
+    blk->config.capacity = raw_disk(disk_fd).size / VIRTIO_BLK_SECTOR_SIZE;
+    blk->config.seg_max = BLK_SEG_MAX;
+    blk->config.blk_size = VIRTIO_BLK_SECTOR_SIZE;
+    blk->config.num_queues = nb_queues;
+    blk->config.max_discard_sectors = BLK_MAX_DISCARD_SECTORS;
+    blk->config.max_discard_seg = 1;
+    blk->config.discard_sector_alignment = 1;
+
+    struct virtio_device *dev = &blk->dev;
+    dev->device_id = VIRTIO_ID_BLOCK;
+    dev->device_features = VIRTIO_FEATURE(VIRTIO_BLK_F_SEG_MAX)
+        | VIRTIO_FEATURE(VIRTIO_BLK_F_BLK_SIZE)
+        | VIRTIO_FEATURE(VIRTIO_BLK_F_FLUSH)
+        | VIRTIO_FEATURE(VIRTIO_BLK_F_MQ)
+        | VIRTIO_FEATURE(VIRTIO_RING_F_EVENT_IDX);
+    dev->device_features |= blk->read_only
+        ? VIRTIO_FEATURE(VIRTIO_BLK_F_RO)
+        : VIRTIO_FEATURE(VIRTIO_BLK_F_DISCARD);
+    dev->num_queues = nb_queues;
+    dev->config = &blk->config;
+    dev->config_size = sizeof(blk->config);
+    dev->notify = blk_notify;
+    dev->data = blk;
+
+    if (virtio_device_init(dev, vm, base_address, irq) == 0)
+    {
+        blk_free(blk);
+        return NULL;
+    }
+
+    for (u16 i = 0; i < nb_queues; ++i)
+    {
+        struct virtio_blk_queue *queue = &blk->queues[i];
+
+        if (pthread_create(&queue->thread, NULL, completion_thread, queue)
+            != 0)
+        {
+            for (u16 j = 0; j < i; ++j)
+            {
+                stop_queue(&blk->queues[j]);
+            }
+
+            virtio_device_uninit(dev);
+            blk_free(blk);
+            return NULL;
+        }
+    }
+
+    return blk;
+}
+
+void virtio_blk_destroy(virtio_blk_t *blk)
+{
+    if (blk == NULL)
+    {
+        return;
+    }
+
+    for (u16 i = 0; i < blk->nb_queues; ++i)
+    {
+        stop_queue(&blk->queues[i]);
+    }
+
+    virtio_device_uninit(&blk->dev);
+    blk_free(blk);
+}
+
+s32 virtio_blk_set_affinity(virtio_blk_t *blk, u16 queue, u32 cpu)
+{
+    if (blk == NULL || queue >= blk->nb_queues || cpu >= CPU_SETSIZE)
+    {
+        return 0;
+    }
+
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(blk->queues[queue].thread, sizeof(set), &set)
+        == 0;
+}
@@ -0,0 +1,331 @@
+#include <blackhv/virtio_console.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define RECEIVEQ 0 // Host to guest
+#define TRANSMITQ 1 // Guest to host
+
+#define CONSOLE_COLS 80
+#define CONSOLE_ROWS 25
+
+/**
+ * Copy the data written by the host into the buffers posted by the guest
+ */
+static void flush_rx(virtio_console_t *console)
+{
+    struct virtq *vq = &console->dev.queues[RECEIVEQ];
+    struct virtq_chain chain;
+    u32 pushed = 0;
+
+    pthread_mutex_lock(&vq->lock);
+
+    while (!queue_empty(console->host_queue)
+           && virtq_pop(&console->dev, vq, &chain))
+    {
+        u32 written = 0;
+
+        for (u16 i = chain.out_num; i < chain.out_num + chain.in_num; ++i)
+        {
+            size_t len = chain.iov[i].iov_len;
+            size_t r =
+                queue_read(console->host_queue, chain.iov[i].iov_base, len);
+
+            written += r;
+
+            if (r < len)
+            {
+                break;
+            }
+        }
+
+        virtq_push(vq, chain.head, written);
+        pushed = 1;
+    }
+
+    if (pushed)
+    {
+        virtq_notify(&console->dev, vq);
+    }
+
+    pthread_mutex_unlock(&vq->lock);
+}
+
+/**
+ * Copy the current transmit chain to the guest queue, resuming at tx_offset.
+ *
+ * @return 1 if the whole chain was copied, 0 if guest_queue is full
+ */
+static u32 copy_tx_chain(virtio_console_t *console, u32 *written)
+{
+    struct virtq_chain *chain = &console->tx_chain;
+    size_t skip = console->tx_offset;
+
+    for (u16 i = 0; i < chain->out_num; ++i)
+    {
+        size_t len = chain->iov[i].iov_len;
+
+        if (skip >= len)
+        {
+            skip -= len;
+            continue;
+        }
+
+        size_t w = queue_write(console->guest_queue,
+                               (u8 *)chain->iov[i].iov_base + skip,
+                               len - skip);
+
+        console->tx_offset += w;
+        *written += w;
+
+        if (w < len - skip)
+        {
+            return 0;
+        }
+
+        skip = 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Move the buffers sent by the guest to the guest queue. When the queue is
+ * full the chain is kept and resumed once the host has read some data, so
+ * nothing is dropped.
+ */
+static void flush_tx(virtio_console_t *console)
+{
+    struct virtq *vq = &console->dev.queues[TRANSMITQ];
+    u32 written = 0;
+    u32 pushed = 0;
+    u32 full = 0;
+
+    pthread_mutex_lock(&vq->lock);
+
+    do
+    {
+        virtq_disable_notify(&console->dev, vq);
+
+        for (;;)
+        {
+            if (!console->tx_pending)
+            {
+                if (!virtq_pop(&console->dev, vq, &console->tx_chain))
+                {
+                    break;
+                }
+
+                console->tx_pending = 1;
+                console->tx_offset = 0;
+            }
+
+            if (!copy_tx_chain(console, &written))
+            {
+                full = 1;
+                break;
+            }
+
+            virtq_push(vq, console->tx_chain.head, 0);
+            console->tx_pending = 0;
+            pushed = 1;
+        }
+    } while (!full && virtq_enable_notify(&console->dev, vq));
+
+    if (pushed)
+    {
+        virtq_notify(&console->dev, vq);
+    }
+
+    pthread_mutex_unlock(&vq->lock);
+
+    if (written != 0)
+    {
+        eventfd_write(console->event_fd, 1);
+    }
+}
+
+static void console_notify(struct virtio_device *dev, u16 queue)
+{
+    virtio_console_t *console = dev->data;
+
+    if (queue == RECEIVEQ)
+    {
+        flush_rx(console);
+    }
+    else if (queue == TRANSMITQ)
+    {
+        flush_tx(console);
+    }
+}
+
+static void console_config_write(struct virtio_device *dev,
+                                 u32 offset,
+                                 u8 *data,
+                                 u32 len)
+{
+    virtio_console_t *console = dev->data;
+
+    if (offset != offsetof(struct virtio_console_config, emerg_wr) || len == 0)
+    {
+        return;
+    }
+
+    // Emergency write, a single character outside of the virtqueues
+    struct virtq *vq = &dev->queues[TRANSMITQ];
+    pthread_mutex_lock(&vq->lock);
+    u32 written = queue_write(console->guest_queue, data, 1);
+    pthread_mutex_unlock(&vq->lock);
+
+    if (written != 0)
+    {
+        eventfd_write(console->event_fd, 1);
+    }
+}
+
+static void console_reset(struct virtio_device *dev)
+{
+    virtio_console_t *console = dev->data;
+    struct virtq *vq = &dev->queues[TRANSMITQ];
+
+    pthread_mutex_lock(&vq->lock);
+    console->tx_pending = 0;
+    console->tx_offset = 0;
+    pthread_mutex_unlock(&vq->lock);
+}
+
+static void console_free(virtio_console_t *console)
+{
+    if (console->event_fd >= 0)
+    {
+        close(console->event_fd);
+    }
+
+    queue_destroy(console->guest_queue);
+    queue_destroy(console->host_queue);
+    free(console);
+}
+
+virtio_console_t *virtio_console_new(vm_t *vm,
+                                     u64 base_address,
+                                     u32 irq,
+                                     size_t internal_buffer_size)
+{
+    virtio_console_t *console = calloc(1, sizeof(virtio_console_t));
+
+    if (console == NULL)
+    {
+        return NULL;
+    }
+
+    console->guest_queue = queue_new(internal_buffer_size);
+    console->host_queue = queue_new(internal_buffer_size);
+    console->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (console->guest_queue == NULL || console->host_queue == NULL
+        || console->event_fd < 0)
+    {
+        console_free(console);
+        return NULL;
+    }
+
+    console->config.cols = CONSOLE_COLS;
+    console->config.rows = CONSOLE_ROWS;
+    console->config.max_nr_ports = 1;
+
+    struct virtio_device *dev = &console->dev;
+    dev->device_id = VIRTIO_ID_CONSOLE;
+    dev->device_features = VIRTIO_FEATURE(VIRTIO_CONSOLE_F_SIZE)
+        | VIRTIO_FEATURE(VIRTIO_CONSOLE_F_EMERG_WRITE)
+        | VIRTIO_FEATURE(VIRTIO_RING_F_EVENT_IDX);
+    dev->num_queues = 2;
+    dev->config = &console->config;
+    dev->config_size = sizeof(console->config);
+    dev->notify = console_notify;
+    dev->config_write = console_config_write;
+    dev->reset = console_reset;
+    dev->data = console;
+
+    if (virtio_device_init(dev, vm, base_address, irq) == 0)
+    {
+        console_free(console);
+        return NULL;
+    }
+
+    return console;
+}
+
+void virtio_console_destroy(virtio_console_t *console)
+{
+    if (console == NULL)
+    {
+        return;
+    }
+
+    virtio_device_uninit(&console->dev);
+    console_free(console);
+}
+
+size_t virtio_console_read(virtio_console_t *console, u8 *buffer, size_t len)
+{
+    if (console == NULL || buffer == NULL)
+    {
+        return -1;
+    }
+
+    size_t r = queue_read(console->guest_queue, buffer, len);
+
+    // Room was made, resume a transmission stopped by a full queue
+    if (r != 0)
+    {
+        flush_tx(console);
+    }
+
+    return r;
+}
+
+size_t virtio_console_read_timeout(virtio_console_t *console,
+                                   u8 *buffer,
+                                   size_t len,
+                                   s32 timeout_ms)
+{
+    if (console == NULL || buffer == NULL)
+    {
+        return -1;
+    }
+
+    size_t r = queue_read_wait(
+        console->guest_queue, console->event_fd, buffer, len, timeout_ms);
+
+    if (r != 0)
+    {
+        flush_tx(console);
+    }
+
+    return r;
+}
+
+s32 virtio_console_get_eventfd(virtio_console_t *console)
+{
+    if (console == NULL)
+    {
+        return -1;
+    }
+
+    return console->event_fd;
+}
+
+size_t virtio_console_write(virtio_console_t *console, u8 *buffer, size_t len)
+{
+    if (console == NULL || buffer == NULL)
+    {
+        return -1;
+    }
+
+    size_t written = queue_write(console->host_queue, buffer, len);
+
+    flush_rx(console);
+
+    return written;
+}
@@ -0,0 +1,227 @@
+#include <blackhv/memory.h>
+#include <blackhv/virtio_pmem.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define REQUESTQ 0
+
+/**
+ * A flush request popped from the queue, answered once the file is synced
+ */
+struct pmem_request
+{
+    u16 head;
+    struct virtio_pmem_resp *resp; // NULL if the chain is malformed
+    u32 type;
+};
+
+static u32 pop_requests(virtio_pmem_t *pmem, struct pmem_request *requests)
+{
+    struct virtq *vq = &pmem->dev.queues[REQUESTQ];
+    struct virtq_chain chain;
+    u32 nb_requests = 0;
+
+    pthread_mutex_lock(&vq->lock);
+
+    while (nb_requests < VIRTQ_MAX_SIZE && virtq_pop(&pmem->dev, vq, &chain))
+    {
+        struct pmem_request *req = &requests[nb_requests++];
+        struct iovec *resp = &chain.iov[chain.out_num];
+
+        req->head = chain.head;
+        req->resp = NULL;
+
+        if (chain.out_num >= 1 && chain.in_num >= 1
+            && chain.iov[0].iov_len >= sizeof(struct virtio_pmem_req)
+            && resp->iov_len >= sizeof(struct virtio_pmem_resp))
+        {
+            req->type = ((struct virtio_pmem_req *)chain.iov[0].iov_base)->type;
+            req->resp = resp->iov_base;
+        }
+    }
+
+    pthread_mutex_unlock(&vq->lock);
+
+    return nb_requests;
+}
+
+static void complete_requests(virtio_pmem_t *pmem,
+                              struct pmem_request *requests,
+                              u32 nb_requests,
+                              u32 ret)
+{
+    struct virtq *vq = &pmem->dev.queues[REQUESTQ];
+
+    pthread_mutex_lock(&vq->lock);
+
+    for (u32 i = 0; i < nb_requests; ++i)
+    {
+        struct pmem_request *req = &requests[i];
+        u32 len = 0;
+
+        if (req->resp != NULL)
+        {
+            req->resp->ret = req->type == VIRTIO_PMEM_REQ_TYPE_FLUSH ? ret : 1;
+            len = sizeof(struct virtio_pmem_resp);
+        }
+
+        // The queue may have been reset while the file was synced
+        if (vq->ready)
+        {
+            virtq_push(vq, req->head, len);
+        }
+    }
+
+    virtq_notify(&pmem->dev, vq);
+    pthread_mutex_unlock(&vq->lock);
+}
+
+/**
+ * Requests kicked while the file is synced wait for the next fdatasync,
+ * which covers all of them
+ */
+static void *flush_thread(void *arg)
+{
+    virtio_pmem_t *pmem = arg;
+    struct pmem_request requests[VIRTQ_MAX_SIZE];
+
+    while (1)
+    {
+        pthread_mutex_lock(&pmem->lock);
+
+        while (!pmem->pending && !pmem->stop)
+        {
+            pthread_cond_wait(&pmem->cond, &pmem->lock);
+        }
+
+        u32 stop = pmem->stop;
+
+        pmem->pending = 0;
+        pthread_mutex_unlock(&pmem->lock);
+
+        if (stop)
+        {
+            return NULL;
+        }
+
+        u32 nb_requests = pop_requests(pmem, requests);
+
+        if (nb_requests == 0)
+        {
+            continue;
+        }
+
+        // Nothing can be dirty in a read-only mapping
+        u32 ret = !pmem->read_only && fdatasync(pmem->fd) != 0;
+
+        complete_requests(pmem, requests, nb_requests, ret);
+    }
+}
+
+static void pmem_notify(struct virtio_device *dev, u16 queue)
+{
+    virtio_pmem_t *pmem = dev->data;
+
+    if (queue != REQUESTQ)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pmem->lock);
+    pmem->pending = 1;
+    pthread_cond_signal(&pmem->cond);
+    pthread_mutex_unlock(&pmem->lock);
+}
+
+static void pmem_free(virtio_pmem_t *pmem)
+{
+    pthread_cond_destroy(&pmem->cond);
+    pthread_mutex_destroy(&pmem->lock);
+    free(pmem);
+}
+
+virtio_pmem_t *virtio_pmem_new(vm_t *vm,
+                               u64 base_address,
+                               u32 irq,
+                               u64 phys_addr,
+                               int fd,
+                               u32 flags)
+{
+    struct stat stat;
+
+    if (fstat(fd, &stat) < 0 || stat.st_size == 0)
+    {
+        fprintf(stderr, "Invalid virtio-pmem file\n");
+        return NULL;
+    }
+
+    virtio_pmem_t *pmem = calloc(1, sizeof(virtio_pmem_t));
+
+    if (pmem == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&pmem->lock, NULL);
+    pthread_cond_init(&pmem->cond, NULL);
+    pmem->fd = fd;
+    pmem->read_only = (flags & VIRTIO_PMEM_READ_ONLY) != 0;
+
+    // The end of the last page past the end of the file reads as zeros
+    pmem->config.start = phys_addr;
+    pmem->config.size = align_up(stat.st_size);
+
+    if (memory_map_file(vm,
+                        phys_addr,
+                        pmem->config.size,
+                        fd,
+                        pmem->read_only ? MEMORY_READ_ONLY : 0)
+        == 0)
+    {
+        pmem_free(pmem);
+        return NULL;
+    }
+
+    struct virtio_device *dev = &pmem->dev;
+    dev->device_id = VIRTIO_ID_PMEM;
+    dev->device_features = VIRTIO_FEATURE(VIRTIO_RING_F_EVENT_IDX);
+    dev->num_queues = 1;
+    dev->config = &pmem->config;
+    dev->config_size = sizeof(pmem->config);
+    dev->notify = pmem_notify;
+    dev->data = pmem;
+
+    if (virtio_device_init(dev, vm, base_address, irq) == 0)
+    {
+        pmem_free(pmem);
+        return NULL;
+    }
+
+    if (pthread_create(&pmem->thread, NULL, flush_thread, pmem) != 0)
+    {
+        virtio_device_uninit(dev);
+        pmem_free(pmem);
+        return NULL;
+    }
+
+    return pmem;
+}
+
+void virtio_pmem_destroy(virtio_pmem_t *pmem)
+{
+    if (pmem == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pmem->lock);
+    pmem->stop = 1;
+    pthread_cond_signal(&pmem->cond);
+    pthread_mutex_unlock(&pmem->lock);
+    pthread_join(pmem->thread, NULL);
+
+    virtio_device_uninit(&pmem->dev);
+    pmem_free(pmem);
+}
@@ -263,6 +263,16 @@ static void handle_exit_io(vm_t *vm)
                         vm->kvm_run->io.port);
             }
         }
+        else if (vm->kvm_run->io.size == 4)
+        {
+            u32 data = *(u32 *)(tmp + vm->kvm_run->io.data_offset);
+            if (io_handle_outl(vm->kvm_run->io.port, data) == 0)
+            {
+                fprintf(stderr,
+                        "Outl to unsupported port: %x\n",
+                        vm->kvm_run->io.port);
+            }
+        }
     }
     else if (vm->kvm_run->io.direction == KVM_EXIT_IO_IN)
     {
@@ -290,6 +300,17 @@ static void handle_exit_io(vm_t *vm)
                         vm->kvm_run->io.port);
             }
         }
+        else if (vm->kvm_run->io.size == 4)
+        {
+            if (io_handle_inl(vm->kvm_run->io.port,
+                              (u32 *)(tmp + vm->kvm_run->io.data_offset))
+                == 0)
+            {
+                fprintf(stderr,
+                        "Inl to unsupported port: %x\n",
+                        vm->kvm_run->io.port);
+            }
+        }
     }
 }
 
@@ -321,6 +342,12 @@ s32 vm_run(vm_t *vm)
                                   vm->kvm_run->mmio.data,
                                   vm->kvm_run->mmio.len);
             }
+            else
+            {
+                mmio_handle_read(vm->kvm_run->mmio.phys_addr,
+                                 vm->kvm_run->mmio.data,
+                                 vm->kvm_run->mmio.len);
+            }
             break;
         }
         case KVM_EXIT_HLT: {
@@ -367,3 +394,15 @@ s32 vm_dump_regs(vm_t *vm)
 
     return 1;
 }
+
+s32 vm_irq_line(vm_t *vm, u32 irq, u32 level)
+{
+    if (vm == NULL)
+    {
+        return 0;
+    }
+
+    struct kvm_irq_level irq_level = { .irq = irq, .level = level };
+
+    return ioctl(vm->vm_fd, KVM_IRQ_LINE, &irq_level) == 0;
+}
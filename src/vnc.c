@@ -0,0 +1,1885 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <blackhv/headless.h>
+#include <blackhv/pixel.h>
+#include <blackhv/ps2.h>
+#include <blackhv/vnc.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+#define IN_BUFFER_SIZE 4096
+#define WAIT_TIMEOUT_MS 100 // The frame thread checks for a stop this often
+
+#define TILE_COLS (VBE_MAX_XRES / VNC_TILE)
+#define TILE_ROWS (VBE_MAX_YRES / VNC_TILE)
+#define NB_TILES (TILE_COLS * TILE_ROWS)
+#define TILE_WORDS ((NB_TILES + 63) / 64)
+#define TILE_PIXELS (VNC_TILE * VNC_TILE)
+#define TILE_MAX_SIZE (1 + TILE_PIXELS * 4) // A raw tile
+#define RECT_HEADER_SIZE 12
+
+/* Event sources */
+#define SOURCE_STOP 0
+#define SOURCE_FRAME 1
+#define SOURCE_LISTEN 2
+#define SOURCE_CLIENT 3
+
+/* Client states */
+#define STATE_VERSION 0
+#define STATE_SECURITY 1
+#define STATE_INIT 2
+#define STATE_NORMAL 3
+
+/* Client messages */
+#define MSG_SET_PIXEL_FORMAT 0
+#define MSG_SET_ENCODINGS 2
+#define MSG_UPDATE_REQUEST 3
+#define MSG_KEY 4
+#define MSG_POINTER 5
+#define MSG_CUT_TEXT 6
+
+/* Server messages */
+#define MSG_COLOUR_MAP 1
+
+#define COLOUR_MAP_SIZE 256
+
+/* Pointer button mask bits */
+#define POINTER_LEFT 0x01
+#define POINTER_MIDDLE 0x02
+#define POINTER_RIGHT 0x04
+#define POINTER_WHEEL_UP 0x08
+#define POINTER_WHEEL_DOWN 0x10
+
+#define SECURITY_NONE 1
+#define PROTOCOL_VERSION "RFB 003.008\n"
+#define PROTOCOL_VERSION_SIZE 12
+#define SERVER_NAME "blackhv"
+
+struct client;
+
+/**
+ * Pixel format of a viewer, the pixels are packed in bpp / 8 bytes
+ */
+struct format
+{
+    u8 bpp;
+    u8 big_endian;
+    u8 true_colour;
+    u16 max[3]; // Red, green and blue
+    u8 shift[3];
+};
+
+static const struct format server_format = { .bpp = 32,
+                                             .big_endian = 0,
+                                             .true_colour = 1,
+                                             .max = { 255, 255, 255 },
+                                             .shift = { 16, 8, 0 } };
+
+/**
+ * Hextile tiles encoded in one pixel format, shared by the viewers using it
+ */
+struct cache
+{
+    struct format format;
+    u32 users;
+    u8 *tiles; // Allocated when a hextile viewer first needs it
+    u16 tile_size[NB_TILES];
+    u64 valid[TILE_WORDS];
+};
+
+struct source
+{
+    u32 kind;
+    s32 fd;
+    struct client *client;
+};
+
+struct client
+{
+    struct source source;
+    u32 state;
+    u32 minor; // Protocol version 3.minor
+    u8 hextile;
+    u8 desktop_size;
+    u8 requested; // An update was requested and not sent yet
+    u8 out_polled; // Waiting for the socket to accept more output
+    u8 closed; // Freed once the current events are handled
+    u32 width; // Of the last update
+    u32 height;
+    u64 dirty[TILE_WORDS];
+    struct cache *cache; // Of the pixel format of the client
+
+    u8 in[IN_BUFFER_SIZE];
+    u32 in_len;
+    u32 skip; // Cut text bytes still to be discarded
+
+    // Last pointer event, the mouse only gets the moves
+    u8 pointer_valid;
+    u8 pointer_mask;
+    u16 pointer_x;
+    u16 pointer_y;
+
+    u8 *out;
+    u64 out_len;
+    u64 out_off;
+    u64 out_capacity;
+};
+
+struct vnc
+{
+    u8 *memory; // The headless shared memory
+    struct headless_header *header;
+
+    // Last frame read from the header
+    u32 sequence;
+    u32 width;
+    u32 height;
+    u32 pitch;
+    u32 bpp;
+    u32 offset;
+    u32 palette[256];
+
+    // Encoded tiles per pixel format, the server one first
+    struct cache *caches[VNC_MAX_CLIENTS + 1];
+    u32 rows[VBE_MAX_XRES * VNC_TILE]; // Pixels of a run of tiles
+
+    s32 epoll_fd;
+    s32 stop_fd;
+    s32 frame_fd;
+    struct source stop_source;
+    struct source frame_source;
+    pthread_t io_thread;
+    pthread_t frame_thread;
+    u32 threads; // Started threads
+    u32 stop;
+
+    pthread_mutex_t lock; // Protects the listeners
+    struct source listeners[VNC_MAX_LISTENERS];
+    char *paths[VNC_MAX_LISTENERS]; // Unix sockets to remove
+    u32 nb_listeners;
+
+    struct client *clients[VNC_MAX_CLIENTS];
+
+    pthread_mutex_t input_lock; // Held by the I/O thread during a batch
+    ps2_t *ps2;
+    u32 input_queued; // Input to flush at the end of the batch
+};
+
+/* Printable keysyms (Latin-1) to USB HID usage, US layout */
+static const u8 ascii_usages[128] = {
+    [' '] = 0x2C, ['!'] = 0x1E, ['"'] = 0x34, ['#'] = 0x20, ['$'] = 0x21,
+    ['%'] = 0x22, ['&'] = 0x24, ['\''] = 0x34, ['('] = 0x26, [')'] = 0x27,
+    ['*'] = 0x25, ['+'] = 0x2E, [','] = 0x36, ['-'] = 0x2D, ['.'] = 0x37,
+    ['/'] = 0x38, ['0'] = 0x27, ['1'] = 0x1E, ['2'] = 0x1F, ['3'] = 0x20,
+    ['4'] = 0x21, ['5'] = 0x22, ['6'] = 0x23, ['7'] = 0x24, ['8'] = 0x25,
+    ['9'] = 0x26, [':'] = 0x33, [';'] = 0x33, ['<'] = 0x36, ['='] = 0x2E,
+    ['>'] = 0x37, ['?'] = 0x38, ['@'] = 0x1F, ['['] = 0x2F, ['\\'] = 0x31,
+    [']'] = 0x30, ['^'] = 0x23, ['_'] = 0x2D, ['`'] = 0x35, ['{'] = 0x2F,
+    ['|'] = 0x31, ['}'] = 0x30, ['~'] = 0x35,
+};
+
+/* Function and modifier keysyms to USB HID usage */
+static const u16 special_usages[][2] = {
+    { 0xFF08, 0x2A }, { 0xFF09, 0x2B }, { 0xFF0D, 0x28 }, { 0xFF13, 0x48 },
+    { 0xFF14, 0x47 }, { 0xFF1B, 0x29 }, { 0xFF50, 0x4A }, { 0xFF51, 0x50 },
+    { 0xFF52, 0x52 }, { 0xFF53, 0x4F }, { 0xFF54, 0x51 }, { 0xFF55, 0x4B },
+    { 0xFF56, 0x4E }, { 0xFF57, 0x4D }, { 0xFF61, 0x46 }, { 0xFF63, 0x49 },
+    { 0xFF67, 0x65 }, { 0xFF7F, 0x53 }, { 0xFF8D, 0x58 }, { 0xFF95, 0x5F },
+    { 0xFF96, 0x5C }, { 0xFF97, 0x60 }, { 0xFF98, 0x5E }, { 0xFF99, 0x5A },
+    { 0xFF9A, 0x61 }, { 0xFF9B, 0x5B }, { 0xFF9C, 0x59 }, { 0xFF9D, 0x5D },
+    { 0xFF9E, 0x62 }, { 0xFF9F, 0x63 }, { 0xFFAA, 0x55 }, { 0xFFAB, 0x57 },
+    { 0xFFAD, 0x56 }, { 0xFFAE, 0x63 }, { 0xFFAF, 0x54 }, { 0xFFB0, 0x62 },
+    { 0xFFB1, 0x59 }, { 0xFFB2, 0x5A }, { 0xFFB3, 0x5B }, { 0xFFB4, 0x5C },
+    { 0xFFB5, 0x5D }, { 0xFFB6, 0x5E }, { 0xFFB7, 0x5F }, { 0xFFB8, 0x60 },
+    { 0xFFB9, 0x61 }, { 0xFFE1, 0xE1 }, { 0xFFE2, 0xE5 }, { 0xFFE3, 0xE0 },
+    { 0xFFE4, 0xE4 }, { 0xFFE5, 0x39 }, { 0xFFE7, 0xE3 }, { 0xFFE8, 0xE7 },
+    { 0xFFE9, 0xE2 }, { 0xFFEA, 0xE6 }, { 0xFFEB, 0xE3 }, { 0xFFEC, 0xE7 },
+    { 0xFE03, 0xE6 }, { 0xFFFF, 0x4C },
+};
+
+static u32 test_bit(const u64 *bits, u32 i)
+{
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void set_bit(u64 *bits, u32 i)
+{
+    bits[i / 64] |= 1ULL << (i % 64);
+}
+
+static u32 bytes_per_pixel(u32 bpp)
+{
+    return (bpp + 7) / 8;
+}
+
+static u16 get_u16(const u8 *buffer)
+{
+    return (buffer[0] << 8) | buffer[1];
+}
+
+static u32 get_u32(const u8 *buffer)
+{
+    return ((u32)buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8)
+        | buffer[3];
+}
+
+static u8 *put_u16(u8 *buffer, u16 value)
+{
+    buffer[0] = value >> 8;
+    buffer[1] = value;
+    return buffer + 2;
+}
+
+static u8 *put_u32(u8 *buffer, u32 value)
+{
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+    return buffer + 4;
+}
+
+static u32 same_format(const struct format *a, const struct format *b)
+{
+    return a->bpp == b->bpp && a->big_endian == b->big_endian
+        && a->true_colour == b->true_colour
+        && memcmp(a->max, b->max, sizeof(a->max)) == 0
+        && memcmp(a->shift, b->shift, sizeof(a->shift)) == 0;
+}
+
+/**
+ * Write a pixel already packed in `format`
+ */
+static u8 *put_pixel(u8 *buffer, const struct format *format, u32 pixel)
+{
+    u32 size = format->bpp / 8;
+
+    for (u32 i = 0; i < size; ++i)
+    {
+        u32 byte = format->big_endian ? size - 1 - i : i;
+
+        buffer[i] = pixel >> (byte * 8);
+    }
+
+    return buffer + size;
+}
+
+/**
+ * Pack XRGB pixels in `format`, in place
+ */
+static void pack_pixels(const struct format *format, u32 *pixels, u32 count)
+{
+    if (same_format(format, &server_format))
+    {
+        return;
+    }
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        u32 pixel = 0;
+
+        for (u32 c = 0; c < 3; ++c)
+        {
+            u32 value = (pixels[i] >> (16 - c * 8)) & 0xFF;
+
+            pixel |= ((value * format->max[c] + 127) / 255) << format->shift[c];
+        }
+
+        pixels[i] = pixel;
+    }
+}
+
+static u8 *put_pixel_format(u8 *buffer)
+{
+    *buffer++ = 32; // Bits per pixel
+    *buffer++ = 24; // Depth
+    *buffer++ = 0; // Big endian
+    *buffer++ = 1; // True colour
+    buffer = put_u16(buffer, 255);
+    buffer = put_u16(buffer, 255);
+    buffer = put_u16(buffer, 255);
+    *buffer++ = 16;
+    *buffer++ = 8;
+    *buffer++ = 0;
+    memset(buffer, 0, 3);
+    return buffer + 3;
+}
+
+/**
+ * Mark the tiles covering the pixels [x, x + width) x [y, y + height)
+ */
+static void add_tiles(u64 *bits, u32 x, u32 y, u32 width, u32 height)
+{
+    if (width == 0 || height == 0)
+    {
+        return;
+    }
+
+    for (u32 row = y / VNC_TILE; row <= (y + height - 1) / VNC_TILE; ++row)
+    {
+        for (u32 col = x / VNC_TILE; col <= (x + width - 1) / VNC_TILE;
+             ++col)
+        {
+            set_bit(bits, row * TILE_COLS + col);
+        }
+    }
+}
+
+static u32 valid_mode(const struct headless_header *header)
+{
+    u32 bpp = header->bpp;
+    u64 row_size = (u64)header->width * bytes_per_pixel(bpp);
+
+    u64 end = header->offset + (u64)header->pitch * (header->height - 1);
+
+    return header->width > 0 && header->width <= VBE_MAX_XRES
+        && header->height > 0 && header->height <= VBE_MAX_YRES
+        && (bpp == 8 || bpp == 15 || bpp == 16 || bpp == 24 || bpp == 32)
+        && header->pitch >= row_size && end + row_size <= VBE_VRAM_SIZE;
+}
+
+/**
+ * Copy the mode and the damage of the last published frame, following the
+ * seqlock of headless.h. The whole frame is damaged when frames were missed.
+ *
+ * @return 1 if a new frame was published, 0 otherwise
+ */
+static u32 read_frame(vnc_t *vnc, u64 *damage)
+{
+    struct headless_header *shared = vnc->header;
+    struct headless_header header;
+    u32 sequence;
+
+    for (;;)
+    {
+        sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+
+        if (sequence == vnc->sequence)
+        {
+            return 0;
+        }
+
+        if (sequence & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(&header, shared, sizeof(header));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == sequence)
+        {
+            break;
+        }
+    }
+
+    u32 missed = sequence - vnc->sequence != 2;
+    vnc->sequence = sequence;
+
+    if (!valid_mode(&header))
+    {
+        return 0;
+    }
+
+    u32 full = missed || header.width != vnc->width
+        || header.height != vnc->height || header.bpp != vnc->bpp
+        || header.pitch != vnc->pitch || header.offset != vnc->offset;
+
+    vnc->width = header.width;
+    vnc->height = header.height;
+    vnc->bpp = header.bpp;
+    vnc->pitch = header.pitch;
+    vnc->offset = header.offset;
+
+    if (header.bpp == 8)
+    {
+        memcpy(vnc->palette, header.palette, sizeof(vnc->palette));
+    }
+
+    memset(damage, 0, TILE_WORDS * sizeof(u64));
+
+    if (full || header.nb_rects > HEADLESS_MAX_RECTS)
+    {
+        add_tiles(damage, 0, 0, header.width, header.height);
+        return 1;
+    }
+
+    for (u32 i = 0; i < header.nb_rects; ++i)
+    {
+        struct headless_rect *rect = &header.rects[i];
+
+        if (rect->x >= header.width || rect->y >= header.height)
+        {
+            continue;
+        }
+
+        u32 width = header.width - rect->x;
+        u32 height = header.height - rect->y;
+
+        add_tiles(damage,
+                  rect->x,
+                  rect->y,
+                  rect->width < width ? rect->width : width,
+                  rect->height < height ? rect->height : height);
+    }
+
+    return 1;
+}
+
+/**
+ * Convert the pixels [x, x + width) x [y, y + height) to vnc->rows in
+ * `format`, whose rows are `width` pixels
+ */
+static void convert_rect(vnc_t *vnc,
+                         const struct format *format,
+                         u32 x,
+                         u32 y,
+                         u32 width,
+                         u32 height)
+{
+    const u8 *src = vnc->memory + vnc->offset + (u64)y * vnc->pitch
+        + (u64)x * bytes_per_pixel(vnc->bpp);
+
+    for (u32 i = 0; i < height; ++i)
+    {
+        pixel_convert(
+            vnc->rows + i * width, src, width, vnc->bpp, vnc->palette);
+        src += vnc->pitch;
+    }
+
+    pack_pixels(format, vnc->rows, width * height);
+}
+
+static u32 encode_raw(u8 *out,
+                      const struct format *format,
+                      const u32 *pixels,
+                      u32 stride,
+                      u32 width,
+                      u32 height)
+{
+    u8 *cursor = out;
+
+    *cursor++ = VNC_HEXTILE_RAW;
+
+    for (u32 y = 0; y < height; ++y)
+    {
+        for (u32 x = 0; x < width; ++x)
+        {
+            cursor = put_pixel(cursor, format, pixels[y * stride + x]);
+        }
+    }
+
+    return cursor - out;
+}
+
+/**
+ * Extend the subrectangle of `color` at (x, y) to the right, then down
+ */
+static void grow_subrect(const u32 *pixels,
+                         u32 stride,
+                         const u8 *covered,
+                         u32 width,
+                         u32 height,
+                         u32 x,
+                         u32 y,
+                         u32 *sub_width,
+                         u32 *sub_height)
+{
+    u32 color = pixels[y * stride + x];
+    u32 w = 1;
+    u32 h = 1;
+
+    while (x + w < width && pixels[y * stride + x + w] == color
+        && !covered[y * VNC_TILE + x + w])
+    {
+        ++w;
+    }
+
+    for (; y + h < height; ++h)
+    {
+        const u32 *row = pixels + (y + h) * stride;
+        const u8 *row_covered = covered + (y + h) * VNC_TILE;
+        u32 i = 0;
+
+        while (i < w && row[x + i] == color && !row_covered[x + i])
+        {
+            ++i;
+        }
+
+        if (i < w)
+        {
+            break;
+        }
+    }
+
+    *sub_width = w;
+    *sub_height = h;
+}
+
+/**
+ * Encode a tile of `width` x `height` pixels, whose rows are `stride` pixels
+ * apart. Its background and foreground are always given, so that the tile
+ * does not depend on the one sent before it and can be shared.
+ *
+ * @return the size of the tile, at most TILE_MAX_SIZE
+ */
+static u32 encode_tile(u8 *out,
+                       const struct format *format,
+                       const u32 *pixels,
+                       u32 stride,
+                       u32 width,
+                       u32 height)
+{
+    u32 background = pixels[0];
+    u32 foreground = background;
+    u32 nb_colors = 1;
+
+    for (u32 y = 0; y < height && nb_colors < 3; ++y)
+    {
+        for (u32 x = 0; x < width; ++x)
+        {
+            u32 pixel = pixels[y * stride + x];
+
+            if (pixel == background || pixel == foreground)
+            {
+                continue;
+            }
+
+            foreground = pixel;
+
+            if (++nb_colors == 3)
+            {
+                break;
+            }
+        }
+    }
+
+    u32 pixel_size = format->bpp / 8;
+
+    if (nb_colors == 1)
+    {
+        out[0] = VNC_HEXTILE_BACKGROUND;
+        put_pixel(out + 1, format, background);
+        return 1 + pixel_size;
+    }
+
+    u32 colored = nb_colors > 2;
+    u32 subrect_size = colored ? pixel_size + 2 : 2;
+    u32 raw_size = 1 + width * height * pixel_size;
+    u32 size = colored ? 2 + pixel_size : 2 + 2 * pixel_size;
+    u32 nb_subrects = 0;
+    u8 covered[TILE_PIXELS] = { 0 };
+
+    for (u32 y = 0; y < height; ++y)
+    {
+        for (u32 x = 0; x < width; ++x)
+        {
+            u32 pixel = pixels[y * stride + x];
+
+            if (pixel == background || covered[y * VNC_TILE + x])
+            {
+                continue;
+            }
+
+            if (size + subrect_size >= raw_size || nb_subrects == 255)
+            {
+                return encode_raw(
+                    out, format, pixels, stride, width, height);
+            }
+
+            u32 w;
+            u32 h;
+
+            grow_subrect(
+                pixels, stride, covered, width, height, x, y, &w, &h);
+
+            for (u32 i = 0; i < h; ++i)
+            {
+                memset(covered + (y + i) * VNC_TILE + x, 1, w);
+            }
+
+            if (colored)
+            {
+                put_pixel(out + size, format, pixel);
+                size += pixel_size;
+            }
+
+            out[size++] = (x << 4) | y;
+            out[size++] = ((w - 1) << 4) | (h - 1);
+            ++nb_subrects;
+        }
+    }
+
+    out[0] = VNC_HEXTILE_BACKGROUND | VNC_HEXTILE_ANY_SUBRECTS;
+    put_pixel(out + 1, format, background);
+
+    if (colored)
+    {
+        out[0] |= VNC_HEXTILE_COLOURED;
+        out[1 + pixel_size] = nb_subrects;
+    }
+    else
+    {
+        out[0] |= VNC_HEXTILE_FOREGROUND;
+        put_pixel(out + 1 + pixel_size, format, foreground);
+        out[1 + 2 * pixel_size] = nb_subrects;
+    }
+
+    return size;
+}
+
+/**
+ * Get the cache of `format`, created on first use
+ *
+ * @return the cache, NULL on failure
+ */
+static struct cache *get_cache(vnc_t *vnc, const struct format *format)
+{
+    u32 slot = VNC_MAX_CLIENTS + 1;
+
+    for (u32 i = 0; i < VNC_MAX_CLIENTS + 1; ++i)
+    {
+        struct cache *cache = vnc->caches[i];
+
+        if (cache != NULL && same_format(&cache->format, format))
+        {
+            cache->users += 1;
+            return cache;
+        }
+
+        slot = cache == NULL && slot > i ? i : slot;
+    }
+
+    // Each client uses one cache, there is always a free slot
+    struct cache *cache = calloc(1, sizeof(struct cache));
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    cache->format = *format;
+    cache->users = 1;
+    vnc->caches[slot] = cache;
+
+    return cache;
+}
+
+static void free_cache(struct cache *cache)
+{
+    free(cache->tiles);
+    free(cache);
+}
+
+/**
+ * Release a cache, the ones of other formats than the server one are freed
+ * by their last user
+ */
+static void put_cache(vnc_t *vnc, struct cache *cache)
+{
+    if (cache == NULL || --cache->users > 0 || cache == vnc->caches[0])
+    {
+        return;
+    }
+
+    for (u32 i = 1; i < VNC_MAX_CLIENTS + 1; ++i)
+    {
+        if (vnc->caches[i] == cache)
+        {
+            vnc->caches[i] = NULL;
+        }
+    }
+
+    free_cache(cache);
+}
+
+static void close_client(vnc_t *vnc, struct client *client)
+{
+    if (client->closed)
+    {
+        return;
+    }
+
+    epoll_ctl(vnc->epoll_fd, EPOLL_CTL_DEL, client->source.fd, NULL);
+    close(client->source.fd);
+    put_cache(vnc, client->cache);
+    client->cache = NULL;
+    client->closed = 1;
+}
+
+/**
+ * Make room for `size` more bytes of output
+ *
+ * @return the end of the output, NULL on failure
+ */
+static u8 *reserve(struct client *client, u64 size)
+{
+    if (client->out_len + size > client->out_capacity)
+    {
+        u64 capacity = client->out_capacity ? client->out_capacity : 4096;
+
+        while (capacity < client->out_len + size)
+        {
+            capacity *= 2;
+        }
+
+        u8 *out = realloc(client->out, capacity);
+
+        if (out == NULL)
+        {
+            return NULL;
+        }
+
+        client->out = out;
+        client->out_capacity = capacity;
+    }
+
+    return client->out + client->out_len;
+}
+
+static void append(struct client *client, const void *data, u64 size)
+{
+    memcpy(client->out + client->out_len, data, size);
+    client->out_len += size;
+}
+
+static void poll_output(vnc_t *vnc, struct client *client, u8 polled)
+{
+    if (client->out_polled == polled)
+    {
+        return;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN | (polled ? EPOLLOUT : 0),
+                                 .data.ptr = &client->source };
+
+    epoll_ctl(vnc->epoll_fd, EPOLL_CTL_MOD, client->source.fd, &event);
+    client->out_polled = polled;
+}
+
+/**
+ * Send the pending output, the rest is sent when the socket is writable
+ *
+ * @return 1 if everything was sent, 0 otherwise
+ */
+static u32 flush_client(vnc_t *vnc, struct client *client)
+{
+    while (client->out_off < client->out_len)
+    {
+        ssize_t w = send(client->source.fd,
+                         client->out + client->out_off,
+                         client->out_len - client->out_off,
+                         MSG_NOSIGNAL);
+
+        if (w < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (w < 0 && errno == EAGAIN)
+        {
+            poll_output(vnc, client, 1);
+            return 0;
+        }
+
+        if (w < 0)
+        {
+            close_client(vnc, client);
+            return 0;
+        }
+
+        client->out_off += w;
+    }
+
+    client->out_len = 0;
+    client->out_off = 0;
+    poll_output(vnc, client, 0);
+
+    return 1;
+}
+
+/**
+ * Append the tiles [col, col + nb_cols) of the tile row `row` as one
+ * rectangle. Hextile tiles are only encoded when they are not cached.
+ */
+static void append_run(vnc_t *vnc,
+                       struct client *client,
+                       u32 row,
+                       u32 col,
+                       u32 nb_cols)
+{
+    u32 x = col * VNC_TILE;
+    u32 y = row * VNC_TILE;
+    u32 width = nb_cols * VNC_TILE;
+    u32 height = VNC_TILE;
+    u8 header[RECT_HEADER_SIZE];
+
+    width = x + width > vnc->width ? vnc->width - x : width;
+    height = y + height > vnc->height ? vnc->height - y : height;
+
+    u8 *cursor = put_u16(header, x);
+    cursor = put_u16(cursor, y);
+    cursor = put_u16(cursor, width);
+    cursor = put_u16(cursor, height);
+    put_u32(cursor, client->hextile ? VNC_ENCODING_HEXTILE : VNC_ENCODING_RAW);
+    append(client, header, sizeof(header));
+
+    struct cache *cache = client->cache;
+    const struct format *format = &cache->format;
+
+    if (!client->hextile)
+    {
+        convert_rect(vnc, format, x, y, width, height);
+
+        // The rows are already in the little endian server format
+        if (same_format(format, &server_format))
+        {
+            append(client, vnc->rows, (u64)width * height * 4);
+            return;
+        }
+
+        u8 *out = client->out + client->out_len;
+
+        for (u32 i = 0; i < width * height; ++i)
+        {
+            out = put_pixel(out, format, vnc->rows[i]);
+        }
+
+        client->out_len = out - client->out;
+        return;
+    }
+
+    u32 converted = 0;
+
+    for (u32 i = 0; i < nb_cols; ++i)
+    {
+        u32 tile = row * TILE_COLS + col + i;
+        u8 *data = cache->tiles + (u64)tile * TILE_MAX_SIZE;
+
+        if (!test_bit(cache->valid, tile))
+        {
+            if (!converted)
+            {
+                convert_rect(vnc, format, x, y, width, height);
+                converted = 1;
+            }
+
+            u32 tile_x = i * VNC_TILE;
+            u32 tile_width =
+                width - tile_x < VNC_TILE ? width - tile_x : VNC_TILE;
+
+            cache->tile_size[tile] = encode_tile(
+                data, format, vnc->rows + tile_x, width, tile_width, height);
+            set_bit(cache->valid, tile);
+        }
+
+        append(client, data, cache->tile_size[tile]);
+    }
+}
+
+/**
+ * Send the dirty tiles of the client if it asked for an update and got the
+ * previous one. Each tile row run of dirty tiles is a rectangle.
+ */
+static void send_update(vnc_t *vnc, struct client *client)
+{
+    if (client->closed || client->state != STATE_NORMAL
+        || !client->requested || client->out_len != 0)
+    {
+        return;
+    }
+
+    u32 resize = client->width != vnc->width || client->height != vnc->height;
+
+    if (resize)
+    {
+        if (!client->desktop_size)
+        {
+            fprintf(stderr, "VNC viewer cannot follow a resolution change\n");
+            close_client(vnc, client);
+            return;
+        }
+
+        add_tiles(client->dirty, 0, 0, vnc->width, vnc->height);
+    }
+
+    u32 cols = (vnc->width + VNC_TILE - 1) / VNC_TILE;
+    u32 rows = (vnc->height + VNC_TILE - 1) / VNC_TILE;
+    u32 nb_runs = 0;
+    u32 nb_tiles = 0;
+
+    for (u32 row = 0; row < rows; ++row)
+    {
+        for (u32 col = 0; col < cols; ++col)
+        {
+            if (test_bit(client->dirty, row * TILE_COLS + col))
+            {
+                nb_runs += col == 0
+                    || !test_bit(client->dirty, row * TILE_COLS + col - 1);
+                ++nb_tiles;
+            }
+        }
+    }
+
+    if (nb_runs == 0 && !resize)
+    {
+        return;
+    }
+
+    struct cache *cache = client->cache;
+
+    if (client->hextile && cache->tiles == NULL)
+    {
+        cache->tiles = malloc((u64)NB_TILES * TILE_MAX_SIZE);
+    }
+
+    // A raw tile is no larger than a hextile one
+    u64 size = 4 + (u64)(nb_runs + 1) * RECT_HEADER_SIZE
+        + (u64)nb_tiles * TILE_MAX_SIZE;
+
+    if ((client->hextile && cache->tiles == NULL)
+        || reserve(client, size) == NULL)
+    {
+        close_client(vnc, client);
+        return;
+    }
+
+    u8 header[4] = { 0, 0 };
+
+    put_u16(header + 2, nb_runs + resize);
+    append(client, header, sizeof(header));
+
+    if (resize)
+    {
+        u8 rect[RECT_HEADER_SIZE] = { 0 };
+
+        put_u16(rect + 4, vnc->width);
+        put_u16(rect + 6, vnc->height);
+        put_u32(rect + 8, VNC_ENCODING_DESKTOP_SIZE);
+        append(client, rect, sizeof(rect));
+        client->width = vnc->width;
+        client->height = vnc->height;
+    }
+
+    for (u32 row = 0; row < rows; ++row)
+    {
+        for (u32 col = 0; col < cols;)
+        {
+            u32 first = col;
+
+            while (col < cols && test_bit(client->dirty, row * TILE_COLS + col))
+            {
+                ++col;
+            }
+
+            if (col > first)
+            {
+                append_run(vnc, client, row, first, col - first);
+            }
+            else
+            {
+                ++col;
+            }
+        }
+    }
+
+    memset(client->dirty, 0, sizeof(client->dirty));
+    client->requested = 0;
+    flush_client(vnc, client);
+}
+
+static void process_frame(vnc_t *vnc)
+{
+    u64 damage[TILE_WORDS];
+
+    if (!read_frame(vnc, damage))
+    {
+        return;
+    }
+
+    for (u32 i = 0; i < VNC_MAX_CLIENTS + 1; ++i)
+    {
+        for (u32 j = 0; vnc->caches[i] != NULL && j < TILE_WORDS; ++j)
+        {
+            vnc->caches[i]->valid[j] &= ~damage[j];
+        }
+    }
+
+    for (u32 i = 0; i < VNC_MAX_CLIENTS; ++i)
+    {
+        struct client *client = vnc->clients[i];
+
+        if (client == NULL)
+        {
+            continue;
+        }
+
+        for (u32 j = 0; j < TILE_WORDS; ++j)
+        {
+            client->dirty[j] |= damage[j];
+        }
+
+        send_update(vnc, client);
+    }
+}
+
+/**
+ * Send the colour map of the BGR233 pixels given to colour map viewers
+ */
+static void send_colour_map(vnc_t *vnc, struct client *client)
+{
+    u8 *out = reserve(client, 6 + COLOUR_MAP_SIZE * 6);
+
+    if (out == NULL)
+    {
+        close_client(vnc, client);
+        return;
+    }
+
+    out[0] = MSG_COLOUR_MAP;
+    out[1] = 0;
+    out = put_u16(out + 2, 0); // First colour
+    out = put_u16(out, COLOUR_MAP_SIZE);
+
+    for (u32 i = 0; i < COLOUR_MAP_SIZE; ++i)
+    {
+        out = put_u16(out, (i & 0x7) * 65535 / 7);
+        out = put_u16(out, ((i >> 3) & 0x7) * 65535 / 7);
+        out = put_u16(out, (i >> 6) * 65535 / 3);
+    }
+
+    client->out_len += 6 + COLOUR_MAP_SIZE * 6;
+}
+
+/**
+ * Send the next updates in the pixel format asked by the client. Colour map
+ * viewers get BGR233 pixels and the matching colour map. An invalid format
+ * is ignored, the client keeps its current one.
+ */
+static void set_pixel_format(vnc_t *vnc, struct client *client, const u8 *in)
+{
+    struct format format = { .bpp = in[0],
+                             .big_endian = in[2] != 0,
+                             .true_colour = in[3] != 0,
+                             .max = { 7, 7, 3 },
+                             .shift = { 0, 3, 6 } };
+    u32 valid = format.bpp == 8 || format.bpp == 16 || format.bpp == 32;
+
+    for (u32 i = 0; valid && format.true_colour && i < 3; ++i)
+    {
+        format.max[i] = get_u16(in + 4 + i * 2);
+        format.shift[i] = in[10 + i];
+        valid = format.max[i] != 0 && format.shift[i] < format.bpp;
+    }
+
+    if (!valid)
+    {
+        fprintf(stderr, "VNC viewer asked for an invalid format, ignored\n");
+        return;
+    }
+
+    struct cache *cache = get_cache(vnc, &format);
+
+    if (cache == NULL)
+    {
+        close_client(vnc, client);
+        return;
+    }
+
+    put_cache(vnc, client->cache);
+    client->cache = cache;
+    add_tiles(client->dirty, 0, 0, vnc->width, vnc->height);
+
+    if (!format.true_colour)
+    {
+        send_colour_map(vnc, client);
+    }
+}
+
+static u32 handshake(vnc_t *vnc, struct client *client, u8 *in, u32 len)
+{
+    u8 *out = reserve(client, 64);
+
+    if (out == NULL)
+    {
+        close_client(vnc, client);
+        return 0;
+    }
+
+    switch (client->state)
+    {
+    case STATE_VERSION:
+        if (len < PROTOCOL_VERSION_SIZE)
+        {
+            return 0;
+        }
+
+        if (memcmp(in, "RFB 003.", 8) != 0)
+        {
+            close_client(vnc, client);
+            return 0;
+        }
+
+        client->minor = atoi((char *)in + 8);
+        client->minor = client->minor > 8 ? 8 : client->minor;
+
+        if (client->minor >= 7)
+        {
+            // The client picks in the list of security types
+            out[0] = 1;
+            out[1] = SECURITY_NONE;
+            client->out_len += 2;
+            client->state = STATE_SECURITY;
+        }
+        else
+        {
+            // 3.3, the server picks the security type
+            client->minor = 3;
+            put_u32(out, SECURITY_NONE);
+            client->out_len += 4;
+            client->state = STATE_INIT;
+        }
+
+        return PROTOCOL_VERSION_SIZE;
+    case STATE_SECURITY:
+        if (len < 1)
+        {
+            return 0;
+        }
+
+        if (in[0] != SECURITY_NONE)
+        {
+            close_client(vnc, client);
+            return 0;
+        }
+
+        if (client->minor == 8)
+        {
+            put_u32(out, 0); // SecurityResult OK
+            client->out_len += 4;
+        }
+
+        client->state = STATE_INIT;
+        return 1;
+    default:
+        if (len < 1)
+        {
+            return 0;
+        }
+
+        // The shared flag is ignored, every client shares the screen
+        out = put_u16(out, vnc->width);
+        out = put_u16(out, vnc->height);
+        out = put_pixel_format(out);
+        out = put_u32(out, sizeof(SERVER_NAME) - 1);
+        memcpy(out, SERVER_NAME, sizeof(SERVER_NAME) - 1);
+        client->out_len += 24 + sizeof(SERVER_NAME) - 1;
+        client->width = vnc->width;
+        client->height = vnc->height;
+        add_tiles(client->dirty, 0, 0, vnc->width, vnc->height);
+        client->state = STATE_NORMAL;
+        return 1;
+    }
+}
+
+/**
+ * Translate a keysym to the USB HID usage of the key producing it on a US
+ * keyboard, the viewer sends the modifiers as separate keys
+ *
+ * @return the usage, 0 if the key is unknown
+ */
+static u32 keysym_usage(u32 keysym)
+{
+    if (keysym >= 'a' && keysym <= 'z')
+    {
+        return 0x04 + keysym - 'a';
+    }
+
+    if (keysym >= 'A' && keysym <= 'Z')
+    {
+        return 0x04 + keysym - 'A';
+    }
+
+    if (keysym < 128)
+    {
+        return ascii_usages[keysym];
+    }
+
+    if (keysym >= 0xFFBE && keysym <= 0xFFC9)
+    {
+        return 0x3A + keysym - 0xFFBE; // F1 to F12
+    }
+
+    for (u32 i = 0; i < sizeof(special_usages) / sizeof(special_usages[0]);
+         ++i)
+    {
+        if (special_usages[i][0] == keysym)
+        {
+            return special_usages[i][1];
+        }
+    }
+
+    return 0;
+}
+
+static void forward_key(vnc_t *vnc, const u8 *in)
+{
+    u32 usage = keysym_usage(get_u32(in + 4));
+
+    if (vnc->ps2 != NULL && usage != 0)
+    {
+        ps2_key(vnc->ps2, usage, in[1]);
+        vnc->input_queued = 1;
+    }
+}
+
+/**
+ * The viewer sends absolute positions, the mouse moves by the difference
+ * with the previous one. Each press of a wheel button is a wheel notch.
+ */
+static void forward_pointer(vnc_t *vnc, struct client *client, const u8 *in)
+{
+    u8 mask = in[1];
+    u16 x = get_u16(in + 2);
+    u16 y = get_u16(in + 4);
+    u8 pressed = mask & ~client->pointer_mask;
+    s32 dx = client->pointer_valid ? x - client->pointer_x : 0;
+    s32 dy = client->pointer_valid ? y - client->pointer_y : 0;
+    s32 dz = 0;
+
+    dz += (pressed & POINTER_WHEEL_UP) != 0 ? 1 : 0;
+    dz -= (pressed & POINTER_WHEEL_DOWN) != 0 ? 1 : 0;
+
+    u32 buttons = 0;
+
+    buttons |= (mask & POINTER_LEFT) != 0 ? PS2_BUTTON_LEFT : 0;
+    buttons |= (mask & POINTER_MIDDLE) != 0 ? PS2_BUTTON_MIDDLE : 0;
+    buttons |= (mask & POINTER_RIGHT) != 0 ? PS2_BUTTON_RIGHT : 0;
+
+    u32 changed = (mask ^ client->pointer_mask)
+                  & (POINTER_LEFT | POINTER_MIDDLE | POINTER_RIGHT);
+
+    client->pointer_valid = 1;
+    client->pointer_mask = mask;
+    client->pointer_x = x;
+    client->pointer_y = y;
+
+    if (vnc->ps2 != NULL && (dx != 0 || dy != 0 || dz != 0 || changed))
+    {
+        ps2_mouse(vnc->ps2, dx, dy, dz, buttons);
+        vnc->input_queued = 1;
+    }
+}
+
+/**
+ * Handle the message at the start of `in`
+ *
+ * @return the number of bytes used, 0 if the message is incomplete
+ */
+static u32 handle_message(vnc_t *vnc, struct client *client, u8 *in, u32 len)
+{
+    if (client->skip > 0)
+    {
+        u32 skipped = client->skip < len ? client->skip : len;
+
+        client->skip -= skipped;
+        return skipped;
+    }
+
+    if (client->state != STATE_NORMAL)
+    {
+        return handshake(vnc, client, in, len);
+    }
+
+    if (len < 1)
+    {
+        return 0;
+    }
+
+    switch (in[0])
+    {
+    case MSG_SET_PIXEL_FORMAT:
+        if (len < 20)
+        {
+            return 0;
+        }
+
+        set_pixel_format(vnc, client, in + 4);
+        return 20;
+    case MSG_SET_ENCODINGS: {
+        if (len < 4)
+        {
+            return 0;
+        }
+
+        u32 size = 4 + 4 * get_u16(in + 2);
+
+        if (size > IN_BUFFER_SIZE)
+        {
+            close_client(vnc, client);
+            return 0;
+        }
+
+        if (len < size)
+        {
+            return 0;
+        }
+
+        client->hextile = 0;
+        client->desktop_size = 0;
+
+        for (u32 i = 4; i < size; i += 4)
+        {
+            s32 encoding = get_u32(in + i);
+
+            client->hextile |= encoding == VNC_ENCODING_HEXTILE;
+            client->desktop_size |= encoding == VNC_ENCODING_DESKTOP_SIZE;
+        }
+
+        return size;
+    }
+    case MSG_UPDATE_REQUEST: {
+        if (len < 10)
+        {
+            return 0;
+        }
+
+        u32 x = get_u16(in + 2);
+        u32 y = get_u16(in + 4);
+
+        if (!in[1] && x < vnc->width && y < vnc->height)
+        {
+            u32 width = vnc->width - x;
+            u32 height = vnc->height - y;
+
+            add_tiles(client->dirty,
+                      x,
+                      y,
+                      get_u16(in + 6) < width ? get_u16(in + 6) : width,
+                      get_u16(in + 8) < height ? get_u16(in + 8) : height);
+        }
+
+        client->requested = 1;
+        return 10;
+    }
+    case MSG_KEY:
+        if (len < 8)
+        {
+            return 0;
+        }
+
+        forward_key(vnc, in);
+        return 8;
+    case MSG_POINTER:
+        if (len < 6)
+        {
+            return 0;
+        }
+
+        forward_pointer(vnc, client, in);
+        return 6;
+    case MSG_CUT_TEXT:
+        if (len < 8)
+        {
+            return 0;
+        }
+
+        client->skip = get_u32(in + 4);
+        return 8;
+    default:
+        fprintf(stderr, "Unknown VNC message %u\n", in[0]);
+        close_client(vnc, client);
+        return 0;
+    }
+}
+
+static void read_client(vnc_t *vnc, struct client *client)
+{
+    ssize_t r = recv(client->source.fd,
+                     client->in + client->in_len,
+                     IN_BUFFER_SIZE - client->in_len,
+                     0);
+
+    if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+    {
+        close_client(vnc, client);
+        return;
+    }
+
+    if (r < 0)
+    {
+        return;
+    }
+
+    client->in_len += r;
+
+    u32 off = 0;
+    u32 used = 1;
+
+    while (!client->closed && used > 0)
+    {
+        used = handle_message(vnc, client, client->in + off,
+                              client->in_len - off);
+        off += used;
+    }
+
+    if (client->closed)
+    {
+        return;
+    }
+
+    memmove(client->in, client->in + off, client->in_len - off);
+    client->in_len -= off;
+
+    if (client->out_len == 0 || flush_client(vnc, client))
+    {
+        send_update(vnc, client);
+    }
+}
+
+static void accept_client(vnc_t *vnc, s32 listen_fd)
+{
+    s32 fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return;
+    }
+
+    u32 slot = 0;
+
+    while (slot < VNC_MAX_CLIENTS && vnc->clients[slot] != NULL)
+    {
+        ++slot;
+    }
+
+    struct client *client =
+        slot < VNC_MAX_CLIENTS ? calloc(1, sizeof(struct client)) : NULL;
+
+    if (client == NULL)
+    {
+        fprintf(stderr, "Too many VNC viewers\n");
+        close(fd);
+        return;
+    }
+
+    // Fails on unix sockets, which do not batch
+    s32 one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    client->source.kind = SOURCE_CLIENT;
+    client->source.fd = fd;
+    client->source.client = client;
+
+    struct epoll_event event = { .events = EPOLLIN,
+                                 .data.ptr = &client->source };
+
+    if (epoll_ctl(vnc->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0
+        || reserve(client, PROTOCOL_VERSION_SIZE) == NULL)
+    {
+        close(fd);
+        free(client->out);
+        free(client);
+        return;
+    }
+
+    // Clients start with the server pixel format
+    client->cache = vnc->caches[0];
+    client->cache->users += 1;
+    vnc->clients[slot] = client;
+    append(client, PROTOCOL_VERSION, PROTOCOL_VERSION_SIZE);
+    flush_client(vnc, client);
+}
+
+static void free_client(struct client *client)
+{
+    free(client->out);
+    free(client);
+}
+
+static void handle_event(vnc_t *vnc, struct epoll_event *event)
+{
+    struct source *source = event->data.ptr;
+    struct client *client = source->client;
+
+    switch (source->kind)
+    {
+    case SOURCE_FRAME: {
+        eventfd_t value;
+        eventfd_read(vnc->frame_fd, &value);
+        process_frame(vnc);
+        break;
+    }
+    case SOURCE_LISTEN:
+        accept_client(vnc, source->fd);
+        break;
+    case SOURCE_CLIENT:
+        if (!client->closed && (event->events & EPOLLOUT) != 0
+            && flush_client(vnc, client))
+        {
+            send_update(vnc, client);
+        }
+
+        if (!client->closed
+            && (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0)
+        {
+            read_client(vnc, client);
+        }
+        break;
+    }
+}
+
+static void *io_thread(void *arg)
+{
+    vnc_t *vnc = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;)
+    {
+        s32 n = epoll_wait(vnc->epoll_fd, events, MAX_EVENTS, -1);
+
+        pthread_mutex_lock(&vnc->input_lock);
+
+        for (s32 i = 0; i < n; ++i)
+        {
+            struct source *source = events[i].data.ptr;
+
+            if (source->kind == SOURCE_STOP)
+            {
+                pthread_mutex_unlock(&vnc->input_lock);
+                return NULL;
+            }
+
+            handle_event(vnc, &events[i]);
+        }
+
+        // The guest is interrupted once for the input of all the viewers
+        if (vnc->input_queued)
+        {
+            ps2_flush(vnc->ps2);
+            vnc->input_queued = 0;
+        }
+
+        pthread_mutex_unlock(&vnc->input_lock);
+
+        // Later events of the batch may point to a closed client
+        for (u32 i = 0; i < VNC_MAX_CLIENTS; ++i)
+        {
+            if (vnc->clients[i] != NULL && vnc->clients[i]->closed)
+            {
+                free_client(vnc->clients[i]);
+                vnc->clients[i] = NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Wait for the frames published by headless and wake the I/O thread
+ */
+static void *frame_thread(void *arg)
+{
+    vnc_t *vnc = arg;
+    u32 *shared = &vnc->header->sequence;
+    struct timespec timeout = { .tv_sec = 0,
+                                .tv_nsec = WAIT_TIMEOUT_MS * 1000000 };
+    u32 sequence = __atomic_load_n(shared, __ATOMIC_ACQUIRE);
+
+    while (!__atomic_load_n(&vnc->stop, __ATOMIC_ACQUIRE))
+    {
+        syscall(SYS_futex, shared, FUTEX_WAIT, sequence, &timeout, NULL, 0);
+
+        u32 current = __atomic_load_n(shared, __ATOMIC_ACQUIRE);
+
+        if (current != sequence)
+        {
+            sequence = current;
+            eventfd_write(vnc->frame_fd, 1);
+        }
+    }
+
+    return NULL;
+}
+
+static void vnc_free(vnc_t *vnc)
+{
+    for (u32 i = 0; i < VNC_MAX_CLIENTS; ++i)
+    {
+        if (vnc->clients[i] != NULL)
+        {
+            close_client(vnc, vnc->clients[i]);
+            free_client(vnc->clients[i]);
+        }
+    }
+
+    for (u32 i = 0; i < vnc->nb_listeners; ++i)
+    {
+        close(vnc->listeners[i].fd);
+
+        if (vnc->paths[i] != NULL)
+        {
+            unlink(vnc->paths[i]);
+            free(vnc->paths[i]);
+        }
+    }
+
+    if (vnc->memory != NULL)
+    {
+        munmap(vnc->memory, HEADLESS_SIZE);
+    }
+
+    if (vnc->epoll_fd >= 0)
+    {
+        close(vnc->epoll_fd);
+    }
+
+    if (vnc->stop_fd >= 0)
+    {
+        close(vnc->stop_fd);
+    }
+
+    if (vnc->frame_fd >= 0)
+    {
+        close(vnc->frame_fd);
+    }
+
+    pthread_mutex_destroy(&vnc->lock);
+    pthread_mutex_destroy(&vnc->input_lock);
+
+    for (u32 i = 0; i < VNC_MAX_CLIENTS + 1; ++i)
+    {
+        if (vnc->caches[i] != NULL)
+        {
+            free_cache(vnc->caches[i]);
+        }
+    }
+
+    free(vnc);
+}
+
+static s32 add_source(vnc_t *vnc, struct source *source, s32 fd, u32 kind)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = source };
+
+    source->kind = kind;
+    source->fd = fd;
+
+    return epoll_ctl(vnc->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+vnc_t *vnc_new(s32 fd)
+{
+    vnc_t *vnc = calloc(1, sizeof(vnc_t));
+
+    if (vnc == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&vnc->lock, NULL);
+    pthread_mutex_init(&vnc->input_lock, NULL);
+    vnc->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    vnc->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    vnc->frame_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    vnc->caches[0] = calloc(1, sizeof(struct cache));
+    vnc->memory = mmap(NULL, HEADLESS_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (vnc->memory == MAP_FAILED)
+    {
+        vnc->memory = NULL;
+    }
+
+    if (vnc->epoll_fd < 0 || vnc->stop_fd < 0 || vnc->frame_fd < 0
+        || vnc->caches[0] == NULL || vnc->memory == NULL
+        || !add_source(vnc, &vnc->stop_source, vnc->stop_fd, SOURCE_STOP)
+        || !add_source(vnc, &vnc->frame_source, vnc->frame_fd, SOURCE_FRAME))
+    {
+        vnc_free(vnc);
+        return NULL;
+    }
+
+    vnc->caches[0]->format = server_format;
+    vnc->header =
+        (struct headless_header *)(vnc->memory + HEADLESS_HEADER_OFFSET);
+
+    if (vnc->header->magic != HEADLESS_MAGIC
+        || vnc->header->version != HEADLESS_VERSION)
+    {
+        fprintf(stderr, "Not a headless framebuffer\n");
+        vnc_free(vnc);
+        return NULL;
+    }
+
+    // An odd sequence is never read, the first frame is a full one
+    u64 damage[TILE_WORDS];
+
+    vnc->sequence = 1;
+    read_frame(vnc, damage);
+
+    if (pthread_create(&vnc->io_thread, NULL, io_thread, vnc) != 0)
+    {
+        vnc_free(vnc);
+        return NULL;
+    }
+
+    vnc->threads = 1;
+
+    if (pthread_create(&vnc->frame_thread, NULL, frame_thread, vnc) != 0)
+    {
+        vnc_destroy(vnc);
+        return NULL;
+    }
+
+    vnc->threads = 2;
+
+    return vnc;
+}
+
+void vnc_destroy(vnc_t *vnc)
+{
+    if (vnc == NULL)
+    {
+        return;
+    }
+
+    if (vnc->threads > 1)
+    {
+        __atomic_store_n(&vnc->stop, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex,
+                &vnc->header->sequence,
+                FUTEX_WAKE,
+                INT_MAX,
+                NULL,
+                NULL,
+                0);
+        pthread_join(vnc->frame_thread, NULL);
+    }
+
+    eventfd_write(vnc->stop_fd, 1);
+    pthread_join(vnc->io_thread, NULL);
+    vnc_free(vnc);
+}
+
+void vnc_set_ps2(vnc_t *vnc, ps2_t *ps2)
+{
+    pthread_mutex_lock(&vnc->input_lock);
+
+    // The queued input goes to the previous device
+    if (vnc->input_queued)
+    {
+        ps2_flush(vnc->ps2);
+        vnc->input_queued = 0;
+    }
+
+    vnc->ps2 = ps2;
+    pthread_mutex_unlock(&vnc->input_lock);
+}
+
+static s32 add_listener(vnc_t *vnc, s32 fd, const char *path)
+{
+    pthread_mutex_lock(&vnc->lock);
+
+    u32 i = vnc->nb_listeners;
+
+    if (i == VNC_MAX_LISTENERS || listen(fd, VNC_MAX_CLIENTS) < 0)
+    {
+        pthread_mutex_unlock(&vnc->lock);
+        close(fd);
+        return 0;
+    }
+
+    vnc->paths[i] = path != NULL ? strdup(path) : NULL;
+
+    if (!add_source(vnc, &vnc->listeners[i], fd, SOURCE_LISTEN))
+    {
+        free(vnc->paths[i]);
+        pthread_mutex_unlock(&vnc->lock);
+        close(fd);
+        return 0;
+    }
+
+    vnc->nb_listeners = i + 1;
+    pthread_mutex_unlock(&vnc->lock);
+
+    return 1;
+}
+
+s32 vnc_add_unix(vnc_t *vnc, const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (vnc == NULL || path == NULL || strlen(path) >= sizeof(addr.sun_path))
+    {
+        return 0;
+    }
+
+    strcpy(addr.sun_path, path);
+
+    s32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    return add_listener(vnc, fd, path);
+}
+
+s32 vnc_add_tcp(vnc_t *vnc, u16 port)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET,
+                                .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+
+    if (vnc == NULL)
+    {
+        return 0;
+    }
+
+    s32 fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    s32 one = 1;
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    return add_listener(vnc, fd, NULL);
+}
@@ -0,0 +1,540 @@
+#include <blackhv/block_cache.h>
+#include <blackhv/zimage.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define MIN_CHUNK_SIZE 0x200
+#define MAX_CHUNK_SIZE 0x1000000
+
+/**
+ * Buffers used to decompress a chunk, kept by the image for the next misses
+ */
+struct zimage_scratch
+{
+    u8 *data; // chunk_size bytes
+    u8 *packed; // compressBound(chunk_size) bytes
+    struct zimage_scratch *next;
+};
+
+struct zimage
+{
+    int fd;
+    u64 size;
+    u32 chunk_size;
+    u32 nb_chunks;
+    u64 *index; // nb_chunks + 1 offsets
+    block_cache_t *cache; // Decompressed chunks
+    pthread_mutex_t scratch_lock;
+    struct zimage_scratch *scratch; // Unused buffers, one per reading thread
+};
+
+/**
+ * Read until `len` bytes or the end of the file, the input of the converter
+ * can be a pipe
+ *
+ * @return number of bytes read, -1 on error
+ */
+static ssize_t read_full(int fd, u8 *buffer, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len)
+    {
+        ssize_t r = read(fd, buffer + done, len - done);
+
+        if (r < 0)
+        {
+            return -1;
+        }
+
+        if (r == 0)
+        {
+            break;
+        }
+
+        done += r;
+    }
+
+    return done;
+}
+
+static u32 write_full(int fd, const void *buffer, size_t len)
+{
+    const u8 *data = buffer;
+
+    while (len > 0)
+    {
+        ssize_t r = write(fd, data, len);
+
+        if (r <= 0)
+        {
+            return 0;
+        }
+
+        data += r;
+        len -= r;
+    }
+
+    return 1;
+}
+
+/**
+ * Compress the chunks of the input and record their offsets in `index`
+ *
+ * @return 1 on success with `footer` filled, 0 otherwise
+ */
+static u32 write_chunks(int in_fd,
+                        int out_fd,
+                        s32 level,
+                        struct zimage_footer *footer,
+                        u64 **index)
+{
+    uLong bound = compressBound(footer->chunk_size);
+    u8 *raw = malloc(footer->chunk_size);
+    u8 *packed = malloc(bound);
+    u64 capacity = 0;
+    u64 offset = 0;
+    u32 ok = raw != NULL && packed != NULL;
+
+    while (ok)
+    {
+        ssize_t len = read_full(in_fd, raw, footer->chunk_size);
+
+        if (len <= 0)
+        {
+            ok = len == 0;
+            break;
+        }
+
+        if (footer->nb_chunks + 1 >= capacity)
+        {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+
+            u64 *grown = realloc(*index, capacity * sizeof(u64));
+
+            if (grown == NULL)
+            {
+                ok = 0;
+                break;
+            }
+
+            *index = grown;
+        }
+
+        uLongf packed_len = bound;
+        const u8 *data = packed;
+
+        // Only kept when strictly smaller, an equal length means raw
+        if (compress2(packed, &packed_len, raw, len, level) != Z_OK
+            || packed_len >= (uLongf)len)
+        {
+            data = raw;
+            packed_len = len;
+        }
+
+        (*index)[footer->nb_chunks++] = offset;
+        ok = write_full(out_fd, data, packed_len);
+        offset += packed_len;
+        footer->size += len;
+
+        // Only the last chunk can be short
+        if ((size_t)len < footer->chunk_size)
+        {
+            break;
+        }
+    }
+
+    free(packed);
+    free(raw);
+
+    if (ok && *index == NULL)
+    {
+        // Empty image, the index is a single offset
+        *index = malloc(sizeof(u64));
+        ok = *index != NULL;
+    }
+
+    if (ok)
+    {
+        (*index)[footer->nb_chunks] = offset;
+        footer->index_offset = offset;
+    }
+
+    return ok;
+}
+
+s32 zimage_convert(int in_fd, int out_fd, u32 chunk_size, s32 level)
+{
+    struct zimage_footer footer;
+    u64 *index = NULL;
+
+    if (chunk_size < MIN_CHUNK_SIZE || chunk_size > MAX_CHUNK_SIZE
+        || level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION)
+    {
+        return 0;
+    }
+
+    memset(&footer, 0, sizeof(footer));
+    footer.magic = ZIMAGE_MAGIC;
+    footer.version = ZIMAGE_VERSION;
+    footer.chunk_size = chunk_size;
+
+    u32 ok = write_chunks(in_fd, out_fd, level, &footer, &index)
+        && write_full(out_fd, index, (footer.nb_chunks + 1) * sizeof(u64))
+        && write_full(out_fd, &footer, sizeof(footer)) && fsync(out_fd) == 0;
+
+    free(index);
+
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to convert the image\n");
+    }
+
+    return ok;
+}
+
+static void zimage_free(zimage_t *zimage)
+{
+    while (zimage->scratch != NULL)
+    {
+        struct zimage_scratch *next = zimage->scratch->next;
+
+        free(zimage->scratch->packed);
+        free(zimage->scratch->data);
+        free(zimage->scratch);
+        zimage->scratch = next;
+    }
+
+    pthread_mutex_destroy(&zimage->scratch_lock);
+    block_cache_destroy(zimage->cache);
+    free(zimage->index);
+
+    if (zimage->fd >= 0)
+    {
+        close(zimage->fd);
+    }
+
+    free(zimage);
+}
+
+static u64 chunk_len(zimage_t *zimage, u32 chunk)
+{
+    u64 start = (u64)chunk * zimage->chunk_size;
+    u64 left = zimage->size - start;
+
+    return left < zimage->chunk_size ? left : zimage->chunk_size;
+}
+
+static u32 check_footer(struct zimage_footer *footer, u64 file_size)
+{
+    if (footer->magic != ZIMAGE_MAGIC || footer->version != ZIMAGE_VERSION
+        || footer->chunk_size < MIN_CHUNK_SIZE
+        || footer->chunk_size > MAX_CHUNK_SIZE)
+    {
+        return 0;
+    }
+
+    u64 nb_chunks =
+        (footer->size + footer->chunk_size - 1) / footer->chunk_size;
+    u64 index_bytes = (nb_chunks + 1) * sizeof(u64);
+
+    return footer->nb_chunks == nb_chunks
+        && footer->index_offset <= file_size
+        && file_size - footer->index_offset
+            == index_bytes + sizeof(struct zimage_footer);
+}
+
+static u32 check_index(zimage_t *zimage, u64 index_offset)
+{
+    for (u32 i = 0; i < zimage->nb_chunks; ++i)
+    {
+        u64 start = zimage->index[i];
+        u64 end = zimage->index[i + 1];
+
+        if (end < start || end - start > compressBound(chunk_len(zimage, i)))
+        {
+            return 0;
+        }
+    }
+
+    return zimage->index[0] == 0
+        && zimage->index[zimage->nb_chunks] == index_offset;
+}
+
+zimage_t *zimage_open(const char *path)
+{
+    struct zimage_footer footer;
+    struct stat stat;
+    zimage_t *zimage = calloc(1, sizeof(zimage_t));
+
+    if (zimage == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&zimage->scratch_lock, NULL);
+    zimage->fd = open(path, O_RDONLY);
+
+    if (zimage->fd < 0 || fstat(zimage->fd, &stat) < 0
+        || (u64)stat.st_size < sizeof(footer)
+        || pread(zimage->fd,
+                 &footer,
+                 sizeof(footer),
+                 stat.st_size - sizeof(footer))
+            != sizeof(footer)
+        || !check_footer(&footer, stat.st_size))
+    {
+        fprintf(stderr, "%s is not a valid compressed image\n", path);
+        zimage_free(zimage);
+        return NULL;
+    }
+
+    zimage->size = footer.size;
+    zimage->chunk_size = footer.chunk_size;
+    zimage->nb_chunks = footer.nb_chunks;
+
+    size_t index_bytes = (zimage->nb_chunks + 1) * sizeof(u64);
+    size_t nb_cached = ZIMAGE_CACHE_BYTES / zimage->chunk_size;
+
+    zimage->index = malloc(index_bytes);
+    zimage->cache =
+        block_cache_new(zimage->chunk_size, nb_cached > 0 ? nb_cached : 1);
+
+    if (zimage->index == NULL || zimage->cache == NULL
+        || pread(zimage->fd, zimage->index, index_bytes, footer.index_offset)
+            != (ssize_t)index_bytes
+        || !check_index(zimage, footer.index_offset))
+    {
+        fprintf(stderr, "%s has an invalid chunk index\n", path);
+        zimage_free(zimage);
+        return NULL;
+    }
+
+    return zimage;
+}
+
+void zimage_close(zimage_t *zimage)
+{
+    if (zimage == NULL)
+    {
+        return;
+    }
+
+    zimage_free(zimage);
+}
+
+/**
+ * Take unused scratch buffers, allocated on the first miss of each thread
+ * reading at the same time
+ *
+ * @return the buffers, NULL if they cannot be allocated
+ */
+static struct zimage_scratch *scratch_get(zimage_t *zimage)
+{
+    pthread_mutex_lock(&zimage->scratch_lock);
+
+    struct zimage_scratch *scratch = zimage->scratch;
+
+    if (scratch != NULL)
+    {
+        zimage->scratch = scratch->next;
+    }
+
+    pthread_mutex_unlock(&zimage->scratch_lock);
+
+    if (scratch != NULL)
+    {
+        return scratch;
+    }
+
+    scratch = calloc(1, sizeof(struct zimage_scratch));
+
+    if (scratch == NULL)
+    {
+        return NULL;
+    }
+
+    scratch->data = malloc(zimage->chunk_size);
+    scratch->packed = malloc(compressBound(zimage->chunk_size));
+
+    if (scratch->data == NULL || scratch->packed == NULL)
+    {
+        free(scratch->packed);
+        free(scratch->data);
+        free(scratch);
+        return NULL;
+    }
+
+    return scratch;
+}
+
+static void scratch_put(zimage_t *zimage, struct zimage_scratch *scratch)
+{
+    if (scratch == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&zimage->scratch_lock);
+    scratch->next = zimage->scratch;
+    zimage->scratch = scratch;
+    pthread_mutex_unlock(&zimage->scratch_lock);
+}
+
+/**
+ * Read and decompress a chunk missing from the cache in `scratch->data`, then
+ * cache it
+ *
+ * @return 1 on success, 0 on an I/O error or a corrupted chunk
+ */
+static u32 load_chunk(zimage_t *zimage,
+                      u32 chunk,
+                      struct zimage_scratch *scratch)
+{
+    u64 start = zimage->index[chunk];
+    u64 stored = zimage->index[chunk + 1] - start;
+    uLongf len = chunk_len(zimage, chunk);
+    u8 *data = scratch->data;
+
+    if (pread(zimage->fd, stored == len ? data : scratch->packed, stored, start)
+        != (ssize_t)stored)
+    {
+        return 0;
+    }
+
+    if (stored != len)
+    {
+        uLongf expected = len;
+
+        if (uncompress(data, &len, scratch->packed, stored) != Z_OK
+            || len != expected)
+        {
+            fprintf(stderr, "Corrupted chunk %u in the image\n", chunk);
+            return 0;
+        }
+    }
+
+    // Two threads missing the same chunk both insert it, which is harmless
+    block_cache_write(zimage->cache, chunk, data);
+
+    return 1;
+}
+
+ssize_t zimage_readv(zimage_t *zimage,
+                     const struct iovec *iov,
+                     u32 nb_iov,
+                     u64 offset)
+{
+    if (offset >= zimage->size)
+    {
+        return 0;
+    }
+
+    struct zimage_scratch *scratch = NULL;
+    u64 left = zimage->size - offset;
+    u64 done = 0;
+    u64 loaded = zimage->nb_chunks; // Chunk in scratch->data, none yet
+    u32 ok = 1;
+
+    for (u32 i = 0; ok && i < nb_iov && left > 0; ++i)
+    {
+        u8 *dst = iov[i].iov_base;
+        u64 len = iov[i].iov_len < left ? iov[i].iov_len : left;
+
+        for (u64 copied = 0; ok && copied < len;)
+        {
+            u64 position = offset + done;
+            u32 chunk = position / zimage->chunk_size;
+            u64 in_chunk = position % zimage->chunk_size;
+            u64 n = zimage->chunk_size - in_chunk;
+
+            n = n < len - copied ? n : len - copied;
+
+            // Consecutive iovecs often share the chunk just decompressed
+            if (chunk == loaded)
+            {
+                memcpy(dst + copied, scratch->data + in_chunk, n);
+            }
+            else if (!block_cache_read_at(zimage->cache,
+                                          chunk,
+                                          in_chunk,
+                                          n,
+                                          dst + copied))
+            {
+                if (scratch == NULL)
+                {
+                    scratch = scratch_get(zimage);
+                }
+
+                ok = scratch != NULL && load_chunk(zimage, chunk, scratch);
+                loaded = ok ? chunk : zimage->nb_chunks;
+
+                if (ok)
+                {
+                    memcpy(dst + copied, scratch->data + in_chunk, n);
+                }
+            }
+
+            if (ok)
+            {
+                copied += n;
+                done += n;
+                left -= n;
+            }
+        }
+    }
+
+    scratch_put(zimage, scratch);
+
+    return ok ? (ssize_t)done : -1;
+}
+
+void zimage_stats(zimage_t *zimage, u64 *hits, u64 *misses)
+{
+    block_cache_stats(zimage->cache, hits, misses);
+}
+
+static ssize_t zimage_disk_readv(void *image,
+                                 const struct iovec *iov,
+                                 u32 nb_iov,
+                                 u64 offset)
+{
+    return zimage_readv(image, iov, nb_iov, offset);
+}
+
+static ssize_t zimage_disk_writev(void *image,
+                                  const struct iovec *iov,
+                                  u32 nb_iov,
+                                  u64 offset)
+{
+    (void)image;
+    (void)iov;
+    (void)nb_iov;
+    (void)offset;
+
+    return -1;
+}
+
+static s32 zimage_disk_flush(void *image)
+{
+    (void)image;
+
+    return 1;
+}
+
+struct disk zimage_disk(zimage_t *zimage)
+{
+    struct disk disk = { .image = zimage,
+                         .size = zimage->size,
+                         .readv = zimage_disk_readv,
+                         .writev = zimage_disk_writev,
+                         .flush = zimage_disk_flush };
+
+    return disk;
+}